@@ -0,0 +1,89 @@
+/* Benchmark of emu51_reset_to_baseline().
+ *
+ * Resets an emulator with 64 KiB of external memory to its baseline many
+ * times, with an increasing number of written pages, and compares the time per
+ * reset with copying all the memories back.
+ *
+ * usage: bench_baseline [resets]
+ */
+
+#define _POSIX_C_SOURCE 199309L /* clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <emu51.h>
+
+#define PMEM_SIZE 4096
+#define XRAM_SIZE 65536
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+	long count = argc > 1 ? atol(argv[1]) : 100000;
+	uint8_t *pmem = calloc(PMEM_SIZE, 1);
+	uint8_t *xram = malloc(XRAM_SIZE);
+	uint8_t iram[256], sfr[128];
+	emu51_config config;
+	emu51 *m;
+	void *buffer;
+	double start;
+	long i;
+	int pages, page;
+
+	memset(&config, 0, sizeof(config));
+	config.pmem = pmem;
+	config.pmem_len = PMEM_SIZE;
+	config.xram_len = XRAM_SIZE;
+	config.iram_upper = 1;
+	m = emu51_create(&config);
+	buffer = malloc(emu51_baseline_size(m));
+	emu51_set_baseline(m, buffer);
+
+	/* the copy the host would make without a baseline */
+	memcpy(xram, m->xram, XRAM_SIZE);
+	memcpy(iram, m->iram_lower, 128);
+	memcpy(iram + 128, m->iram_upper, 128);
+	memcpy(sfr, m->sfr, 128);
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		m->xram[i & (XRAM_SIZE - 1)] = 1;
+		memcpy(m->xram, xram, XRAM_SIZE);
+		memcpy(m->iram_lower, iram, 128);
+		memcpy(m->iram_upper, iram + 128, 128);
+		memcpy(m->sfr, sfr, 128);
+		emu51_reset(m);
+	}
+	printf("%ld resets with %d KiB of xram\n", count, XRAM_SIZE / 1024);
+	printf("dirty pages  ns/reset\n");
+	printf("full copy    %8.1f\n", (now() - start) * 1e9 / count);
+
+	for (pages = 0; pages <= 256; pages = pages ? pages * 4 : 1) {
+		start = now();
+		for (i = 0; i < count; i++) {
+			for (page = 0; page < pages; page++) {
+				uint16_t addr = (uint16_t)(page * 256 + i);
+				m->xram[addr] = 1;
+				emu51_mark_xram_dirty(m, addr, 1);
+			}
+			emu51_reset_to_baseline(m);
+		}
+		printf("%11d  %8.1f\n", pages, (now() - start) * 1e9 / count);
+	}
+
+	emu51_set_baseline(m, NULL);
+	emu51_destroy(m);
+	free(buffer);
+	free(xram);
+	free(pmem);
+	return 0;
+}
@@ -0,0 +1,95 @@
+/* Benchmark of the fleet runner.
+ *
+ * Runs the same number of emulators with an increasing number of worker
+ * threads, up to one per online CPU, and prints the emulated cycles per
+ * second and the speedup over one thread.
+ *
+ * usage: bench_fleet [emulators] [cycles per emulator] [slice]
+ */
+
+#define _POSIX_C_SOURCE 199309L /* clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <emu51.h>
+
+#define PMEM_SIZE 4096
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* program: nested loops that add to the accumulator
+ *   0x00: ADD A, #1
+ *   0x02: DJNZ 0x30, 0x00
+ *   0x05: DJNZ 0x31, 0x00
+ *   0x08: SJMP 0x00
+ */
+static const uint8_t program[] = {
+	0x24, 0x01, 0xd5, 0x30, 0xfb, 0xd5, 0x31, 0xf8, 0x80, 0xf6,
+};
+
+int main(int argc, char *argv[])
+{
+	long count = argc > 1 ? atol(argv[1]) : 1024;
+	long cycles = argc > 2 ? atol(argv[2]) : 1000000;
+	long slice = argc > 3 ? atol(argv[3]) : 10000;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint8_t *pmem = calloc(PMEM_SIZE, 1);
+	emu51 **machines = calloc(count, sizeof(emu51*));
+	emu51_fleet_status *status = calloc(count, sizeof(emu51_fleet_status));
+	emu51_config config;
+	double base = 0;
+	long i;
+	int threads;
+
+	if (!(emu51_build_options() & EMU51_BUILD_FLEET)) {
+		printf("the fleet runner is not built\n");
+		return 1;
+	}
+
+	memcpy(pmem, program, sizeof(program));
+	memset(&config, 0, sizeof(config));
+	config.pmem = pmem;
+	config.pmem_len = PMEM_SIZE;
+	for (i = 0; i < count; i++)
+		machines[i] = emu51_create(&config);
+
+	printf("%ld emulators, %ld cycles each, slices of %ld cycles\n",
+		count, cycles, slice);
+	printf("threads  Mcycles/s  speedup\n");
+	for (threads = 1; threads <= cpus; ) {
+		emu51_fleet *fleet = emu51_fleet_create(threads);
+
+		for (i = 0; i < count; i++)
+			emu51_reset(machines[i]);
+		double start = now();
+		emu51_fleet_run(fleet, machines, count, cycles, slice, status);
+		double rate = count * (double)cycles / (now() - start);
+		if (threads == 1)
+			base = rate;
+
+		printf("%7d  %9.1f  %7.2f\n", threads, rate * 1e-6, rate / base);
+		emu51_fleet_destroy(fleet);
+
+		/* double the threads, ending with all CPUs */
+		if (threads < cpus && threads * 2 > cpus)
+			threads = (int)cpus;
+		else
+			threads *= 2;
+	}
+
+	for (i = 0; i < count; i++)
+		emu51_destroy(machines[i]);
+	free(status);
+	free(machines);
+	free(pmem);
+	return 0;
+}
@@ -0,0 +1,101 @@
+/* Benchmark of emu51_fork().
+ *
+ * Forks many emulators with 64 KiB of external memory from one snapshot, each
+ * writing a few bytes of external memory, and compares the time per fork and
+ * the memory used with creating the emulators and restoring the snapshot.
+ *
+ * usage: bench_fork [forks]
+ */
+
+#define _POSIX_C_SOURCE 199309L /* clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <emu51.h>
+
+#define PMEM_SIZE 4096
+#define XRAM_SIZE 65536
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Get the peak resident memory of the process in KiB. */
+static long peak_kib(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+/* Make the first n emulators write to their external memory like a branch of
+ * a what-if analysis, and free them. */
+static void use(emu51 **machines, long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+		machines[i]->xram[(i * 4099) % XRAM_SIZE] = 1;
+	for (i = 0; i < n; i++)
+		emu51_destroy(machines[i]);
+}
+
+int main(int argc, char *argv[])
+{
+	long count = argc > 1 ? atol(argv[1]) : 4096;
+	uint8_t *pmem = calloc(PMEM_SIZE, 1);
+	emu51 **machines = calloc(count, sizeof(emu51*));
+	emu51_config config;
+	emu51_state *s;
+	emu51 *m;
+	double start, copy_time, fork_time;
+	long i, base, copy_peak, fork_peak;
+
+	memset(&config, 0, sizeof(config));
+	config.pmem = pmem;
+	config.pmem_len = PMEM_SIZE;
+	config.xram_len = XRAM_SIZE;
+	m = emu51_create(&config);
+	memset(m->xram, 0x5a, XRAM_SIZE);
+	s = emu51_snapshot(m);
+	base = peak_kib();
+
+	/* the forks first, since the peak can only grow */
+	start = now();
+	for (i = 0; i < count; i++)
+		machines[i] = emu51_fork(s);
+	fork_time = now() - start;
+	use(machines, count);
+	fork_peak = peak_kib();
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		machines[i] = emu51_create(&config);
+		emu51_restore(machines[i], s);
+	}
+	copy_time = now() - start;
+	use(machines, count);
+	copy_peak = peak_kib();
+
+	printf("%ld emulators with %d KiB of xram%s\n", count, XRAM_SIZE / 1024,
+		emu51_build_options() & EMU51_BUILD_COW_FORK
+			? "" : " (copy-on-write not built)");
+	printf("method          us/emulator  peak MiB\n");
+	printf("create+restore  %11.2f  %8.1f\n", copy_time * 1e6 / count,
+		(copy_peak - base) / 1024.0);
+	printf("fork            %11.2f  %8.1f\n", fork_time * 1e6 / count,
+		(fork_peak - base) / 1024.0);
+
+	emu51_state_destroy(s);
+	emu51_destroy(m);
+	free(machines);
+	free(pmem);
+	return 0;
+}
@@ -0,0 +1,108 @@
+/* Micro-benchmark of the instruction handlers.
+ *
+ * Runs the handler of each implemented opcode many times on a fixed machine
+ * state and prints the average time per execution. The handlers are called
+ * through the instruction table, like the interpreter cores do.
+ *
+ * The benchmark is built against both variants of the library if the variant
+ * without callbacks is enabled (bench_instr and bench_instr_nocallback).
+ *
+ * usage: bench_instr [iterations]
+ */
+
+#define _POSIX_C_SOURCE 199309L /* clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <emu51.h>
+
+/* library internal headers */
+#include <instr.h>
+
+/* mnemonics from the instruction table */
+#define INSTR(op, mne, b, c, h) [op] = mne,
+#define NOT_IMPLEMENTED(op)
+static const char *const mnemonics[256] = {
+#include <instr_table.h>
+};
+#undef INSTR
+#undef NOT_IMPLEMENTED
+
+#define PMEM_SIZE 65536
+#define START_PC 0x1000
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Set up a machine state on which every implemented instruction succeeds. */
+static void init_machine(emu51 *m, uint8_t *pmem, uint8_t *iram_lower,
+		uint8_t *iram_upper, uint8_t *sfr)
+{
+	memset(m, 0, sizeof(*m));
+	memset(pmem, 0, PMEM_SIZE);
+	memset(iram_lower, 0, 128);
+	memset(iram_upper, 0, 128);
+	memset(sfr, 0, 128);
+
+	m->pmem = pmem;
+	m->pmem_len = PMEM_SIZE;
+	m->iram_lower = iram_lower;
+	m->iram_upper = iram_upper;
+	m->sfr = sfr;
+	emu51_reset(m);
+
+	iram_lower[0] = 0x40; /* @R0 and @R1 point to lower iram */
+	iram_lower[1] = 0x41;
+	iram_lower[2] = 200;  /* DJNZ counter */
+	sfr[SFR_ACC] = 0x35;
+	sfr[SFR_DPL] = 0x20;
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+	uint8_t *pmem = malloc(PMEM_SIZE);
+	uint8_t iram_lower[128], iram_upper[128], sfr[128];
+	double total = 0;
+	int opcode, count = 0;
+	emu51 m;
+
+	printf("callbacks: %s\n",
+		(emu51_build_options() & EMU51_BUILD_CALLBACKS) ? "on" : "compiled out");
+	printf("opcode  mnemonic  ns/instr\n");
+	for (opcode = 0; opcode < 256; opcode++) {
+		const emu51_instr *instr = _emu51_decode_instr(opcode);
+		/* operands: bit/iram address 0x35, relative offset 0x12 */
+		uint8_t code[3] = { opcode, 0x35, 0x12 };
+		emu51_decoded d;
+		long i;
+
+		if (!instr->handler)
+			continue;
+
+		init_machine(&m, pmem, iram_lower, iram_upper, sfr);
+		_emu51_decode(&d, code, START_PC + instr->bytes);
+
+		double start = now();
+		for (i = 0; i < iterations; i++) {
+			m.pc = START_PC + instr->bytes;
+			d.handler(&d, &m);
+		}
+		double ns = (now() - start) * 1e9 / iterations;
+
+		printf("0x%02x    %-8s  %6.2f\n", opcode, mnemonics[opcode], ns);
+		total += ns;
+		count++;
+	}
+	printf("mean over %d opcodes: %.2f ns/instr\n", count, total / count);
+
+	free(pmem);
+	return 0;
+}
@@ -0,0 +1,113 @@
+/* Benchmark of the lockstep engine.
+ *
+ * Runs the same program on many emulators with different inputs, with the
+ * lockstep engine and with one emulator at a time (emu51_step() and
+ * emu51_run() loops), and prints the emulated instances per second, i.e. the
+ * runs of the whole cycle budget.
+ *
+ * usage: bench_lockstep [lanes] [cycles per lane]
+ */
+
+#define _POSIX_C_SOURCE 199309L /* clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <emu51.h>
+
+#define PMEM_SIZE 4096
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* program: a checksum of the inputs, with data dependent branches and a call
+ * run lane by lane once in 256 iterations
+ *   0x00: ADD A, @R0
+ *   0x01: JNC 0x05
+ *   0x03: ADDC A, #1
+ *   0x05: ADD A, R1
+ *   0x06: CJNE A, #0x80, 0x09
+ *   0x09: DJNZ R2, 0x00
+ *   0x0b: ACALL 0x10
+ *   0x0d: SJMP 0x00
+ *   0x10: RET
+ */
+static const uint8_t program[] = {
+	0x26, 0x50, 0x02, 0x34, 0x01, 0x29, 0xb4, 0x80,
+	0x00, 0xda, 0xf5, 0x11, 0x10, 0x80, 0xf1, 0x00,
+	0x22,
+};
+
+/* Set the inputs of an instance. */
+static void setup(emu51 *m, long instance)
+{
+	int i;
+
+	emu51_reset(m);
+	m->iram_lower[0x00] = 0x40 + instance % 16; /* R0 */
+	m->iram_lower[0x01] = (uint8_t)instance; /* R1 */
+	for (i = 0; i < 16; i++)
+		m->iram_lower[0x40 + i] = (uint8_t)(instance * 13 + i * 71);
+}
+
+int main(int argc, char *argv[])
+{
+	long lanes = argc > 1 ? atol(argv[1]) : 256;
+	long cycles = argc > 2 ? atol(argv[2]) : 100000;
+	uint8_t *pmem = calloc(PMEM_SIZE, 1);
+	void *buffer = malloc(emu51_lockstep_size(lanes));
+	emu51_lockstep *ls;
+	emu51_config config;
+	emu51 *m;
+	double start, step_rate, run_rate, lockstep_rate;
+	int reason;
+	long i;
+
+	memcpy(pmem, program, sizeof(program));
+	memset(&config, 0, sizeof(config));
+	config.pmem = pmem;
+	config.pmem_len = PMEM_SIZE;
+	m = emu51_create(&config);
+
+	start = now();
+	for (i = 0; i < lanes; i++) {
+		setup(m, i);
+		while (m->cycles < (uint64_t)cycles)
+			emu51_step(m, NULL);
+	}
+	step_rate = lanes / (now() - start);
+
+	start = now();
+	for (i = 0; i < lanes; i++) {
+		setup(m, i);
+		emu51_run(m, cycles, &reason);
+	}
+	run_rate = lanes / (now() - start);
+
+	start = now();
+	ls = emu51_lockstep_init(buffer, pmem, PMEM_SIZE, lanes);
+	for (i = 0; i < lanes; i++) {
+		setup(m, i);
+		emu51_lockstep_load(ls, i, m);
+	}
+	emu51_lockstep_run(ls, cycles, NULL);
+	lockstep_rate = lanes / (now() - start);
+
+	printf("%ld instances, %ld cycles each\n", lanes, cycles);
+	printf("engine        instances/s  speedup\n");
+	printf("emu51_step    %11.1f  %7.2f\n", step_rate, 1.0);
+	printf("emu51_run     %11.1f  %7.2f\n", run_rate, run_rate / step_rate);
+	printf("lockstep      %11.1f  %7.2f\n", lockstep_rate,
+		lockstep_rate / step_rate);
+
+	emu51_destroy(m);
+	free(buffer);
+	free(pmem);
+	return 0;
+}
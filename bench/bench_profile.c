@@ -0,0 +1,103 @@
+/* Benchmark of the execution profiler.
+ *
+ * Runs a program with and without the block cache, without a profile and
+ * with profiles of several sampling periods, and prints the cost of
+ * profiling on emu51_run().
+ *
+ * usage: bench_profile [cycles]
+ */
+
+#define _POSIX_C_SOURCE 199309L /* clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <emu51.h>
+
+#define PMEM_SIZE 4096
+#define REPEATS 5
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* program: a checksum of the internal memory, with a call
+ *   0x00: ADD A, @R0
+ *   0x01: JNC 0x05
+ *   0x03: ADDC A, #1
+ *   0x05: ADD A, R1
+ *   0x06: CJNE A, #0x80, 0x09
+ *   0x09: DJNZ R2, 0x00
+ *   0x0b: ACALL 0x10
+ *   0x0d: SJMP 0x00
+ *   0x10: RET
+ */
+static const uint8_t program[] = {
+	0x26, 0x50, 0x02, 0x34, 0x01, 0x29, 0xb4, 0x80,
+	0x00, 0xda, 0xf5, 0x11, 0x10, 0x80, 0xf1, 0x00,
+	0x22,
+};
+
+/* Run the program for the cycles, and return the best time taken of a few
+ * runs. */
+static double run(emu51 *m, long cycles)
+{
+	double start, elapsed, best = 0;
+	int i, reason;
+
+	for (i = 0; i < REPEATS; i++) {
+		emu51_reset(m);
+		m->iram_lower[0x00] = 0x40; /* R0 */
+		m->iram_lower[0x01] = 0x17; /* R1 */
+		start = now();
+		emu51_run(m, cycles, &reason);
+		elapsed = now() - start;
+		if (i == 0 || elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+int main(int argc, char *argv[])
+{
+	static const long periods[] = { 1, 7, 61, 1021 };
+	long cycles = argc > 1 ? atol(argv[1]) : 20000000;
+	uint8_t *pmem = calloc(PMEM_SIZE, 1);
+	void *cache = malloc(emu51_block_cache_size(PMEM_SIZE));
+	void *profile = malloc(emu51_profile_size(PMEM_SIZE));
+	emu51_config config;
+	emu51 *m;
+	double plain;
+	size_t i;
+	int blocks;
+
+	memcpy(pmem, program, sizeof(program));
+	memset(&config, 0, sizeof(config));
+	config.pmem = pmem;
+	config.pmem_len = PMEM_SIZE;
+	m = emu51_create(&config);
+
+	printf("%ld cycles\n", cycles);
+	printf("engine  period  overhead\n");
+	for (blocks = 0; blocks < 2; blocks++) {
+		emu51_set_block_cache(m, blocks ? cache : NULL);
+		plain = run(m, cycles);
+		for (i = 0; i < sizeof(periods) / sizeof(periods[0]); i++) {
+			emu51_set_profile(m, profile, periods[i]);
+			printf("%-6s  %6ld  %7.1f%%\n", blocks ? "blocks" : "plain",
+				periods[i], (run(m, cycles) / plain - 1) * 100);
+			emu51_set_profile(m, NULL, 0);
+		}
+	}
+
+	emu51_destroy(m);
+	free(profile);
+	free(cache);
+	free(pmem);
+	return 0;
+}
@@ -0,0 +1,107 @@
+/* Benchmark of the reverse execution.
+ *
+ * Runs a program on an emulator with 64 KiB of external memory, keeping a
+ * history with several checkpoint intervals, and prints the cost of keeping
+ * the history on emu51_run() and the time taken by emu51_reverse_step(),
+ * which grows with the interval.
+ *
+ * usage: bench_reverse [cycles]
+ */
+
+#define _POSIX_C_SOURCE 199309L /* clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <emu51.h>
+
+#define PMEM_SIZE 4096
+#define XRAM_SIZE 65536
+#define CHECKPOINTS 16
+#define INPUTS 1024
+#define REVERSE_STEPS 100
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* program: a checksum of the internal memory, with a call
+ *   0x00: ADD A, @R0
+ *   0x01: JNC 0x05
+ *   0x03: ADDC A, #1
+ *   0x05: ADD A, R1
+ *   0x06: CJNE A, #0x80, 0x09
+ *   0x09: DJNZ R2, 0x00
+ *   0x0b: ACALL 0x10
+ *   0x0d: SJMP 0x00
+ *   0x10: RET
+ */
+static const uint8_t program[] = {
+	0x26, 0x50, 0x02, 0x34, 0x01, 0x29, 0xb4, 0x80,
+	0x00, 0xda, 0xf5, 0x11, 0x10, 0x80, 0xf1, 0x00,
+	0x22,
+};
+
+/* Run the program for the cycles, and return the time taken. */
+static double run(emu51 *m, long cycles)
+{
+	double start;
+	int reason;
+
+	emu51_reset(m);
+	m->iram_lower[0x00] = 0x40; /* R0 */
+	m->iram_lower[0x01] = 0x17; /* R1 */
+	start = now();
+	emu51_run(m, cycles, &reason);
+	return now() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	static const long intervals[] = { 1000, 10000, 100000 };
+	long cycles = argc > 1 ? atol(argv[1]) : 10000000;
+	uint8_t *pmem = calloc(PMEM_SIZE, 1);
+	emu51_config config;
+	emu51 *m;
+	void *buffer;
+	double plain, forward, start;
+	size_t i;
+	int j;
+
+	memcpy(pmem, program, sizeof(program));
+	memset(&config, 0, sizeof(config));
+	config.pmem = pmem;
+	config.pmem_len = PMEM_SIZE;
+	config.xram_len = XRAM_SIZE;
+	m = emu51_create(&config);
+	buffer = malloc(emu51_history_size(m, CHECKPOINTS, INPUTS));
+
+	plain = run(m, cycles);
+	printf("%ld cycles, %d checkpoints of %zu bytes\n", cycles, CHECKPOINTS,
+		emu51_history_size(m, CHECKPOINTS, INPUTS) / CHECKPOINTS);
+	printf("interval  run overhead  reverse step (us)\n");
+
+	for (i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+		emu51_reset(m);
+		emu51_set_history(m, buffer, CHECKPOINTS, INPUTS, intervals[i]);
+		forward = run(m, cycles);
+
+		start = now();
+		for (j = 0; j < REVERSE_STEPS; j++)
+			if (emu51_reverse_step(m))
+				break;
+		printf("%8ld  %11.1f%%  %17.1f\n", intervals[i],
+			(forward / plain - 1) * 100, (now() - start) / j * 1e6);
+		emu51_set_history(m, NULL, 0, 0, 0);
+	}
+
+	emu51_destroy(m);
+	free(buffer);
+	free(pmem);
+	return 0;
+}
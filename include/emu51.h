@@ -6,6 +6,8 @@
 #define _EMU51_H_
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -17,22 +19,131 @@ extern "C" {
  */
 typedef struct emu51_features
 {
-	unsigned int timer2:1; /**< has timer2 */
+	unsigned int timer2:1; /**< has timer2 (8052), see @ref emu51::sfr */
 } emu51_features;
 
 typedef struct emu51 emu51;
 
+/** Predecoded instruction cache (opaque), see emu51_set_decode_cache(). */
+typedef struct emu51_decode_cache emu51_decode_cache;
+
+/** Basic block cache (opaque), see emu51_set_block_cache(). */
+typedef struct emu51_block_cache emu51_block_cache;
+
+/** Statistics of the basic block cache, see emu51_get_block_stats(). */
+typedef struct emu51_block_stats
+{
+	uint64_t hits;   /**< blocks executed, including the ones just built */
+	uint64_t misses; /**< blocks built */
+	uint64_t chained; /**< hits that followed a link from the previous block */
+	uint64_t invalidations; /**< times the cache was emptied */
+	uint64_t compiled; /**< blocks compiled to native code by the JIT */
+	uint64_t native; /**< block executions that ran native code */
+} emu51_block_stats;
+
+/** JIT compiler state (opaque), see emu51_jit_enable(). */
+typedef struct emu51_jit emu51_jit;
+
+/** Trusted program memory (opaque), see emu51_set_trusted(). */
+typedef struct emu51_trust emu51_trust;
+
+/** Memory write event log (opaque), see emu51_set_event_log(). */
+typedef struct emu51_event_log emu51_event_log;
+
+/** Host side of the serial port (opaque), see emu51_set_serial(). */
+typedef struct emu51_serial emu51_serial;
+
+/** Pool of threads running emulators (opaque), see emu51_fleet_create(). */
+typedef struct emu51_fleet emu51_fleet;
+
+/** Emulators run in lockstep (opaque), see emu51_lockstep_init(). */
+typedef struct emu51_lockstep emu51_lockstep;
+
+/** Saved state of an emulator (opaque), see emu51_snapshot(). */
+typedef struct emu51_state emu51_state;
+
+/** Baseline state for emu51_reset_to_baseline() (opaque), see
+ * emu51_set_baseline(). */
+typedef struct emu51_baseline emu51_baseline;
+
+/** Recorder or player of the external inputs (opaque), see
+ * emu51_set_recorder(). */
+typedef struct emu51_recorder emu51_recorder;
+
+/** Execution history for reverse execution (opaque), see
+ * emu51_set_history(). */
+typedef struct emu51_history emu51_history;
+
+/** Per-address execution profile (opaque), see emu51_set_profile(). */
+typedef struct emu51_profile emu51_profile;
+
+/** Result of an emulator in emu51_fleet_run(). */
+typedef struct emu51_fleet_status
+{
+	long cycles; /**< cycles run, see emu51_run() */
+	int reason;  /**< stop reason of the last slice, see emu51_run() */
+} emu51_fleet_status;
+
+/** A function of the firmware for emu51_profile_aggregate(). */
+typedef struct emu51_symbol
+{
+	const char *name; /**< name of the function, not used by the library */
+	uint16_t start;   /**< address of the first byte of the function, which
+	                       ends at the start of the next symbol */
+	uint64_t count;   /**< [out] instructions executed in the function */
+	uint64_t cycles;  /**< [out] cycles taken by those instructions */
+} emu51_symbol;
+
+/** Kinds of the events in the event log, see @ref emu51_event. */
+enum emu51_event_kind
+{
+	EMU51_EVENT_SFR = 0,  /**< SFR write, the address is the SFR index */
+	EMU51_EVENT_IRAM = 1, /**< internal RAM write (0~255) */
+	EMU51_EVENT_XRAM = 2, /**< external RAM write (0~65535) */
+};
+
+/** A memory write recorded in the event log, see emu51_set_event_log(). */
+typedef struct emu51_event
+{
+	uint32_t cycle; /**< lower 32 bits of @ref emu51::cycles at the start of
+	                     the instruction that made the write, or when the
+	                     change of a peripheral SFR was seen */
+	uint16_t addr;  /**< written address, see @ref emu51_event_kind */
+	uint8_t kind;   /**< one of @ref emu51_event_kind */
+	uint8_t value;  /**< value after the write */
+} emu51_event;
+
+/** Configuration of an emulator allocated by emu51_create(). */
+typedef struct emu51_config
+{
+	const uint8_t *pmem; /**< Read-only program memory, owned by the caller */
+	long pmem_len; /**< Size of the @c pmem buffer,
+								must be power of 2 within 1k~64k */
+	long xram_len; /**< Size of the external memory to allocate: 0 for none,
+								or a power of 2 within 1k~64k */
+	int iram_upper; /**< Non-zero to allocate the upper internal memory
+								(8052 mode) */
+	emu51_features feature; /**< Additional features of the emulator. */
+} emu51_config;
+
 /** Emulator event callbacks.
  *
  * This structure stores callback pointers. The first arguments of any callback
  * function must be an pointer to @ref emu51.
+ *
+ * The callbacks are ignored if the library is built without them, see
+ * @ref EMU51_BUILD_CALLBACKS.
  */
 typedef struct emu51_callbacks
 {
 	/** SFR update callback.
 	 *
-	 * Called after a SFR is written, regardless of whether the new value is
-	 * identical to the old value. Note that I/O operations are also included.
+	 * Called after a SFR is written by an instruction, regardless of whether
+	 * the new value is identical to the old value. Note that I/O operations
+	 * are also included. The changes made by the timers, the serial port and
+	 * the interrupt dispatch are only recorded in the event log (see
+	 * emu51_set_event_log()). Only the SFRs selected by @ref emu51::watch are
+	 * reported.
 	 *
 	 * @param m the emulator instance
 	 * @param addr index of the written SFR in the sfr buffer
@@ -42,7 +153,8 @@ typedef struct emu51_callbacks
 
 	/** Internal RAM update callback.
 	 *
-	 * Called after a write operation to the internal RAM.
+	 * Called after a write operation to the internal RAM. Only the addresses
+	 * selected by @ref emu51::watch are reported.
 	 *
 	 * @param m the emulator instance
 	 * @param addr address of the written memory location (0~255).
@@ -51,7 +163,8 @@ typedef struct emu51_callbacks
 
 	/** External RAM update callback.
 	 *
-	 * Called after a write operation to the exteranl RAM.
+	 * Called after a write operation to the exteranl RAM. Only the addresses
+	 * selected by @ref emu51::watch are reported.
 	 *
 	 * @param m the emulator instance
 	 * @param addr address of the written memory location (0~65535).
@@ -116,7 +229,12 @@ typedef struct emu51_callbacks
 
 /** 8051/8052 emulator structure
  *
- * This structure holds the state of the emulator.
+ * This structure holds the state of the emulator. It can be set up by the
+ * user with their own buffers, or allocated together with its memories by
+ * emu51_create().
+ *
+ * The fields up to @c next_event are used by every instruction, so they are kept
+ * together at the start of the structure, within its first two cache lines.
  */
 typedef struct emu51
 {
@@ -140,6 +258,13 @@ typedef struct emu51
 	/** Buffer to store special function registers (SFR).
 	 *
 	 * User must supply a 128-byte buffer to this pointer.
+	 *
+	 * Timers 0 and 1 count machine cycles in all four modes as configured by
+	 * TMOD and TCON, and so does timer 2 as configured by T2CON if
+	 * @ref emu51_features::timer2 is set (the counter modes are not
+	 * emulated since the pins are not; T2EX is read from the P1.1 latch).
+	 * The timer SFRs are up to date when emu51_step() or emu51_run()
+	 * returns, and the user may change them between the calls.
 	 */
 	uint8_t *sfr;
 
@@ -149,10 +274,197 @@ typedef struct emu51
 
 	uint16_t pc; /**< Program counter */
 
+	/** PSW flags whose evaluation is pending (internal).
+	 *
+	 * Only used if the library is built with EMU51_LAZY_FLAGS: arithmetic
+	 * instructions record their operands here instead of computing the flags,
+	 * and the flags are computed when PSW is read by an instruction, before a
+	 * callback is invoked and before emu51_step() or emu51_run() returns. The
+	 * PSW in @c sfr is therefore always up to date when the user can see it.
+	 */
+	struct emu51_lazy_psw
+	{
+		uint8_t pending;  /**< bitmask of the pending flag computations */
+		uint8_t acc;      /**< ACC before the last ADD/ADDC */
+		uint8_t operand;  /**< operand of the last ADD/ADDC */
+		uint8_t carry_in; /**< carry into the last ADD/ADDC */
+	} lazy_psw;
+
+	/** Address space tables (internal).
+	 *
+	 * Built from @c iram_lower, @c iram_upper and @c sfr when emu51_reset(),
+	 * emu51_step() or emu51_run() is called, so that an instruction accesses
+	 * memory with a table lookup. The buffer pointers must therefore not be
+	 * changed by a callback.
+	 */
+	struct emu51_memory_map
+	{
+		uint8_t *direct[2];   /**< direct addresses 0~0x7f and 0x80~0xff */
+		uint8_t *indirect[2]; /**< indirect addresses 0~0x7f and 0x80~0xff */
+		int8_t indirect_error[2]; /**< error code of accessing each half of
+		                               the indirect addresses, or 0 */
+		uint8_t *bank; /**< R0~R7 of the register bank selected by PSW */
+	} map;
+
+	/** Number of cycles executed since the last reset.
+	 *
+	 * Counted by emu51_step() and emu51_run(). While an instruction is
+	 * executed (e.g. in a callback), it is the count at the start of the
+	 * instruction.
+	 */
+	uint64_t cycles;
+
+	/** Cycle at which the next timer overflow is due (internal).
+	 *
+	 * The timers are not ticked for each instruction: the run loops execute
+	 * freely until @c cycles reaches this value, and the timer SFRs are
+	 * brought up to date when they are read. Lowered to the current cycle
+	 * when an interrupt can be taken. UINT64_MAX if there is no event.
+	 */
+	uint64_t next_event;
+
 	emu51_features feature; /**< Additional features of the emulator. */
 
 	emu51_callbacks callback; /**< callback pointers */
 
+	/** Addresses watched by the memory update callbacks (optional).
+	 *
+	 * Each bitmap selects the addresses whose writes fire the respective
+	 * callback: bit `addr % 8` of byte `addr / 8` marks address `addr`.
+	 * Leave a bitmap NULL to fire the callback for every address.
+	 */
+	struct emu51_watch
+	{
+		const uint8_t *sfr;  /**< sfr_update, by SFR index (16 bytes) */
+		const uint8_t *iram; /**< iram_update (32 bytes) */
+		const uint8_t *xram; /**< xram_update (8192 bytes) */
+	} watch;
+
+	/** The bitmaps of @c watch, with NULL replaced by a bitmap of all
+	 * addresses (internal). Built together with @c map. */
+	struct emu51_watch active_watch;
+
+	/** Memory write event log (optional).
+	 *
+	 * Use emu51_set_event_log() to set this field.
+	 */
+	emu51_event_log *event_log;
+
+	/** Host side of the serial port (optional).
+	 *
+	 * Use emu51_set_serial() to set this field.
+	 */
+	emu51_serial *serial;
+
+	/** Timer state (internal). */
+	struct emu51_timers
+	{
+		uint64_t synced; /**< cycle up to which the timers are counted in
+		                      the timer SFRs */
+		uint8_t t2ex;    /**< last seen level of the T2EX pin (P1.1) */
+	} timers;
+
+	/** Interrupt controller state (internal).
+	 *
+	 * Interrupts are requested by the flags in TCON, SCON and T2CON, and
+	 * enabled and prioritized by IE and IP (see emu51_ie_mask). The
+	 * external interrupts follow the INT0 and INT1 pins (P3.2 and P3.3):
+	 * edge triggered ones on a falling edge written to P3, level triggered
+	 * ones when the level written changes.
+	 */
+	struct emu51_irq
+	{
+		uint64_t earliest;  /**< no interrupt is taken before this cycle,
+		                         so that an instruction runs after RETI */
+		uint8_t pending;    /**< requested and enabled sources, in the
+		                         bit order of IE */
+		uint8_t in_service; /**< priority levels in service: 1 low,
+		                         2 high; the next RETI ends the highest */
+		uint8_t pins;       /**< last seen levels of INT0 and INT1 */
+	} irq;
+
+	/** Serial port state (internal).
+	 *
+	 * A frame takes 8 cycles in mode 0, 11 bits at 1/64 (SMOD: 1/32) of
+	 * the oscillator in mode 2, and 10 (mode 1) or 11 (mode 3) bits at the
+	 * baud rate of timer 1 in 8-bit auto-reload mode, or of timer 2 if
+	 * TCLK/RCLK is set. The baud rate is taken when a transfer starts.
+	 */
+	struct emu51_uart
+	{
+		uint64_t tx_done; /**< cycle at which the byte being sent is
+		                       done, UINT64_MAX if idle */
+		uint64_t rx_done; /**< same for the byte being received */
+		uint8_t tx_byte;  /**< byte being sent */
+		uint8_t rx_byte;  /**< last byte received, which the firmware
+		                       reads from SBUF; the SBUF entry of the
+		                       sfr buffer holds the last byte written */
+	} uart;
+
+	/** Predecoded instruction cache (optional).
+	 *
+	 * Use emu51_set_decode_cache() to set this field.
+	 */
+	emu51_decode_cache *decode_cache;
+
+	/** Basic block cache (optional).
+	 *
+	 * Use emu51_set_block_cache() to set this field.
+	 */
+	emu51_block_cache *block_cache;
+
+	/** JIT compiler state (optional).
+	 *
+	 * Use emu51_jit_enable() and emu51_jit_disable() to set this field.
+	 */
+	emu51_jit *jit;
+
+	/** Trusted program memory (optional).
+	 *
+	 * Use emu51_set_trusted() to set this field.
+	 */
+	emu51_trust *trust;
+
+	/** Baseline state (optional).
+	 *
+	 * Use emu51_set_baseline() to set this field.
+	 */
+	emu51_baseline *baseline;
+
+	/** Input recorder or player (optional).
+	 *
+	 * Use emu51_set_recorder() to set this field.
+	 */
+	emu51_recorder *recorder;
+
+	/** Execution history (optional).
+	 *
+	 * Use emu51_set_history() to set this field.
+	 */
+	emu51_history *history;
+
+	/** Execution profile (optional).
+	 *
+	 * Use emu51_set_profile() to set this field.
+	 */
+	emu51_profile *profile;
+
+	/** Breakpoint bitmap for emu51_run() (optional).
+	 *
+	 * One bit per program memory address: bit `addr % 8` of byte `addr / 8`
+	 * marks address `addr`, so the buffer must be at least `pmem_len / 8`
+	 * bytes long. Leave this field NULL if no breakpoints are used.
+	 */
+	const uint8_t *breakpoints;
+
+	/** Non-zero if the host asked emu51_run() to stop.
+	 *
+	 * Set by emu51_stop() and cleared when emu51_run() honours the request,
+	 * both with atomic operations when built with gcc or clang. Do not
+	 * write this field directly while emu51_run() is executing.
+	 */
+	volatile int stop_request;
+
 	/** Pointer for the user to store arbitrary data.
 	 *
 	 * This pointer can be used to store extra data associated with the emulator
@@ -193,6 +505,12 @@ enum emu51_sfr_index
 	SFR_IE = 0xa8 - 0x80,   /**< interrupt enable */
 	SFR_IP = 0xb8 - 0x80,   /**< interrupt priority */
 
+	SFR_T2CON = 0xc8 - 0x80,  /**< timer 2 control (8052) */
+	SFR_RCAP2L = 0xca - 0x80, /**< timer 2 capture/reload low (8052) */
+	SFR_RCAP2H = 0xcb - 0x80, /**< timer 2 capture/reload high (8052) */
+	SFR_TL2 = 0xcc - 0x80,    /**< timer 2 low (8052) */
+	SFR_TH2 = 0xcd - 0x80,    /**< timer 2 high (8052) */
+
 	SFR_PSW = 0xd0 - 0x80,  /**< program status word */
 	SFR_ACC = 0xe0 - 0x80,  /**< accumulator */
 	SFR_B = 0xf0 - 0x80,    /**< B register */
@@ -211,14 +529,132 @@ enum emu51_psw_mask
 	PSW_C  = 0x80,  /* carry */
 };
 
+/* bitmasks of TCON */
+enum emu51_tcon_mask
+{
+	TCON_IT0 = 0x01, /* INT0 triggered by falling edge */
+	TCON_IE0 = 0x02, /* INT0 edge flag */
+	TCON_IT1 = 0x04, /* INT1 triggered by falling edge */
+	TCON_IE1 = 0x08, /* INT1 edge flag */
+	TCON_TR0 = 0x10, /* timer 0 run */
+	TCON_TF0 = 0x20, /* timer 0 overflow */
+	TCON_TR1 = 0x40, /* timer 1 run */
+	TCON_TF1 = 0x80, /* timer 1 overflow */
+};
+
+/* bitmasks of TMOD */
+enum emu51_tmod_mask
+{
+	TMOD_T0_M0 = 0x01,   /* timer 0 mode, lower bit */
+	TMOD_T0_M1 = 0x02,   /* timer 0 mode, higher bit */
+	TMOD_T0_CT = 0x04,   /* timer 0 counts the T0 pin (not emulated) */
+	TMOD_T0_GATE = 0x08, /* timer 0 also gated by the INT0 pin */
+	TMOD_T1_M0 = 0x10,   /* timer 1 mode, lower bit */
+	TMOD_T1_M1 = 0x20,   /* timer 1 mode, higher bit */
+	TMOD_T1_CT = 0x40,   /* timer 1 counts the T1 pin (not emulated) */
+	TMOD_T1_GATE = 0x80, /* timer 1 also gated by the INT1 pin */
+};
+
+/* bitmasks of T2CON */
+enum emu51_t2con_mask
+{
+	T2CON_CP_RL2 = 0x01, /* capture (1) or auto-reload (0) */
+	T2CON_C_T2 = 0x02,   /* timer 2 counts the T2 pin (not emulated) */
+	T2CON_TR2 = 0x04,    /* timer 2 run */
+	T2CON_EXEN2 = 0x08,  /* capture or reload on a falling edge of T2EX */
+	T2CON_TCLK = 0x10,   /* baud rate generator for transmit */
+	T2CON_RCLK = 0x20,   /* baud rate generator for receive */
+	T2CON_EXF2 = 0x40,   /* timer 2 external flag */
+	T2CON_TF2 = 0x80,    /* timer 2 overflow */
+};
+
+/* bitmasks of IE; IP has the same layout without EA */
+enum emu51_ie_mask
+{
+	IE_EX0 = 0x01, /* external interrupt 0 */
+	IE_ET0 = 0x02, /* timer 0 */
+	IE_EX1 = 0x04, /* external interrupt 1 */
+	IE_ET1 = 0x08, /* timer 1 */
+	IE_ES = 0x10,  /* serial port */
+	IE_ET2 = 0x20, /* timer 2 (8052) */
+	IE_EA = 0x80,  /* enable all */
+};
+
+/* bitmasks of SCON */
+enum emu51_scon_mask
+{
+	SCON_RI = 0x01,  /* receive interrupt flag */
+	SCON_TI = 0x02,  /* transmit interrupt flag */
+	SCON_RB8 = 0x04, /* 9th data bit received */
+	SCON_TB8 = 0x08, /* 9th data bit to transmit */
+	SCON_REN = 0x10, /* receive enable */
+	SCON_SM2 = 0x20, /* multiprocessor communication */
+	SCON_SM1 = 0x40, /* serial mode, lower bit */
+	SCON_SM0 = 0x80, /* serial mode, higher bit */
+};
+
 /** Error codes returned by the emulator. */
 enum emu51_errno
 {
 	EMU51_PMEM_OUT_OF_RANGE = -1, /**< Accessing beyond the program memory */
 	EMU51_IRAM_OUT_OF_RANGE = -2, /**< Accessing beyond the internal memory */
 	EMU51_BIT_OUT_OF_RANGE = -3, /**< Accessing bit address >= 128 */
+	EMU51_NOT_SUPPORTED = -4, /**< Feature not available in this build */
+	EMU51_OUT_OF_MEMORY = -5, /**< Memory allocation failed */
+	EMU51_NOT_IMPLEMENTED = -6, /**< Executing an unimplemented instruction */
+	EMU51_STATE_MISMATCH = -7, /**< Restoring a snapshot of an emulator with
+	                                other memories */
+	EMU51_LOG_ERROR = -8, /**< Input log or profile file cannot be accessed
+	                           or is invalid */
+	EMU51_REPLAY_DIVERGED = -9, /**< Execution differs from the input log */
+	EMU51_NO_HISTORY = -10, /**< Going back beyond the execution history */
+};
+
+/** Modes of emu51_set_recorder(). */
+enum emu51_record_mode
+{
+	EMU51_RECORD = 1, /**< Log the external inputs to a file */
+	EMU51_REPLAY = 2, /**< Feed the external inputs from a log */
+};
+
+/** File formats of emu51_profile_write(). */
+enum emu51_profile_format
+{
+	EMU51_PROFILE_TEXT = 0,   /**< Text lines of address, count and cycles */
+	EMU51_PROFILE_BINARY = 1, /**< Little endian records */
+};
+
+/** Reasons for emu51_run() to return.
+ *
+ * If emu51_run() stops because of an error, the stop reason is the (negative)
+ * error number from @ref emu51_errno instead of one of these values.
+ */
+enum emu51_stop_reason
+{
+	EMU51_STOP_BUDGET = 0,     /**< The cycle budget is exhausted */
+	EMU51_STOP_BREAKPOINT = 1, /**< pc reached a breakpoint */
+	EMU51_STOP_HOST = 2,       /**< The host called emu51_stop() */
+};
+
+/** Options the library was built with, see emu51_build_options(). */
+enum emu51_build_option
+{
+	/** The callbacks in @ref emu51::callback are invoked. Libraries built
+	 * without them (the `emu51_nocallback` target) ignore the callbacks. */
+	EMU51_BUILD_CALLBACKS = 0x01,
+	EMU51_BUILD_THREADED_DISPATCH = 0x02, /**< threaded interpreter core */
+	EMU51_BUILD_LAZY_FLAGS = 0x04, /**< PSW flags are computed lazily */
+	EMU51_BUILD_JIT = 0x08, /**< the JIT compiler is available */
+	EMU51_BUILD_FLEET = 0x10, /**< the fleet runner is available */
+	EMU51_BUILD_COW_FORK = 0x20, /**< forks share external memory pages */
 };
 
+/** Get the options the linked library was built with.
+ *
+ * @return a bitmask of @ref emu51_build_option
+ */
+unsigned int emu51_build_options(void);
+
 /** Reset the emulator.
  *
  * @note The SFR buffer @c m->sfr must be specified before calling this
@@ -228,6 +664,31 @@ enum emu51_errno
  */
 void emu51_reset(emu51 *m);
 
+/** Allocate and reset an emulator with its memories.
+ *
+ * The emulator structure, the SFRs, the internal memory and the external
+ * memory are allocated as one block aligned to a cache line, with the SFRs and
+ * the internal memory right after the structure. The memories are zeroed and
+ * the pointer fields of the structure are set up, so the returned emulator
+ * can be used like one set up by the user. The program memory is not copied.
+ *
+ * @param config the configuration of the emulator
+ * @return Returns the emulator, or NULL if the memory cannot be allocated.
+ *         Free it with emu51_destroy().
+ */
+emu51 *emu51_create(const emu51_config *config);
+
+/** Free an emulator allocated by emu51_create().
+ *
+ * The JIT is disabled if it is enabled. Caches and other buffers attached by
+ * the user are not freed, and not accessed either, so they may be freed
+ * before the emulator. Must not be called on an emulator that was set up by
+ * the user.
+ *
+ * @param m the emulator object, or NULL
+ */
+void emu51_destroy(emu51 *m);
+
 /** Execute one instruction.
  *
  * @param m the emulator object
@@ -240,6 +701,729 @@ void emu51_reset(emu51 *m);
  */
 int emu51_step(emu51 *m, int *cycles);
 
+/** Execute instructions until the cycle budget runs out or a stop condition
+ * occurs.
+ *
+ * The stop conditions are checked before each instruction: an instruction
+ * error, a breakpoint set in @ref emu51::breakpoints, or a call to
+ * emu51_stop(). The breakpoint at the address where emu51_run() starts is
+ * ignored, so that calling it again after a breakpoint resumes the program.
+ *
+ * The last instruction may overrun the budget by a few cycles; the return
+ * value tells exactly how many cycles were executed.
+ *
+ * @param m the emulator object
+ * @param max_cycles cycle budget
+ * @param reason [out] Why the function returned: one of
+ *                     @ref emu51_stop_reason, or the error number if an
+ *                     instruction failed. Set it to NULL to ignore the value.
+ *
+ * @return Returns the number of cycles executed.
+ * @note On error, the program counter points to the offending instruction,
+ *       just like emu51_step().
+ */
+long emu51_run(emu51 *m, long max_cycles, int *reason);
+
+/** Get the size of the buffer needed by emu51_set_decode_cache().
+ *
+ * @param pmem_len size of the program memory
+ * @return the buffer size in bytes
+ */
+size_t emu51_decode_cache_size(long pmem_len);
+
+/** Attach a predecoded instruction cache to the emulator.
+ *
+ * With a cache attached, each program memory address is decoded only the
+ * first time it is executed; later executions skip the opcode table lookup,
+ * the instruction length check and the operand decoding.
+ *
+ * The cache is tied to the program memory (@ref emu51::pmem and
+ * @ref emu51::pmem_len). If either of them is changed, the cache is
+ * discarded and refilled at the next emu51_step() or emu51_run() call;
+ * if the new program memory is larger than the cache, the cache is detached.
+ * Since program memory is read-only, modifying its content in place requires
+ * attaching the cache again.
+ *
+ * @param m the emulator object
+ * @param buffer A buffer of at least
+ *               `emu51_decode_cache_size(m->pmem_len)` bytes, aligned for any
+ *               type (e.g. allocated by malloc()). The buffer is owned by the
+ *               caller and must stay valid while attached. Set it to NULL to
+ *               detach the cache.
+ */
+void emu51_set_decode_cache(emu51 *m, void *buffer);
+
+/** Get the size of the buffer needed by emu51_set_block_cache().
+ *
+ * @param pmem_len size of the program memory
+ * @return the buffer size in bytes
+ */
+size_t emu51_block_cache_size(long pmem_len);
+
+/** Attach a basic block cache to the emulator.
+ *
+ * With a block cache attached, emu51_run() executes the program as basic
+ * blocks: straight runs of instructions that end at a jump, branch or call.
+ * Each block is built the first time its address is executed, its cycles are
+ * accounted at once, and blocks are linked to their static successors (the
+ * fall-through address and the direct jump target) so that the hot path
+ * doesn't go through the opcode table. The results are identical to
+ * executing the instructions one by one.
+ *
+ * The block engine is not used while breakpoints are set
+ * (@ref emu51::breakpoints). The cache is tied to the program memory in the
+ * same way as the predecoded instruction cache, see emu51_set_decode_cache().
+ * The block cache holds its own decoded instructions, so it does not need
+ * @ref emu51::decode_cache.
+ *
+ * @param m the emulator object
+ * @param buffer A buffer of at least `emu51_block_cache_size(m->pmem_len)`
+ *               bytes, aligned for any type (e.g. allocated by malloc()).
+ *               The buffer is owned by the caller and must stay valid while
+ *               attached. Attaching a buffer resets the statistics. Set it
+ *               to NULL to detach the cache.
+ */
+void emu51_set_block_cache(emu51 *m, void *buffer);
+
+/** Get the size of the buffer needed by emu51_set_trusted().
+ *
+ * @param pmem_len size of the program memory
+ * @return the buffer size in bytes
+ */
+size_t emu51_trust_size(long pmem_len);
+
+/** Verify the program memory and run it in trusted mode.
+ *
+ * The code reachable from the reset vector (address 0) is scanned once,
+ * following the fall-through paths and the direct jumps and calls. The
+ * firmware is rejected if the scan reaches an instruction that is not
+ * implemented, or one that does not entirely reside in program memory.
+ * Otherwise the emulator enters trusted mode, in which emu51_step() and
+ * emu51_run() don't check pc against the program memory size for each
+ * instruction, since pc can only reach verified code:
+ *
+ * - When emu51_step() or emu51_run() starts at an address that was not
+ *   reached by the scan (e.g. pc was set by the user), the code reachable
+ *   from there is verified first. If it is rejected, the error is returned
+ *   and nothing is executed.
+ * - An indirect jump (JMP @A+DPTR) verifies the code at its target the same
+ *   way, and fails with the error if it is rejected.
+ * - MOVC addresses wrap around at the end of program memory (mirroring)
+ *   instead of failing with EMU51_PMEM_OUT_OF_RANGE.
+ *
+ * The trusted mode is tied to the program memory in the same way as the
+ * predecoded instruction cache, see emu51_set_decode_cache(): if the program
+ * memory is swapped, its code is verified again as it is entered.
+ *
+ * @param m the emulator object
+ * @param buffer A buffer of at least `emu51_trust_size(m->pmem_len)` bytes,
+ *               aligned for any type (e.g. allocated by malloc()). The buffer
+ *               is owned by the caller and must stay valid while attached.
+ *               Set it to NULL to leave trusted mode.
+ * @return Returns 0 on success; returns EMU51_NOT_IMPLEMENTED or
+ *         EMU51_PMEM_OUT_OF_RANGE if the firmware is rejected, in which case
+ *         the emulator is not in trusted mode.
+ */
+int emu51_set_trusted(emu51 *m, void *buffer);
+
+/** Get the size of the buffer needed by emu51_set_event_log().
+ *
+ * @param capacity number of events the log can hold
+ * @return the buffer size in bytes
+ */
+size_t emu51_event_log_size(long capacity);
+
+/** Record the memory writes in an event log.
+ *
+ * With an event log attached, every write of an instruction to a watched
+ * address (see @ref emu51::watch) appends an @ref emu51_event to a ring
+ * buffer, so that the host can consume the writes in bulk with
+ * emu51_drain_events() (e.g. once after each emu51_run() slice) instead of
+ * taking a callback per write. The memory update callbacks still fire if they
+ * are set; leave them NULL to only use the log.
+ *
+ * The SFRs changed by the hardware (TCON, TLx/THx, SCON, SBUF and the timer 2
+ * SFRs, by the timers, the serial port and the interrupt dispatch) are logged
+ * with their new value when the change is seen: at each event (e.g. a timer
+ * overflow or the end of a serial transfer), when an instruction accesses
+ * one of those SFRs, and when emu51_step() or emu51_run() returns. A counting
+ * timer therefore appears as one event per change seen, not per increment.
+ *
+ * When the log is full, further events are dropped and counted, see
+ * emu51_events_lost(). The log must not be drained while emu51_step() or
+ * emu51_run() is executing, except from a callback.
+ *
+ * @param m the emulator object
+ * @param buffer A buffer of at least `emu51_event_log_size(capacity)` bytes,
+ *               aligned for any type (e.g. allocated by malloc()). The buffer
+ *               is owned by the caller and must stay valid while attached.
+ *               Set it to NULL to stop recording.
+ * @param capacity number of events the log can hold, must be a power of 2
+ */
+void emu51_set_event_log(emu51 *m, void *buffer, long capacity);
+
+/** Take the oldest events out of the event log.
+ *
+ * @param m the emulator object
+ * @param events [out] buffer for the events, oldest first
+ * @param max_events size of the @a events buffer
+ * @return Returns the number of events stored in @a events; 0 if the log is
+ *         empty or no event log is attached.
+ */
+long emu51_drain_events(emu51 *m, emu51_event *events, long max_events);
+
+/** Get the number of events dropped because the event log was full.
+ *
+ * @param m the emulator object
+ * @return the number of dropped events since the log was attached
+ */
+uint64_t emu51_events_lost(const emu51 *m);
+
+/** Get the size of the buffer needed by emu51_set_serial().
+ *
+ * @param capacity number of bytes each FIFO can hold
+ * @return the buffer size in bytes
+ */
+size_t emu51_serial_size(long capacity);
+
+/** Connect the serial port to host FIFOs.
+ *
+ * The firmware sends a byte by writing SBUF: TI is set when the frame is
+ * done, at the cycle given by the baud rate (see @ref emu51::uart), and the
+ * byte is appended to the transmit FIFO, for emu51_serial_receive(). The
+ * bytes queued by emu51_serial_send() are received one at a time while REN is
+ * set and RI is clear: RI is set and the byte is stored in the receive
+ * buffer when the frame is done. Like on the chip, the receive buffer, read
+ * from SBUF (see @ref emu51::uart), is separate from the transmit buffer, so a
+ * byte written to SBUF doesn't overwrite the byte received. The receiver is thus flow controlled by the firmware, and
+ * no byte is lost on overrun.
+ *
+ * When the transmit FIFO is full, further bytes are dropped and counted, see
+ * emu51_serial_lost(). Without FIFOs, the bytes sent are dropped and nothing
+ * is received. The SM2 multiprocessor mode and the 9th data bit (TB8/RB8)
+ * are not emulated. The FIFOs must not be accessed while emu51_step() or
+ * emu51_run() is executing, except from a callback.
+ *
+ * @param m the emulator object
+ * @param buffer A buffer of at least `emu51_serial_size(capacity)` bytes,
+ *               aligned for any type (e.g. allocated by malloc()). The buffer
+ *               is owned by the caller and must stay valid while attached.
+ *               Set it to NULL to disconnect the FIFOs.
+ * @param capacity number of bytes each FIFO can hold, must be a power of 2
+ */
+void emu51_set_serial(emu51 *m, void *buffer, long capacity);
+
+/** Queue bytes for the firmware to receive.
+ *
+ * @param m the emulator object
+ * @param data the bytes to send
+ * @param len number of bytes in @a data
+ * @return Returns the number of bytes queued, which is less than @a len if
+ *         the receive FIFO is full; 0 if no FIFOs are attached.
+ */
+long emu51_serial_send(emu51 *m, const uint8_t *data, long len);
+
+/** Take the oldest bytes sent by the firmware out of the transmit FIFO.
+ *
+ * @param m the emulator object
+ * @param data [out] buffer for the bytes, oldest first
+ * @param max_len size of the @a data buffer
+ * @return Returns the number of bytes stored in @a data; 0 if the FIFO is
+ *         empty or no FIFOs are attached.
+ */
+long emu51_serial_receive(emu51 *m, uint8_t *data, long max_len);
+
+/** Get the number of bytes sent by the firmware and dropped because the
+ * transmit FIFO was full.
+ *
+ * @param m the emulator object
+ * @return the number of dropped bytes since the FIFOs were attached
+ */
+uint64_t emu51_serial_lost(const emu51 *m);
+
+/** Start a pool of threads to run many emulators with emu51_fleet_run().
+ *
+ * Only available if the library is built with the fleet runner, see
+ * @ref EMU51_BUILD_FLEET.
+ *
+ * @param threads number of worker threads, or 0 for one per online CPU
+ * @return Returns the fleet, or NULL if the fleet runner is not built or the
+ *         threads cannot be started. Free it with emu51_fleet_destroy().
+ */
+emu51_fleet *emu51_fleet_create(int threads);
+
+/** Stop the threads of a fleet and free it.
+ *
+ * @param fleet the fleet, or NULL
+ */
+void emu51_fleet_destroy(emu51_fleet *fleet);
+
+/** Get the number of worker threads of a fleet.
+ *
+ * @param fleet the fleet
+ * @return the number of threads
+ */
+int emu51_fleet_threads(const emu51_fleet *fleet);
+
+/** Run independent emulators on the threads of a fleet.
+ *
+ * Each emulator runs with emu51_run() in slices of @a slice_cycles, until it
+ * has run @a max_cycles (which may be overrun like in emu51_run()) or a slice
+ * stops for another reason than @ref EMU51_STOP_BUDGET, e.g. an error, a
+ * breakpoint or emu51_stop(). Each thread takes turns among the emulators of
+ * its own queue, and steals emulators from the other threads when its queue
+ * is empty.
+ *
+ * The call returns when all emulators are done. An emulator must appear once
+ * in @a machines, and must not be accessed by the caller until the call
+ * returns, except with emu51_stop(). Its callbacks are called from the worker
+ * threads, one slice at a time.
+ *
+ * @param fleet the fleet
+ * @param machines the emulators to run
+ * @param count number of emulators in @a machines
+ * @param max_cycles cycle budget of each emulator
+ * @param slice_cycles cycle budget of a slice; 0 to run each emulator in one
+ *                     slice
+ * @param status [out] the result of each emulator, @a count entries
+ * @return Returns 0 on success; EMU51_OUT_OF_MEMORY if the queues cannot be
+ *         allocated; EMU51_NOT_SUPPORTED if the fleet runner is not built.
+ */
+int emu51_fleet_run(emu51_fleet *fleet, emu51 *const *machines, long count,
+		long max_cycles, long slice_cycles, emu51_fleet_status *status);
+
+/** Get the size of the buffer for emu51_lockstep_init().
+ *
+ * @param lanes number of emulators run in lockstep
+ * @return the size in bytes
+ */
+size_t emu51_lockstep_size(long lanes);
+
+/** Set up emulators run in lockstep on the same program.
+ *
+ * The lanes run the program in the same way as emu51_run() on a plain
+ * emulator, with their state stored column-wise so that the lanes at the same
+ * pc run each instruction together, vectorized by the compiler for the common
+ * ALU and branch instructions. This is meant for many instances of a small
+ * program with different inputs, e.g. fuzzing or parameter sweeps.
+ *
+ * A lane only has the lower 128 bytes of internal RAM and the SFRs, which
+ * are plain registers: there are no timers, interrupts, serial port,
+ * callbacks, event log or external memory. Accessing the upper internal RAM
+ * or the external memory stops the lane with an error.
+ *
+ * All lanes start in the reset state, see emu51_reset().
+ *
+ * @param buffer the memory for the lanes, emu51_lockstep_size() bytes aligned
+ *               like a pointer
+ * @param pmem program memory shared by all lanes, must outlive the lanes
+ * @param pmem_len size of the program memory
+ * @param lanes number of lanes
+ * @return the lanes, in @a buffer
+ */
+emu51_lockstep *emu51_lockstep_init(void *buffer, const uint8_t *pmem,
+		long pmem_len, long lanes);
+
+/** Copy pc, cycles, the lower internal RAM and the SFRs of an emulator to a
+ * lane.
+ *
+ * @param ls the lanes
+ * @param lane the index of the lane
+ * @param m the emulator
+ */
+void emu51_lockstep_load(emu51_lockstep *ls, long lane, const emu51 *m);
+
+/** Copy pc, cycles, the lower internal RAM and the SFRs of a lane to an
+ * emulator.
+ *
+ * @param ls the lanes
+ * @param lane the index of the lane
+ * @param m [out] the emulator
+ */
+void emu51_lockstep_store(const emu51_lockstep *ls, long lane, emu51 *m);
+
+/** Run all lanes for up to @a max_cycles each.
+ *
+ * Each lane stops like emu51_run() when it has run @a max_cycles (which may
+ * be overrun by the last instruction) or on an error, which leaves pc at the
+ * faulting instruction.
+ *
+ * @param ls the lanes
+ * @param max_cycles cycle budget of each lane
+ * @param reasons [out] the stop reason of each lane (see emu51_run()), or
+ *                NULL
+ * @return the number of lanes that stopped because of an error
+ */
+long emu51_lockstep_run(emu51_lockstep *ls, long max_cycles, int *reasons);
+
+/** Save the state of an emulator.
+ *
+ * The snapshot holds pc, the cycle count, the internal and external memories,
+ * the SFRs and the internal state of the timers, the interrupt controller and
+ * the serial port. The attached buffers (caches, event log, serial FIFOs,
+ * ...) are not saved; the caches stay valid across emu51_restore() since
+ * they only depend on the program memory.
+ *
+ * @param m the emulator object, which must not be running
+ * @return Returns the snapshot, or NULL if the memory cannot be allocated.
+ *         Free it with emu51_state_destroy().
+ */
+emu51_state *emu51_snapshot(const emu51 *m);
+
+/** Return an emulator to a saved state.
+ *
+ * The emulator must have the same memories as the one the snapshot was taken
+ * from (upper internal memory, and size of the external memory), but may be
+ * another emulator. The snapshot is not modified and can be restored again.
+ *
+ * @param m the emulator object, which must not be running
+ * @param s the snapshot
+ * @return Returns 0 on success, or EMU51_STATE_MISMATCH if the memories
+ *         differ.
+ */
+int emu51_restore(emu51 *m, const emu51_state *s);
+
+/** Allocate a new emulator in a saved state.
+ *
+ * The emulator is allocated like with emu51_create() and restored from the
+ * snapshot. It shares the program memory, the callbacks, the watched
+ * addresses, the breakpoints and the user data of the emulator the snapshot
+ * was taken from, but none of its attached buffers.
+ *
+ * If the library is built with @ref EMU51_BUILD_COW_FORK, the external memory
+ * is shared copy-on-write: the forks of a snapshot share the pages (4 KiB on
+ * most hosts) they have not written with the snapshot, so forking costs no
+ * copy of the external memory, and each fork only uses memory for the pages
+ * it writes. Otherwise the external memory is copied.
+ *
+ * @param s the snapshot, which may be freed before the fork
+ * @return Returns the emulator, or NULL if the memory cannot be allocated.
+ *         Free it with emu51_destroy().
+ */
+emu51 *emu51_fork(const emu51_state *s);
+
+/** Free a snapshot.
+ *
+ * @param s the snapshot, or NULL
+ */
+void emu51_state_destroy(emu51_state *s);
+
+/** Get the size of the buffer for emu51_set_baseline().
+ *
+ * @param m the emulator object, with its memories set up
+ * @return the size in bytes
+ */
+size_t emu51_baseline_size(const emu51 *m);
+
+/** Mark the current state as the baseline for emu51_reset_to_baseline().
+ *
+ * The state is saved like with emu51_snapshot() into the buffer, which must
+ * stay valid while it is attached. From then on, the library tracks the
+ * 256-byte pages of external memory written by the emulator, so that a reset
+ * only copies those pages back. Since the internal memory and the SFRs take a
+ * few cache lines, they are copied back as a whole.
+ *
+ * The writes of the host to the external memory are not seen by the library:
+ * the host must report them with emu51_mark_xram_dirty(). emu51_restore()
+ * marks the whole external memory. The memory buffers of the emulator must
+ * not be changed while the baseline is attached.
+ *
+ * @param m the emulator object, which must not be running
+ * @param buffer emu51_baseline_size() bytes aligned like a pointer, or NULL to
+ *               detach the baseline
+ */
+void emu51_set_baseline(emu51 *m, void *buffer);
+
+/** Report a write of the host to the external memory.
+ *
+ * Only needed if a baseline is set, see emu51_set_baseline().
+ *
+ * @param m the emulator object
+ * @param addr the first written address
+ * @param len the number of written bytes
+ */
+void emu51_mark_xram_dirty(emu51 *m, uint16_t addr, long len);
+
+/** Return the emulator to its baseline state.
+ *
+ * The state is the one saved by emu51_set_baseline(). The cost depends on
+ * the number of pages of external memory written since the baseline was set
+ * or the emulator was last reset to it, not on the size of the external
+ * memory. Does nothing if no baseline is set.
+ *
+ * @param m the emulator object, which must not be running
+ */
+void emu51_reset_to_baseline(emu51 *m);
+
+/** Get the size of the buffer for emu51_set_recorder().
+ *
+ * @return Returns the size in bytes.
+ */
+size_t emu51_recorder_size(void);
+
+/** Record the external inputs of the emulator to a log, or replay them.
+ *
+ * The external inputs are the values of the ports P0~P3 read by the
+ * instructions, which come from the @ref emu51_callbacks::io_read callback,
+ * the bytes sent to the serial port with emu51_serial_send(), and the levels
+ * of the external interrupt pins INT0 and INT1 (P3.2 and P3.3) that the host
+ * sets in the P3 latch. Everything else the emulator does is determined by
+ * its state, so a recorded run can be repeated exactly from the same starting
+ * state with no host involved.
+ *
+ * In @ref EMU51_RECORD mode, each input is appended to the file as it occurs,
+ * with the number of cycles since the previous input; most entries are two
+ * bytes. Writes to the file are buffered, and flushed when the recorder is
+ * detached.
+ *
+ * In @ref EMU51_REPLAY mode, the port reads take their values from the log
+ * instead of calling @ref emu51_callbacks::io_read, and the serial input is
+ * delivered at the recorded cycles while emu51_serial_send() discards the
+ * bytes given to it. The serial port must be attached (see emu51_set_serial())
+ * as it was while recording. If a port is read at another cycle than the
+ * recorded one, or another port is read, the instruction fails with
+ * @ref EMU51_REPLAY_DIVERGED. After the last input of the log, ports read
+ * their latch. The levels of INT0 and INT1 are recorded when the interrupt
+ * controller sees them change: when emu51_step() or emu51_run() starts, or
+ * when the firmware writes P3 or another SFR the interrupts depend on. While
+ * replaying, they are set in P3 from the log at the same points, and the
+ * changes the host makes to these two bits are ignored.
+ *
+ * Other changes the host makes to the memories or the SFRs between runs are
+ * not inputs and are not recorded. The cycle counter must not go back while
+ * recording, e.g. by emu51_reset() or emu51_restore().
+ *
+ * @param m the emulator object, which must not be running
+ * @param buffer a buffer of emu51_recorder_size() bytes, or NULL to detach the
+ *               current recorder
+ * @param file the log, open for writing (recording) or reading (replaying);
+ *             it stays owned by the caller and must stay open until the
+ *             recorder is detached
+ * @param mode @ref EMU51_RECORD or @ref EMU51_REPLAY
+ * @return Returns 0 on success, or EMU51_LOG_ERROR if the log to replay does
+ *         not start with a valid header, in which case nothing is attached.
+ *         When a recorder is detached, returns EMU51_LOG_ERROR if writing
+ *         or reading its log failed at any point, or if the replayed log
+ *         turned out to be invalid.
+ */
+int emu51_set_recorder(emu51 *m, void *buffer, FILE *file, int mode);
+
+/** Test if all the inputs of the replayed log have been fed.
+ *
+ * @param m the emulator object
+ * @return Returns non-zero if the emulator is replaying a log and has
+ *         reached its end, 0 otherwise.
+ */
+int emu51_replay_done(const emu51 *m);
+
+/** Get the size of the buffer for emu51_set_history().
+ *
+ * This is the memory budget of the history: each checkpoint takes about the
+ * size of the external memory plus 1 KiB, and each input 16 bytes.
+ *
+ * @param m the emulator object, with its external memory allocated
+ * @param checkpoints number of checkpoints kept
+ * @param inputs number of inputs kept, see emu51_set_history()
+ * @return Returns the size in bytes.
+ */
+size_t emu51_history_size(const emu51 *m, long checkpoints, long inputs);
+
+/** Keep an execution history, for emu51_reverse_step() and
+ * emu51_reverse_continue().
+ *
+ * A checkpoint of the state is taken now, and then at the first instruction
+ * boundary after every @a interval cycles of emu51_step() or emu51_run().
+ * When all the checkpoints are taken, the oldest one is dropped. Going back
+ * restores the latest checkpoint before the target and executes the
+ * firmware again from there, so it costs up to two intervals of emulation,
+ * and the history reaches back between `(checkpoints - 1) * interval` and
+ * `checkpoints * interval` cycles.
+ *
+ * The firmware is executed again without the host: the callbacks are not
+ * called, nothing is sent to or taken from the serial FIFOs, and nothing is
+ * added to the event log. The inputs the firmware took from the host are kept
+ * in the history and fed again instead: the values of the ports returned by
+ * @ref emu51_callbacks::io_read, the bytes received from the serial port, and
+ * the levels of INT0 and INT1 set by the host. If the inputs since the oldest
+ * checkpoint fill the space for @a inputs, older checkpoints are dropped; if
+ * there is only one left, the history starts over at the next instruction
+ * boundary.
+ *
+ * Changes the host makes to the state (e.g. emu51_reset(), emu51_restore(),
+ * writes to the memories) are not part of the history, so the history must
+ * be set again after them. Going forward after going back executes the
+ * firmware with the host again, and the history of the abandoned future is
+ * forgotten.
+ *
+ * @param m the emulator object, which must not be running
+ * @param buffer a buffer of `emu51_history_size(m, checkpoints, inputs)`
+ *               bytes, aligned for any type (e.g. allocated by malloc()), or
+ *               NULL to stop keeping a history
+ * @param checkpoints number of checkpoints kept, at least 1
+ * @param inputs number of inputs kept, a power of 2
+ * @param interval cycles between the checkpoints
+ */
+void emu51_set_history(emu51 *m, void *buffer, long checkpoints, long inputs,
+		long interval);
+
+/** Go back to the state before the last step.
+ *
+ * A step is what emu51_step() executes: an instruction, or the call to an
+ * interrupt vector.
+ *
+ * @param m the emulator object, which must not be running
+ * @return Returns 0 on success. Returns EMU51_NO_HISTORY if no history is kept
+ *         or the state is the oldest one of the history, in which case the
+ *         emulator is not changed. Returns EMU51_NOT_SUPPORTED if a recorder
+ *         is attached (see emu51_set_recorder()). If the execution turns out
+ *         to differ from the history, returns the error of emu51_step() or
+ *         EMU51_REPLAY_DIVERGED; the emulator is then left where the
+ *         execution stopped, and the history starts over from there.
+ */
+int emu51_reverse_step(emu51 *m);
+
+/** Go back to the state before the last step that changed an address.
+ *
+ * Like a software watchpoint, the writes are found by comparing the value
+ * before and after each step, so writes of the same value are not seen.
+ *
+ * @param m the emulator object, which must not be running
+ * @param kind the address space, one of @ref emu51_event_kind
+ * @param addr the address, as in @ref emu51_event
+ * @return Returns 0 on success, so that the next emu51_step() writes to
+ *         the address. Returns EMU51_NO_HISTORY if no history is kept or
+ *         the state is the oldest one, in which case the emulator is not
+ *         changed, or if no write is found, in which case the emulator goes
+ *         back to the oldest state of the history. Other errors are the same
+ *         as emu51_reverse_step(), and EMU51_NOT_SUPPORTED if the address
+ *         does not exist.
+ */
+int emu51_reverse_continue(emu51 *m, int kind, uint16_t addr);
+
+/** Get the size of the buffer for emu51_set_profile().
+ *
+ * @param pmem_len the size of the program memory
+ * @return Returns the size in bytes: 16 bytes per address.
+ */
+size_t emu51_profile_size(long pmem_len);
+
+/** Count the executions and the cycles of the instruction at each address.
+ *
+ * emu51_step() and emu51_run() add to the counters of the profile; the
+ * cycles of the calls to interrupt vectors are not counted. Without the
+ * block cache, emu51_run() uses the portable interpreter while profiling,
+ * even in a build with @ref EMU51_BUILD_THREADED_DISPATCH.
+ *
+ * With a sampling @a period of N, only one execution in N is counted (with
+ * the block cache, one block execution in N, with all its instructions) and
+ * it counts N times, so the counters estimate the true counts at a fraction
+ * of the cost. A period that divides the length of a hot loop may always
+ * sample the same part of it; a prime number avoids this. The delay loops
+ * that emu51_run() skips at once are always counted exactly.
+ *
+ * The re-executions of emu51_reverse_step() and emu51_reverse_continue()
+ * are not counted.
+ *
+ * @param m the emulator object, which must not be running
+ * @param buffer a buffer of `emu51_profile_size(m->pmem_len)` bytes, aligned
+ *               for any type (e.g. allocated by malloc()), or NULL to stop
+ *               profiling; the counters start at zero
+ * @param period the sampling period, 1 (or less) to count every execution
+ */
+void emu51_set_profile(emu51 *m, void *buffer, long period);
+
+/** Get the counters of an address.
+ *
+ * @param m the emulator object
+ * @param addr the program memory address
+ * @param count [out] executions of the instruction at the address
+ * @param cycles [out] cycles taken by those executions. Both are 0 if no
+ *               profile is attached.
+ */
+void emu51_profile_get(const emu51 *m, uint16_t addr, uint64_t *count,
+		uint64_t *cycles);
+
+/** Write the profile to a file.
+ *
+ * Only the addresses that were executed are written, in increasing order.
+ * The text format has two comment lines starting with `#`, then a line per
+ * address with the address (4 hex digits), the count and the cycles. The
+ * binary format starts with "E51P", a version byte (1), the period and the
+ * number of records as 32-bit integers, then a record per address with the
+ * address as a 16-bit integer, the count and the cycles as 64-bit integers,
+ * all little endian.
+ *
+ * @param m the emulator object
+ * @param file the file, open for writing; it is flushed
+ * @param format one of @ref emu51_profile_format
+ * @return Returns 0 on success, EMU51_LOG_ERROR if writing fails, or
+ *         EMU51_NOT_SUPPORTED if no profile is attached or the format is
+ *         unknown.
+ */
+int emu51_profile_write(const emu51 *m, FILE *file, int format);
+
+/** Sum the counters of the addresses of each function.
+ *
+ * A function spans from its start to the start of the next symbol, or to the
+ * end of the program memory for the last one; the addresses before the first
+ * symbol are not counted. All the counters are 0 if no profile is attached.
+ *
+ * @param m the emulator object
+ * @param symbols [in,out] the functions, sorted by start address
+ * @param n number of symbols
+ */
+void emu51_profile_aggregate(const emu51 *m, emu51_symbol *symbols, long n);
+
+/** Get the statistics of the basic block cache.
+ *
+ * @param m the emulator object
+ * @param stats [out] The statistics since the cache was attached. All zero if
+ *                    no block cache is attached.
+ */
+void emu51_get_block_stats(const emu51 *m, emu51_block_stats *stats);
+
+/** Enable the JIT compiler for the emulator.
+ *
+ * With the JIT enabled, emu51_run() compiles the blocks of the block cache
+ * (see emu51_set_block_cache()) that are executed often into native code.
+ * Blocks containing instructions the compiler does not cover, and blocks
+ * that would fire a callback that is set or log an event for a watched
+ * address (see @ref emu51::watch), keep being interpreted; the results
+ * are the same either way. Without a block cache the JIT has no effect.
+ *
+ * The compiled code is referenced from the attached block cache, so the block
+ * cache must not be shared with other instances while the JIT is enabled.
+ *
+ * @param m the emulator object
+ * @return Returns 0 on success or if the JIT is already enabled; returns
+ *         EMU51_NOT_SUPPORTED if the library is built without the JIT (it is
+ *         only available on x86-64 POSIX hosts), or EMU51_OUT_OF_MEMORY if the
+ *         code buffer cannot be allocated.
+ */
+int emu51_jit_enable(emu51 *m);
+
+/** Disable the JIT compiler and free the compiled code.
+ *
+ * Does nothing if the JIT is not enabled.
+ *
+ * @param m the emulator object
+ */
+void emu51_jit_disable(emu51 *m);
+
+/** Ask emu51_run() to return before executing the next instruction.
+ *
+ * Intended to be called from a callback while emu51_run() is executing, or
+ * from another thread when the library is built with gcc or clang, which
+ * access the request with atomic operations (other compilers use plain
+ * accesses, which are not safe across threads). If emu51_run() is not
+ * executing, the next call to it returns immediately with
+ * @ref EMU51_STOP_HOST, without executing anything or handling events, even
+ * with a budget of 0 cycles.
+ *
+ * @param m the emulator object
+ */
+void emu51_stop(emu51 *m);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,365 @@
+#include <emu51.h>
+#include <string.h>
+
+#include "block.h"
+#include "helpers.h"
+#include "jit.h"
+#include "interrupt.h"
+#include "profile.h"
+
+/* round size up to the alignment of pointers */
+#define ALIGN_UP(size) (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+size_t emu51_block_cache_size(long pmem_len)
+{
+	return ALIGN_UP(sizeof(emu51_block_cache))
+		+ ALIGN_UP(pmem_len * sizeof(emu51_decoded))
+		+ pmem_len * sizeof(emu51_block);
+}
+
+void emu51_set_block_cache(emu51 *m, void *buffer)
+{
+	emu51_block_cache *cache = buffer;
+
+	if (cache) {
+		char *p = (char*)buffer + ALIGN_UP(sizeof(emu51_block_cache));
+
+		memset(&cache->stats, 0, sizeof(cache->stats));
+		cache->entries = (emu51_decoded*)p;
+		p += ALIGN_UP(m->pmem_len * sizeof(emu51_decoded));
+		cache->blocks = (emu51_block*)p;
+
+		/* the entries are cleared on first use */
+		cache->pmem = NULL;
+		cache->pmem_len = 0;
+		cache->capacity = m->pmem_len;
+	}
+	m->block_cache = cache;
+}
+
+void emu51_get_block_stats(const emu51 *m, emu51_block_stats *stats)
+{
+	if (m->block_cache)
+		*stats = m->block_cache->stats;
+	else
+		memset(stats, 0, sizeof(*stats));
+}
+
+/* Get the block cache to use for the current program memory.
+ *
+ * The cache is emptied if the program memory was swapped since the blocks
+ * were built, and detached if the new program memory does not fit.
+ */
+static emu51_block_cache *valid_block_cache(emu51 *m)
+{
+	emu51_block_cache *cache = m->block_cache;
+
+	if (cache && (cache->pmem != m->pmem || cache->pmem_len != m->pmem_len)) {
+		if (m->pmem_len > cache->capacity) {
+			m->block_cache = NULL;
+			return NULL;
+		}
+		if (cache->pmem)
+			cache->stats.invalidations++;
+		memset(cache->entries, 0, cache->capacity * sizeof(emu51_decoded));
+		memset(cache->blocks, 0, cache->capacity * sizeof(emu51_block));
+#ifdef EMU51_JIT
+		if (m->jit) /* the compiled code belonged to the old blocks */
+			_emu51_jit_flush(m->jit);
+#endif
+		cache->pmem = m->pmem;
+		cache->pmem_len = m->pmem_len;
+	}
+
+	return cache;
+}
+
+/* Get the decoded instruction at addr, decoding it if necessary.
+ *
+ * Returns NULL if the instruction does not entirely reside in program memory.
+ */
+static emu51_decoded *decoded_at(emu51 *m, emu51_block_cache *cache,
+		long addr)
+{
+	emu51_decoded *d = &cache->entries[addr];
+
+	if (!d->handler) {
+		const emu51_instr *instr = _emu51_decode_instr(m->pmem[addr]);
+		if (addr + instr->bytes > m->pmem_len)
+			return NULL;
+		_emu51_decode(d, &m->pmem[addr], addr + instr->bytes);
+	}
+	return d;
+}
+
+/* Build the block starting at start.
+ *
+ * Returns 0 on success, or an error number if the first instruction cannot be
+ * decoded.
+ */
+static int build_block(emu51 *m, emu51_block_cache *cache, uint16_t start)
+{
+	emu51_block *block = &cache->blocks[start];
+	emu51_decoded *d = NULL;
+	long pc = start;
+
+	block->count = 0;
+	block->cycles = 0;
+	block->cycles_before_last = 0;
+
+	while (pc < m->pmem_len && block->count < BLOCK_MAX_INSTRS) {
+		emu51_decoded *next = decoded_at(m, cache, pc);
+		if (!next)
+			break;
+
+		/* An unimplemented instruction is only put in a block of its own, so
+		 * that executing it behaves like emu51_step(). */
+		if (!next->handler && block->count > 0)
+			break;
+
+		d = next;
+		block->cycles_before_last = block->cycles;
+		block->cycles += d->cycles;
+		block->count++;
+		pc += d->bytes;
+
+		if (!d->handler || _emu51_branch_kind(d->code[0]) != BRANCH_NONE)
+			break;
+	}
+
+	if (block->count == 0)
+		return EMU51_PMEM_OUT_OF_RANGE;
+
+	/* static successors */
+	block->succ_pc[0] = pc & 0xffff;
+	switch (_emu51_branch_kind(d->code[0])) {
+		case BRANCH_RELATIVE:
+			block->succ_pc[1] = (uint16_t)(pc + d->reladdr);
+			break;
+		case BRANCH_ABSOLUTE:
+			block->succ_pc[1] = d->target;
+			break;
+		default:
+			block->succ_pc[1] = -1;
+	}
+	block->link[0] = block->link[1] = NULL;
+
+	return 0;
+}
+
+/* Get the total cycles of the first n instructions of the block at start. */
+static long partial_cycles(const emu51_block_cache *cache, uint16_t start,
+		int n)
+{
+	const emu51_decoded *d = &cache->entries[start];
+	long cycles = 0;
+
+	for (; n > 0; n--, d += d->bytes)
+		cycles += d->cycles;
+	return cycles;
+}
+
+/* Count a sampled execution of the first n instructions of the block at
+ * start. */
+static void profile_block(emu51_profile *profile,
+		const emu51_block_cache *cache, uint16_t start, int n)
+{
+	const emu51_decoded *d = &cache->entries[start];
+	long pc = start;
+
+	for (; n > 0; n--, pc += d->bytes, d += d->bytes)
+		profile_instr(profile, (uint16_t)pc, d->cycles);
+}
+
+/* Execute the block instruction by instruction, stopping early on errors,
+ * stop requests and when the budget runs out.
+ *
+ * profile: the profile counting the instructions, or NULL
+ *
+ * Returns the number of cycles executed, and stores the stop reason in *stop
+ * (EMU51_STOP_BUDGET if the budget ran out).
+ */
+static long run_block_slow(emu51 *m, const emu51_block_cache *cache,
+		const emu51_block *block, long budget, emu51_profile *profile,
+		int *stop)
+{
+	const emu51_decoded *d = &cache->entries[m->pc];
+	long used = 0;
+	int i;
+
+	*stop = EMU51_STOP_BUDGET;
+	for (i = 0; i < block->count && used < budget; i++, d += d->bytes) {
+		if (i > 0 && take_stop_request(m)) {
+			*stop = EMU51_STOP_HOST;
+			break;
+		}
+
+		uint16_t old_pc = m->pc;
+		m->pc += d->bytes;
+		int err = d->handler(d, m);
+		if (err) {
+			m->pc = old_pc; /* restore pc when an error occurs */
+			*stop = err;
+			break;
+		}
+		used += d->cycles;
+		m->cycles += d->cycles;
+		if (profile)
+			profile_instr(profile, old_pc, d->cycles);
+	}
+
+	return used;
+}
+
+/* Block engine, see _emu51_run_blocks(). In trusted mode, pc is not checked
+ * against the program memory size. In profiled mode, the blocks are counted
+ * in m->profile. */
+static ALWAYS_INLINE long run_blocks(emu51 *m, long max_cycles, int *reason,
+		const int trusted, const int profiled)
+{
+	emu51_block_cache *cache = valid_block_cache(m);
+	emu51_block *prev = NULL;
+	int stop = EMU51_STOP_BUDGET;
+	long used = 0;
+
+	while (used < max_cycles) {
+		emu51_block *block;
+		long budget;
+		int i, err = 0;
+
+		if (take_stop_request(m)) {
+			stop = EMU51_STOP_HOST;
+			break;
+		}
+		if (m->cycles >= m->next_event) {
+			err = _emu51_handle_event(m);
+			if (err < 0) {
+				stop = err;
+				break;
+			}
+			if (err) { /* called an interrupt vector */
+				used += err;
+				prev = NULL;
+				continue;
+			}
+		}
+		if (!trusted && m->pc >= m->pmem_len) {
+			stop = EMU51_PMEM_OUT_OF_RANGE;
+			break;
+		}
+
+		/* find the block at pc, following the links of the previous block */
+		if (prev && prev->link[0] && m->pc == prev->succ_pc[0]) {
+			block = prev->link[0];
+			cache->stats.chained++;
+		} else if (prev && prev->link[1] && m->pc == prev->succ_pc[1]) {
+			block = prev->link[1];
+			cache->stats.chained++;
+		} else {
+			block = &cache->blocks[m->pc];
+			if (block->count == 0) {
+				err = build_block(m, cache, m->pc);
+				if (err) {
+					stop = err;
+					break;
+				}
+				cache->stats.misses++;
+			}
+
+			/* link the edge from the previous block if it is static */
+			if (prev && m->pc == prev->succ_pc[0])
+				prev->link[0] = block;
+			else if (prev && m->pc == prev->succ_pc[1])
+				prev->link[1] = block;
+		}
+		cache->stats.hits++;
+
+		/* a block of one instruction that jumps to itself may be a delay
+		 * loop or an idle spin */
+		budget = event_budget(m, max_cycles - used);
+		if (block->count == 1 && block->succ_pc[1] == m->pc) {
+			uint16_t pc = m->pc;
+			long skipped = _emu51_fast_forward(m, budget);
+			if (skipped) {
+				if (profiled)
+					profile_skip(m->profile, pc, skipped,
+						cache->entries[pc].cycles);
+				used += skipped;
+				prev = block;
+				continue;
+			}
+		}
+
+		if (block->cycles_before_last >= budget) {
+			/* the budget runs out or the next event is due inside the
+			 * block */
+			used += run_block_slow(m, cache, block, budget,
+				profiled && profile_sample(m->profile) ? m->profile : NULL,
+				&stop);
+			if (stop != EMU51_STOP_BUDGET)
+				break;
+			prev = NULL;
+			continue;
+		}
+
+		/* fast path: run the whole block and account its cycles at once */
+		uint16_t start = m->pc;
+		const emu51_decoded *d = &cache->entries[start];
+		i = 0;
+#ifdef EMU51_JIT
+		if (m->jit) {
+			/* the interpreter continues where the native code stopped */
+			i = _emu51_jit_execute(m, cache, block);
+			if (i < block->count)
+				d = &cache->entries[m->pc];
+			m->cycles += i == block->count ? block->cycles
+				: partial_cycles(cache, start, i);
+		}
+#endif
+		for (; i < block->count; i++, d += d->bytes) {
+			uint16_t old_pc = m->pc;
+			m->pc += d->bytes;
+			err = d->handler(d, m);
+			if (err) {
+				m->pc = old_pc; /* restore pc when an error occurs */
+				break;
+			}
+			m->cycles += d->cycles;
+			if (i + 1 < block->count && stop_requested(m)) {
+				i++; /* honoured at the top of the loop */
+				break;
+			}
+		}
+
+		if (profiled && profile_sample(m->profile))
+			profile_block(m->profile, cache, start, i);
+
+		if (i < block->count) {
+			/* left the block early: account the completed instructions */
+			used += partial_cycles(cache, start, i);
+			if (err) {
+				stop = err;
+				break;
+			}
+			prev = NULL;
+			continue;
+		}
+
+		used += block->cycles;
+		prev = block;
+	}
+
+	if (reason)
+		*reason = stop;
+	return used;
+}
+
+long _emu51_run_blocks(emu51 *m, long max_cycles, int *reason, int trusted)
+{
+	if (m->profile)
+		return trusted ? run_blocks(m, max_cycles, reason, 1, 1)
+			: run_blocks(m, max_cycles, reason, 0, 1);
+	if (trusted)
+		return run_blocks(m, max_cycles, reason, 1, 0);
+	return run_blocks(m, max_cycles, reason, 0, 0);
+}
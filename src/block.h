@@ -0,0 +1,63 @@
+#ifndef _BLOCK_H_
+#define _BLOCK_H_
+
+/* NOTE: This header file is internal to emu51. */
+
+#include <emu51.h>
+#include "instr.h"
+
+/* maximum number of instructions in a basic block */
+#define BLOCK_MAX_INSTRS 64
+
+/* A basic block: a straight run of instructions in program memory that ends
+ * at a control transfer instruction.
+ *
+ * Blocks are indexed by the address of their first instruction. The
+ * successors of a block are known statically (the fall-through address and
+ * the target of a direct jump); once the block at a successor address is
+ * built, it is linked to the predecessor so that following the edge doesn't
+ * need a lookup.
+ */
+typedef struct emu51_block
+{
+	uint16_t count;         /* number of instructions, 0 if not built yet */
+	int cycles;             /* total cycles of all instructions */
+	int cycles_before_last; /* total cycles of all but the last instruction */
+
+	/* static successor addresses, -1 if there is no such successor:
+	 * [0] the address following the block
+	 * [1] the target of the last instruction if it is a direct jump/call
+	 */
+	int32_t succ_pc[2];
+	struct emu51_block *link[2]; /* built blocks at succ_pc, or NULL */
+
+	/* JIT state, see jit.h */
+	int (*native)(emu51 *m); /* compiled code, or NULL */
+	uint16_t heat;           /* executions while not compiled */
+	uint8_t jit_flags;       /* JIT_* flags */
+} emu51_block;
+
+/* Basic block cache, see emu51_set_block_cache().
+ *
+ * The decoded instructions and the blocks are both indexed by program memory
+ * address and stored after the header in the same buffer.
+ */
+struct emu51_block_cache
+{
+	const uint8_t *pmem; /* program memory the blocks were built from */
+	long pmem_len;       /* size of that program memory */
+	long capacity;       /* number of entries */
+	emu51_block_stats stats;
+
+	emu51_decoded *entries; /* decoded instructions */
+	emu51_block *blocks;    /* blocks starting at each address */
+};
+
+/* Block engine. The arguments and the return value are the same as
+ * emu51_run(). Breakpoints are not supported by this engine.
+ *
+ * trusted: non-zero in trusted mode, see _emu51_enter_trusted()
+ */
+long _emu51_run_blocks(emu51 *m, long max_cycles, int *reason, int trusted);
+
+#endif /* _BLOCK_H_ */
@@ -1,46 +1,400 @@
 #include <emu51.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "instr.h"
+#include "helpers.h"
+#include "block.h"
+#include "trust.h"
+#include "interrupt.h"
+#include "profile.h"
+#include "snapshot.h"
+
+unsigned int emu51_build_options(void)
+{
+	unsigned int options = 0;
+
+#ifndef EMU51_NO_CALLBACKS
+	options |= EMU51_BUILD_CALLBACKS;
+#endif
+#ifdef EMU51_THREADED_DISPATCH
+	options |= EMU51_BUILD_THREADED_DISPATCH;
+#endif
+#ifdef EMU51_LAZY_FLAGS
+	options |= EMU51_BUILD_LAZY_FLAGS;
+#endif
+#ifdef EMU51_JIT
+	options |= EMU51_BUILD_JIT;
+#endif
+#ifdef EMU51_FLEET
+	options |= EMU51_BUILD_FLEET;
+#endif
+#ifdef EMU51_COW_FORK
+	options |= EMU51_BUILD_COW_FORK;
+#endif
+	return options;
+}
 
 void emu51_reset(emu51 *m)
 {
 	assert(m->sfr && "emu51_reset: m->sfr must not be NULL");
 
 	m->pc = 0;
+	m->cycles = 0;
 	m->sfr[SFR_SP] = 0x07; /* initial stack pointer in 8051 is 0x07 */
+	_emu51_reset_events(m); /* no edge before the first run */
+	map_memory(m);
 }
 
-int emu51_step(emu51 *m, int *cycles)
+/* alignment of the block allocated by emu51_create() */
+#define CACHE_LINE_SIZE 64
+
+/* Round size up to a multiple of the cache line size. */
+static size_t cache_line_align(size_t size)
 {
-	/* check if pc points to a valid program memory location */
-	if (m->pc >= m->pmem_len)
-		return EMU51_PMEM_OUT_OF_RANGE;
+	return (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+}
+
+/* Header stored right before the block allocated by _emu51_create(). */
+struct block_header
+{
+	void *raw;   /* pointer returned by malloc() */
+	int mapped;  /* non-zero if xram is a mapping of a snapshot */
+};
+
+emu51 *_emu51_create(const emu51_config *config, uint8_t *xram)
+{
+	/* layout of the block: the emulator, then SFR, lower iram, upper iram and
+	 * xram (unless it is given). The memories are multiples of the cache line
+	 * size, so each of them starts at a cache line. */
+	size_t sfr_offset = cache_line_align(sizeof(emu51));
+	size_t iram_offset = sfr_offset + 128;
+	size_t xram_offset = iram_offset + (config->iram_upper ? 256 : 128);
+	size_t size = xram_offset + (xram ? 0 : config->xram_len);
+	struct block_header *header;
+	uint8_t *block;
+	void *raw;
+	emu51 *m;
+
+	/* the header is stored right before the aligned block for
+	 * emu51_destroy() */
+	raw = malloc(size + sizeof(struct block_header) + CACHE_LINE_SIZE - 1);
+	if (!raw)
+		return NULL;
+	block = (uint8_t*)cache_line_align((uintptr_t)raw
+		+ sizeof(struct block_header));
+	header = (struct block_header*)block - 1;
+	header->raw = raw;
+	header->mapped = xram != NULL;
+	memset(block, 0, size);
+
+	m = (emu51*)block;
+	m->pmem = config->pmem;
+	m->pmem_len = config->pmem_len;
+	m->sfr = block + sfr_offset;
+	m->iram_lower = block + iram_offset;
+	if (config->iram_upper)
+		m->iram_upper = block + iram_offset + 128;
+	if (config->xram_len) {
+		m->xram = xram ? xram : block + xram_offset;
+		m->xram_len = config->xram_len;
+	}
+	m->feature = config->feature;
+	emu51_reset(m);
+
+	return m;
+}
+
+emu51 *emu51_create(const emu51_config *config)
+{
+	return _emu51_create(config, NULL);
+}
+
+void emu51_destroy(emu51 *m)
+{
+	struct block_header *header;
+
+	if (!m)
+		return;
 
-	/* decode the instruction */
+	/* the block cache may already be freed: emu51_set_block_cache() clears
+	 * the compiled code it references if it is used again */
+	m->block_cache = NULL;
+	emu51_jit_disable(m);
+	header = (struct block_header*)m - 1;
+	if (header->mapped)
+		_emu51_unmap_xram(m->xram, m->xram_len);
+	free(header->raw);
+}
+
+/* Decode the instruction at pc into d.
+ *
+ * trusted: non-zero if pc is verified (see _emu51_enter_trusted())
+ *
+ * Returns 0 on success, or EMU51_PMEM_OUT_OF_RANGE if the instruction does not
+ * entirely reside in program memory.
+ */
+static ALWAYS_INLINE int decode_at_pc(emu51 *m, emu51_decoded *d,
+		const int trusted)
+{
 	const uint8_t *code = &m->pmem[m->pc];
 	const emu51_instr *instr = _emu51_decode_instr(code[0]);
 
 	/* check if the entire instruction resides in valid program memory */
-	if (m->pc + instr->bytes > m->pmem_len)
+	if (!trusted && m->pc + instr->bytes > m->pmem_len)
 		return EMU51_PMEM_OUT_OF_RANGE;
 
+	_emu51_decode(d, code, m->pc + instr->bytes);
+	return 0;
+}
+
+/* Execute the instruction at pc.
+ *
+ * cache: the decode cache to use, or NULL to decode the instruction each time
+ * trusted: non-zero if pc is verified, in which case it is not checked against
+ *          the program memory size
+ *
+ * Returns the number of cycles the instruction takes (always positive) on
+ * success, or a negative error number on failure. This is shared by
+ * emu51_step() and emu51_run() so that both behave identically.
+ */
+static ALWAYS_INLINE int execute_instr(emu51 *m, emu51_decode_cache *cache,
+		const int trusted)
+{
+	emu51_decoded decoded;
+	const emu51_decoded *d;
+	int err;
+
+	/* check if pc points to a valid program memory location */
+	if (!trusted && m->pc >= m->pmem_len)
+		return EMU51_PMEM_OUT_OF_RANGE;
+
+	/* decode the instruction, or fetch it from the cache */
+	if (cache) {
+		emu51_decoded *entry = &cache->entries[m->pc];
+		if (!entry->handler) { /* first execution of this address */
+			err = decode_at_pc(m, entry, trusted);
+			if (err)
+				return err;
+		}
+		d = entry;
+	} else {
+		err = decode_at_pc(m, &decoded, trusted);
+		if (err)
+			return err;
+		d = &decoded;
+	}
+
 	/* Increment pc and save the old pc in case an error occurs.
 	 * FIXME: does the pc wrap around at the end of program memory?
 	 */
 	uint16_t old_pc = m->pc;
-	m->pc += instr->bytes;
+	m->pc += d->bytes;
 
 	/* invoke instruction handler */
-	int instr_error = instr->handler(instr, code, m);
+	int instr_error = d->handler(d, m);
 	if (instr_error) {
 		m->pc = old_pc; /* restore pc when an error occurs */
 		return instr_error;
 	}
 
+	return d->cycles;
+}
+
+/* Get the decode cache to use for the current program memory.
+ *
+ * The cache is emptied if the program memory was swapped since the entries
+ * were decoded, and detached if the new program memory does not fit.
+ */
+static emu51_decode_cache *valid_decode_cache(emu51 *m)
+{
+	emu51_decode_cache *cache = m->decode_cache;
+
+	if (cache && (cache->pmem != m->pmem || cache->pmem_len != m->pmem_len)) {
+		if (m->pmem_len > cache->capacity) {
+			m->decode_cache = NULL;
+			return NULL;
+		}
+		memset(cache->entries, 0, cache->capacity * sizeof(emu51_decoded));
+		cache->pmem = m->pmem;
+		cache->pmem_len = m->pmem_len;
+	}
+
+	return cache;
+}
+
+size_t emu51_decode_cache_size(long pmem_len)
+{
+	return sizeof(emu51_decode_cache) + pmem_len * sizeof(emu51_decoded);
+}
+
+void emu51_set_decode_cache(emu51 *m, void *buffer)
+{
+	emu51_decode_cache *cache = buffer;
+
+	if (cache) {
+		/* the entries are cleared on first use */
+		cache->pmem = NULL;
+		cache->pmem_len = 0;
+		cache->capacity = m->pmem_len;
+	}
+	m->decode_cache = cache;
+}
+
+int emu51_step(emu51 *m, int *cycles)
+{
+	int result;
+
+	map_memory(m); /* the user may have changed the buffers or PSW */
+	_emu51_enter_events(m);
+
+	/* taking an interrupt counts as a step */
+	result = 0;
+	if (m->cycles >= m->next_event)
+		result = _emu51_handle_event(m);
+	if (result == 0) {
+		uint16_t pc = m->pc;
+		result = _emu51_enter_trusted(m);
+		if (result > 0)
+			result = execute_instr(m, valid_decode_cache(m), 1);
+		else if (result == 0)
+			result = execute_instr(m, valid_decode_cache(m), 0);
+		if (result > 0) {
+			m->cycles += result;
+			if (m->profile && profile_sample(m->profile))
+				profile_instr(m->profile, pc, result);
+		}
+	}
+	sync_psw(m); /* make PSW visible to the user */
+	_emu51_sync_events(m); /* and the timers and serial port */
+	if (result < 0)
+		return result;
+
 	/* return the cycle count of the instruction */
 	if (cycles)
-		*cycles = instr->cycles;
+		*cycles = result;
 
 	return 0;
 }
+
+/* Portable interpreter core: a loop around execute_instr().
+ *
+ * The arguments and the return value are the same as emu51_run(). trusted is
+ * the same as for execute_instr(). In profiled mode, the instructions are
+ * counted in m->profile; the threaded core has no such mode, so this core is
+ * also used in builds with EMU51_THREADED_DISPATCH.
+ */
+static ALWAYS_INLINE long run_portable(emu51 *m, emu51_decode_cache *cache,
+		long max_cycles, int *reason, const int trusted, const int profiled)
+{
+	/* the bitmap is only read once; breakpoints are checked after the first
+	 * instruction so that the run can be resumed from a breakpoint */
+	const uint8_t *breakpoints = m->breakpoints;
+	int stop = EMU51_STOP_BUDGET;
+	long used = 0;
+
+	while (used < max_cycles) {
+		if (take_stop_request(m)) {
+			stop = EMU51_STOP_HOST;
+			break;
+		}
+		if (m->cycles >= m->next_event) {
+			int result = _emu51_handle_event(m);
+			if (result < 0) {
+				stop = result;
+				break;
+			}
+			if (result) { /* called an interrupt vector */
+				used += result;
+				continue;
+			}
+		}
+		if (breakpoints && used > 0 && (trusted || m->pc < m->pmem_len)
+				&& is_breakpoint(breakpoints, m->pc)) {
+			stop = EMU51_STOP_BREAKPOINT;
+			break;
+		}
+		uint16_t pc = m->pc;
+		if ((trusted || pc < m->pmem_len)
+				&& _emu51_is_spin_opcode(m->pmem[pc])) {
+			long skipped = _emu51_fast_forward(m,
+				event_budget(m, max_cycles - used));
+			if (skipped) {
+				if (profiled)
+					profile_skip(m->profile, pc, skipped,
+						_emu51_decode_instr(m->pmem[pc])->cycles);
+				used += skipped;
+				continue;
+			}
+		}
+
+		int result = execute_instr(m, cache, trusted);
+		if (result < 0) {
+			stop = result;
+			break;
+		}
+		used += result;
+		m->cycles += result;
+		if (profiled && profile_sample(m->profile))
+			profile_instr(m->profile, pc, result);
+	}
+
+	if (reason)
+		*reason = stop;
+	return used;
+}
+
+long emu51_run(emu51 *m, long max_cycles, int *reason)
+{
+	long used;
+	int trusted;
+
+	map_memory(m); /* the user may have changed the buffers or PSW */
+	_emu51_enter_events(m);
+	trusted = _emu51_enter_trusted(m);
+	if (take_stop_request(m)) { /* requested before the call */
+		used = 0;
+		if (reason)
+			*reason = EMU51_STOP_HOST;
+	} else if (trusted < 0) { /* the code at pc is rejected */
+		used = 0;
+		if (reason)
+			*reason = trusted;
+	} else if (m->block_cache && !m->breakpoints) {
+		used = _emu51_run_blocks(m, max_cycles, reason, trusted);
+	} else if (m->profile) {
+		emu51_decode_cache *cache = valid_decode_cache(m);
+		if (trusted)
+			used = run_portable(m, cache, max_cycles, reason, 1, 1);
+		else
+			used = run_portable(m, cache, max_cycles, reason, 0, 1);
+	} else {
+		emu51_decode_cache *cache = valid_decode_cache(m);
+#ifdef EMU51_THREADED_DISPATCH
+		if (trusted)
+			used = _emu51_run_threaded_trusted(m, cache, max_cycles, reason);
+		else
+			used = _emu51_run_threaded(m, cache, max_cycles, reason);
+#else
+		if (trusted)
+			used = run_portable(m, cache, max_cycles, reason, 1, 0);
+		else
+			used = run_portable(m, cache, max_cycles, reason, 0, 0);
+#endif
+	}
+
+	sync_psw(m); /* make PSW visible to the user */
+	_emu51_sync_events(m); /* and the timers and serial port */
+	return used;
+}
+
+void emu51_stop(emu51 *m)
+{
+#ifdef __GNUC__
+	__atomic_store_n(&m->stop_request, 1, __ATOMIC_RELEASE);
+#else
+	m->stop_request = 1;
+#endif
+}
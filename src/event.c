@@ -0,0 +1,87 @@
+#include <emu51.h>
+#include <string.h>
+
+#include "event.h"
+#include "helpers.h"
+
+/* round size up to the alignment of pointers */
+#define ALIGN_UP(size) (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+size_t emu51_event_log_size(long capacity)
+{
+	return ALIGN_UP(sizeof(emu51_event_log)) + capacity * sizeof(emu51_event);
+}
+
+void emu51_set_event_log(emu51 *m, void *buffer, long capacity)
+{
+	emu51_event_log *log = buffer;
+
+	if (log) {
+		log->head = log->tail = log->lost = 0;
+		log->capacity = capacity;
+		log->events = (emu51_event*)((char*)buffer
+			+ ALIGN_UP(sizeof(emu51_event_log)));
+		memcpy(log->sfr, m->sfr, sizeof(log->sfr));
+		log->rx_byte = m->uart.rx_byte;
+	}
+	m->event_log = log;
+}
+
+/* the SFRs written by the peripherals */
+static const uint8_t peripheral_sfrs[] = {
+	SFR_TCON, SFR_TL0, SFR_TL1, SFR_TH0, SFR_TH1, SFR_SCON,
+	SFR_T2CON, SFR_RCAP2L, SFR_RCAP2H, SFR_TL2, SFR_TH2,
+};
+
+void _emu51_log_peripherals(emu51 *m)
+{
+	emu51_event_log *log = m->event_log;
+	size_t i;
+
+	for (i = 0; i < sizeof(peripheral_sfrs); i++) {
+		uint8_t index = peripheral_sfrs[i];
+		if (m->sfr[index] == log->sfr[index])
+			continue;
+		if (is_watched(m->active_watch.sfr, index))
+			log_event(m, EMU51_EVENT_SFR, index, m->sfr[index]);
+		log->sfr[index] = m->sfr[index];
+	}
+
+	/* a received byte is logged as a change of SBUF */
+	if (m->uart.rx_byte != log->rx_byte) {
+		if (is_watched(m->active_watch.sfr, SFR_SBUF))
+			log_event(m, EMU51_EVENT_SFR, SFR_SBUF, m->uart.rx_byte);
+		log->rx_byte = m->uart.rx_byte;
+	}
+}
+
+long emu51_drain_events(emu51 *m, emu51_event *events, long max_events)
+{
+	emu51_event_log *log = m->event_log;
+	long count, i;
+
+	if (!log)
+		return 0;
+
+	count = (long)(log->head - log->tail);
+	if (count > max_events)
+		count = max_events;
+
+	/* copy in up to two pieces, since the events may wrap around */
+	for (i = 0; i < count; ) {
+		long index = (long)((log->tail + i) & (log->capacity - 1));
+		long n = log->capacity - index;
+		if (n > count - i)
+			n = count - i;
+		memcpy(&events[i], &log->events[index], n * sizeof(emu51_event));
+		i += n;
+	}
+	log->tail += count;
+
+	return count;
+}
+
+uint64_t emu51_events_lost(const emu51 *m)
+{
+	return m->event_log ? m->event_log->lost : 0;
+}
@@ -0,0 +1,54 @@
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+/* NOTE: This header file is internal to emu51. */
+
+#include <emu51.h>
+
+/* Memory write event log, see emu51_set_event_log().
+ *
+ * A ring buffer of capacity events (a power of 2), stored after the header in
+ * the same buffer. head and tail count the events appended and drained since
+ * the log was attached; the event at count n is events[n & (capacity - 1)].
+ */
+struct emu51_event_log
+{
+	uint64_t head;     /* events appended */
+	uint64_t tail;     /* events drained */
+	uint64_t lost;     /* events dropped because the log was full */
+	long capacity;     /* number of entries */
+	emu51_event *events;
+	uint8_t sfr[128];  /* last logged value of each SFR */
+	uint8_t rx_byte;   /* last logged byte received into SBUF */
+};
+
+/* Append an event to the log of the emulator, which must be attached. */
+static inline void log_event(emu51 *m, uint8_t kind, uint16_t addr,
+		uint8_t value)
+{
+	emu51_event_log *log = m->event_log;
+	emu51_event *event;
+
+	if (log->head - log->tail == (uint64_t)log->capacity) {
+		log->lost++;
+		return;
+	}
+
+	event = &log->events[log->head & (log->capacity - 1)];
+	event->cycle = (uint32_t)m->cycles;
+	event->addr = addr;
+	event->kind = kind;
+	event->value = value;
+	log->head++;
+	if (kind == EMU51_EVENT_SFR)
+		log->sfr[addr & 0x7f] = value;
+}
+
+/* Log the SFRs changed by the timers, the serial port and the interrupt
+ * dispatch since they were last logged. These writes are made by the
+ * hardware rather than by an instruction, so they are logged when the events
+ * are synced, handled or rescheduled, and they don't call the sfr_update
+ * callback. The event log must be attached. */
+void _emu51_log_peripherals(emu51 *m);
+
+#endif /* _EVENT_H_ */
@@ -0,0 +1,387 @@
+#include <emu51.h>
+#include <stdlib.h>
+
+#ifdef EMU51_FLEET
+
+#include <pthread.h>
+#include <unistd.h>
+
+/* Fleet runner.
+ *
+ * Each worker thread owns a queue of emulator indices. A worker runs the
+ * emulator at the front of its own queue for one slice and appends it back
+ * if it isn't done, so that its emulators take turns; a worker whose queue is
+ * empty steals from the back of the queue of another worker. The queues are
+ * only locked for the few instructions it takes to pop or push an index, once
+ * per slice, which is cheap next to a slice of emulation. A worker that finds
+ * all the queues empty sleeps until an emulator is put back or the job ends.
+ */
+
+/* work queue of a worker: a ring of indices, big enough for all emulators */
+typedef struct worker
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	long *queue;
+	long head;  /* position of the front entry */
+	long count; /* number of entries */
+	struct emu51_fleet *fleet;
+} worker;
+
+struct emu51_fleet
+{
+	int threads;
+	worker *workers;
+	long capacity; /* size of the queue of each worker */
+
+	/* job of the current emu51_fleet_run() call */
+	emu51 *const *machines;
+	emu51_fleet_status *status;
+	long max_cycles;
+	long slice_cycles;
+
+	pthread_mutex_t lock;     /* protects the fields below */
+	pthread_cond_t start;     /* signaled when a job starts, or on shutdown */
+	pthread_cond_t done;      /* signaled when the last worker is done */
+	pthread_cond_t work;      /* signaled when an emulator is put back, and
+	                             when the last emulator is done */
+	unsigned long generation; /* number of jobs started */
+	int busy;                 /* workers running the current job */
+	int idle;                 /* workers waiting for work */
+	long remaining;           /* emulators that are not done */
+	int shutdown;
+};
+
+/* Take the index at the front (own queue) or at the back (stealing) of the
+ * queue of the worker. Returns 0 if the queue is empty. */
+static int take(worker *w, long capacity, int back, long *index)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->count > 0) {
+		if (back) {
+			*index = w->queue[(w->head + w->count - 1) % capacity];
+		} else {
+			*index = w->queue[w->head];
+			w->head = (w->head + 1) % capacity;
+		}
+		w->count--;
+		found = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return found;
+}
+
+/* Append the index to the back of the queue of the worker. */
+static void put(worker *w, long capacity, long index)
+{
+	pthread_mutex_lock(&w->lock);
+	w->queue[(w->head + w->count) % capacity] = index;
+	w->count++;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Wake a worker waiting for work, after an index was put into a queue. */
+static void wake_idle(emu51_fleet *fleet)
+{
+#ifdef __GNUC__
+	/* pairs with the fence in wait_for_work(): either the waiting worker
+	 * sees the index in its scan, or this sees the worker waiting, so the
+	 * lock is only taken when a worker waits */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&fleet->idle, __ATOMIC_RELAXED))
+		return;
+#endif
+	pthread_mutex_lock(&fleet->lock);
+	pthread_cond_signal(&fleet->work);
+	pthread_mutex_unlock(&fleet->lock);
+}
+
+/* Test if any queue holds an index. */
+static int has_work(emu51_fleet *fleet)
+{
+	int i, found = 0;
+
+	for (i = 0; i < fleet->threads && !found; i++) {
+		worker *w = &fleet->workers[i];
+		pthread_mutex_lock(&w->lock);
+		found = w->count > 0;
+		pthread_mutex_unlock(&w->lock);
+	}
+	return found;
+}
+
+/* Sleep until an index is put into a queue or all emulators are done.
+ * Returns 0 if they are done. */
+static int wait_for_work(emu51_fleet *fleet)
+{
+	long remaining;
+
+	pthread_mutex_lock(&fleet->lock);
+#ifdef __GNUC__
+	__atomic_store_n(&fleet->idle, fleet->idle + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#else
+	fleet->idle++;
+#endif
+	while (fleet->remaining && !has_work(fleet))
+		pthread_cond_wait(&fleet->work, &fleet->lock);
+#ifdef __GNUC__
+	__atomic_store_n(&fleet->idle, fleet->idle - 1, __ATOMIC_RELAXED);
+#else
+	fleet->idle--;
+#endif
+	remaining = fleet->remaining;
+	pthread_mutex_unlock(&fleet->lock);
+	return remaining != 0;
+}
+
+/* Find the next emulator to run: from the own queue, otherwise stolen from
+ * the other workers in turn. Returns 0 if all queues are empty. */
+static int next_machine(worker *self, long *index)
+{
+	emu51_fleet *fleet = self->fleet;
+	int id = (int)(self - fleet->workers);
+	int i;
+
+	if (take(self, fleet->capacity, 0, index))
+		return 1;
+	for (i = 1; i < fleet->threads; i++) {
+		worker *victim = &fleet->workers[(id + i) % fleet->threads];
+		if (take(victim, fleet->capacity, 1, index))
+			return 1;
+	}
+	return 0;
+}
+
+/* Run emulators until all of them are done. */
+static void run_job(worker *self)
+{
+	emu51_fleet *fleet = self->fleet;
+
+	for (;;) {
+		emu51_fleet_status *status;
+		long index, budget;
+		int reason;
+
+		if (!next_machine(self, &index)) {
+			/* the other workers may still put back the emulators they
+			 * are running */
+			if (!wait_for_work(fleet))
+				return;
+			continue;
+		}
+
+		status = &fleet->status[index];
+		budget = fleet->max_cycles - status->cycles;
+		if (budget > fleet->slice_cycles)
+			budget = fleet->slice_cycles;
+		status->cycles += emu51_run(fleet->machines[index], budget, &reason);
+		status->reason = reason;
+
+		if (reason == EMU51_STOP_BUDGET && status->cycles < fleet->max_cycles) {
+			put(self, fleet->capacity, index);
+			wake_idle(fleet);
+		} else {
+			pthread_mutex_lock(&fleet->lock);
+			if (--fleet->remaining == 0)
+				pthread_cond_broadcast(&fleet->work);
+			pthread_mutex_unlock(&fleet->lock);
+		}
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	worker *self = arg;
+	emu51_fleet *fleet = self->fleet;
+	unsigned long generation = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&fleet->lock);
+		while (!fleet->shutdown && fleet->generation == generation)
+			pthread_cond_wait(&fleet->start, &fleet->lock);
+		if (fleet->shutdown) {
+			pthread_mutex_unlock(&fleet->lock);
+			return NULL;
+		}
+		generation = fleet->generation;
+		pthread_mutex_unlock(&fleet->lock);
+
+		run_job(self);
+
+		pthread_mutex_lock(&fleet->lock);
+		if (--fleet->busy == 0)
+			pthread_cond_signal(&fleet->done);
+		pthread_mutex_unlock(&fleet->lock);
+	}
+}
+
+/* Stop and join the first count workers, and free the fleet. */
+static void destroy(emu51_fleet *fleet, int count)
+{
+	int i;
+
+	pthread_mutex_lock(&fleet->lock);
+	fleet->shutdown = 1;
+	pthread_cond_broadcast(&fleet->start);
+	pthread_mutex_unlock(&fleet->lock);
+
+	for (i = 0; i < count; i++) {
+		pthread_join(fleet->workers[i].thread, NULL);
+		pthread_mutex_destroy(&fleet->workers[i].lock);
+		free(fleet->workers[i].queue);
+	}
+	pthread_cond_destroy(&fleet->work);
+	pthread_cond_destroy(&fleet->done);
+	pthread_cond_destroy(&fleet->start);
+	pthread_mutex_destroy(&fleet->lock);
+	free(fleet->workers);
+	free(fleet);
+}
+
+emu51_fleet *emu51_fleet_create(int threads)
+{
+	emu51_fleet *fleet;
+	int i;
+
+	if (threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (int)cpus : 1;
+	}
+
+	fleet = calloc(1, sizeof(emu51_fleet));
+	if (!fleet)
+		return NULL;
+	fleet->workers = calloc(threads, sizeof(worker));
+	if (!fleet->workers) {
+		free(fleet);
+		return NULL;
+	}
+	fleet->threads = threads;
+	pthread_mutex_init(&fleet->lock, NULL);
+	pthread_cond_init(&fleet->start, NULL);
+	pthread_cond_init(&fleet->done, NULL);
+	pthread_cond_init(&fleet->work, NULL);
+
+	for (i = 0; i < threads; i++) {
+		worker *w = &fleet->workers[i];
+		w->fleet = fleet;
+		pthread_mutex_init(&w->lock, NULL);
+		if (pthread_create(&w->thread, NULL, worker_main, w)) {
+			pthread_mutex_destroy(&w->lock);
+			destroy(fleet, i);
+			return NULL;
+		}
+	}
+	return fleet;
+}
+
+void emu51_fleet_destroy(emu51_fleet *fleet)
+{
+	if (fleet)
+		destroy(fleet, fleet->threads);
+}
+
+int emu51_fleet_threads(const emu51_fleet *fleet)
+{
+	return fleet->threads;
+}
+
+/* Make the queue of each worker hold at least count indices. Only called
+ * while the workers are idle. Returns 0 on success or EMU51_OUT_OF_MEMORY. */
+static int reserve_queues(emu51_fleet *fleet, long count)
+{
+	int i;
+
+	if (count <= fleet->capacity)
+		return 0;
+	for (i = 0; i < fleet->threads; i++) {
+		long *queue = realloc(fleet->workers[i].queue, count * sizeof(long));
+		if (!queue)
+			return EMU51_OUT_OF_MEMORY;
+		fleet->workers[i].queue = queue;
+	}
+	fleet->capacity = count;
+	return 0;
+}
+
+int emu51_fleet_run(emu51_fleet *fleet, emu51 *const *machines, long count,
+		long max_cycles, long slice_cycles, emu51_fleet_status *status)
+{
+	long i;
+	int err;
+
+	err = reserve_queues(fleet, count);
+	if (err)
+		return err;
+
+	for (i = 0; i < count; i++) {
+		status[i].cycles = 0;
+		status[i].reason = EMU51_STOP_BUDGET;
+	}
+	if (count == 0 || max_cycles <= 0)
+		return 0;
+
+	/* deal contiguous ranges of emulators to the workers */
+	for (i = 0; i < fleet->threads; i++) {
+		worker *w = &fleet->workers[i];
+		long first = count * i / fleet->threads;
+		long last = count * (i + 1) / fleet->threads;
+		long j;
+
+		w->head = 0;
+		w->count = last - first;
+		for (j = first; j < last; j++)
+			w->queue[j - first] = j;
+	}
+
+	pthread_mutex_lock(&fleet->lock);
+	fleet->machines = machines;
+	fleet->status = status;
+	fleet->max_cycles = max_cycles;
+	fleet->slice_cycles = slice_cycles > 0 ? slice_cycles : max_cycles;
+	fleet->remaining = count;
+	fleet->busy = fleet->threads;
+	fleet->generation++;
+	pthread_cond_broadcast(&fleet->start);
+	while (fleet->busy)
+		pthread_cond_wait(&fleet->done, &fleet->lock);
+	pthread_mutex_unlock(&fleet->lock);
+
+	return 0;
+}
+
+#else /* EMU51_FLEET */
+
+emu51_fleet *emu51_fleet_create(int threads)
+{
+	(void)threads;
+	return NULL;
+}
+
+void emu51_fleet_destroy(emu51_fleet *fleet)
+{
+	(void)fleet;
+}
+
+int emu51_fleet_threads(const emu51_fleet *fleet)
+{
+	(void)fleet;
+	return 0;
+}
+
+int emu51_fleet_run(emu51_fleet *fleet, emu51 *const *machines, long count,
+		long max_cycles, long slice_cycles, emu51_fleet_status *status)
+{
+	(void)fleet;
+	(void)machines;
+	(void)count;
+	(void)max_cycles;
+	(void)slice_cycles;
+	(void)status;
+	return EMU51_NOT_SUPPORTED;
+}
+
+#endif /* EMU51_FLEET */
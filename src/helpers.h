@@ -5,8 +5,154 @@
 
 #include <emu51.h>
 
+#include "interrupt.h"
+#include "record.h"
+
 #define BIT_ADDR_BASE 0x20
 
+/* PSW flag computations that can be pending, see emu51::lazy_psw */
+enum lazy_psw_pending
+{
+	LAZY_PARITY = 0x01, /* P: ACC was written */
+	LAZY_ADD = 0x02,    /* C, AC and OV of the last ADD/ADDC */
+};
+
+/* Compute C, AC and OV of acc + operand + carry_in. */
+static inline uint8_t add_flags(uint8_t acc, uint8_t operand,
+		uint8_t carry_in)
+{
+	unsigned int sum = acc + operand + carry_in;
+	unsigned int carries = acc ^ operand ^ sum; /* carry into each bit */
+
+	return ((sum >> 1) & PSW_C)       /* carry out of bit 7 */
+		| ((carries << 2) & PSW_AC)     /* carry out of bit 3 */
+		| ((((acc ^ sum) & (operand ^ sum)) >> 5) & PSW_OV);
+		/* overflow: both addends have a sign different from the sum */
+}
+
+/* Compute P of the given ACC value: set if the number of 1 bits is odd. */
+static inline uint8_t parity_flag(uint8_t acc)
+{
+	acc ^= acc >> 4;
+	acc ^= acc >> 2;
+	acc ^= acc >> 1;
+	return acc & PSW_P;
+}
+
+/* Compute the pending PSW flags, see emu51::lazy_psw. Must be called before
+ * PSW is read. */
+static inline void sync_psw(emu51 *m)
+{
+#ifdef EMU51_LAZY_FLAGS
+	struct emu51_lazy_psw *lazy = &m->lazy_psw;
+	if (lazy->pending) {
+		uint8_t psw = m->sfr[SFR_PSW];
+		if (lazy->pending & LAZY_ADD)
+			psw = (psw & ~(PSW_C | PSW_AC | PSW_OV))
+				| add_flags(lazy->acc, lazy->operand, lazy->carry_in);
+		if (lazy->pending & LAZY_PARITY)
+			psw = (psw & ~PSW_P) | parity_flag(m->sfr[SFR_ACC]);
+		m->sfr[SFR_PSW] = psw;
+		lazy->pending = 0;
+	}
+#else
+	(void)m;
+#endif
+}
+
+/* Get the carry flag (0 or 1) without computing the other pending flags. */
+static inline int carry_flag(emu51 *m)
+{
+#ifdef EMU51_LAZY_FLAGS
+	const struct emu51_lazy_psw *lazy = &m->lazy_psw;
+	if (lazy->pending & LAZY_ADD)
+		return (lazy->acc + lazy->operand + lazy->carry_in) >> 8;
+#endif
+	return (m->sfr[SFR_PSW] & PSW_C) ? 1 : 0;
+}
+
+/* Update P after ACC is written. */
+static inline void acc_written(emu51 *m)
+{
+#ifdef EMU51_LAZY_FLAGS
+	m->lazy_psw.pending |= LAZY_PARITY;
+#else
+	m->sfr[SFR_PSW] = (m->sfr[SFR_PSW] & ~PSW_P)
+		| parity_flag(m->sfr[SFR_ACC]);
+#endif
+}
+
+/* Point the register bank pointer (emu51::map) to the bank selected by the RS
+ * bits of PSW. Must be called after the RS bits are changed. */
+static inline void select_bank(emu51 *m)
+{
+	m->map.bank = m->iram_lower + (m->sfr[SFR_PSW] & (PSW_RS1 | PSW_RS0));
+}
+
+/* bitmap with all 65536 bits set, see map_memory() */
+extern const uint8_t _emu51_watch_all[65536 / 8];
+
+/* Test if the address is set in the bitmap of emu51::active_watch. */
+static inline int is_watched(const uint8_t *bitmap, uint16_t addr)
+{
+	return (bitmap[addr / 8] >> (addr % 8)) & 1;
+}
+
+/* Test if the callback is set. Always false if the library is built without
+ * callbacks (EMU51_NO_CALLBACKS), so that the callback sites are compiled
+ * out. */
+#ifdef EMU51_NO_CALLBACKS
+#define HAS_CALLBACK(m, cb_name) ((void)(m), 0)
+#else
+#define HAS_CALLBACK(m, cb_name) ((m)->callback.cb_name != NULL)
+#endif
+
+/* Test if a write to the SFR is reported, to the event log or to the
+ * sfr_update callback. */
+static inline int sfr_reported(const emu51 *m, uint8_t index)
+{
+	return (m->event_log || HAS_CALLBACK(m, sfr_update))
+		&& is_watched(m->active_watch.sfr, index);
+}
+
+/* Test if a write to the internal ram address is reported, to the event log
+ * or to the iram_update callback. */
+static inline int iram_reported(const emu51 *m, uint8_t addr)
+{
+	return (m->event_log || HAS_CALLBACK(m, iram_update))
+		&& is_watched(m->active_watch.iram, addr);
+}
+
+/* Build the address space tables (emu51::map) from the buffer pointers, and
+ * the watch bitmaps (emu51::active_watch). */
+static inline void map_memory(emu51 *m)
+{
+	struct emu51_memory_map *map = &m->map;
+	struct emu51_watch *watch = &m->active_watch;
+
+	map->direct[0] = m->iram_lower;
+	map->direct[1] = m->sfr;
+
+	map->indirect[0] = m->iram_lower;
+	map->indirect_error[0] = 0;
+	if (m->iram_upper) {
+		map->indirect[1] = m->iram_upper;
+		map->indirect_error[1] = 0;
+	} else {
+		/* stub for the missing upper iram: accesses fail with the error, so
+		 * the buffer is never written and what is read from it is unused */
+		map->indirect[1] = m->iram_lower;
+		map->indirect_error[1] = EMU51_IRAM_OUT_OF_RANGE;
+	}
+
+	select_bank(m);
+
+	/* without a bitmap, every address is watched */
+	watch->sfr = m->watch.sfr ? m->watch.sfr : _emu51_watch_all;
+	watch->iram = m->watch.iram ? m->watch.iram : _emu51_watch_all;
+	watch->xram = m->watch.xram ? m->watch.xram : _emu51_watch_all;
+}
+
 /* Read data from immediate address.
  * An immediate address can refer to:
  *  1. internal ram, if addr < 0x80
@@ -14,19 +160,71 @@
  */
 static inline uint8_t direct_addr_read(emu51 *m, uint8_t addr)
 {
-	if (addr < 0x80) /* lower internal ram (0~0x7f) */
-		return m->iram_lower[addr];
-	else /* SFR */
-		return m->sfr[addr - SFR_BASE_ADDR];
+	if (addr == SFR_BASE_ADDR + SFR_PSW) {
+		sync_psw(m);
+	} else if (is_event_sfr(addr)) {
+		_emu51_sync_events(m);
+		/* SBUF reads the receive buffer, writes go to the transmitter */
+		if (addr == SFR_BASE_ADDR + SFR_SBUF)
+			return m->uart.rx_byte;
+	}
+	return m->map.direct[addr >> 7][addr & 0x7f];
+}
+
+/* Read a direct address as the operand of an instruction. The ports
+ * (P0~P3) read their pins, see _emu51_port_read(), unlike the
+ * read-modify-write instructions, which read the latch with
+ * direct_addr_read().
+ *
+ * Returns 0 on success, or EMU51_REPLAY_DIVERGED. */
+static inline int direct_operand_read(emu51 *m, uint8_t addr, uint8_t *out)
+{
+	if ((addr & 0xcf) == SFR_BASE_ADDR) /* 0x80, 0x90, 0xa0 or 0xb0 */
+		return _emu51_port_read(m, (addr >> 4) & 3, out);
+	*out = direct_addr_read(m, addr);
+	return 0;
 }
 
 /* Write data to direct address */
 static inline void direct_addr_write(emu51 *m, uint8_t addr, uint8_t data)
 {
-	if (addr < 0x80) /* lower internal ram (0~0x7f) */
-		m->iram_lower[addr] = data;
-	else /* SFR */
-		m->sfr[addr - SFR_BASE_ADDR] = data;
+	/* the events are run with the old settings up to this write */
+	int event = is_event_sfr(addr);
+	if (event)
+		_emu51_sync_events(m);
+
+	m->map.direct[addr >> 7][addr & 0x7f] = data;
+
+	if (addr == SFR_BASE_ADDR + SFR_PSW) {
+		m->lazy_psw.pending = 0; /* overwritten by the new value */
+		select_bank(m);
+	} else if (addr == SFR_BASE_ADDR + SFR_ACC) {
+		acc_written(m);
+	} else if (event) {
+		_emu51_event_sfr_written(m, addr);
+	}
+}
+
+/* Read the internal ram byte at addr, which is in the upper iram if
+ * addr >= 0x80.
+ *
+ * Returns 0 on success or EMU51_IRAM_OUT_OF_RANGE if the upper iram is
+ * missing, in which case the content of *out is undefined. The caller must
+ * check for the error code.
+ */
+static inline int indirect_read(emu51 *m, uint8_t addr, uint8_t *out)
+{
+	*out = m->map.indirect[addr >> 7][addr & 0x7f];
+	return m->map.indirect_error[addr >> 7];
+}
+
+/* Write the internal ram byte at addr. See indirect_read() for details. */
+static inline int indirect_write(emu51 *m, uint8_t addr, uint8_t data)
+{
+	int err = m->map.indirect_error[addr >> 7];
+	if (!err)
+		m->map.indirect[addr >> 7][addr & 0x7f] = data;
+	return err;
 }
 
 /* Read data from the address obtained by dereferencing ptr.
@@ -42,21 +240,7 @@ static inline void direct_addr_write(emu51 *m, uint8_t addr, uint8_t data)
  */
 static inline int indirect_addr_read(emu51 *m, uint8_t ptr, uint8_t *out)
 {
-	uint8_t addr = direct_addr_read(m, ptr);
-	if (addr < 0x80) { /* lower iram */
-		/* m->iram_lower is required to be set by the user, so we don't have to
-		 * check for NULL here. */
-		*out = m->iram_lower[addr];
-		return 0;
-	} else { /* upper iram */
-		/* m->iram_upper is not guaranteed to exist, so checking is necessary */
-		if (m->iram_upper) {
-			*out = m->iram_upper[addr - 0x80];
-			return 0;
-		} else { /* upper iram is not set */
-			return EMU51_IRAM_OUT_OF_RANGE;
-		}
-	}
+	return indirect_read(m, direct_addr_read(m, ptr), out);
 }
 
 /* Write data to the address obtained by dereferencing ptr.
@@ -64,21 +248,7 @@ static inline int indirect_addr_read(emu51 *m, uint8_t ptr, uint8_t *out)
  */
 static inline int indirect_addr_write(emu51 *m, uint8_t ptr, uint8_t data)
 {
-	uint8_t addr = direct_addr_read(m, ptr);
-	if (addr < 0x80) { /* lower iram */
-		/* m->iram_lower is required to be set by the user, so we don't have to
-		 * check for NULL here. */
-		m->iram_lower[addr] = data;
-		return 0;
-	} else { /* upper iram */
-		/* m->iram_upper is not guaranteed to exist, so checking is necessary */
-		if (m->iram_upper) {
-			m->iram_upper[addr - 0x80] = data;
-			return 0;
-		} else { /* upper iram is not set */
-			return EMU51_IRAM_OUT_OF_RANGE;
-		}
-	}
+	return indirect_write(m, direct_addr_read(m, ptr), data);
 }
 
 /* Read bit memory.
@@ -129,8 +299,7 @@ static inline int bit_write(emu51 *m, uint8_t addr, int value)
  */
 static inline int stack_push(emu51 *m, uint8_t data)
 {
-	++m->sfr[SFR_SP];
-	return indirect_addr_write(m, SFR_BASE_ADDR + SFR_SP, data);
+	return indirect_write(m, ++m->sfr[SFR_SP], data);
 }
 
 /* Add reladdr to the program counter.
@@ -146,4 +315,43 @@ static inline void relative_jump(emu51 *m, int8_t reladdr)
 	m->pc += reladdr;
 }
 
+/* Test if there is a breakpoint at addr in the breakpoint bitmap.
+ * See emu51::breakpoints for the layout.
+ */
+static inline int is_breakpoint(const uint8_t *breakpoints, uint16_t addr)
+{
+	return (breakpoints[addr / 8] >> (addr % 8)) & 1;
+}
+
+/* Test if the host asked emu51_run() to stop, without taking the request.
+ *
+ * The request may come from another thread, see emu51_stop(). This is only a
+ * hint that is read at every instruction, so it is a relaxed load.
+ */
+static inline int stop_requested(const emu51 *m)
+{
+#ifdef __GNUC__
+	return __atomic_load_n(&m->stop_request, __ATOMIC_RELAXED);
+#else
+	return m->stop_request;
+#endif
+}
+
+/* Take the stop request of the host. Returns non-zero if there was one.
+ *
+ * The flag is cleared by an atomic exchange, so that a request made by
+ * another thread at the same time is not lost.
+ */
+static inline int take_stop_request(emu51 *m)
+{
+	if (!stop_requested(m))
+		return 0;
+#ifdef __GNUC__
+	return __atomic_exchange_n(&m->stop_request, 0, __ATOMIC_ACQUIRE);
+#else
+	m->stop_request = 0;
+	return 1;
+#endif
+}
+
 #endif /* _HELPERS_H_ */
@@ -0,0 +1,334 @@
+#include <emu51.h>
+#include <string.h>
+
+#include "history.h"
+#include "snapshot.h"
+
+/* round size up to the alignment of pointers */
+#define ALIGN_UP(size) (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+static size_t slot_size(long xram_len)
+{
+	return ALIGN_UP(ALIGN_UP(sizeof(struct checkpoint)) + xram_len);
+}
+
+size_t emu51_history_size(const emu51 *m, long checkpoints, long inputs)
+{
+	return ALIGN_UP(sizeof(emu51_history))
+		+ checkpoints * slot_size(m->xram ? m->xram_len : 0)
+		+ inputs * sizeof(struct history_input);
+}
+
+/* Get the checkpoint at the position from the oldest one. */
+static struct checkpoint *checkpoint_at(const emu51_history *h, long i)
+{
+	return (struct checkpoint*)(h->slots
+		+ ((h->first + i) % h->capacity) * h->slot_size);
+}
+
+static uint8_t *checkpoint_xram(struct checkpoint *ck)
+{
+	return (uint8_t*)ck + ALIGN_UP(sizeof(struct checkpoint));
+}
+
+/* Drop the oldest checkpoint, and release the inputs before the next one. */
+static void drop_oldest(emu51_history *h)
+{
+	h->first = (h->first + 1) % h->capacity;
+	h->count--;
+	h->input_tail = h->count ? checkpoint_at(h, 0)->input : h->input_head;
+}
+
+void _emu51_take_checkpoint(emu51 *m)
+{
+	emu51_history *h = m->history;
+	struct checkpoint *ck;
+
+	if (h->count == h->capacity)
+		drop_oldest(h);
+	ck = checkpoint_at(h, h->count++);
+
+	_emu51_save_registers(m, &ck->m, ck->sfr, ck->iram);
+	if (m->xram)
+		memcpy(checkpoint_xram(ck), m->xram, h->xram_len);
+	ck->input = h->input_head;
+
+	h->next = m->cycles + h->interval;
+}
+
+/* Drop all the checkpoints, and take the next one at the next instruction
+ * boundary. */
+static void restart_history(emu51 *m, emu51_history *h)
+{
+	h->count = 0;
+	h->input_tail = h->input_head = h->cursor;
+	h->next = m->cycles;
+	if (m->next_event > m->cycles)
+		m->next_event = m->cycles;
+}
+
+void _emu51_history_log(emu51 *m, int kind, uint8_t value)
+{
+	emu51_history *h = m->history;
+	struct history_input *input;
+
+	/* nothing to log while waiting for a checkpoint */
+	if (h->replaying || !h->count)
+		return;
+
+	while (h->input_head - h->input_tail == (uint64_t)h->input_capacity) {
+		if (h->count == 1) {
+			h->cursor = h->input_head;
+			restart_history(m, h);
+			return;
+		}
+		drop_oldest(h);
+	}
+
+	input = &h->inputs[h->input_head++ & (h->input_capacity - 1)];
+	input->cycle = m->cycles;
+	input->kind = (uint8_t)kind;
+	input->value = value;
+}
+
+int _emu51_history_feed(emu51 *m, int kind, uint8_t *value)
+{
+	emu51_history *h = m->history;
+	const struct history_input *input;
+
+	if (h->cursor == h->input_head)
+		return 0;
+	input = &h->inputs[h->cursor & (h->input_capacity - 1)];
+	if (input->cycle != m->cycles || input->kind != kind)
+		return 0;
+	if (value)
+		*value = input->value;
+	h->cursor++;
+	return 1;
+}
+
+void emu51_set_history(emu51 *m, void *buffer, long checkpoints, long inputs,
+		long interval)
+{
+	emu51_history *h = buffer;
+	uint8_t *p = buffer;
+
+	m->history = h;
+	if (!h)
+		return;
+
+	h->interval = interval;
+	h->replaying = 0;
+	h->xram_len = m->xram ? m->xram_len : 0;
+
+	p += ALIGN_UP(sizeof(emu51_history));
+	h->slots = p;
+	h->slot_size = slot_size(h->xram_len);
+	h->capacity = checkpoints;
+	h->first = h->count = 0;
+	p += checkpoints * h->slot_size;
+
+	h->inputs = (struct history_input*)p;
+	h->input_capacity = inputs;
+	h->input_head = h->input_tail = h->cursor = 0;
+
+	/* the first checkpoint is the current state */
+	_emu51_take_checkpoint(m);
+}
+
+/* State of the emulator tied to the host, which is taken out while
+ * re-executing, and the profile, which counts the original execution only. */
+struct host_state
+{
+	emu51_callbacks callback;
+	emu51_event_log *event_log;
+	emu51_serial *serial;
+	emu51_profile *profile;
+};
+
+static void detach_host(emu51 *m, struct host_state *host)
+{
+	host->callback = m->callback;
+	host->event_log = m->event_log;
+	host->serial = m->serial;
+	host->profile = m->profile;
+	memset(&m->callback, 0, sizeof(m->callback));
+	m->event_log = NULL;
+	m->serial = NULL;
+	m->profile = NULL;
+	m->history->replaying = 1;
+	m->history->next = UINT64_MAX;
+}
+
+static void attach_host(emu51 *m, const struct host_state *host)
+{
+	m->callback = host->callback;
+	m->event_log = host->event_log;
+	m->serial = host->serial;
+	m->profile = host->profile;
+	m->history->replaying = 0;
+}
+
+/* Return to the checkpoint at the position from the oldest one. */
+static void restore_checkpoint(emu51 *m, emu51_history *h, long i)
+{
+	struct checkpoint *ck = checkpoint_at(h, i);
+
+	_emu51_restore_registers(m, &ck->m, ck->sfr, ck->iram);
+	if (m->xram) {
+		memcpy(m->xram, checkpoint_xram(ck), h->xram_len);
+		emu51_mark_xram_dirty(m, 0, h->xram_len);
+	}
+	h->cursor = ck->input;
+}
+
+/* Get the position of the latest checkpoint before the cycle, or -1. */
+static long checkpoint_before(const emu51_history *h, uint64_t cycle)
+{
+	long i;
+
+	for (i = h->count - 1; i >= 0; i--)
+		if (checkpoint_at(h, i)->m.cycles < cycle)
+			return i;
+	return -1;
+}
+
+/* Re-execute from the checkpoint to the instruction boundary at the cycle.
+ *
+ * Returns 0 on success, an error from emu51_step(), or EMU51_REPLAY_DIVERGED
+ * if the cycle is not an instruction boundary. */
+static int run_to(emu51 *m, emu51_history *h, long i, uint64_t cycle)
+{
+	restore_checkpoint(m, h, i);
+	while (m->cycles < cycle) {
+		int err = emu51_step(m, NULL);
+		if (err)
+			return err;
+	}
+	return m->cycles == cycle ? 0 : EMU51_REPLAY_DIVERGED;
+}
+
+/* Forget the future of the current state: the later checkpoints and the
+ * inputs not fed yet, which are taken again from the host. */
+static void truncate_history(emu51 *m, emu51_history *h)
+{
+	struct checkpoint *last = checkpoint_at(h, h->count - 1);
+
+	while (last->m.cycles > m->cycles || last->input > h->cursor) {
+		h->count--;
+		last = checkpoint_at(h, h->count - 1);
+	}
+	h->input_head = h->cursor;
+	h->next = last->m.cycles + h->interval;
+}
+
+int emu51_reverse_step(emu51 *m)
+{
+	emu51_history *h = m->history;
+	uint64_t end = m->cycles, target;
+	struct host_state host;
+	long i;
+	int err = 0;
+
+	if (!h)
+		return EMU51_NO_HISTORY;
+	if (m->recorder)
+		return EMU51_NOT_SUPPORTED;
+	i = checkpoint_before(h, end);
+	if (i < 0)
+		return EMU51_NO_HISTORY;
+
+	detach_host(m, &host);
+
+	/* find the start of the last step... */
+	restore_checkpoint(m, h, i);
+	target = m->cycles;
+	while (!err && m->cycles < end) {
+		target = m->cycles;
+		err = emu51_step(m, NULL);
+	}
+	if (!err && m->cycles != end)
+		err = EMU51_REPLAY_DIVERGED;
+
+	/* ...and go there */
+	if (!err)
+		err = run_to(m, h, i, target);
+
+	attach_host(m, &host);
+	if (err)
+		restart_history(m, h);
+	else
+		truncate_history(m, h);
+	return err;
+}
+
+/* Get the location of the address, or NULL if it does not exist. */
+static const uint8_t *locate(const emu51 *m, int kind, uint16_t addr)
+{
+	switch (kind) {
+		case EMU51_EVENT_SFR:
+			return addr < 128 ? &m->sfr[addr] : NULL;
+		case EMU51_EVENT_IRAM:
+			if (addr < 128)
+				return &m->iram_lower[addr];
+			return addr < 256 && m->iram_upper ? &m->iram_upper[addr - 128]
+				: NULL;
+		case EMU51_EVENT_XRAM:
+			return m->xram && addr < m->xram_len ? &m->xram[addr] : NULL;
+	}
+	return NULL;
+}
+
+int emu51_reverse_continue(emu51 *m, int kind, uint16_t addr)
+{
+	emu51_history *h = m->history;
+	const uint8_t *p = locate(m, kind, addr);
+	uint64_t end = m->cycles, target = 0;
+	struct host_state host;
+	long i;
+	int err = 0, found = 0;
+
+	if (!h)
+		return EMU51_NO_HISTORY;
+	if (m->recorder || !p)
+		return EMU51_NOT_SUPPORTED;
+	i = checkpoint_before(h, end);
+	if (i < 0)
+		return EMU51_NO_HISTORY;
+
+	detach_host(m, &host);
+
+	/* search the intervals from the latest one, and stop at the start of the
+	 * last step that changed the value in the first interval having one */
+	for (; i >= 0; i--) {
+		restore_checkpoint(m, h, i);
+		while (m->cycles < end) {
+			uint64_t start = m->cycles;
+			uint8_t value = *p;
+			err = emu51_step(m, NULL);
+			if (err)
+				break;
+			if (*p != value) {
+				target = start;
+				found = 1;
+			}
+		}
+		if (!err && m->cycles != end)
+			err = EMU51_REPLAY_DIVERGED;
+		if (found || err)
+			break;
+		end = checkpoint_at(h, i)->m.cycles;
+	}
+
+	/* go to the write, or to the start of the history */
+	if (!err)
+		err = found ? run_to(m, h, i, target) : run_to(m, h, 0, end);
+
+	attach_host(m, &host);
+	if (err) {
+		restart_history(m, h);
+		return err;
+	}
+	truncate_history(m, h);
+	return found ? 0 : EMU51_NO_HISTORY;
+}
@@ -0,0 +1,99 @@
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+/* NOTE: This header file is internal to emu51. */
+
+#include <emu51.h>
+
+/* Execution history for reverse execution, see emu51_set_history().
+ *
+ * Checkpoints of the whole state are taken as an event (see interrupt.h) at
+ * the first instruction boundary after every interval cycles, into a ring of
+ * slots: when the ring is full, the oldest checkpoint is overwritten. Going
+ * back re-executes the firmware from a checkpoint with emu51_step(), with the
+ * host taken out: no callbacks, no serial FIFOs, no event log. Going back to
+ * a write compares the value before and after each step.
+ *
+ * The re-execution must see the same inputs as the original execution, so
+ * the inputs taken from the host are logged in a second ring, in the order
+ * they occur: the port values returned by the io_read callback, the serial
+ * receptions, which start if the FIFO has a byte and take the byte from the
+ * FIFO when they are done, and the changes of the INT0 and INT1 pins. Each checkpoint holds the
+ * position of the log at the time it was taken. The inputs before the oldest
+ * checkpoint are released; if the inputs of a single interval fill the log,
+ * all the checkpoints are dropped and the history starts over at the next
+ * instruction boundary.
+ */
+
+/* kinds of the logged inputs */
+enum history_kind
+{
+	HISTORY_PORT = 0, /* + port number: value returned by io_read */
+	HISTORY_RX_START = 4, /* start of a serial reception */
+	HISTORY_RX = 5,       /* end of a serial reception: the received byte */
+	HISTORY_PINS = 6,     /* + 1 if seen as a step or run started: levels of
+	                         INT0 and INT1, see _emu51_pins_input() */
+};
+
+struct history_input
+{
+	uint64_t cycle; /* emu51::cycles when the input was taken */
+	uint8_t kind;   /* enum history_kind */
+	uint8_t value;
+};
+
+/* A checkpoint, followed by the copy of the external memory in its slot. */
+struct checkpoint
+{
+	emu51 m;           /* the emulator at the checkpoint; the pointers to its
+	                      memories are not used */
+	uint8_t sfr[128];
+	uint8_t iram[256]; /* lower, then upper internal memory */
+	uint64_t input;    /* count of inputs logged before the checkpoint */
+};
+
+struct emu51_history
+{
+	long interval;           /* cycles between checkpoints */
+	uint64_t next;           /* cycle of the next checkpoint, UINT64_MAX
+	                            while re-executing */
+	int replaying;           /* non-zero while re-executing */
+
+	uint8_t *slots;          /* ring of checkpoints */
+	size_t slot_size;
+	long capacity;           /* number of slots */
+	long first, count;       /* oldest checkpoint and number of checkpoints */
+	long xram_len;           /* size of the external memory copies */
+
+	struct history_input *inputs; /* ring of inputs */
+	long input_capacity;          /* a power of 2 */
+	uint64_t input_head;          /* inputs logged */
+	uint64_t input_tail;          /* inputs released */
+	uint64_t cursor;              /* next input to feed while re-executing */
+};
+
+/* Take a checkpoint, which must be due (see _emu51_history_next()). */
+void _emu51_take_checkpoint(emu51 *m);
+
+/* Log an input taken from the host at emu51::cycles. */
+void _emu51_history_log(emu51 *m, int kind, uint8_t value);
+
+/* Feed the next input while re-executing, if it was taken at emu51::cycles
+ * and is of the kind.
+ *
+ * Returns 1 and sets value (if not NULL) if fed, 0 otherwise. */
+int _emu51_history_feed(emu51 *m, int kind, uint8_t *value);
+
+/* Test if the emulator is re-executing from a checkpoint. */
+static inline int _emu51_history_replaying(const emu51 *m)
+{
+	return m->history && m->history->replaying;
+}
+
+/* Get the cycle of the next checkpoint, or UINT64_MAX. */
+static inline uint64_t _emu51_history_next(const emu51 *m)
+{
+	return m->history ? m->history->next : UINT64_MAX;
+}
+
+#endif /* _HISTORY_H_ */
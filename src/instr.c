@@ -1,6 +1,9 @@
 #include <emu51.h>
 #include "instr.h"
 #include "helpers.h"
+#include "trust.h"
+#include "event.h"
+#include "snapshot.h"
 
 /* Implementations of 8051/8052 instructions.
  *
@@ -18,12 +21,21 @@
  * reasons) without replacing each handler function.
  *
  * The emulator object should always be called m in the argument list.
+ *
+ * A handler is not called directly: it is inlined into one specialised
+ * function per opcode in the instruction table (see SPECIALIZED below), with
+ * the opcode as a compile-time constant. Tests on OPCODE and REGNO are
+ * therefore folded away by the compiler.
  */
-#define DEFINE_HANDLER(name) static int name ( \
-		const emu51_instr *instr, const uint8_t *code, emu51 *m)
-#define OPCODE code[0]
-#define OPERAND1 code[1]
-#define OPERAND2 code[2]
+#define DEFINE_HANDLER(name) static ALWAYS_INLINE int name ( \
+		const emu51_decoded *d, emu51 *m, const uint8_t opcode)
+#define OPCODE opcode
+#define OPERAND1 d->code[1]
+#define OPERAND2 d->code[2]
+/* register index of Rn (opcode x8~xf) or @Ri (opcode x6~x7) */
+#define REGNO ((OPCODE & 0x08) ? (OPCODE & 0x07) : (OPCODE & 0x01))
+#define RELADDR d->reladdr /* signed relative address */
+#define TARGET d->target   /* absolute target address */
 #define PC m->pc
 
 #define DPTR ((m->sfr[SFR_DPH] << 8) | m->sfr[SFR_DPL])
@@ -31,28 +43,51 @@
 #define PSW m->sfr[SFR_PSW]
 #define SP m->sfr[SFR_SP]
 
-#define BANK_BASE_ADDR (m->sfr[SFR_PSW] & (PSW_RS1 | PSW_RS0))
-#define REG_R(n) m->iram_lower[BANK_BASE_ADDR + (n)]
+#define REG_R(n) m->map.bank[n]
+
+/* Invoke the callback. The pending PSW flags are computed first, since the
+ * callback may read PSW, and the register bank is selected again afterwards,
+ * since the callback may write it. */
+#define INVOKE_CALLBACK(cb_name, ...) do { \
+	sync_psw(m); \
+	m->callback.cb_name(m, __VA_ARGS__); \
+	select_bank(m); } while (0)
 
 /* Call the callback if it is not NULL. */
 #define CALLBACK(cb_name, ...) do { \
-	if (m->callback.cb_name) m->callback.cb_name(m, __VA_ARGS__); } while (0)
-
-/* operation: NOP
- * function: consume 1 cycle and do nothing
- */
-DEFINE_HANDLER(nop_handler)
+	if (HAS_CALLBACK(m, cb_name)) \
+		INVOKE_CALLBACK(cb_name, __VA_ARGS__); } while (0)
+
+/* Report a memory update: append it to the event log and call the callback,
+ * if they are set and the address is watched (see emu51::watch). value is
+ * only evaluated if the event is logged. */
+#define MEMORY_UPDATE(cb_name, kind, space, addr, value) do { \
+	if (m->event_log && is_watched(m->active_watch.space, addr)) \
+		log_event(m, kind, addr, value); \
+	if (HAS_CALLBACK(m, cb_name) && is_watched(m->active_watch.space, addr)) \
+		INVOKE_CALLBACK(cb_name, addr); } while (0)
+#define SFR_UPDATE(index) MEMORY_UPDATE(sfr_update, EMU51_EVENT_SFR, sfr, \
+	(uint8_t)(index), sfr_value(m, index))
+#define IRAM_UPDATE(addr) MEMORY_UPDATE(iram_update, EMU51_EVENT_IRAM, iram, \
+	(uint8_t)(addr), m->map.indirect[(uint8_t)(addr) >> 7][(addr) & 0x7f])
+#define XRAM_UPDATE(addr) do { \
+	mark_xram_dirty(m, (uint16_t)(addr)); \
+	MEMORY_UPDATE(xram_update, EMU51_EVENT_XRAM, xram, \
+		(uint16_t)(addr), m->xram[(uint16_t)(addr)]); } while (0)
+
+/* Get the value of the SFR for the event log, computing PSW first. */
+static inline uint8_t sfr_value(emu51 *m, uint8_t index)
 {
-	return 0;
+	if (index == SFR_PSW)
+		sync_psw(m);
+	return m->sfr[index];
 }
 
-/* operation: ACALL
- * function: absolute call within 2k block
- */
-DEFINE_HANDLER(acall_handler)
+/* Call the target: push pc onto the stack, least-significant-byte first,
+ * most-significant-byte second, and jump. Shared by ACALL, LCALL and the
+ * calls to interrupt vectors. */
+static ALWAYS_INLINE int call(emu51 *m, uint16_t target)
 {
-	/* push PC onto the stack, least-significant-byte first,
-	 * most-significant-byte second. */
 	int err = stack_push(m, PC & 0xff);
 	if (err)
 		return err;
@@ -60,31 +95,74 @@ DEFINE_HANDLER(acall_handler)
 	if (err)
 		return err;
 
-	/* the first 3 bit of the opcode is the page number */
-	int page = (OPCODE >> 5) & 0x7;
+	PC = target;
+
+	/* callbacks */
+	SFR_UPDATE(SFR_SP);
+	IRAM_UPDATE(SP - 1);
+	IRAM_UPDATE(SP);
+
+	return 0;
+}
+
+/* Pop the return address pushed by call() off the stack and jump to it.
+ * The stack is left unchanged on error. */
+static ALWAYS_INLINE int ret(emu51 *m)
+{
+	uint8_t high, low;
+	int err = indirect_read(m, SP, &high);
+	if (err)
+		return err;
+	err = indirect_read(m, (uint8_t)(SP - 1), &low);
+	if (err)
+		return err;
+
+	/* the return address is only known now, check it in trusted mode */
+	uint16_t target = (high << 8) | low;
+	err = _emu51_trust_jump(m, target);
+	if (err)
+		return err;
 
-	/* replace the lower 11 bits of PC with {page, OPERAND1} */
-	PC = (PC & 0xf800) | (page << 8) | OPERAND1;
+	SP -= 2;
+	PC = target;
 
 	/* callbacks */
-	CALLBACK(sfr_update, SFR_SP);
-	CALLBACK(iram_update, SP - 1);
-	CALLBACK(iram_update, SP);
+	SFR_UPDATE(SFR_SP);
+
+	return 0;
+}
+
+int _emu51_interrupt_call(emu51 *m, uint16_t vector)
+{
+	return call(m, vector);
+}
 
+/* operation: NOP
+ * function: consume 1 cycle and do nothing
+ */
+DEFINE_HANDLER(nop_handler)
+{
 	return 0;
 }
 
+/* operation: ACALL
+ * function: absolute call within 2k block
+ */
+DEFINE_HANDLER(acall_handler)
+{
+	/* replace the lower 11 bits of PC with {page, OPERAND1}; the target
+	 * address is computed by the decoder */
+	return call(m, TARGET);
+}
+
 /* operation: AJMP
  * function: absolute jump within 2k block
  */
 DEFINE_HANDLER(ajmp_handler)
 {
-	/* the first 3 bit of the opcode is the page number */
-	int page = (OPCODE >> 5) & 0x7;
-
-	/* replace the lower 11 bits of PC with {page, OPERAND1} */
-	PC &= 0xf800; /* clear the lower 11 bits */
-	PC |= (page << 8) | OPERAND1; /* set the lower 11 bits to target */
+	/* replace the lower 11 bits of PC with {page, OPERAND1}; the target
+	 * address is computed by the decoder */
+	PC = TARGET;
 
 	return 0;
 }
@@ -94,7 +172,14 @@ DEFINE_HANDLER(ajmp_handler)
  */
 DEFINE_HANDLER(jmp_handler)
 {
-	PC = DPTR + ACC;
+	uint16_t target = DPTR + ACC;
+
+	/* the target is only known now, check it in trusted mode */
+	int err = _emu51_trust_jump(m, target);
+	if (err)
+		return err;
+
+	PC = target;
 	return 0;
 }
 
@@ -103,9 +188,9 @@ DEFINE_HANDLER(jmp_handler)
  */
 DEFINE_HANDLER(jc_handler)
 {
-	int8_t reladdr = OPERAND1; /* reladdr is signed -128~127 */
+	int8_t reladdr = RELADDR; /* reladdr is signed -128~127 */
 
-	if ((PSW & PSW_C) == PSW_C)
+	if (carry_flag(m))
 		relative_jump(m, reladdr);
 	return 0;
 }
@@ -115,9 +200,9 @@ DEFINE_HANDLER(jc_handler)
  */
 DEFINE_HANDLER(jnc_handler)
 {
-	int8_t reladdr = OPERAND1; /* reladdr is signed -128~127 */
+	int8_t reladdr = RELADDR; /* reladdr is signed -128~127 */
 
-	if ((PSW & PSW_C) == 0)
+	if (!carry_flag(m))
 		relative_jump(m, reladdr);
 	return 0;
 }
@@ -128,7 +213,7 @@ DEFINE_HANDLER(jnc_handler)
  */
 DEFINE_HANDLER(jz_handler)
 {
-	int8_t reladdr = OPERAND1; /* -128~127 */
+	int8_t reladdr = RELADDR; /* -128~127 */
 
 	if (ACC == 0)
 		relative_jump(m, reladdr);
@@ -140,7 +225,7 @@ DEFINE_HANDLER(jz_handler)
  */
 DEFINE_HANDLER(jnz_handler)
 {
-	int8_t reladdr = OPERAND1; /* -128~127 */
+	int8_t reladdr = RELADDR; /* -128~127 */
 
 	if (ACC != 0)
 		relative_jump(m, reladdr);
@@ -152,8 +237,7 @@ DEFINE_HANDLER(jnz_handler)
  */
 DEFINE_HANDLER(ljmp_handler)
 {
-	uint16_t target_addr = (OPERAND1 << 8) | OPERAND2;
-	PC = target_addr;
+	PC = TARGET;
 	return 0;
 }
 
@@ -162,23 +246,28 @@ DEFINE_HANDLER(ljmp_handler)
  */
 DEFINE_HANDLER(lcall_handler)
 {
-	/* push PC onto stack, low-byte first, high-byte second. */
-	int err = stack_push(m, PC & 0xff);
-	if (err)
-		return err;
-	err = stack_push(m, (PC >> 8) & 0xff);
+	return call(m, TARGET);
+}
+
+/* operation: RET, RETI
+ * function: return from subroutine or interrupt
+ */
+DEFINE_HANDLER(ret_handler)
+{
+	int err = ret(m);
 	if (err)
 		return err;
 
-	/* set PC to target address */
-	uint16_t target_addr = (OPERAND1 << 8) | OPERAND2;
-	PC = target_addr;
-
-	/* callbacks */
-	CALLBACK(sfr_update, SFR_SP);
-	CALLBACK(iram_update, SP - 1);
-	CALLBACK(iram_update, SP);
-
+	if (OPCODE == 0x32) { /* RETI */
+		/* the highest priority level in service ends; another interrupt
+		 * can only be taken after the next instruction */
+		if (m->irq.in_service & IRQ_HIGH)
+			m->irq.in_service &= ~IRQ_HIGH;
+		else
+			m->irq.in_service &= ~IRQ_LOW;
+		m->irq.earliest = m->cycles + d->cycles + 1;
+		_emu51_irq_update(m);
+	}
 	return 0;
 }
 
@@ -187,7 +276,7 @@ DEFINE_HANDLER(lcall_handler)
  */
 DEFINE_HANDLER(sjmp_handler)
 {
-	int8_t reladdr = OPERAND1;
+	int8_t reladdr = RELADDR;
 
 	relative_jump(m, reladdr);
 
@@ -200,12 +289,16 @@ DEFINE_HANDLER(movc_dptr_handler)
 {
 	uint16_t addr = ACC + DPTR;
 
-	/* check if the target address is outside valid program memory */
-	if (addr >= m->pmem_len)
+	/* check if the target address is outside valid program memory; the
+	 * program memory is mirrored in trusted mode */
+	if (m->trust)
+		addr &= m->pmem_len - 1;
+	else if (addr >= m->pmem_len)
 		return EMU51_PMEM_OUT_OF_RANGE;
 
 	ACC = m->pmem[addr];
-	CALLBACK(sfr_update, SFR_ACC);
+	acc_written(m);
+	SFR_UPDATE(SFR_ACC);
 
 	return 0;
 }
@@ -216,12 +309,16 @@ DEFINE_HANDLER(movc_pc_handler)
 {
 	uint16_t addr = ACC + PC;
 
-	/* check if the target address is outside valid program memory */
-	if (addr >= m->pmem_len)
+	/* check if the target address is outside valid program memory; the
+	 * program memory is mirrored in trusted mode */
+	if (m->trust)
+		addr &= m->pmem_len - 1;
+	else if (addr >= m->pmem_len)
 		return EMU51_PMEM_OUT_OF_RANGE;
 
 	ACC = m->pmem[addr];
-	CALLBACK(sfr_update, SFR_ACC);
+	acc_written(m);
+	SFR_UPDATE(SFR_ACC);
 
 	return 0;
 }
@@ -231,6 +328,7 @@ static inline int general_cjne(emu51 *m, uint8_t op1, uint8_t op2,
 		int8_t reladdr)
 {
 	/* compute carry flag: set only when op1 < op2 */
+	sync_psw(m);
 	if (op1 < op2)
 		PSW |= PSW_C;
 	else
@@ -241,7 +339,7 @@ static inline int general_cjne(emu51 *m, uint8_t op1, uint8_t op2,
 		relative_jump(m, reladdr);
 
 	/* PSW is updated */
-	CALLBACK(sfr_update, SFR_PSW);
+	SFR_UPDATE(SFR_PSW);
 
 	return 0;
 }
@@ -252,7 +350,7 @@ static inline int general_cjne(emu51 *m, uint8_t op1, uint8_t op2,
 DEFINE_HANDLER(cjne_a_data_handler)
 {
 	uint8_t data = OPERAND1;
-	int8_t reladdr = OPERAND2;
+	int8_t reladdr = RELADDR;
 
 	return general_cjne(m, ACC, data, reladdr);
 }
@@ -263,9 +361,12 @@ DEFINE_HANDLER(cjne_a_data_handler)
 DEFINE_HANDLER(cjne_a_addr_handler)
 {
 	uint8_t addr = OPERAND1;
-	int8_t reladdr = OPERAND2;
-	uint8_t data = direct_addr_read(m, addr);
+	int8_t reladdr = RELADDR;
+	uint8_t data;
+	int err = direct_operand_read(m, addr, &data);
 
+	if (err)
+		return err;
 	return general_cjne(m, ACC, data, reladdr);
 }
 
@@ -275,17 +376,17 @@ DEFINE_HANDLER(cjne_a_addr_handler)
 DEFINE_HANDLER(cjne_deref_r_data_handler)
 {
 	uint8_t data = OPERAND1;
-	int8_t reladdr = OPERAND2;
+	int8_t reladdr = RELADDR;
 
 	/* The last bit of opcode determines whether to use R0 or R1.
 	 * last bit == 0 => R0
 	 * last bit == 1 => R1
 	 */
-	uint8_t addr = BANK_BASE_ADDR + (OPCODE & 0x01);
+	uint8_t addr = REG_R(REGNO);
 
 	/* get the value of @R0 or R1 */
 	uint8_t reg_derefenced_value;
-	int err = indirect_addr_read(m, addr, &reg_derefenced_value);
+	int err = indirect_read(m, addr, &reg_derefenced_value);
 	if (err)
 		return err;
 
@@ -298,10 +399,10 @@ DEFINE_HANDLER(cjne_deref_r_data_handler)
 DEFINE_HANDLER(cjne_r_data_handler)
 {
 	uint8_t data = OPERAND1;
-	int8_t reladdr = OPERAND2;
+	int8_t reladdr = RELADDR;
 
 	/* The last 3 bit of opcode is the R number (0~7) */
-	uint8_t r_index = OPCODE & 0x07;
+	uint8_t r_index = REGNO;
 
 	return general_cjne(m, REG_R(r_index), data, reladdr);
 }
@@ -311,7 +412,7 @@ DEFINE_HANDLER(cjne_r_data_handler)
 DEFINE_HANDLER(djnz_iram_handler)
 {
 	uint8_t iram_addr = OPERAND1;
-	int8_t reladdr = OPERAND2;
+	int8_t reladdr = RELADDR;
 
 	/* decrement the data */
 	uint8_t new_value = direct_addr_read(m, iram_addr) - 1;
@@ -321,8 +422,11 @@ DEFINE_HANDLER(djnz_iram_handler)
 	if (new_value != 0)
 		relative_jump(m, reladdr);
 
-	/* ACC is updated */
-	CALLBACK(sfr_update, SFR_ACC);
+	/* callbacks */
+	if (iram_addr < 0x80)
+		IRAM_UPDATE(iram_addr);
+	else
+		SFR_UPDATE(iram_addr & 0x7f);
 
 	return 0;
 }
@@ -334,7 +438,7 @@ DEFINE_HANDLER(djnz_iram_handler)
 DEFINE_HANDLER(jump_if_bit_handler)
 {
 	uint8_t bit_addr = OPERAND1;
-	int8_t reladdr = OPERAND2;
+	int8_t reladdr = RELADDR;
 	int jump_value = (OPCODE == 0x30) ? 0 : 1;
 
 	int bit_value = bit_read(m, bit_addr);
@@ -343,8 +447,10 @@ DEFINE_HANDLER(jump_if_bit_handler)
 
 	if (bit_value == jump_value) {
 		/* clear the bit if the instruction is JBC */
-		if (OPCODE == 0x10)
+		if (OPCODE == 0x10) {
 			bit_write(m, bit_addr, 0);
+			IRAM_UPDATE(BIT_ADDR_BASE + bit_addr / 8);
+		}
 		relative_jump(m, reladdr);
 	}
 
@@ -355,50 +461,44 @@ DEFINE_HANDLER(jump_if_bit_handler)
  */
 DEFINE_HANDLER(djnz_r_handler)
 {
-	uint8_t regno = OPCODE & 0x07;
-	int8_t reladdr = OPERAND1;
+	uint8_t regno = REGNO;
+	int8_t reladdr = RELADDR;
 
 	/* decrement Rn and jump if new value is not zero */
 	if (--REG_R(regno))
 		relative_jump(m, reladdr);
 
+	/* callbacks */
+	IRAM_UPDATE((PSW & (PSW_RS1 | PSW_RS0)) + regno);
+
 	return 0;
 }
 
 /* ACC <- ACC + operand + carry_in
- * affected flags: C, AC, OV
+ * affected flags: C, AC, OV, P
  */
 static void general_add(emu51 *m, uint8_t operand, uint8_t carry_in)
 {
-#define signbit(byte) ((byte) & 0x80)
-	uint16_t sum_with_carry;
+	uint8_t acc = ACC;
 	carry_in &= 1; /* only the lowest bit of carry_in is used */
-	sum_with_carry = (uint16_t)ACC + (uint16_t)operand + carry_in;
-
-	PSW &= ~(PSW_C | PSW_AC | PSW_OV); /* clear flags */
-
-	/* auxiliary carry: carry out at the 4th bit */
-	if ((sum_with_carry & 0x0f) != (ACC & 0x0f) + (operand & 0x0f) + carry_in)
-		PSW |= PSW_AC;
-
-	/* carry out: sum > 255 */
-	if (sum_with_carry > 0xff)
-		PSW |= PSW_C;
-
-	/* overflow: adding two numbers of the same sign but get a number with a
-	 * different sign
-	 */
-	if (signbit(ACC) == signbit(operand)
-			&& signbit(operand) != signbit(sum_with_carry))
-		PSW |= PSW_OV;
 
 	/* write result to ACC */
-	ACC = sum_with_carry & 0xff;
+	ACC = acc + operand + carry_in;
+
+#ifdef EMU51_LAZY_FLAGS
+	/* the flags are computed when PSW is read, see sync_psw() */
+	m->lazy_psw.acc = acc;
+	m->lazy_psw.operand = operand;
+	m->lazy_psw.carry_in = carry_in;
+	m->lazy_psw.pending |= LAZY_ADD;
+#else
+	PSW = (PSW & ~(PSW_C | PSW_AC | PSW_OV)) | add_flags(acc, operand, carry_in);
+#endif
+	acc_written(m);
 
 	/* callbacks */
-	CALLBACK(sfr_update, SFR_PSW);
-
-#undef signbit
+	SFR_UPDATE(SFR_ACC);
+	SFR_UPDATE(SFR_PSW);
 }
 
 /* operation: ADD  A, operand (opcode: 0x24~0x2f)
@@ -416,23 +516,25 @@ DEFINE_HANDLER(add_handler)
 			operand = OPERAND1;
 			break;
 		case 0x05: /* ADD A, iram addr */
-			operand = direct_addr_read(m, OPERAND1);
+			err = direct_operand_read(m, OPERAND1, &operand);
+			if (err)
+				return err;
 			break;
 		case 0x06: /* ADD A, @R0 */
 		case 0x07: /* ADD A, @R1 */
-			err = indirect_addr_read(m, BANK_BASE_ADDR + (OPCODE & 1), &operand);
+			err = indirect_read(m, REG_R(REGNO), &operand);
 			if (err)
 				return err;
 			break;
 		default: /* ADD A, Rn */
-			operand = REG_R(OPCODE & 0x07);
+			operand = REG_R(REGNO);
 	}
 
 	/* 0x2* -> ADD (carry_in = 0)
 	 * 0x3* -> ADDC (carry_in = carry flag)
 	 */
-	if ((OPCODE & 0xf0) == 0x30 && (PSW & PSW_C))
-		carry_in = 1;
+	if ((OPCODE & 0xf0) == 0x30)
+		carry_in = carry_flag(m);
 
 	/* ADD A, #data */
 	general_add(m, operand, carry_in);
@@ -446,271 +548,115 @@ DEFINE_HANDLER(add_handler)
 #pragma GCC diagnostic pop
 #endif
 
+/* name of the handler h specialised for opcode op */
+#define SPECIALIZED(h, op) h##_##op
+
+/* one specialised handler for each implemented opcode */
+#define INSTR(op, mne, b, c, h) \
+	static int SPECIALIZED(h, op)(const emu51_decoded *d, emu51 *m) \
+	{ \
+		return h(d, m, op); \
+	}
+#define NOT_IMPLEMENTED(op)
+#include "instr_table.h"
+#undef INSTR
+#undef NOT_IMPLEMENTED
+
 /* macro to define an instruction */
 #define INSTR(op, mne, b, c, h) {.opcode = op, .bytes = b, .cycles = c, \
-	.handler = h}
+	.handler = SPECIALIZED(h, op)},
 
 /* fill in this macro in the table if the opcode is not implemented */
 #define NOT_IMPLEMENTED(op) {.opcode = (op), \
-	.bytes = 0, .cycles = 0, .handler = 0}
+	.bytes = 0, .cycles = 0, .handler = 0},
 
 /* the instruction lookup table: valid range of opcode is 0~255 */
 const emu51_instr _emu51_instr_table[256] = {
-	/* opcode, mnemonics, bytes, cycles, handler */
-	INSTR(0x00, "NOP",  1, 1, nop_handler),
-	INSTR(0x01, "AJMP", 2, 2, ajmp_handler),
-	INSTR(0x02, "LJMP", 3, 2, ljmp_handler),
-	NOT_IMPLEMENTED(0x03),
-	NOT_IMPLEMENTED(0x04),
-	NOT_IMPLEMENTED(0x05),
-	NOT_IMPLEMENTED(0x06),
-	NOT_IMPLEMENTED(0x07),
-	NOT_IMPLEMENTED(0x08),
-	NOT_IMPLEMENTED(0x09),
-	NOT_IMPLEMENTED(0x0a),
-	NOT_IMPLEMENTED(0x0b),
-	NOT_IMPLEMENTED(0x0c),
-	NOT_IMPLEMENTED(0x0d),
-	NOT_IMPLEMENTED(0x0e),
-	NOT_IMPLEMENTED(0x0f),
-	INSTR(0x10, "JBC", 3, 2, jump_if_bit_handler),
-	INSTR(0x11, "ACALL", 2, 2, acall_handler),
-	INSTR(0x12, "LCALL", 3, 2, lcall_handler),
-	NOT_IMPLEMENTED(0x13),
-	NOT_IMPLEMENTED(0x14),
-	NOT_IMPLEMENTED(0x15),
-	NOT_IMPLEMENTED(0x16),
-	NOT_IMPLEMENTED(0x17),
-	NOT_IMPLEMENTED(0x18),
-	NOT_IMPLEMENTED(0x19),
-	NOT_IMPLEMENTED(0x1a),
-	NOT_IMPLEMENTED(0x1b),
-	NOT_IMPLEMENTED(0x1c),
-	NOT_IMPLEMENTED(0x1d),
-	NOT_IMPLEMENTED(0x1e),
-	NOT_IMPLEMENTED(0x1f),
-	INSTR(0x20, "JB", 3, 2, jump_if_bit_handler),
-	INSTR(0x21, "AJMP", 2, 2, ajmp_handler),
-	NOT_IMPLEMENTED(0x22),
-	NOT_IMPLEMENTED(0x23),
-	INSTR(0x24, "ADD", 2, 1, add_handler),
-	INSTR(0x25, "ADD", 2, 1, add_handler),
-	INSTR(0x26, "ADD", 1, 1, add_handler),
-	INSTR(0x27, "ADD", 1, 1, add_handler),
-	INSTR(0x28, "ADD", 1, 1, add_handler),
-	INSTR(0x29, "ADD", 1, 1, add_handler),
-	INSTR(0x2a, "ADD", 1, 1, add_handler),
-	INSTR(0x2b, "ADD", 1, 1, add_handler),
-	INSTR(0x2c, "ADD", 1, 1, add_handler),
-	INSTR(0x2d, "ADD", 1, 1, add_handler),
-	INSTR(0x2e, "ADD", 1, 1, add_handler),
-	INSTR(0x2f, "ADD", 1, 1, add_handler),
-	INSTR(0x30, "JNB", 3, 2, jump_if_bit_handler),
-	INSTR(0x31, "ACALL", 2, 2, acall_handler),
-	NOT_IMPLEMENTED(0x32),
-	NOT_IMPLEMENTED(0x33),
-	INSTR(0x34, "ADDC", 2, 1, add_handler),
-	INSTR(0x35, "ADDC", 2, 1, add_handler),
-	INSTR(0x36, "ADDC", 1, 1, add_handler),
-	INSTR(0x37, "ADDC", 1, 1, add_handler),
-	INSTR(0x38, "ADDC", 1, 1, add_handler),
-	INSTR(0x39, "ADDC", 1, 1, add_handler),
-	INSTR(0x3a, "ADDC", 1, 1, add_handler),
-	INSTR(0x3b, "ADDC", 1, 1, add_handler),
-	INSTR(0x3c, "ADDC", 1, 1, add_handler),
-	INSTR(0x3d, "ADDC", 1, 1, add_handler),
-	INSTR(0x3e, "ADDC", 1, 1, add_handler),
-	INSTR(0x3f, "ADDC", 1, 1, add_handler),
-	INSTR(0x40, "JC", 2, 2, jc_handler),
-	INSTR(0x41, "AJMP", 2, 2, ajmp_handler),
-	NOT_IMPLEMENTED(0x42),
-	NOT_IMPLEMENTED(0x43),
-	NOT_IMPLEMENTED(0x44),
-	NOT_IMPLEMENTED(0x45),
-	NOT_IMPLEMENTED(0x46),
-	NOT_IMPLEMENTED(0x47),
-	NOT_IMPLEMENTED(0x48),
-	NOT_IMPLEMENTED(0x49),
-	NOT_IMPLEMENTED(0x4a),
-	NOT_IMPLEMENTED(0x4b),
-	NOT_IMPLEMENTED(0x4c),
-	NOT_IMPLEMENTED(0x4d),
-	NOT_IMPLEMENTED(0x4e),
-	NOT_IMPLEMENTED(0x4f),
-	INSTR(0x50, "JNC", 2, 2, jnc_handler),
-	INSTR(0x51, "ACALL", 2, 2, acall_handler),
-	NOT_IMPLEMENTED(0x52),
-	NOT_IMPLEMENTED(0x53),
-	NOT_IMPLEMENTED(0x54),
-	NOT_IMPLEMENTED(0x55),
-	NOT_IMPLEMENTED(0x56),
-	NOT_IMPLEMENTED(0x57),
-	NOT_IMPLEMENTED(0x58),
-	NOT_IMPLEMENTED(0x59),
-	NOT_IMPLEMENTED(0x5a),
-	NOT_IMPLEMENTED(0x5b),
-	NOT_IMPLEMENTED(0x5c),
-	NOT_IMPLEMENTED(0x5d),
-	NOT_IMPLEMENTED(0x5e),
-	NOT_IMPLEMENTED(0x5f),
-	INSTR(0x60, "JZ", 2, 2, jz_handler),
-	INSTR(0x61, "AJMP", 2, 2, ajmp_handler),
-	NOT_IMPLEMENTED(0x62),
-	NOT_IMPLEMENTED(0x63),
-	NOT_IMPLEMENTED(0x64),
-	NOT_IMPLEMENTED(0x65),
-	NOT_IMPLEMENTED(0x66),
-	NOT_IMPLEMENTED(0x67),
-	NOT_IMPLEMENTED(0x68),
-	NOT_IMPLEMENTED(0x69),
-	NOT_IMPLEMENTED(0x6a),
-	NOT_IMPLEMENTED(0x6b),
-	NOT_IMPLEMENTED(0x6c),
-	NOT_IMPLEMENTED(0x6d),
-	NOT_IMPLEMENTED(0x6e),
-	NOT_IMPLEMENTED(0x6f),
-	INSTR(0x70, "JNZ", 2, 2, jnz_handler),
-	INSTR(0x71, "ACALL", 2, 2, acall_handler),
-	NOT_IMPLEMENTED(0x72),
-	INSTR(0x73, "JMP", 1, 2, jmp_handler),
-	NOT_IMPLEMENTED(0x74),
-	NOT_IMPLEMENTED(0x75),
-	NOT_IMPLEMENTED(0x76),
-	NOT_IMPLEMENTED(0x77),
-	NOT_IMPLEMENTED(0x78),
-	NOT_IMPLEMENTED(0x79),
-	NOT_IMPLEMENTED(0x7a),
-	NOT_IMPLEMENTED(0x7b),
-	NOT_IMPLEMENTED(0x7c),
-	NOT_IMPLEMENTED(0x7d),
-	NOT_IMPLEMENTED(0x7e),
-	NOT_IMPLEMENTED(0x7f),
-	INSTR(0x80, "SJMP", 2, 2, sjmp_handler),
-	INSTR(0x81, "AJMP", 2, 2, ajmp_handler),
-	NOT_IMPLEMENTED(0x82),
-	INSTR(0x83, "MOVC", 1, 1, movc_pc_handler),
-	NOT_IMPLEMENTED(0x84),
-	NOT_IMPLEMENTED(0x85),
-	NOT_IMPLEMENTED(0x86),
-	NOT_IMPLEMENTED(0x87),
-	NOT_IMPLEMENTED(0x88),
-	NOT_IMPLEMENTED(0x89),
-	NOT_IMPLEMENTED(0x8a),
-	NOT_IMPLEMENTED(0x8b),
-	NOT_IMPLEMENTED(0x8c),
-	NOT_IMPLEMENTED(0x8d),
-	NOT_IMPLEMENTED(0x8e),
-	NOT_IMPLEMENTED(0x8f),
-	NOT_IMPLEMENTED(0x90),
-	INSTR(0x91, "ACALL", 2, 2, acall_handler),
-	NOT_IMPLEMENTED(0x92),
-	INSTR(0x93, "MOVC", 1, 2, movc_dptr_handler),
-	NOT_IMPLEMENTED(0x94),
-	NOT_IMPLEMENTED(0x95),
-	NOT_IMPLEMENTED(0x96),
-	NOT_IMPLEMENTED(0x97),
-	NOT_IMPLEMENTED(0x98),
-	NOT_IMPLEMENTED(0x99),
-	NOT_IMPLEMENTED(0x9a),
-	NOT_IMPLEMENTED(0x9b),
-	NOT_IMPLEMENTED(0x9c),
-	NOT_IMPLEMENTED(0x9d),
-	NOT_IMPLEMENTED(0x9e),
-	NOT_IMPLEMENTED(0x9f),
-	NOT_IMPLEMENTED(0xa0),
-	INSTR(0xa1, "AJMP", 2, 2, ajmp_handler),
-	NOT_IMPLEMENTED(0xa2),
-	NOT_IMPLEMENTED(0xa3),
-	NOT_IMPLEMENTED(0xa4),
-	NOT_IMPLEMENTED(0xa5),
-	NOT_IMPLEMENTED(0xa6),
-	NOT_IMPLEMENTED(0xa7),
-	NOT_IMPLEMENTED(0xa8),
-	NOT_IMPLEMENTED(0xa9),
-	NOT_IMPLEMENTED(0xaa),
-	NOT_IMPLEMENTED(0xab),
-	NOT_IMPLEMENTED(0xac),
-	NOT_IMPLEMENTED(0xad),
-	NOT_IMPLEMENTED(0xae),
-	NOT_IMPLEMENTED(0xaf),
-	NOT_IMPLEMENTED(0xb0),
-	INSTR(0xb1, "ACALL", 2, 2, acall_handler),
-	NOT_IMPLEMENTED(0xb2),
-	NOT_IMPLEMENTED(0xb3),
-	INSTR(0xb4, "CJNE", 3, 2, cjne_a_data_handler),
-	INSTR(0xb5, "CJNE", 3, 2, cjne_a_addr_handler),
-	INSTR(0xb6, "CJNE", 3, 2, cjne_deref_r_data_handler),
-	INSTR(0xb7, "CJNE", 3, 2, cjne_deref_r_data_handler),
-	INSTR(0xb8, "CJNE", 3, 2, cjne_r_data_handler),
-	INSTR(0xb9, "CJNE", 3, 2, cjne_r_data_handler),
-	INSTR(0xba, "CJNE", 3, 2, cjne_r_data_handler),
-	INSTR(0xbb, "CJNE", 3, 2, cjne_r_data_handler),
-	INSTR(0xbc, "CJNE", 3, 2, cjne_r_data_handler),
-	INSTR(0xbd, "CJNE", 3, 2, cjne_r_data_handler),
-	INSTR(0xbe, "CJNE", 3, 2, cjne_r_data_handler),
-	INSTR(0xbf, "CJNE", 3, 2, cjne_r_data_handler),
-	NOT_IMPLEMENTED(0xc0),
-	INSTR(0xc1, "AJMP", 2, 2, ajmp_handler),
-	NOT_IMPLEMENTED(0xc2),
-	NOT_IMPLEMENTED(0xc3),
-	NOT_IMPLEMENTED(0xc4),
-	NOT_IMPLEMENTED(0xc5),
-	NOT_IMPLEMENTED(0xc6),
-	NOT_IMPLEMENTED(0xc7),
-	NOT_IMPLEMENTED(0xc8),
-	NOT_IMPLEMENTED(0xc9),
-	NOT_IMPLEMENTED(0xca),
-	NOT_IMPLEMENTED(0xcb),
-	NOT_IMPLEMENTED(0xcc),
-	NOT_IMPLEMENTED(0xcd),
-	NOT_IMPLEMENTED(0xce),
-	NOT_IMPLEMENTED(0xcf),
-	NOT_IMPLEMENTED(0xd0),
-	INSTR(0xd1, "ACALL", 2, 2, acall_handler),
-	NOT_IMPLEMENTED(0xd2),
-	NOT_IMPLEMENTED(0xd3),
-	NOT_IMPLEMENTED(0xd4),
-	INSTR(0xd5, "DJNZ", 3, 2, djnz_iram_handler),
-	NOT_IMPLEMENTED(0xd6),
-	NOT_IMPLEMENTED(0xd7),
-	INSTR(0xd8, "DJNZ", 2, 2, djnz_r_handler),
-	INSTR(0xd9, "DJNZ", 2, 2, djnz_r_handler),
-	INSTR(0xda, "DJNZ", 2, 2, djnz_r_handler),
-	INSTR(0xdb, "DJNZ", 2, 2, djnz_r_handler),
-	INSTR(0xdc, "DJNZ", 2, 2, djnz_r_handler),
-	INSTR(0xdd, "DJNZ", 2, 2, djnz_r_handler),
-	INSTR(0xde, "DJNZ", 2, 2, djnz_r_handler),
-	INSTR(0xdf, "DJNZ", 2, 2, djnz_r_handler),
-	NOT_IMPLEMENTED(0xe0),
-	INSTR(0xe1, "AJMP", 2, 2, ajmp_handler),
-	NOT_IMPLEMENTED(0xe2),
-	NOT_IMPLEMENTED(0xe3),
-	NOT_IMPLEMENTED(0xe4),
-	NOT_IMPLEMENTED(0xe5),
-	NOT_IMPLEMENTED(0xe6),
-	NOT_IMPLEMENTED(0xe7),
-	NOT_IMPLEMENTED(0xe8),
-	NOT_IMPLEMENTED(0xe9),
-	NOT_IMPLEMENTED(0xea),
-	NOT_IMPLEMENTED(0xeb),
-	NOT_IMPLEMENTED(0xec),
-	NOT_IMPLEMENTED(0xed),
-	NOT_IMPLEMENTED(0xee),
-	NOT_IMPLEMENTED(0xef),
-	NOT_IMPLEMENTED(0xf0),
-	INSTR(0xf1, "ACALL", 2, 2, acall_handler),
-	NOT_IMPLEMENTED(0xf2),
-	NOT_IMPLEMENTED(0xf3),
-	NOT_IMPLEMENTED(0xf4),
-	NOT_IMPLEMENTED(0xf5),
-	NOT_IMPLEMENTED(0xf6),
-	NOT_IMPLEMENTED(0xf7),
-	NOT_IMPLEMENTED(0xf8),
-	NOT_IMPLEMENTED(0xf9),
-	NOT_IMPLEMENTED(0xfa),
-	NOT_IMPLEMENTED(0xfb),
-	NOT_IMPLEMENTED(0xfc),
-	NOT_IMPLEMENTED(0xfd),
-	NOT_IMPLEMENTED(0xfe),
-	NOT_IMPLEMENTED(0xff),
+#include "instr_table.h"
 };
+
+#undef INSTR
+#undef NOT_IMPLEMENTED
+
+#define ALL_8 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+#define ALL_64 ALL_8, ALL_8, ALL_8, ALL_8, ALL_8, ALL_8, ALL_8, ALL_8
+#define ALL_512 ALL_64, ALL_64, ALL_64, ALL_64, ALL_64, ALL_64, ALL_64, ALL_64
+#define ALL_4096 ALL_512, ALL_512, ALL_512, ALL_512, \
+	ALL_512, ALL_512, ALL_512, ALL_512
+const uint8_t _emu51_watch_all[65536 / 8] = { ALL_4096, ALL_4096 };
+#undef ALL_8
+#undef ALL_64
+#undef ALL_512
+#undef ALL_4096
+
+void _emu51_sync_psw(emu51 *m)
+{
+	sync_psw(m);
+}
+
+void _emu51_map_memory(emu51 *m)
+{
+	map_memory(m);
+}
+
+long _emu51_fast_forward(emu51 *m, long budget)
+{
+	const uint8_t *code = &m->pmem[m->pc];
+	const emu51_instr *instr = _emu51_decode_instr(code[0]);
+	uint8_t bank = PSW & (PSW_RS1 | PSW_RS0); /* address of R0 */
+	uint8_t *counter;
+	long iterations, limit, skipped;
+
+	if (m->pc + instr->bytes > m->pmem_len)
+		return 0;
+	if (m->breakpoints && is_breakpoint(m->breakpoints, m->pc))
+		return 0;
+
+	/* the number of iterations that start before the budget runs out */
+	limit = (budget + instr->cycles - 1) / instr->cycles;
+
+	if (code[0] == 0x80 && code[1] == 0xfe) { /* SJMP $ */
+		/* the jump never ends: spin until the budget runs out */
+		m->cycles += limit * instr->cycles;
+		return limit * instr->cycles;
+	} else if ((code[0] & 0xf8) == 0xd8 && code[1] == 0xfe
+			&& !iram_reported(m, bank + (code[0] & 0x07))) {
+		/* DJNZ Rn, $ (without a report for each iteration) */
+		counter = &REG_R(code[0] & 0x07);
+	} else if (code[0] == 0xd5 && code[2] == 0xfd && code[1] < 0x80
+			&& !iram_reported(m, code[1])) {
+		/* DJNZ iram addr, $ (likewise) */
+		counter = &m->iram_lower[code[1]];
+	} else {
+		return 0;
+	}
+
+	/* the counter is decremented before testing, so 0 means 256 iterations */
+	iterations = *counter ? *counter : 256;
+	if (iterations > limit) {
+		*counter -= limit;
+		skipped = limit * instr->cycles;
+	} else {
+		*counter = 0;
+		m->pc += instr->bytes;
+		skipped = iterations * instr->cycles;
+	}
+	m->cycles += skipped;
+	return skipped;
+}
+
+#ifdef EMU51_THREADED_DISPATCH
+
+#define THREADED_CORE _emu51_run_threaded
+#define TRUSTED 0
+#include "run_threaded.h"
+#undef THREADED_CORE
+#undef TRUSTED
+
+#define THREADED_CORE _emu51_run_threaded_trusted
+#define TRUSTED 1
+#include "run_threaded.h"
+#undef THREADED_CORE
+#undef TRUSTED
+
+#endif /* EMU51_THREADED_DISPATCH */
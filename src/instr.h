@@ -5,18 +5,25 @@
 
 #include <stdint.h>
 
+/* force inlining, e.g. to generate variants of a function for constant
+ * arguments */
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
 /* forward declarations */
 typedef struct emu51 emu51;
 typedef struct emu51_instr emu51_instr;
+typedef struct emu51_decoded emu51_decoded;
 
 /* instruction handler
  *
- * instr: the emu51_instr struct containing information about the instruction
- * code: the actual bytes of the instruction,
- *       its size must be at least instr->bytes
+ * d: the decoded instruction, see _emu51_decode()
  * m: the emulator structure
  */
-typedef int (*instr_handler)(const emu51_instr *instr, const uint8_t *code, emu51* m);
+typedef int (*instr_handler)(const emu51_decoded *d, emu51* m);
 
 typedef struct emu51_instr
 {
@@ -29,6 +36,36 @@ typedef struct emu51_instr
 	instr_handler handler; /* callback function to process the instruction */
 } emu51_instr;
 
+/* An instruction decoded at a known address.
+ *
+ * The operand fields are extracted once by _emu51_decode() so that handlers
+ * don't have to pick them out of the opcode bits on every execution. Fields
+ * that don't apply to the instruction hold meaningless values.
+ */
+typedef struct emu51_decoded
+{
+	instr_handler handler; /* NULL if the entry is not decoded yet */
+	uint8_t bytes;         /* same as emu51_instr::bytes */
+	uint8_t cycles;        /* same as emu51_instr::cycles */
+	uint8_t code[3];       /* raw instruction bytes, zero-padded */
+	uint8_t reg;           /* register index: n of Rn, or i of @Ri */
+	int8_t reladdr;        /* signed relative offset (the last byte) */
+	uint16_t target;       /* absolute target of AJMP/ACALL/LJMP/LCALL */
+} emu51_decoded;
+
+/* Predecoded instruction cache, see emu51_set_decode_cache().
+ *
+ * The entries are indexed by program memory address and filled lazily the
+ * first time the address is executed.
+ */
+struct emu51_decode_cache
+{
+	const uint8_t *pmem; /* program memory the entries were decoded from */
+	long pmem_len;       /* size of that program memory */
+	long capacity;       /* number of entries */
+	emu51_decoded entries[];
+};
+
 /* decode the opcode into instruction info */
 static inline const emu51_instr* _emu51_decode_instr(uint8_t opcode)
 {
@@ -36,4 +73,128 @@ static inline const emu51_instr* _emu51_decode_instr(uint8_t opcode)
 	return &_emu51_instr_table[opcode];
 }
 
+/* Decode the instruction in code into d.
+ *
+ * code: the instruction bytes; only the first instruction length bytes are
+ *       read
+ * next_pc: address of the byte following the instruction, which is the value
+ *          of pc when the handler runs
+ */
+static inline void _emu51_decode(emu51_decoded *d, const uint8_t *code,
+		uint16_t next_pc)
+{
+	const emu51_instr *instr = _emu51_decode_instr(code[0]);
+	uint8_t opcode = code[0];
+
+	d->handler = instr->handler;
+	d->bytes = instr->bytes;
+	d->cycles = instr->cycles;
+	d->code[0] = opcode;
+	d->code[1] = instr->bytes > 1 ? code[1] : 0;
+	d->code[2] = instr->bytes > 2 ? code[2] : 0;
+
+	/* Rn is encoded in the lowest 3 bits (opcode x8~xf), and @Ri in the lowest
+	 * bit (opcode x6~x7) */
+	d->reg = (opcode & 0x08) ? (opcode & 0x07) : (opcode & 0x01);
+
+	/* the relative offset is always the last byte of the instruction */
+	d->reladdr = instr->bytes > 1 ? (int8_t)code[instr->bytes - 1] : 0;
+
+	if ((opcode & 0x0f) == 0x01) /* AJMP/ACALL: page in the top 3 bits */
+		d->target = (next_pc & 0xf800) | ((opcode >> 5) << 8) | d->code[1];
+	else /* LJMP/LCALL: 16-bit address */
+		d->target = (d->code[1] << 8) | d->code[2];
+}
+
+/* Kinds of control transfer instructions, see _emu51_branch_kind(). */
+enum emu51_branch_kind
+{
+	BRANCH_NONE = 0,     /* not a control transfer instruction */
+	BRANCH_RELATIVE = 1, /* (conditional) jump to pc + reladdr */
+	BRANCH_ABSOLUTE = 2, /* jump or call to emu51_decoded::target */
+	BRANCH_INDIRECT = 3, /* target computed at run time (JMP @A+DPTR, RET) */
+};
+
+/* Classify the instruction with the given opcode by how it changes pc. */
+static inline int _emu51_branch_kind(uint8_t opcode)
+{
+	if ((opcode & 0x0f) == 0x01) /* AJMP, ACALL */
+		return BRANCH_ABSOLUTE;
+
+	switch (opcode) {
+		case 0x02: /* LJMP */
+		case 0x12: /* LCALL */
+			return BRANCH_ABSOLUTE;
+		case 0x10: /* JBC */
+		case 0x20: /* JB */
+		case 0x30: /* JNB */
+		case 0x40: /* JC */
+		case 0x50: /* JNC */
+		case 0x60: /* JZ */
+		case 0x70: /* JNZ */
+		case 0x80: /* SJMP */
+		case 0xd5: /* DJNZ iram addr */
+			return BRANCH_RELATIVE;
+		case 0x22: /* RET */
+		case 0x32: /* RETI */
+		case 0x73: /* JMP @A+DPTR */
+			return BRANCH_INDIRECT;
+	}
+
+	if (opcode >= 0xb4 && opcode <= 0xbf) /* CJNE */
+		return BRANCH_RELATIVE;
+	if (opcode >= 0xd8) /* DJNZ Rn (0xd8~0xdf) */
+		return opcode <= 0xdf ? BRANCH_RELATIVE : BRANCH_NONE;
+
+	return BRANCH_NONE;
+}
+
+/* Compute the pending PSW flags (see emu51::lazy_psw), for code outside the
+ * library core that reads PSW after running a handler directly. */
+void _emu51_sync_psw(emu51 *m);
+
+/* Build the address space tables (see emu51::map), for code outside the
+ * library core that runs a handler directly. */
+void _emu51_map_memory(emu51 *m);
+
+/* Check whether the opcode may start a loop that only jumps to itself, see
+ * _emu51_fast_forward(). */
+static inline int _emu51_is_spin_opcode(uint8_t opcode)
+{
+	return opcode == 0x80 || opcode == 0xd5 || (opcode & 0xf8) == 0xd8;
+}
+
+/* Skip the iterations of a loop that only jumps to itself: "DJNZ Rn, $",
+ * "DJNZ direct, $" (iram only) and "SJMP $" at pc.
+ *
+ * The loop counter, pc and emu51::cycles are left as if the iterations were
+ * executed one by one, up to the iteration that runs out of the budget (like
+ * emu51_run(), the last iteration may overrun it). Nothing is skipped if an
+ * iteration could be observed: if there is a breakpoint at pc, or if the
+ * instruction reports a write to a watched address (see iram_reported()).
+ *
+ * budget: the cycles left, must be positive
+ *
+ * Returns the number of cycles skipped, 0 if pc is not at such a loop.
+ */
+long _emu51_fast_forward(emu51 *m, long budget);
+
+/* Call an interrupt vector like LCALL, reporting the stack writes.
+ *
+ * Returns 0 on success or EMU51_IRAM_OUT_OF_RANGE on stack overflow.
+ */
+int _emu51_interrupt_call(emu51 *m, uint16_t vector);
+
+/* Threaded-code interpreter core, only available if the library is built with
+ * EMU51_THREADED_DISPATCH. The arguments and the return value are the same as
+ * emu51_run(), except that the decode cache must already be validated.
+ */
+long _emu51_run_threaded(emu51 *m, struct emu51_decode_cache *cache,
+		long max_cycles, int *reason);
+
+/* Same as _emu51_run_threaded() in trusted mode, see _emu51_enter_trusted().
+ */
+long _emu51_run_threaded_trusted(emu51 *m, struct emu51_decode_cache *cache,
+		long max_cycles, int *reason);
+
 #endif /* _INSTR_H_ */
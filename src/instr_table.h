@@ -0,0 +1,267 @@
+/* The 8051/8052 instruction table.
+ *
+ * This file is included several times with different definitions of the
+ * following macros to generate code from the table:
+ *
+ *   INSTR(opcode, mnemonic, bytes, cycles, handler)
+ *   NOT_IMPLEMENTED(opcode)
+ *
+ * Keep the entries ordered by opcode. There is no include guard on purpose.
+ */
+
+INSTR(0x00, "NOP",  1, 1, nop_handler)
+INSTR(0x01, "AJMP", 2, 2, ajmp_handler)
+INSTR(0x02, "LJMP", 3, 2, ljmp_handler)
+NOT_IMPLEMENTED(0x03)
+NOT_IMPLEMENTED(0x04)
+NOT_IMPLEMENTED(0x05)
+NOT_IMPLEMENTED(0x06)
+NOT_IMPLEMENTED(0x07)
+NOT_IMPLEMENTED(0x08)
+NOT_IMPLEMENTED(0x09)
+NOT_IMPLEMENTED(0x0a)
+NOT_IMPLEMENTED(0x0b)
+NOT_IMPLEMENTED(0x0c)
+NOT_IMPLEMENTED(0x0d)
+NOT_IMPLEMENTED(0x0e)
+NOT_IMPLEMENTED(0x0f)
+INSTR(0x10, "JBC", 3, 2, jump_if_bit_handler)
+INSTR(0x11, "ACALL", 2, 2, acall_handler)
+INSTR(0x12, "LCALL", 3, 2, lcall_handler)
+NOT_IMPLEMENTED(0x13)
+NOT_IMPLEMENTED(0x14)
+NOT_IMPLEMENTED(0x15)
+NOT_IMPLEMENTED(0x16)
+NOT_IMPLEMENTED(0x17)
+NOT_IMPLEMENTED(0x18)
+NOT_IMPLEMENTED(0x19)
+NOT_IMPLEMENTED(0x1a)
+NOT_IMPLEMENTED(0x1b)
+NOT_IMPLEMENTED(0x1c)
+NOT_IMPLEMENTED(0x1d)
+NOT_IMPLEMENTED(0x1e)
+NOT_IMPLEMENTED(0x1f)
+INSTR(0x20, "JB", 3, 2, jump_if_bit_handler)
+INSTR(0x21, "AJMP", 2, 2, ajmp_handler)
+INSTR(0x22, "RET", 1, 2, ret_handler)
+NOT_IMPLEMENTED(0x23)
+INSTR(0x24, "ADD", 2, 1, add_handler)
+INSTR(0x25, "ADD", 2, 1, add_handler)
+INSTR(0x26, "ADD", 1, 1, add_handler)
+INSTR(0x27, "ADD", 1, 1, add_handler)
+INSTR(0x28, "ADD", 1, 1, add_handler)
+INSTR(0x29, "ADD", 1, 1, add_handler)
+INSTR(0x2a, "ADD", 1, 1, add_handler)
+INSTR(0x2b, "ADD", 1, 1, add_handler)
+INSTR(0x2c, "ADD", 1, 1, add_handler)
+INSTR(0x2d, "ADD", 1, 1, add_handler)
+INSTR(0x2e, "ADD", 1, 1, add_handler)
+INSTR(0x2f, "ADD", 1, 1, add_handler)
+INSTR(0x30, "JNB", 3, 2, jump_if_bit_handler)
+INSTR(0x31, "ACALL", 2, 2, acall_handler)
+INSTR(0x32, "RETI", 1, 2, ret_handler)
+NOT_IMPLEMENTED(0x33)
+INSTR(0x34, "ADDC", 2, 1, add_handler)
+INSTR(0x35, "ADDC", 2, 1, add_handler)
+INSTR(0x36, "ADDC", 1, 1, add_handler)
+INSTR(0x37, "ADDC", 1, 1, add_handler)
+INSTR(0x38, "ADDC", 1, 1, add_handler)
+INSTR(0x39, "ADDC", 1, 1, add_handler)
+INSTR(0x3a, "ADDC", 1, 1, add_handler)
+INSTR(0x3b, "ADDC", 1, 1, add_handler)
+INSTR(0x3c, "ADDC", 1, 1, add_handler)
+INSTR(0x3d, "ADDC", 1, 1, add_handler)
+INSTR(0x3e, "ADDC", 1, 1, add_handler)
+INSTR(0x3f, "ADDC", 1, 1, add_handler)
+INSTR(0x40, "JC", 2, 2, jc_handler)
+INSTR(0x41, "AJMP", 2, 2, ajmp_handler)
+NOT_IMPLEMENTED(0x42)
+NOT_IMPLEMENTED(0x43)
+NOT_IMPLEMENTED(0x44)
+NOT_IMPLEMENTED(0x45)
+NOT_IMPLEMENTED(0x46)
+NOT_IMPLEMENTED(0x47)
+NOT_IMPLEMENTED(0x48)
+NOT_IMPLEMENTED(0x49)
+NOT_IMPLEMENTED(0x4a)
+NOT_IMPLEMENTED(0x4b)
+NOT_IMPLEMENTED(0x4c)
+NOT_IMPLEMENTED(0x4d)
+NOT_IMPLEMENTED(0x4e)
+NOT_IMPLEMENTED(0x4f)
+INSTR(0x50, "JNC", 2, 2, jnc_handler)
+INSTR(0x51, "ACALL", 2, 2, acall_handler)
+NOT_IMPLEMENTED(0x52)
+NOT_IMPLEMENTED(0x53)
+NOT_IMPLEMENTED(0x54)
+NOT_IMPLEMENTED(0x55)
+NOT_IMPLEMENTED(0x56)
+NOT_IMPLEMENTED(0x57)
+NOT_IMPLEMENTED(0x58)
+NOT_IMPLEMENTED(0x59)
+NOT_IMPLEMENTED(0x5a)
+NOT_IMPLEMENTED(0x5b)
+NOT_IMPLEMENTED(0x5c)
+NOT_IMPLEMENTED(0x5d)
+NOT_IMPLEMENTED(0x5e)
+NOT_IMPLEMENTED(0x5f)
+INSTR(0x60, "JZ", 2, 2, jz_handler)
+INSTR(0x61, "AJMP", 2, 2, ajmp_handler)
+NOT_IMPLEMENTED(0x62)
+NOT_IMPLEMENTED(0x63)
+NOT_IMPLEMENTED(0x64)
+NOT_IMPLEMENTED(0x65)
+NOT_IMPLEMENTED(0x66)
+NOT_IMPLEMENTED(0x67)
+NOT_IMPLEMENTED(0x68)
+NOT_IMPLEMENTED(0x69)
+NOT_IMPLEMENTED(0x6a)
+NOT_IMPLEMENTED(0x6b)
+NOT_IMPLEMENTED(0x6c)
+NOT_IMPLEMENTED(0x6d)
+NOT_IMPLEMENTED(0x6e)
+NOT_IMPLEMENTED(0x6f)
+INSTR(0x70, "JNZ", 2, 2, jnz_handler)
+INSTR(0x71, "ACALL", 2, 2, acall_handler)
+NOT_IMPLEMENTED(0x72)
+INSTR(0x73, "JMP", 1, 2, jmp_handler)
+NOT_IMPLEMENTED(0x74)
+NOT_IMPLEMENTED(0x75)
+NOT_IMPLEMENTED(0x76)
+NOT_IMPLEMENTED(0x77)
+NOT_IMPLEMENTED(0x78)
+NOT_IMPLEMENTED(0x79)
+NOT_IMPLEMENTED(0x7a)
+NOT_IMPLEMENTED(0x7b)
+NOT_IMPLEMENTED(0x7c)
+NOT_IMPLEMENTED(0x7d)
+NOT_IMPLEMENTED(0x7e)
+NOT_IMPLEMENTED(0x7f)
+INSTR(0x80, "SJMP", 2, 2, sjmp_handler)
+INSTR(0x81, "AJMP", 2, 2, ajmp_handler)
+NOT_IMPLEMENTED(0x82)
+INSTR(0x83, "MOVC", 1, 1, movc_pc_handler)
+NOT_IMPLEMENTED(0x84)
+NOT_IMPLEMENTED(0x85)
+NOT_IMPLEMENTED(0x86)
+NOT_IMPLEMENTED(0x87)
+NOT_IMPLEMENTED(0x88)
+NOT_IMPLEMENTED(0x89)
+NOT_IMPLEMENTED(0x8a)
+NOT_IMPLEMENTED(0x8b)
+NOT_IMPLEMENTED(0x8c)
+NOT_IMPLEMENTED(0x8d)
+NOT_IMPLEMENTED(0x8e)
+NOT_IMPLEMENTED(0x8f)
+NOT_IMPLEMENTED(0x90)
+INSTR(0x91, "ACALL", 2, 2, acall_handler)
+NOT_IMPLEMENTED(0x92)
+INSTR(0x93, "MOVC", 1, 2, movc_dptr_handler)
+NOT_IMPLEMENTED(0x94)
+NOT_IMPLEMENTED(0x95)
+NOT_IMPLEMENTED(0x96)
+NOT_IMPLEMENTED(0x97)
+NOT_IMPLEMENTED(0x98)
+NOT_IMPLEMENTED(0x99)
+NOT_IMPLEMENTED(0x9a)
+NOT_IMPLEMENTED(0x9b)
+NOT_IMPLEMENTED(0x9c)
+NOT_IMPLEMENTED(0x9d)
+NOT_IMPLEMENTED(0x9e)
+NOT_IMPLEMENTED(0x9f)
+NOT_IMPLEMENTED(0xa0)
+INSTR(0xa1, "AJMP", 2, 2, ajmp_handler)
+NOT_IMPLEMENTED(0xa2)
+NOT_IMPLEMENTED(0xa3)
+NOT_IMPLEMENTED(0xa4)
+NOT_IMPLEMENTED(0xa5)
+NOT_IMPLEMENTED(0xa6)
+NOT_IMPLEMENTED(0xa7)
+NOT_IMPLEMENTED(0xa8)
+NOT_IMPLEMENTED(0xa9)
+NOT_IMPLEMENTED(0xaa)
+NOT_IMPLEMENTED(0xab)
+NOT_IMPLEMENTED(0xac)
+NOT_IMPLEMENTED(0xad)
+NOT_IMPLEMENTED(0xae)
+NOT_IMPLEMENTED(0xaf)
+NOT_IMPLEMENTED(0xb0)
+INSTR(0xb1, "ACALL", 2, 2, acall_handler)
+NOT_IMPLEMENTED(0xb2)
+NOT_IMPLEMENTED(0xb3)
+INSTR(0xb4, "CJNE", 3, 2, cjne_a_data_handler)
+INSTR(0xb5, "CJNE", 3, 2, cjne_a_addr_handler)
+INSTR(0xb6, "CJNE", 3, 2, cjne_deref_r_data_handler)
+INSTR(0xb7, "CJNE", 3, 2, cjne_deref_r_data_handler)
+INSTR(0xb8, "CJNE", 3, 2, cjne_r_data_handler)
+INSTR(0xb9, "CJNE", 3, 2, cjne_r_data_handler)
+INSTR(0xba, "CJNE", 3, 2, cjne_r_data_handler)
+INSTR(0xbb, "CJNE", 3, 2, cjne_r_data_handler)
+INSTR(0xbc, "CJNE", 3, 2, cjne_r_data_handler)
+INSTR(0xbd, "CJNE", 3, 2, cjne_r_data_handler)
+INSTR(0xbe, "CJNE", 3, 2, cjne_r_data_handler)
+INSTR(0xbf, "CJNE", 3, 2, cjne_r_data_handler)
+NOT_IMPLEMENTED(0xc0)
+INSTR(0xc1, "AJMP", 2, 2, ajmp_handler)
+NOT_IMPLEMENTED(0xc2)
+NOT_IMPLEMENTED(0xc3)
+NOT_IMPLEMENTED(0xc4)
+NOT_IMPLEMENTED(0xc5)
+NOT_IMPLEMENTED(0xc6)
+NOT_IMPLEMENTED(0xc7)
+NOT_IMPLEMENTED(0xc8)
+NOT_IMPLEMENTED(0xc9)
+NOT_IMPLEMENTED(0xca)
+NOT_IMPLEMENTED(0xcb)
+NOT_IMPLEMENTED(0xcc)
+NOT_IMPLEMENTED(0xcd)
+NOT_IMPLEMENTED(0xce)
+NOT_IMPLEMENTED(0xcf)
+NOT_IMPLEMENTED(0xd0)
+INSTR(0xd1, "ACALL", 2, 2, acall_handler)
+NOT_IMPLEMENTED(0xd2)
+NOT_IMPLEMENTED(0xd3)
+NOT_IMPLEMENTED(0xd4)
+INSTR(0xd5, "DJNZ", 3, 2, djnz_iram_handler)
+NOT_IMPLEMENTED(0xd6)
+NOT_IMPLEMENTED(0xd7)
+INSTR(0xd8, "DJNZ", 2, 2, djnz_r_handler)
+INSTR(0xd9, "DJNZ", 2, 2, djnz_r_handler)
+INSTR(0xda, "DJNZ", 2, 2, djnz_r_handler)
+INSTR(0xdb, "DJNZ", 2, 2, djnz_r_handler)
+INSTR(0xdc, "DJNZ", 2, 2, djnz_r_handler)
+INSTR(0xdd, "DJNZ", 2, 2, djnz_r_handler)
+INSTR(0xde, "DJNZ", 2, 2, djnz_r_handler)
+INSTR(0xdf, "DJNZ", 2, 2, djnz_r_handler)
+NOT_IMPLEMENTED(0xe0)
+INSTR(0xe1, "AJMP", 2, 2, ajmp_handler)
+NOT_IMPLEMENTED(0xe2)
+NOT_IMPLEMENTED(0xe3)
+NOT_IMPLEMENTED(0xe4)
+NOT_IMPLEMENTED(0xe5)
+NOT_IMPLEMENTED(0xe6)
+NOT_IMPLEMENTED(0xe7)
+NOT_IMPLEMENTED(0xe8)
+NOT_IMPLEMENTED(0xe9)
+NOT_IMPLEMENTED(0xea)
+NOT_IMPLEMENTED(0xeb)
+NOT_IMPLEMENTED(0xec)
+NOT_IMPLEMENTED(0xed)
+NOT_IMPLEMENTED(0xee)
+NOT_IMPLEMENTED(0xef)
+NOT_IMPLEMENTED(0xf0)
+INSTR(0xf1, "ACALL", 2, 2, acall_handler)
+NOT_IMPLEMENTED(0xf2)
+NOT_IMPLEMENTED(0xf3)
+NOT_IMPLEMENTED(0xf4)
+NOT_IMPLEMENTED(0xf5)
+NOT_IMPLEMENTED(0xf6)
+NOT_IMPLEMENTED(0xf7)
+NOT_IMPLEMENTED(0xf8)
+NOT_IMPLEMENTED(0xf9)
+NOT_IMPLEMENTED(0xfa)
+NOT_IMPLEMENTED(0xfb)
+NOT_IMPLEMENTED(0xfc)
+NOT_IMPLEMENTED(0xfd)
+NOT_IMPLEMENTED(0xfe)
+NOT_IMPLEMENTED(0xff)
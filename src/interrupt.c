@@ -0,0 +1,241 @@
+#include <emu51.h>
+
+#include "instr.h"
+#include "event.h"
+#include "history.h"
+#include "interrupt.h"
+#include "record.h"
+#include "trust.h"
+
+/* Get the raised interrupt sources as a bitmask of enum irq_source bits. */
+static uint8_t raised_sources(const emu51 *m)
+{
+	uint8_t tcon = m->sfr[SFR_TCON];
+	uint8_t raised = 0;
+
+	if (tcon & TCON_IE0)
+		raised |= 1 << IRQ_IE0;
+	if (tcon & TCON_TF0)
+		raised |= 1 << IRQ_TF0;
+	if (tcon & TCON_IE1)
+		raised |= 1 << IRQ_IE1;
+	if (tcon & TCON_TF1)
+		raised |= 1 << IRQ_TF1;
+	if (m->sfr[SFR_SCON] & (SCON_RI | SCON_TI))
+		raised |= 1 << IRQ_SERIAL;
+	if (m->feature.timer2 && (m->sfr[SFR_T2CON] & (T2CON_TF2 | T2CON_EXF2)))
+		raised |= 1 << IRQ_TIMER2;
+	return raised;
+}
+
+/* Get the lowest source in the bitmask. */
+static int first_source(uint8_t sources)
+{
+	int i;
+
+	for (i = 0; !(sources & (1 << i)); i++)
+		;
+	return i;
+}
+
+/* Choose the pending interrupt to take: a high priority one unless a high
+ * priority interrupt is in service, otherwise a low priority one if no
+ * interrupt is in service. Returns -1 if none can be taken. */
+static int next_source(const emu51 *m)
+{
+	uint8_t pending = m->irq.pending;
+	uint8_t high = pending & m->sfr[SFR_IP];
+
+	if (high && !(m->irq.in_service & IRQ_HIGH))
+		return first_source(high);
+	if (pending && !m->irq.in_service)
+		return first_source(pending);
+	return -1;
+}
+
+/* Recompute emu51::irq.pending from the flags and IE. */
+static void update_pending(emu51 *m)
+{
+	uint8_t ie = m->sfr[SFR_IE];
+
+	m->irq.pending = (ie & IE_EA) ? raised_sources(m) & ie & ~IE_EA : 0;
+}
+
+void _emu51_irq_update(emu51 *m)
+{
+	uint64_t due = m->cycles > m->irq.earliest ? m->cycles : m->irq.earliest;
+
+	update_pending(m);
+	if (next_source(m) >= 0 && due < m->next_event)
+		m->next_event = due;
+}
+
+/* Compute emu51::next_event from the SFRs. The events must be in sync. */
+static void schedule(emu51 *m)
+{
+	uint64_t serial = _emu51_serial_next(m);
+	uint64_t input = _emu51_replay_next(m);
+	uint64_t checkpoint = _emu51_history_next(m);
+
+	m->next_event = _emu51_timer_next(m);
+	if (serial < m->next_event)
+		m->next_event = serial;
+	if (input < m->next_event)
+		m->next_event = input;
+	if (checkpoint < m->next_event)
+		m->next_event = checkpoint;
+	_emu51_irq_update(m);
+}
+
+/* Act upon the changes of the INT0 and INT1 pins (P3.2 and P3.3) since they
+ * were last seen: a falling edge sets IEx if the interrupt is edge triggered
+ * (ITx set), otherwise IEx follows the inverted level. The levels are an
+ * input, see _emu51_pins_input(), which is reflected in P3.
+ *
+ * entry: 1 if called as emu51_step() or emu51_run() starts */
+static void check_int_pins(emu51 *m, int entry)
+{
+	uint8_t pins = _emu51_pins_input(m,
+		m->sfr[SFR_P3] & (PIN_INT0 | PIN_INT1), entry);
+	uint8_t changed = pins ^ m->irq.pins;
+	uint8_t *tcon = &m->sfr[SFR_TCON];
+	int i;
+
+	m->sfr[SFR_P3] = (m->sfr[SFR_P3] & ~(PIN_INT0 | PIN_INT1)) | pins;
+	m->irq.pins = pins;
+	for (i = 0; i < 2; i++) {
+		uint8_t pin = PIN_INT0 << i;
+		uint8_t flag = i ? TCON_IE1 : TCON_IE0;
+		uint8_t edge = i ? TCON_IT1 : TCON_IT0;
+
+		if (!(changed & pin))
+			continue;
+		if (pins & pin) {
+			if (!(*tcon & edge))
+				*tcon &= ~flag;
+		} else {
+			*tcon |= flag;
+		}
+	}
+}
+
+void _emu51_sync_events(emu51 *m)
+{
+	_emu51_timer_sync(m);
+	_emu51_serial_sync(m);
+	if (m->event_log)
+		_emu51_log_peripherals(m);
+}
+
+/* Act upon the changes of the SFRs since the events were last scheduled.
+ *
+ * entry: 1 if called as emu51_step() or emu51_run() starts */
+static void sfr_changed(emu51 *m, int entry)
+{
+	_emu51_timer_check_t2ex(m);
+	check_int_pins(m, entry);
+	_emu51_serial_check_receive(m);
+	schedule(m);
+	if (m->event_log)
+		_emu51_log_peripherals(m);
+}
+
+void _emu51_event_sfr_written(emu51 *m, uint8_t addr)
+{
+	/* the write itself is reported by the instruction */
+	if (m->event_log)
+		m->event_log->sfr[addr & 0x7f] = m->sfr[addr & 0x7f];
+	if (addr == SFR_BASE_ADDR + SFR_SBUF)
+		_emu51_serial_transmit(m);
+	sfr_changed(m, 0);
+}
+
+/* Take the interrupt of the source: call its vector and raise the priority
+ * level in service. The flags of timers 0 and 1 and of edge triggered
+ * external interrupts are cleared by the hardware; the others are left to the
+ * interrupt service routine.
+ *
+ * Returns 0 on success or an error number.
+ */
+static int take_interrupt(emu51 *m, int source)
+{
+	uint16_t vector = 8 * source + 3;
+	uint8_t *tcon = &m->sfr[SFR_TCON];
+	int err;
+
+	/* the vector is not reached by the static scan in trusted mode */
+	err = _emu51_trust_jump(m, vector);
+	if (err)
+		return err;
+	err = _emu51_interrupt_call(m, vector);
+	if (err)
+		return err;
+
+	m->irq.in_service |= (m->sfr[SFR_IP] >> source) & 1 ? IRQ_HIGH : IRQ_LOW;
+	switch (source) {
+		case IRQ_IE0:
+			if (*tcon & TCON_IT0)
+				*tcon &= ~TCON_IE0;
+			break;
+		case IRQ_TF0:
+			*tcon &= ~TCON_TF0;
+			break;
+		case IRQ_IE1:
+			if (*tcon & TCON_IT1)
+				*tcon &= ~TCON_IE1;
+			break;
+		case IRQ_TF1:
+			*tcon &= ~TCON_TF1;
+			break;
+	}
+	return 0;
+}
+
+/* cycles taken by the call to an interrupt vector (a hardware LCALL) */
+#define INTERRUPT_CYCLES 2
+
+int _emu51_handle_event(emu51 *m)
+{
+	int source, cycles = 0;
+
+	_emu51_sync_events(m);
+	if (_emu51_history_next(m) <= m->cycles)
+		_emu51_take_checkpoint(m);
+	if (_emu51_replay_next(m) <= m->cycles) {
+		/* the bytes the host sent when the recorded run stopped here */
+		_emu51_replay_inputs(m);
+		_emu51_serial_check_receive(m);
+	}
+	update_pending(m);
+
+	source = m->cycles >= m->irq.earliest ? next_source(m) : -1;
+	if (source >= 0) {
+		int err = take_interrupt(m, source);
+		if (err)
+			return err;
+		m->cycles += INTERRUPT_CYCLES;
+		cycles = INTERRUPT_CYCLES;
+	}
+
+	schedule(m);
+	if (m->event_log)
+		_emu51_log_peripherals(m);
+	return cycles;
+}
+
+void _emu51_enter_events(emu51 *m)
+{
+	m->timers.synced = m->cycles;
+	sfr_changed(m, 1);
+}
+
+void _emu51_reset_events(emu51 *m)
+{
+	m->irq.earliest = 0;
+	m->irq.in_service = 0;
+	m->irq.pins = m->sfr[SFR_P3] & (PIN_INT0 | PIN_INT1);
+	m->timers.t2ex = m->sfr[SFR_P1] & 0x02;
+	m->uart.tx_done = UINT64_MAX;
+	m->uart.rx_done = UINT64_MAX;
+	m->uart.rx_byte = 0;
+}
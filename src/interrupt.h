@@ -0,0 +1,120 @@
+#ifndef _INTERRUPT_H_
+#define _INTERRUPT_H_
+
+/* NOTE: This header file is internal to emu51. */
+
+#include <emu51.h>
+
+#include "serial.h"
+#include "timer.h"
+
+/* Interrupt controller and scheduled events.
+ *
+ * The run loops don't scan the interrupt sources or tick the timers after
+ * each instruction: they only compare emu51::cycles with emu51::next_event at
+ * each instruction (or block) boundary, and call _emu51_handle_event() when
+ * it is due. The next event is the earliest of the next timer overflow (see
+ * timer.h), the end of the next serial transfer (see serial.h) and, if an
+ * interrupt can be taken, the current cycle.
+ *
+ * The flags of the enabled interrupt sources are folded into the pending word
+ * emu51::irq.pending, which is only recomputed by _emu51_irq_update() when a
+ * source or IE/IP changes: on events, after a write to one of the SFRs
+ * involved (see is_event_sfr()), on RETI, and when emu51_step() or
+ * emu51_run() starts.
+ */
+
+/* Interrupt sources, in the order of their priority within a level. Bit n of
+ * IE and IP enables and raises the priority of source n, and source n jumps
+ * to the vector 8 * n + 3. */
+enum irq_source
+{
+	IRQ_IE0,    /* external interrupt 0 */
+	IRQ_TF0,    /* timer 0 */
+	IRQ_IE1,    /* external interrupt 1 */
+	IRQ_TF1,    /* timer 1 */
+	IRQ_SERIAL, /* serial port: RI or TI */
+	IRQ_TIMER2, /* timer 2 (8052): TF2 or EXF2 */
+	IRQ_COUNT
+};
+
+/* pins of the external interrupts in P3 */
+#define PIN_INT0 0x04
+#define PIN_INT1 0x08
+
+/* priority levels, as the bits of emu51::irq.in_service */
+enum irq_level
+{
+	IRQ_LOW = 0x01,
+	IRQ_HIGH = 0x02,
+};
+
+/* Test if the direct address is one of the SFRs that events depend on: the
+ * timer SFRs, the interrupt SFRs (IE, IP, SCON), SBUF, and the ports P1 (T2EX)
+ * and P3 (INT0, INT1 and the gates of the timers). */
+static inline int is_event_sfr(uint8_t addr)
+{
+	switch (addr) {
+		case SFR_BASE_ADDR + SFR_TCON:
+		case SFR_BASE_ADDR + SFR_TMOD:
+		case SFR_BASE_ADDR + SFR_TL0:
+		case SFR_BASE_ADDR + SFR_TL1:
+		case SFR_BASE_ADDR + SFR_TH0:
+		case SFR_BASE_ADDR + SFR_TH1:
+		case SFR_BASE_ADDR + SFR_T2CON:
+		case SFR_BASE_ADDR + SFR_RCAP2L:
+		case SFR_BASE_ADDR + SFR_RCAP2H:
+		case SFR_BASE_ADDR + SFR_TL2:
+		case SFR_BASE_ADDR + SFR_TH2:
+		case SFR_BASE_ADDR + SFR_IE:
+		case SFR_BASE_ADDR + SFR_IP:
+		case SFR_BASE_ADDR + SFR_SCON:
+		case SFR_BASE_ADDR + SFR_SBUF:
+		case SFR_BASE_ADDR + SFR_P1:
+		case SFR_BASE_ADDR + SFR_P3:
+			return 1;
+	}
+	return 0;
+}
+
+/* Recompute emu51::irq.pending. If an interrupt can be taken, the next event
+ * is made due at the current cycle, or at emu51::irq.earliest if it is later.
+ */
+void _emu51_irq_update(emu51 *m);
+
+/* Bring the SFRs changed by events up to date with emu51::cycles: count the
+ * timers and end the serial transfers that are done. */
+void _emu51_sync_events(emu51 *m);
+
+/* Handle a write to one of the event SFRs at the direct address: a byte
+ * written to SBUF is sent, the edges of the pins are acted upon, and the next
+ * event is scheduled again. The events must be in sync. */
+void _emu51_event_sfr_written(emu51 *m, uint8_t addr);
+
+/* Handle the event that is due: the events are synced, the pending interrupt
+ * with the highest priority is taken if its level is not in service, and the
+ * next event is scheduled.
+ *
+ * Returns the number of cycles taken by the call to the interrupt vector, 0
+ * if no interrupt is taken, or an error number if the call fails.
+ */
+int _emu51_handle_event(emu51 *m);
+
+/* Schedule the events from the SFRs at the current cycle, since the user may
+ * have changed them; called when emu51_step() or emu51_run() starts. */
+void _emu51_enter_events(emu51 *m);
+
+/* Forget the interrupts in service and the serial transfers, and take the
+ * current levels of the pins as their last seen levels; called on reset. */
+void _emu51_reset_events(emu51 *m);
+
+/* Limit the budget of a loop that can't stop in between (see
+ * _emu51_fast_forward()) to the cycles left before the next event. */
+static inline long event_budget(const emu51 *m, long budget)
+{
+	if (m->next_event - m->cycles < (uint64_t)budget)
+		return (long)(m->next_event - m->cycles);
+	return budget;
+}
+
+#endif /* _INTERRUPT_H_ */
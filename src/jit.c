@@ -0,0 +1,109 @@
+#include <emu51.h>
+#include <stdlib.h>
+
+#include "helpers.h"
+#include "jit.h"
+
+#ifdef EMU51_JIT
+
+/* Drop the compiled code and the heat of all blocks in the cache. */
+static void clear_blocks(emu51_block_cache *cache)
+{
+	long i;
+
+	for (i = 0; i < cache->capacity; i++) {
+		cache->blocks[i].native = NULL;
+		cache->blocks[i].heat = 0;
+		cache->blocks[i].jit_flags = 0;
+	}
+}
+
+int emu51_jit_enable(emu51 *m)
+{
+	emu51_jit *jit;
+
+	if (m->jit)
+		return 0;
+
+	jit = malloc(sizeof(emu51_jit));
+	if (!jit)
+		return EMU51_OUT_OF_MEMORY;
+	if (_emu51_jit_init(jit)) {
+		free(jit);
+		return EMU51_OUT_OF_MEMORY;
+	}
+
+	m->jit = jit;
+	return 0;
+}
+
+void emu51_jit_disable(emu51 *m)
+{
+	if (!m->jit)
+		return;
+
+	/* the blocks must not point into the freed code buffer */
+	if (m->block_cache)
+		clear_blocks(m->block_cache);
+
+	_emu51_jit_release(m->jit);
+	free(m->jit);
+	m->jit = NULL;
+}
+
+void _emu51_jit_flush(emu51_jit *jit)
+{
+	jit->used = 0;
+}
+
+int _emu51_jit_execute(emu51 *m, emu51_block_cache *cache,
+		emu51_block *block)
+{
+	if (!block->native) {
+		int result;
+
+		if ((block->jit_flags & JIT_REJECTED)
+				|| ++block->heat < JIT_HOT_THRESHOLD)
+			return 0;
+
+		result = _emu51_jit_compile(m->jit, cache, block);
+		if (result == JIT_NO_SPACE) {
+			/* start over with an empty code buffer */
+			clear_blocks(cache);
+			_emu51_jit_flush(m->jit);
+			result = _emu51_jit_compile(m->jit, cache, block);
+		}
+		if (result != JIT_OK) {
+			block->jit_flags |= JIT_REJECTED;
+			return 0;
+		}
+		cache->stats.compiled++;
+	}
+
+	/* the native code doesn't invoke callbacks or log events */
+	if ((block->jit_flags & JIT_SFR_UPDATE)
+			&& (sfr_reported(m, SFR_PSW) || sfr_reported(m, SFR_ACC)))
+		return 0;
+	if ((block->jit_flags & JIT_IRAM_UPDATE)
+			&& (m->event_log || HAS_CALLBACK(m, iram_update)))
+		return 0;
+
+	cache->stats.native++;
+	sync_psw(m);
+	return block->native(m);
+}
+
+#else /* EMU51_JIT */
+
+int emu51_jit_enable(emu51 *m)
+{
+	(void)m;
+	return EMU51_NOT_SUPPORTED;
+}
+
+void emu51_jit_disable(emu51 *m)
+{
+	(void)m;
+}
+
+#endif /* EMU51_JIT */
@@ -0,0 +1,74 @@
+#ifndef _JIT_H_
+#define _JIT_H_
+
+/* NOTE: This header file is internal to emu51. */
+
+#include <emu51.h>
+#include "block.h"
+
+/* number of executions after which a block is compiled */
+#define JIT_HOT_THRESHOLD 16
+
+/* emu51_block::jit_flags */
+enum jit_flags
+{
+	JIT_REJECTED = 0x01,    /* the block cannot be compiled */
+	JIT_SFR_UPDATE = 0x02,  /* the block reports writes to PSW or ACC */
+	JIT_IRAM_UPDATE = 0x04, /* the block reports writes to the iram */
+};
+
+/* results of _emu51_jit_compile() */
+enum jit_compile_result
+{
+	JIT_OK = 0,
+	JIT_UNSUPPORTED = 1, /* the block has instructions the backend can't emit */
+	JIT_NO_SPACE = 2,    /* the code buffer is full */
+};
+
+/* JIT compiler state, see emu51_jit_enable(). */
+struct emu51_jit
+{
+	uint8_t *code; /* executable code buffer */
+	size_t size;   /* size of the code buffer */
+	size_t used;   /* bytes in use */
+	size_t page_size; /* granularity of the protection of the buffer */
+};
+
+#ifdef EMU51_JIT
+
+/* Run the block in native code if it is compiled, and count its executions
+ * towards compiling it otherwise.
+ *
+ * Returns the number of instructions of the block that were executed. If this
+ * is less than the block length (the block isn't compiled, or it left the
+ * rest to the interpreter), pc points to the first instruction that was not
+ * executed.
+ */
+int _emu51_jit_execute(emu51 *m, emu51_block_cache *cache,
+		emu51_block *block);
+
+/* Forget all compiled code, e.g. because the blocks are being rebuilt. */
+void _emu51_jit_flush(emu51_jit *jit);
+
+/* Backend interface, implemented once per host architecture. */
+
+/* Allocate the code buffer. Returns 0 on success. */
+int _emu51_jit_init(emu51_jit *jit);
+
+/* Free the code buffer. */
+void _emu51_jit_release(emu51_jit *jit);
+
+/* Compile the block and set its native code and JIT_*_UPDATE flags.
+ *
+ * The compiled code has the same effect as running the instructions of the
+ * block with their handlers, except that it never invokes callbacks or logs
+ * events (it is only run when the writes of its flags are not reported). It
+ * expects no pending PSW flags and leaves none. On an error it stops before
+ * the offending instruction so that the interpreter can report the error.
+ */
+int _emu51_jit_compile(emu51_jit *jit, const emu51_block_cache *cache,
+		emu51_block *block);
+
+#endif /* EMU51_JIT */
+
+#endif /* _JIT_H_ */
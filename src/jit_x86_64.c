@@ -0,0 +1,645 @@
+/* x86-64 backend of the JIT compiler (System V ABI, POSIX mmap). */
+
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS */
+
+#include <emu51.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "helpers.h"
+#include "jit.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* size of the code buffer */
+#define CODE_BUFFER_SIZE (1024 * 1024)
+
+/* upper bound of the code emitted for the prologue, or for one instruction
+ * including its exits */
+#define MAX_CODE_PER_INSTR 512
+
+/* host registers */
+enum
+{
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+/* Guest state kept in callee-saved host registers while a block runs. ACC and
+ * PSW are loaded at entry and written back at every exit. The register bank
+ * can't change inside a compiled block (no compiled instruction writes RS0 or
+ * RS1), so its address is computed once. */
+#define REG_M RBX     /* emu51 *m */
+#define REG_BANK RBP  /* m->map.bank */
+#define REG_IRAM R12  /* m->iram_lower */
+#define REG_SFR R13   /* m->sfr */
+#define REG_ACC R14   /* ACC, zero-extended */
+#define REG_PSW R15   /* PSW, zero-extended */
+
+/* condition codes of jcc */
+enum
+{
+	CC_B = 0x2,  /* below (unsigned) */
+	CC_AE = 0x3, /* above or equal (unsigned) */
+	CC_E = 0x4,  /* equal / zero */
+	CC_NE = 0x5, /* not equal / not zero */
+	CC_NP = 0xb, /* parity odd */
+};
+
+/* opcodes of "op r/m32, r32" */
+enum
+{
+	OP_ADD = 0x01,
+	OP_OR = 0x09,
+	OP_AND = 0x21,
+	OP_SUB = 0x29,
+	OP_XOR = 0x31,
+	OP_CMP = 0x39,
+	OP_TEST = 0x85,
+	OP_MOV = 0x89,
+};
+
+/* opcode extensions of "op r/m32, imm32" (0x81) */
+enum
+{
+	EXT_ADD = 0,
+	EXT_OR = 1,
+	EXT_AND = 4,
+	EXT_SUB = 5,
+	EXT_XOR = 6,
+	EXT_CMP = 7,
+};
+
+/* Code emitter */
+
+typedef struct asm_buf
+{
+	uint8_t *p; /* next byte to write */
+} asm_buf;
+
+static void emit8(asm_buf *a, uint8_t byte)
+{
+	*a->p++ = byte;
+}
+
+static void emit32(asm_buf *a, uint32_t value)
+{
+	emit8(a, value & 0xff);
+	emit8(a, (value >> 8) & 0xff);
+	emit8(a, (value >> 16) & 0xff);
+	emit8(a, (value >> 24) & 0xff);
+}
+
+/* REX prefix; omitted if no bit is set unless force is set (needed to address
+ * the low byte of rsi/rdi/rbp/rsp) */
+static void emit_rex(asm_buf *a, int w, int reg, int rm, int force)
+{
+	uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+	if (rex != 0x40 || force)
+		emit8(a, rex);
+}
+
+/* ModRM of a register operand */
+static void emit_modrm_reg(asm_buf *a, int reg, int rm)
+{
+	emit8(a, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* ModRM of a [base + disp32] operand */
+static void emit_modrm_mem(asm_buf *a, int reg, int base, int32_t disp)
+{
+	emit8(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP) /* rsp and r12 need a SIB byte */
+		emit8(a, 0x24);
+	emit32(a, (uint32_t)disp);
+}
+
+/* op dst, src (32-bit, or 64-bit if w is set) */
+static void emit_op_rr(asm_buf *a, int w, uint8_t op, int dst, int src)
+{
+	emit_rex(a, w, src, dst, 0);
+	emit8(a, op);
+	emit_modrm_reg(a, src, dst);
+}
+
+/* op dst, imm32 */
+static void emit_op_ri(asm_buf *a, int ext, int dst, uint32_t imm)
+{
+	emit_rex(a, 0, 0, dst, 0);
+	emit8(a, 0x81);
+	emit_modrm_reg(a, ext, dst);
+	emit32(a, imm);
+}
+
+/* test dst, imm32 */
+static void emit_test_ri(asm_buf *a, int dst, uint32_t imm)
+{
+	emit_rex(a, 0, 0, dst, 0);
+	emit8(a, 0xf7);
+	emit_modrm_reg(a, 0, dst);
+	emit32(a, imm);
+}
+
+/* mov dst, imm32 */
+static void emit_mov_ri(asm_buf *a, int dst, uint32_t imm)
+{
+	emit_rex(a, 0, 0, dst, 0);
+	emit8(a, 0xb8 + (dst & 7));
+	emit32(a, imm);
+}
+
+/* setcc dst (low byte) */
+static void emit_setcc(asm_buf *a, int cc, int dst)
+{
+	emit_rex(a, 0, 0, dst, 1);
+	emit8(a, 0x0f);
+	emit8(a, 0x90 + cc);
+	emit_modrm_reg(a, 0, dst);
+}
+
+/* movzx dst, src (low byte) */
+static void emit_movzx8(asm_buf *a, int dst, int src)
+{
+	emit_rex(a, 0, dst, src, 1);
+	emit8(a, 0x0f);
+	emit8(a, 0xb6);
+	emit_modrm_reg(a, dst, src);
+}
+
+/* shl dst, n */
+static void emit_shl(asm_buf *a, int dst, uint8_t n)
+{
+	emit_rex(a, 0, 0, dst, 0);
+	emit8(a, 0xc1);
+	emit_modrm_reg(a, 4, dst);
+	emit8(a, n);
+}
+
+/* shr dst, n */
+static void emit_shr(asm_buf *a, int dst, uint8_t n)
+{
+	emit_rex(a, 0, 0, dst, 0);
+	emit8(a, 0xc1);
+	emit_modrm_reg(a, 5, dst);
+	emit8(a, n);
+}
+
+/* movzx dst, byte [base + disp] */
+static void emit_load8(asm_buf *a, int dst, int base, int32_t disp)
+{
+	emit_rex(a, 0, dst, base, 0);
+	emit8(a, 0x0f);
+	emit8(a, 0xb6);
+	emit_modrm_mem(a, dst, base, disp);
+}
+
+/* mov byte [base + disp], src */
+static void emit_store8(asm_buf *a, int base, int32_t disp, int src)
+{
+	emit_rex(a, 0, src, base, 1);
+	emit8(a, 0x88);
+	emit_modrm_mem(a, src, base, disp);
+}
+
+/* mov word [base + disp], src */
+static void emit_store16(asm_buf *a, int base, int32_t disp, int src)
+{
+	emit8(a, 0x66);
+	emit_rex(a, 0, src, base, 0);
+	emit8(a, 0x89);
+	emit_modrm_mem(a, src, base, disp);
+}
+
+/* mov dst, qword [base + disp] */
+static void emit_load64(asm_buf *a, int dst, int base, int32_t disp)
+{
+	emit_rex(a, 1, dst, base, 0);
+	emit8(a, 0x8b);
+	emit_modrm_mem(a, dst, base, disp);
+}
+
+static void emit_push(asm_buf *a, int reg)
+{
+	emit_rex(a, 0, 0, reg, 0);
+	emit8(a, 0x50 + (reg & 7));
+}
+
+static void emit_pop(asm_buf *a, int reg)
+{
+	emit_rex(a, 0, 0, reg, 0);
+	emit8(a, 0x58 + (reg & 7));
+}
+
+/* jcc rel32 / jmp rel32 with the target left open; returns the location of
+ * the displacement for patch_jump() */
+static uint8_t *emit_jcc(asm_buf *a, int cc)
+{
+	emit8(a, 0x0f);
+	emit8(a, 0x80 + cc);
+	emit32(a, 0);
+	return a->p - 4;
+}
+
+static uint8_t *emit_jmp(asm_buf *a)
+{
+	emit8(a, 0xe9);
+	emit32(a, 0);
+	return a->p - 4;
+}
+
+/* make the jump whose displacement is at disp land at the current position */
+static void patch_jump(asm_buf *a, uint8_t *disp)
+{
+	uint32_t rel = (uint32_t)(a->p - (disp + 4));
+
+	disp[0] = rel & 0xff;
+	disp[1] = (rel >> 8) & 0xff;
+	disp[2] = (rel >> 16) & 0xff;
+	disp[3] = (rel >> 24) & 0xff;
+}
+
+/* Block code */
+
+static void emit_prologue(asm_buf *a)
+{
+	emit_push(a, RBX);
+	emit_push(a, RBP);
+	emit_push(a, R12);
+	emit_push(a, R13);
+	emit_push(a, R14);
+	emit_push(a, R15);
+
+	emit_op_rr(a, 1, OP_MOV, REG_M, RDI);
+	emit_load64(a, REG_IRAM, REG_M, offsetof(emu51, iram_lower));
+	emit_load64(a, REG_SFR, REG_M, offsetof(emu51, sfr));
+	emit_load8(a, REG_ACC, REG_SFR, SFR_ACC);
+	emit_load8(a, REG_PSW, REG_SFR, SFR_PSW);
+	emit_load64(a, REG_BANK, REG_M, offsetof(emu51, map.bank));
+}
+
+/* Write the guest state back and return count (the number of executed
+ * instructions) with pc set to the given address. */
+static void emit_exit(asm_buf *a, uint16_t pc, int count)
+{
+	emit_store8(a, REG_SFR, SFR_ACC, REG_ACC);
+	emit_store8(a, REG_SFR, SFR_PSW, REG_PSW);
+	emit_mov_ri(a, RAX, pc);
+	emit_store16(a, REG_M, offsetof(emu51, pc), RAX);
+	emit_mov_ri(a, RAX, count);
+
+	emit_pop(a, R15);
+	emit_pop(a, R14);
+	emit_pop(a, R13);
+	emit_pop(a, R12);
+	emit_pop(a, RBP);
+	emit_pop(a, RBX);
+	emit8(a, 0xc3); /* ret */
+}
+
+/* Load the byte at @Ri into ecx, or exit before the instruction at pc (the
+ * index-th of the block) if it is in the upper iram and that is missing. */
+static void emit_load_indirect(asm_buf *a, uint8_t i, uint16_t pc, int index)
+{
+	uint8_t *lower, *present, *done;
+
+	emit_load8(a, RCX, REG_BANK, i);
+	emit_op_ri(a, EXT_CMP, RCX, 0x80);
+	lower = emit_jcc(a, CC_B);
+
+	/* upper iram */
+	emit_load8(a, RAX, REG_M, offsetof(emu51, map.indirect_error[1]));
+	emit_op_rr(a, 0, OP_TEST, RAX, RAX);
+	present = emit_jcc(a, CC_E);
+	emit_exit(a, pc, index); /* side exit: the interpreter reports the error */
+	patch_jump(a, present);
+	emit_load64(a, RAX, REG_M, offsetof(emu51, map.indirect[1]));
+	emit_op_rr(a, 1, OP_ADD, RAX, RCX);
+	emit_load8(a, RCX, RAX, -0x80);
+	done = emit_jmp(a);
+
+	patch_jump(a, lower);
+	emit_op_rr(a, 1, OP_MOV, RAX, REG_IRAM);
+	emit_op_rr(a, 1, OP_ADD, RAX, RCX);
+	emit_load8(a, RCX, RAX, 0);
+	patch_jump(a, done);
+}
+
+/* ACC <- ACC + ecx + edx (carry in), updating C, AC, OV and P like
+ * general_add() */
+static void emit_add(asm_buf *a)
+{
+	/* eax: 9-bit sum */
+	emit_op_rr(a, 0, OP_MOV, RAX, REG_ACC);
+	emit_op_rr(a, 0, OP_ADD, RAX, RCX);
+	emit_op_rr(a, 0, OP_ADD, RAX, RDX);
+
+	/* esi: AC, the carry into bit 4 is bit 4 of (ACC ^ operand ^ sum) */
+	emit_op_rr(a, 0, OP_MOV, RSI, REG_ACC);
+	emit_op_rr(a, 0, OP_XOR, RSI, RCX);
+	emit_op_rr(a, 0, OP_XOR, RSI, RAX);
+	emit_op_ri(a, EXT_AND, RSI, 0x10);
+	emit_shl(a, RSI, 2);
+
+	/* edi: C, bit 8 of the sum */
+	emit_op_rr(a, 0, OP_MOV, RDI, RAX);
+	emit_op_ri(a, EXT_AND, RDI, 0x100);
+	emit_shr(a, RDI, 1);
+
+	/* r8d: OV, both addends have a sign different from the sum */
+	emit_op_rr(a, 0, OP_MOV, R8, REG_ACC);
+	emit_op_rr(a, 0, OP_XOR, R8, RAX);
+	emit_op_rr(a, 0, OP_MOV, R9, RCX);
+	emit_op_rr(a, 0, OP_XOR, R9, RAX);
+	emit_op_rr(a, 0, OP_AND, R8, R9);
+	emit_op_ri(a, EXT_AND, R8, 0x80);
+	emit_shr(a, R8, 5);
+
+	emit_op_ri(a, EXT_AND, REG_PSW, ~(PSW_C | PSW_AC | PSW_OV) & 0xff);
+	emit_op_rr(a, 0, OP_OR, REG_PSW, RSI);
+	emit_op_rr(a, 0, OP_OR, REG_PSW, RDI);
+	emit_op_rr(a, 0, OP_OR, REG_PSW, R8);
+
+	/* P: the parity flag of the host is set for an even number of 1 bits */
+	emit_op_ri(a, EXT_AND, RAX, 0xff);
+	emit_setcc(a, CC_NP, RCX);
+	emit_movzx8(a, RCX, RCX);
+	emit_op_ri(a, EXT_AND, REG_PSW, ~PSW_P & 0xff);
+	emit_op_rr(a, 0, OP_OR, REG_PSW, RCX);
+	emit_op_rr(a, 0, OP_MOV, REG_ACC, RAX);
+}
+
+/* C <- eax < ecx, like general_cjne(); leaves the flags of cmp eax, ecx */
+static void emit_cjne_compare(asm_buf *a)
+{
+	uint8_t *no_carry;
+
+	emit_op_ri(a, EXT_AND, REG_PSW, ~PSW_C & 0xff);
+	emit_op_rr(a, 0, OP_CMP, RAX, RCX);
+	no_carry = emit_jcc(a, CC_AE);
+	emit_op_ri(a, EXT_OR, REG_PSW, PSW_C);
+	patch_jump(a, no_carry);
+	emit_op_rr(a, 0, OP_CMP, RAX, RCX);
+}
+
+/* Exit to target if the condition holds, and to next otherwise. */
+static void emit_branch(asm_buf *a, int cc, uint16_t target, uint16_t next,
+		int count)
+{
+	uint8_t *taken = emit_jcc(a, cc);
+	emit_exit(a, next, count);
+	patch_jump(a, taken);
+	emit_exit(a, target, count);
+}
+
+/* Check whether the opcode is ADD or ADDC (0x24~0x2f, 0x34~0x3f). */
+static int is_add(uint8_t opcode)
+{
+	return (opcode & 0xe0) == 0x20 && (opcode & 0x0f) >= 0x04;
+}
+
+/* Check whether the backend can emit the instruction. */
+static int is_supported(const emu51_decoded *d)
+{
+	uint8_t opcode = d->code[0];
+
+	if (!d->handler)
+		return 0;
+
+	switch (opcode) {
+		case 0x00: /* NOP */
+		case 0x02: /* LJMP */
+		case 0x24: /* ADD A, #data */
+		case 0x34: /* ADDC A, #data */
+		case 0x40: /* JC */
+		case 0x50: /* JNC */
+		case 0x60: /* JZ */
+		case 0x70: /* JNZ */
+		case 0x80: /* SJMP */
+		case 0xb4: /* CJNE A, #data */
+			return 1;
+		case 0x25: /* ADD A, direct */
+		case 0x35: /* ADDC A, direct */
+		case 0xb5: /* CJNE A, direct */
+		case 0xd5: /* DJNZ direct */
+			/* SFRs are left to the interpreter */
+			return d->code[1] < 0x80;
+		case 0x10: /* JBC */
+		case 0x20: /* JB */
+		case 0x30: /* JNB */
+			/* bit addresses >= 0x80 are errors */
+			return d->code[1] < 0x80;
+	}
+
+	if ((opcode & 0x1f) == 0x01) /* AJMP (ACALL is 0x11, 0x31, ...) */
+		return 1;
+	if (is_add(opcode) && (opcode & 0x0f) >= 0x06) /* ADD(C) A, @Ri/Rn */
+		return 1;
+	if (opcode >= 0xb8 && opcode <= 0xbf) /* CJNE Rn, #data */
+		return 1;
+	if (opcode >= 0xd8 && opcode <= 0xdf) /* DJNZ Rn */
+		return 1;
+
+	return 0;
+}
+
+/* Emit the index-th instruction of the block, located at pc. The last
+ * instruction (last is set) also emits the exits of the block. */
+static void emit_instr(asm_buf *a, const emu51_decoded *d, uint16_t pc,
+		int index, int last)
+{
+	uint8_t opcode = d->code[0];
+	uint16_t next = pc + d->bytes;
+	uint16_t target = next + d->reladdr;
+	int count = index + 1;
+
+	if (is_add(opcode)) {
+		switch (opcode & 0x0f) {
+			case 0x04:
+				emit_mov_ri(a, RCX, d->code[1]);
+				break;
+			case 0x05:
+				emit_load8(a, RCX, REG_IRAM, d->code[1]);
+				break;
+			case 0x06:
+			case 0x07:
+				emit_load_indirect(a, d->reg, pc, index);
+				break;
+			default:
+				emit_load8(a, RCX, REG_BANK, d->reg);
+		}
+		if ((opcode & 0xf0) == 0x30) { /* carry in */
+			emit_op_rr(a, 0, OP_MOV, RDX, REG_PSW);
+			emit_shr(a, RDX, 7);
+		} else {
+			emit_mov_ri(a, RDX, 0);
+		}
+		emit_add(a);
+		if (last)
+			emit_exit(a, next, count);
+		return;
+	}
+
+	if ((opcode & 0x1f) == 0x01) { /* AJMP */
+		emit_exit(a, d->target, count);
+		return;
+	}
+
+	switch (opcode) {
+		case 0x00: /* NOP */
+			if (last)
+				emit_exit(a, next, count);
+			break;
+		case 0x02: /* LJMP */
+			emit_exit(a, d->target, count);
+			break;
+		case 0x80: /* SJMP */
+			emit_exit(a, target, count);
+			break;
+		case 0x40: /* JC */
+		case 0x50: /* JNC */
+			emit_test_ri(a, REG_PSW, PSW_C);
+			emit_branch(a, opcode == 0x40 ? CC_NE : CC_E, target, next, count);
+			break;
+		case 0x60: /* JZ */
+		case 0x70: /* JNZ */
+			emit_op_rr(a, 0, OP_TEST, REG_ACC, REG_ACC);
+			emit_branch(a, opcode == 0x60 ? CC_E : CC_NE, target, next, count);
+			break;
+		case 0x10: /* JBC */
+		case 0x20: /* JB */
+		case 0x30: { /* JNB */
+			int32_t byte = BIT_ADDR_BASE + d->code[1] / 8;
+			uint8_t mask = 1 << (d->code[1] % 8);
+			uint8_t *taken;
+
+			emit_load8(a, RAX, REG_IRAM, byte);
+			emit_test_ri(a, RAX, mask);
+			taken = emit_jcc(a, opcode == 0x30 ? CC_E : CC_NE);
+			emit_exit(a, next, count);
+			patch_jump(a, taken);
+			if (opcode == 0x10) { /* clear the bit */
+				emit_op_ri(a, EXT_AND, RAX, ~mask & 0xff);
+				emit_store8(a, REG_IRAM, byte, RAX);
+			}
+			emit_exit(a, target, count);
+			break;
+		}
+		case 0xb4: /* CJNE A, #data */
+		case 0xb5: /* CJNE A, direct */
+			emit_op_rr(a, 0, OP_MOV, RAX, REG_ACC);
+			if (opcode == 0xb4)
+				emit_mov_ri(a, RCX, d->code[1]);
+			else
+				emit_load8(a, RCX, REG_IRAM, d->code[1]);
+			emit_cjne_compare(a);
+			emit_branch(a, CC_NE, target, next, count);
+			break;
+		case 0xd5: /* DJNZ direct */
+			emit_load8(a, RAX, REG_IRAM, d->code[1]);
+			emit_op_ri(a, EXT_SUB, RAX, 1);
+			emit_store8(a, REG_IRAM, d->code[1], RAX);
+			emit_op_ri(a, EXT_AND, RAX, 0xff);
+			emit_branch(a, CC_NE, target, next, count);
+			break;
+		default:
+			if (opcode >= 0xd8) { /* DJNZ Rn */
+				emit_load8(a, RAX, REG_BANK, d->reg);
+				emit_op_ri(a, EXT_SUB, RAX, 1);
+				emit_store8(a, REG_BANK, d->reg, RAX);
+				emit_op_ri(a, EXT_AND, RAX, 0xff);
+			} else { /* CJNE Rn, #data */
+				emit_load8(a, RAX, REG_BANK, d->reg);
+				emit_mov_ri(a, RCX, d->code[1]);
+				emit_cjne_compare(a);
+			}
+			emit_branch(a, CC_NE, target, next, count);
+	}
+}
+
+/* Check whether the instruction fires the sfr_update callback. */
+static int fires_sfr_update(uint8_t opcode)
+{
+	return is_add(opcode)
+		|| (opcode >= 0xb4 && opcode <= 0xbf); /* CJNE */
+}
+
+/* Check whether the instruction fires the iram_update callback (the direct
+ * address of a compiled DJNZ is in the iram). */
+static int fires_iram_update(uint8_t opcode)
+{
+	return opcode == 0x10 /* JBC */
+		|| opcode == 0xd5 /* DJNZ direct */
+		|| (opcode >= 0xd8 && opcode <= 0xdf); /* DJNZ Rn */
+}
+
+int _emu51_jit_init(emu51_jit *jit)
+{
+	void *code = mmap(NULL, CODE_BUFFER_SIZE, PROT_READ | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED)
+		return -1;
+
+	jit->code = code;
+	jit->size = CODE_BUFFER_SIZE;
+	jit->used = 0;
+	jit->page_size = (size_t)sysconf(_SC_PAGESIZE);
+	return 0;
+}
+
+void _emu51_jit_release(emu51_jit *jit)
+{
+	munmap(jit->code, jit->size);
+}
+
+int _emu51_jit_compile(emu51_jit *jit, const emu51_block_cache *cache,
+		emu51_block *block)
+{
+	uint16_t start = block - cache->blocks;
+	const emu51_decoded *d;
+	uint16_t pc;
+	uint8_t flags = 0;
+	asm_buf a;
+	int i;
+
+	for (i = 0, d = &cache->entries[start]; i < block->count;
+			i++, d += d->bytes) {
+		if (!is_supported(d))
+			return JIT_UNSUPPORTED;
+		if (fires_sfr_update(d->code[0]))
+			flags |= JIT_SFR_UPDATE;
+		if (fires_iram_update(d->code[0]))
+			flags |= JIT_IRAM_UPDATE;
+	}
+
+	size_t max_size = (size_t)(block->count + 1) * MAX_CODE_PER_INSTR;
+	if (max_size > jit->size - jit->used)
+		return JIT_NO_SPACE;
+
+	/* the buffer is only writable while compiling, and only the pages the
+	 * block may be written to */
+	size_t first = jit->used & ~(jit->page_size - 1);
+	size_t last = (jit->used + max_size + jit->page_size - 1)
+		& ~(jit->page_size - 1);
+	if (last > jit->size)
+		last = jit->size;
+	if (mprotect(jit->code + first, last - first, PROT_READ | PROT_WRITE))
+		return JIT_NO_SPACE;
+
+	uint8_t *code = jit->code + jit->used;
+	a.p = code;
+	emit_prologue(&a);
+	for (i = 0, d = &cache->entries[start], pc = start; i < block->count;
+			i++, pc += d->bytes, d += d->bytes)
+		emit_instr(&a, d, pc, i, i + 1 == block->count);
+
+	mprotect(jit->code + first, last - first, PROT_READ | PROT_EXEC);
+
+	/* keep the next block aligned */
+	jit->used = (a.p - jit->code + 15) & ~(size_t)15;
+	block->native = (int (*)(emu51*))(void*)code;
+	block->jit_flags |= flags;
+	return JIT_OK;
+}
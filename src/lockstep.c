@@ -0,0 +1,413 @@
+#include <emu51.h>
+#include <string.h>
+
+#include "helpers.h"
+#include "instr.h"
+
+/* Lockstep engine.
+ *
+ * The state of the lanes is stored column-wise: the byte at address a of the
+ * internal ram (or SFR index a) of every lane is in one column of stride
+ * bytes, so that an instruction with operands from the program memory
+ * touches the same column in each lane. The lanes waiting at the lowest pc
+ * are run together, one instruction at a time: the lanes taking another path
+ * at a branch wait until the others reach their pc again (or finish), which
+ * regroups the lanes of a loop when they leave it.
+ *
+ * The common instructions are run by loops over the lanes (see the ALU_*
+ * functions below), which only select the result of the lanes in the group
+ * with a mask so that the compiler can vectorize them. The other instructions
+ * are run lane by lane by the handlers of the interpreter, on a scratch
+ * emulator the lane is copied into.
+ */
+
+/* round size up to the alignment of pointers */
+#define ALIGN_UP(size) (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+/* the columns are padded to a multiple of the widest vector (256 bits) */
+#define LANE_ALIGN 32
+
+struct emu51_lockstep
+{
+	const uint8_t *pmem; /* program memory shared by all lanes */
+	long pmem_len;       /* size of that program memory */
+	long lanes;          /* number of lanes */
+	long stride;         /* size of a byte column */
+
+	uint64_t *cycles;    /* emu51::cycles of each lane */
+	uint64_t *limit;     /* cycle at which each lane stops */
+	int *reason;         /* stop reason of each lane, see emu51_run() */
+	uint16_t *pc;
+	uint8_t *mask;       /* 1 for the lanes in the running group */
+	uint8_t *operand;    /* per-lane operand of the running instruction */
+	uint8_t *taken;      /* 1 for the lanes taking the branch */
+	uint8_t *iram;       /* 128 columns of lower iram */
+	uint8_t *sfr;        /* 128 columns of SFRs */
+
+	/* scratch emulator for the instructions run lane by lane */
+	emu51 scratch;
+	uint8_t scratch_iram[128];
+	uint8_t scratch_sfr[128];
+};
+
+/* column of the iram address or SFR index */
+#define IRAM(ls, addr) (&(ls)->iram[(long)(addr) * (ls)->stride])
+#define SFR(ls, index) (&(ls)->sfr[(long)(index) * (ls)->stride])
+
+/* Get the column of a direct address. */
+static uint8_t *direct_column(emu51_lockstep *ls, uint8_t addr)
+{
+	return addr < SFR_BASE_ADDR ? IRAM(ls, addr) : SFR(ls, addr & 0x7f);
+}
+
+/* Get the stride for the number of lanes. */
+static long lane_stride(long lanes)
+{
+	return (lanes + LANE_ALIGN - 1) & ~(long)(LANE_ALIGN - 1);
+}
+
+size_t emu51_lockstep_size(long lanes)
+{
+	long stride = lane_stride(lanes);
+
+	return ALIGN_UP(sizeof(emu51_lockstep))
+		+ stride * (2 * sizeof(uint64_t) + sizeof(int) + sizeof(uint16_t)
+			+ 3 + 2 * 128);
+}
+
+emu51_lockstep *emu51_lockstep_init(void *buffer, const uint8_t *pmem,
+		long pmem_len, long lanes)
+{
+	emu51_lockstep *ls = buffer;
+	long stride = lane_stride(lanes);
+	uint8_t *p = (uint8_t*)buffer + ALIGN_UP(sizeof(emu51_lockstep));
+	long i;
+
+	memset(ls, 0, sizeof(emu51_lockstep));
+	ls->pmem = pmem;
+	ls->pmem_len = pmem_len;
+	ls->lanes = lanes;
+	ls->stride = stride;
+
+	/* the columns, widest first so that each one is aligned */
+	ls->cycles = (uint64_t*)p;
+	p += stride * sizeof(uint64_t);
+	ls->limit = (uint64_t*)p;
+	p += stride * sizeof(uint64_t);
+	ls->reason = (int*)p;
+	p += stride * sizeof(int);
+	ls->pc = (uint16_t*)p;
+	p += stride * sizeof(uint16_t);
+	ls->mask = p;
+	ls->operand = p + stride;
+	ls->taken = p + 2 * stride;
+	ls->iram = p + 3 * stride;
+	ls->sfr = ls->iram + 128 * stride;
+	memset(ls->cycles, 0, (uint8_t*)(ls->sfr + 128 * stride)
+		- (uint8_t*)ls->cycles);
+
+	/* the same state as emu51_reset() */
+	for (i = 0; i < lanes; i++)
+		SFR(ls, SFR_SP)[i] = 0x07;
+
+	ls->scratch.pmem = pmem;
+	ls->scratch.pmem_len = pmem_len;
+	ls->scratch.iram_lower = ls->scratch_iram;
+	ls->scratch.sfr = ls->scratch_sfr;
+	return ls;
+}
+
+void emu51_lockstep_load(emu51_lockstep *ls, long lane, const emu51 *m)
+{
+	int i;
+
+	ls->pc[lane] = m->pc;
+	ls->cycles[lane] = m->cycles;
+	for (i = 0; i < 128; i++) {
+		IRAM(ls, i)[lane] = m->iram_lower[i];
+		SFR(ls, i)[lane] = m->sfr[i];
+	}
+}
+
+void emu51_lockstep_store(const emu51_lockstep *ls, long lane, emu51 *m)
+{
+	int i;
+
+	m->pc = ls->pc[lane];
+	m->cycles = ls->cycles[lane];
+	for (i = 0; i < 128; i++) {
+		m->iram_lower[i] = IRAM(ls, i)[lane];
+		m->sfr[i] = SFR(ls, i)[lane];
+	}
+}
+
+/* Gather Rn of the register bank of each lane in the group into the operand
+ * column. */
+static void gather_reg(emu51_lockstep *ls, int n)
+{
+	const uint8_t *psw = SFR(ls, SFR_PSW);
+	long i;
+
+	for (i = 0; i < ls->lanes; i++)
+		if (ls->mask[i])
+			ls->operand[i] = IRAM(ls, (psw[i] & 0x18) + n)[i];
+}
+
+/* Gather @Ri of each lane in the group into the operand column. The lanes
+ * pointing to the upper iram, which lanes don't have, stop with
+ * EMU51_IRAM_OUT_OF_RANGE and leave the group. */
+static void gather_indirect(emu51_lockstep *ls, int n)
+{
+	const uint8_t *psw = SFR(ls, SFR_PSW);
+	long i;
+
+	for (i = 0; i < ls->lanes; i++) {
+		if (!ls->mask[i])
+			continue;
+		uint8_t addr = IRAM(ls, (psw[i] & 0x18) + n)[i];
+		if (addr >= 0x80) {
+			ls->reason[i] = EMU51_IRAM_OUT_OF_RANGE;
+			ls->mask[i] = 0;
+			continue;
+		}
+		ls->operand[i] = IRAM(ls, addr)[i];
+	}
+}
+
+/* Get the column of the operand selected by the low nibble of an ALU opcode:
+ * #data (4), direct (5), @Ri (6~7) or Rn (8~f). */
+static const uint8_t *alu_operand(emu51_lockstep *ls, const emu51_decoded *d)
+{
+	uint8_t mode = d->code[0] & 0x0f;
+
+	if (mode == 0x04) {
+		memset(ls->operand, d->code[1], ls->stride);
+	} else if (mode == 0x05) {
+		return direct_column(ls, d->code[1]);
+	} else if (mode < 0x08) {
+		gather_indirect(ls, mode & 1);
+	} else {
+		gather_reg(ls, mode & 7);
+	}
+	return ls->operand;
+}
+
+/* Move the lanes of the group to next, or to target where the taken column
+ * is set if conditional, and account the cycles of the instruction. */
+static void branch(emu51_lockstep *ls, int conditional, uint16_t next,
+		uint16_t target, int cycles)
+{
+	const uint8_t *mask = ls->mask;
+	const uint8_t *taken = ls->taken;
+	uint16_t *pc = ls->pc;
+	uint64_t *lane_cycles = ls->cycles;
+	long i, lanes = ls->lanes;
+
+	for (i = 0; i < lanes; i++) {
+		uint16_t new_pc = conditional && taken[i] ? target : next;
+		pc[i] = mask[i] ? new_pc : pc[i];
+		lane_cycles[i] += mask[i] ? cycles : 0;
+	}
+}
+
+/* ADD/ADDC A, operand */
+static void alu_add(emu51_lockstep *ls, const uint8_t *operand, int carry)
+{
+	const uint8_t *mask = ls->mask;
+	uint8_t *acc = SFR(ls, SFR_ACC);
+	uint8_t *psw = SFR(ls, SFR_PSW);
+	long i, lanes = ls->lanes;
+
+	for (i = 0; i < lanes; i++) {
+		uint8_t carry_in = carry ? psw[i] >> 7 : 0;
+		uint8_t sum = acc[i] + operand[i] + carry_in;
+		uint8_t flags = add_flags(acc[i], operand[i], carry_in)
+			| parity_flag(sum);
+		uint8_t new_psw = (psw[i] & ~(PSW_C | PSW_AC | PSW_OV | PSW_P))
+			| flags;
+		acc[i] = mask[i] ? sum : acc[i];
+		psw[i] = mask[i] ? new_psw : psw[i];
+	}
+}
+
+/* CJNE value, operand: set C if value < operand, and the taken column if
+ * they differ */
+static void alu_cjne(emu51_lockstep *ls, const uint8_t *value,
+		const uint8_t *operand)
+{
+	const uint8_t *mask = ls->mask;
+	uint8_t *psw = SFR(ls, SFR_PSW);
+	uint8_t *taken = ls->taken;
+	long i, lanes = ls->lanes;
+
+	for (i = 0; i < lanes; i++) {
+		uint8_t carry = value[i] < operand[i] ? PSW_C : 0;
+		psw[i] = mask[i] ? (psw[i] & ~PSW_C) | carry : psw[i];
+		taken[i] = value[i] != operand[i];
+	}
+}
+
+/* Run the instruction at pc on the lanes of the group, lane by lane, with the
+ * handler of the interpreter. */
+static void run_scalar(emu51_lockstep *ls, const emu51_decoded *d, uint16_t pc)
+{
+	emu51 *s = &ls->scratch;
+	long i;
+	int j;
+
+	for (i = 0; i < ls->lanes; i++) {
+		if (!ls->mask[i])
+			continue;
+
+		for (j = 0; j < 128; j++) {
+			s->iram_lower[j] = IRAM(ls, j)[i];
+			s->sfr[j] = SFR(ls, j)[i];
+		}
+		s->cycles = ls->cycles[i];
+		s->next_event = UINT64_MAX;
+		s->timers.synced = s->cycles;
+		s->irq.pins = s->sfr[SFR_P3] & 0x0c;
+		s->uart.tx_done = s->uart.rx_done = UINT64_MAX;
+		s->uart.rx_byte = s->sfr[SFR_SBUF]; /* a plain register */
+		_emu51_map_memory(s);
+
+		s->pc = pc + d->bytes;
+		int err = d->handler(d, s);
+		_emu51_sync_psw(s);
+		if (err) {
+			ls->reason[i] = err;
+			continue;
+		}
+
+		for (j = 0; j < 128; j++) {
+			IRAM(ls, j)[i] = s->iram_lower[j];
+			SFR(ls, j)[i] = s->sfr[j];
+		}
+		ls->pc[i] = s->pc;
+		ls->cycles[i] += d->cycles;
+	}
+}
+
+/* Run the instruction at pc on the lanes of the group. */
+static void execute(emu51_lockstep *ls, uint16_t pc)
+{
+	const emu51_instr *instr = _emu51_decode_instr(ls->pmem[pc]);
+	emu51_decoded d;
+	uint8_t *mask = ls->mask, *taken = ls->taken;
+	uint16_t next, target;
+	uint8_t opcode;
+	long i, lanes = ls->lanes;
+
+	if (!instr->handler || pc + instr->bytes > ls->pmem_len) {
+		int err = instr->handler ? EMU51_PMEM_OUT_OF_RANGE
+			: EMU51_NOT_IMPLEMENTED;
+		for (i = 0; i < lanes; i++)
+			if (mask[i])
+				ls->reason[i] = err;
+		return;
+	}
+
+	next = pc + instr->bytes;
+	_emu51_decode(&d, &ls->pmem[pc], next);
+	opcode = d.code[0];
+	target = (uint16_t)(next + d.reladdr);
+
+	if (opcode == 0x00) { /* NOP */
+		branch(ls, 0, next, next, d.cycles);
+	} else if (opcode == 0x02 || (opcode & 0x1f) == 0x01) { /* LJMP, AJMP */
+		branch(ls, 0, d.target, d.target, d.cycles);
+	} else if (opcode == 0x80) { /* SJMP */
+		branch(ls, 0, target, target, d.cycles);
+	} else if (opcode == 0x40 || opcode == 0x50) { /* JC, JNC */
+		const uint8_t *psw = SFR(ls, SFR_PSW);
+		for (i = 0; i < lanes; i++)
+			taken[i] = (psw[i] >> 7) ^ (opcode == 0x50);
+		branch(ls, 1, next, target, d.cycles);
+	} else if (opcode == 0x60 || opcode == 0x70) { /* JZ, JNZ */
+		const uint8_t *acc = SFR(ls, SFR_ACC);
+		for (i = 0; i < lanes; i++)
+			taken[i] = (acc[i] == 0) ^ (opcode == 0x70);
+		branch(ls, 1, next, target, d.cycles);
+	} else if ((opcode >= 0x24 && opcode <= 0x2f)
+			|| (opcode >= 0x34 && opcode <= 0x3f)) { /* ADD, ADDC */
+		alu_add(ls, alu_operand(ls, &d), opcode >= 0x34);
+		branch(ls, 0, next, next, d.cycles);
+	} else if (opcode == 0xb4 || opcode == 0xb5) { /* CJNE A, ... */
+		alu_cjne(ls, SFR(ls, SFR_ACC), alu_operand(ls, &d));
+		branch(ls, 1, next, target, d.cycles);
+	} else if (opcode >= 0xb6 && opcode <= 0xbf) { /* CJNE @Ri/Rn, #data */
+		if (opcode < 0xb8)
+			gather_indirect(ls, opcode & 1);
+		else
+			gather_reg(ls, opcode & 7);
+		memset(ls->taken, d.code[1], ls->stride);
+		alu_cjne(ls, ls->operand, ls->taken);
+		branch(ls, 1, next, target, d.cycles);
+	} else if (opcode == 0xd5 && d.code[1] < SFR_BASE_ADDR) {
+		/* DJNZ iram, rel; SFRs may have side effects */
+		uint8_t *column = IRAM(ls, d.code[1]);
+		for (i = 0; i < lanes; i++) {
+			uint8_t value = column[i] - mask[i];
+			column[i] = value;
+			taken[i] = value != 0;
+		}
+		branch(ls, 1, next, target, d.cycles);
+	} else if (opcode >= 0xd8 && opcode <= 0xdf) { /* DJNZ Rn, rel */
+		const uint8_t *psw = SFR(ls, SFR_PSW);
+		for (i = 0; i < lanes; i++) {
+			if (!mask[i])
+				continue;
+			uint8_t *reg = &IRAM(ls, (psw[i] & 0x18) + (opcode & 7))[i];
+			taken[i] = --*reg != 0;
+		}
+		branch(ls, 1, next, target, d.cycles);
+	} else {
+		run_scalar(ls, &d, pc);
+	}
+}
+
+long emu51_lockstep_run(emu51_lockstep *ls, long max_cycles, int *reasons)
+{
+	const uint64_t *cycles = ls->cycles, *limit = ls->limit;
+	const uint16_t *lane_pc = ls->pc;
+	int *reason = ls->reason;
+	uint8_t *mask = ls->mask;
+	long i, lanes = ls->lanes, stopped = 0;
+
+	for (i = 0; i < lanes; i++) {
+		ls->limit[i] = cycles[i] + max_cycles;
+		reason[i] = EMU51_STOP_BUDGET;
+	}
+
+	for (;;) {
+		/* the group: the running lanes at the lowest pc */
+		uint32_t pc = 0x10000;
+
+		for (i = 0; i < lanes; i++) {
+			int running = !reason[i] & (cycles[i] < limit[i]);
+			uint32_t next = running ? lane_pc[i] : 0x10000;
+			pc = next < pc ? next : pc;
+		}
+		if (pc > 0xffff)
+			break;
+		for (i = 0; i < lanes; i++) {
+			mask[i] = !reason[i] & (cycles[i] < limit[i])
+				& (lane_pc[i] == pc);
+		}
+
+		if (pc >= ls->pmem_len) {
+			for (i = 0; i < lanes; i++)
+				if (mask[i])
+					reason[i] = EMU51_PMEM_OUT_OF_RANGE;
+			continue;
+		}
+		execute(ls, (uint16_t)pc);
+	}
+
+	for (i = 0; i < lanes; i++) {
+		if (reasons)
+			reasons[i] = reason[i];
+		stopped += reason[i] != EMU51_STOP_BUDGET;
+	}
+	return stopped;
+}
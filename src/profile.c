@@ -0,0 +1,134 @@
+#include <emu51.h>
+#include <string.h>
+
+#include "profile.h"
+
+/* magic number and version at the start of a binary profile */
+static const uint8_t profile_header[] = { 'E', '5', '1', 'P', 1 };
+
+size_t emu51_profile_size(long pmem_len)
+{
+	return sizeof(emu51_profile) + pmem_len * sizeof(struct profile_entry);
+}
+
+void emu51_set_profile(emu51 *m, void *buffer, long period)
+{
+	emu51_profile *p = buffer;
+
+	if (p) {
+		if (period < 1)
+			period = 1;
+		p->pmem_len = m->pmem_len;
+		p->period = period;
+		p->countdown = period;
+		memset(p->entries, 0, m->pmem_len * sizeof(struct profile_entry));
+	}
+	m->profile = p;
+}
+
+void emu51_profile_get(const emu51 *m, uint16_t addr, uint64_t *count,
+		uint64_t *cycles)
+{
+	const emu51_profile *p = m->profile;
+
+	if (p && addr < p->pmem_len) {
+		*count = p->entries[addr].count;
+		*cycles = p->entries[addr].cycles;
+	} else {
+		*count = *cycles = 0;
+	}
+}
+
+/* Store the value in little endian order. */
+static uint8_t *put_le(uint8_t *out, uint64_t value, int bytes)
+{
+	for (; bytes > 0; bytes--, value >>= 8)
+		*out++ = (uint8_t)value;
+	return out;
+}
+
+static int write_text(const emu51_profile *p, FILE *file)
+{
+	long addr;
+
+	if (fprintf(file, "# emu51 profile, period %ld\n# addr count cycles\n",
+			p->period) < 0)
+		return EMU51_LOG_ERROR;
+	for (addr = 0; addr < p->pmem_len; addr++) {
+		const struct profile_entry *e = &p->entries[addr];
+		if (e->count && fprintf(file, "%04lx %llu %llu\n", addr,
+				(unsigned long long)e->count,
+				(unsigned long long)e->cycles) < 0)
+			return EMU51_LOG_ERROR;
+	}
+	return 0;
+}
+
+static int write_binary(const emu51_profile *p, FILE *file)
+{
+	uint8_t record[18];
+	uint32_t n = 0;
+	long addr;
+
+	for (addr = 0; addr < p->pmem_len; addr++)
+		if (p->entries[addr].count)
+			n++;
+
+	put_le(put_le(record, p->period, 4), n, 4);
+	if (fwrite(profile_header, sizeof(profile_header), 1, file) != 1
+			|| fwrite(record, 8, 1, file) != 1)
+		return EMU51_LOG_ERROR;
+
+	for (addr = 0; addr < p->pmem_len; addr++) {
+		const struct profile_entry *e = &p->entries[addr];
+		if (!e->count)
+			continue;
+		put_le(put_le(put_le(record, addr, 2), e->count, 8), e->cycles, 8);
+		if (fwrite(record, sizeof(record), 1, file) != 1)
+			return EMU51_LOG_ERROR;
+	}
+	return 0;
+}
+
+int emu51_profile_write(const emu51 *m, FILE *file, int format)
+{
+	const emu51_profile *p = m->profile;
+	int err;
+
+	if (!p)
+		return EMU51_NOT_SUPPORTED;
+	switch (format) {
+		case EMU51_PROFILE_TEXT:
+			err = write_text(p, file);
+			break;
+		case EMU51_PROFILE_BINARY:
+			err = write_binary(p, file);
+			break;
+		default:
+			return EMU51_NOT_SUPPORTED;
+	}
+	if (!err && fflush(file))
+		err = EMU51_LOG_ERROR;
+	return err;
+}
+
+void emu51_profile_aggregate(const emu51 *m, emu51_symbol *symbols, long n)
+{
+	const emu51_profile *p = m->profile;
+	long i, addr, end;
+
+	for (i = 0; i < n; i++) {
+		symbols[i].count = symbols[i].cycles = 0;
+		if (!p)
+			continue;
+
+		/* a function ends at the next one */
+		end = i + 1 < n ? symbols[i + 1].start : p->pmem_len;
+		if (end > p->pmem_len)
+			end = p->pmem_len;
+		for (addr = symbols[i].start; addr < end; addr++) {
+			symbols[i].count += p->entries[addr].count;
+			symbols[i].cycles += p->entries[addr].cycles;
+		}
+	}
+}
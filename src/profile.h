@@ -0,0 +1,60 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+/* NOTE: This header file is internal to emu51. */
+
+#include <emu51.h>
+
+/* Per-address execution profile, see emu51_set_profile().
+ *
+ * The counters are a flat array indexed by the address of the instruction.
+ * With a sampling period of N, only one execution in N is counted (one
+ * block in N with the block cache, see block.c), and it is counted N times,
+ * so the counters are estimates of the true counts. The loops skipped by
+ * _emu51_fast_forward() are always counted exactly.
+ */
+
+struct profile_entry
+{
+	uint64_t count;  /* executions of the instruction at the address */
+	uint64_t cycles; /* cycles of those executions */
+};
+
+struct emu51_profile
+{
+	long pmem_len;  /* number of entries */
+	long period;    /* sampling period, 1 to count every execution */
+	long countdown; /* executions until the next sample */
+	struct profile_entry entries[];
+};
+
+/* Check whether the next execution is sampled. */
+static inline int profile_sample(emu51_profile *p)
+{
+	if (--p->countdown > 0)
+		return 0;
+	p->countdown = p->period;
+	return 1;
+}
+
+/* Count a sampled execution of the instruction at pc. */
+static inline void profile_instr(emu51_profile *p, uint16_t pc, long cycles)
+{
+	if (pc < p->pmem_len) {
+		p->entries[pc].count += p->period;
+		p->entries[pc].cycles += (uint64_t)p->period * cycles;
+	}
+}
+
+/* Count the iterations skipped by _emu51_fast_forward() at pc, each taking
+ * the cycles of the instruction. */
+static inline void profile_skip(emu51_profile *p, uint16_t pc, long skipped,
+		long cycles)
+{
+	if (pc < p->pmem_len) {
+		p->entries[pc].count += skipped / cycles;
+		p->entries[pc].cycles += skipped;
+	}
+}
+
+#endif
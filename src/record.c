@@ -0,0 +1,276 @@
+#include <emu51.h>
+#include <string.h>
+
+#include "helpers.h"
+#include "history.h"
+#include "record.h"
+#include "serial.h"
+
+/* magic number and version at the start of the log */
+static const uint8_t log_header[] = { 'E', '5', '1', 'L', 1 };
+
+size_t emu51_recorder_size(void)
+{
+	return sizeof(emu51_recorder);
+}
+
+/* Write the buffered bytes to the file. */
+static void flush(emu51_recorder *rec)
+{
+	if (rec->len && !rec->error
+			&& fwrite(rec->buffer, 1, rec->len, rec->file) != (size_t)rec->len)
+		rec->error = EMU51_LOG_ERROR;
+	rec->len = 0;
+}
+
+static void put_byte(emu51_recorder *rec, uint8_t byte)
+{
+	if (rec->len == RECORD_BUFFER_SIZE)
+		flush(rec);
+	rec->buffer[rec->len++] = byte;
+}
+
+static void put_varint(emu51_recorder *rec, uint64_t value)
+{
+	while (value >= 0x80) {
+		put_byte(rec, (uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	put_byte(rec, (uint8_t)value);
+}
+
+/* Start an entry of the kind at the current cycle. */
+static void put_entry(emu51 *m, emu51_recorder *rec, int kind)
+{
+	put_varint(rec, (m->cycles - rec->last_cycle) << 3 | kind);
+	rec->last_cycle = m->cycles;
+}
+
+/* Read a byte. Returns the byte, or -1 at the end of the file. */
+static int get_byte(emu51_recorder *rec)
+{
+	if (rec->pos == rec->len) {
+		rec->pos = 0;
+		rec->len = (long)fread(rec->buffer, 1, RECORD_BUFFER_SIZE, rec->file);
+		if (!rec->len) {
+			if (ferror(rec->file))
+				rec->error = EMU51_LOG_ERROR;
+			return -1;
+		}
+	}
+	return rec->buffer[rec->pos++];
+}
+
+/* Read a varint. Returns 0 on success, 1 at the end of the file, or -1 if the
+ * varint is truncated or too long. */
+static int get_varint(emu51_recorder *rec, uint64_t *value)
+{
+	int byte, shift = 0;
+
+	*value = 0;
+	do {
+		byte = get_byte(rec);
+		if (byte < 0)
+			return shift ? -1 : 1;
+		if (shift > 63)
+			return -1;
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return 0;
+}
+
+/* Stop replaying at an invalid entry. */
+static void invalid_log(emu51_recorder *rec)
+{
+	rec->error = EMU51_LOG_ERROR;
+	rec->next_kind = RECORD_END;
+	rec->next_cycle = UINT64_MAX;
+}
+
+/* Decode the header of the next entry to replay. */
+static void next_entry(emu51_recorder *rec)
+{
+	uint64_t header;
+	int result = get_varint(rec, &header);
+
+	if (result) {
+		if (result < 0)
+			invalid_log(rec);
+		rec->next_kind = RECORD_END;
+		rec->next_cycle = UINT64_MAX;
+		return;
+	}
+	if ((header & 7) > RECORD_PINS + 1) {
+		invalid_log(rec);
+		return;
+	}
+	rec->next_kind = (int)(header & 7);
+	rec->next_cycle = rec->last_cycle + (header >> 3);
+	rec->last_cycle = rec->next_cycle;
+}
+
+int emu51_set_recorder(emu51 *m, void *buffer, FILE *file, int mode)
+{
+	emu51_recorder *rec = m->recorder;
+	uint8_t header[sizeof(log_header)];
+	int err = 0;
+
+	/* detach the current recorder */
+	if (rec) {
+		if (rec->mode == EMU51_RECORD) {
+			flush(rec);
+			if (fflush(rec->file) && !rec->error)
+				rec->error = EMU51_LOG_ERROR;
+		}
+		err = rec->error;
+		m->recorder = NULL;
+	}
+
+	rec = buffer;
+	if (!rec)
+		return err;
+
+	memset(rec, 0, sizeof(emu51_recorder));
+	rec->file = file;
+	rec->mode = mode;
+	rec->last_cycle = m->cycles;
+	if (mode == EMU51_RECORD) {
+		memcpy(rec->buffer, log_header, sizeof(log_header));
+		rec->len = sizeof(log_header);
+	} else {
+		if (fread(header, 1, sizeof(header), file) != sizeof(header)
+				|| memcmp(header, log_header, sizeof(header)))
+			return EMU51_LOG_ERROR;
+		next_entry(rec);
+	}
+	m->recorder = rec;
+	return err;
+}
+
+int emu51_replay_done(const emu51 *m)
+{
+	const emu51_recorder *rec = m->recorder;
+
+	return rec && rec->mode == EMU51_REPLAY && rec->next_kind == RECORD_END;
+}
+
+int _emu51_port_read(emu51 *m, uint8_t portno, uint8_t *out)
+{
+	emu51_recorder *rec = m->recorder;
+	uint8_t data = direct_addr_read(m, SFR_BASE_ADDR + (portno << 4));
+
+	/* re-executing from a checkpoint, the host is not involved */
+	if (_emu51_history_replaying(m)) {
+		_emu51_history_feed(m, HISTORY_PORT + portno, &data);
+		*out = data;
+		return 0;
+	}
+
+	if (rec && rec->mode == EMU51_REPLAY) {
+		int value;
+
+		/* after the end of the log, the ports read their latch */
+		if (rec->next_kind != RECORD_END) {
+			if (rec->next_kind != RECORD_PORT + portno
+					|| rec->next_cycle != m->cycles)
+				return EMU51_REPLAY_DIVERGED;
+			value = get_byte(rec);
+			if (value < 0) {
+				invalid_log(rec);
+				return EMU51_REPLAY_DIVERGED;
+			}
+			data = (uint8_t)value;
+			next_entry(rec);
+		}
+		*out = data;
+		return 0;
+	}
+
+	if (HAS_CALLBACK(m, io_read)) {
+		sync_psw(m); /* the callback may read PSW... */
+		m->callback.io_read(m, portno, 0xff, &data);
+		select_bank(m); /* ...and write it */
+		if (m->history)
+			_emu51_history_log(m, HISTORY_PORT + portno, data);
+	}
+	if (rec) {
+		put_entry(m, rec, RECORD_PORT + portno);
+		put_byte(rec, data);
+	}
+	*out = data;
+	return 0;
+}
+
+uint8_t _emu51_pins_input(emu51 *m, uint8_t pins, int entry)
+{
+	emu51_recorder *rec = m->recorder;
+
+	/* re-executing from a checkpoint, the host is not involved */
+	if (_emu51_history_replaying(m)) {
+		pins = m->irq.pins;
+		_emu51_history_feed(m, HISTORY_PINS + entry, &pins);
+		return pins;
+	}
+
+	if (rec && rec->mode == EMU51_REPLAY) {
+		/* the host's levels are ignored, the log has them */
+		pins = m->irq.pins;
+		/* the bytes the host sent before the levels were seen */
+		_emu51_replay_inputs(m);
+		if (rec->next_kind == RECORD_PINS + entry
+				&& rec->next_cycle == m->cycles) {
+			int value = get_byte(rec);
+			if (value < 0) {
+				invalid_log(rec);
+				return pins;
+			}
+			pins = (uint8_t)value & (PIN_INT0 | PIN_INT1);
+			next_entry(rec);
+		}
+	} else if (rec && pins != m->irq.pins) {
+		put_entry(m, rec, RECORD_PINS + entry);
+		put_byte(rec, pins);
+	}
+
+	if (m->history && pins != m->irq.pins)
+		_emu51_history_log(m, HISTORY_PINS + entry, pins);
+	return pins;
+}
+
+void _emu51_record_serial(emu51 *m, const uint8_t *data, long len)
+{
+	emu51_recorder *rec = m->recorder;
+	long i;
+
+	if (!rec || rec->mode != EMU51_RECORD || len <= 0)
+		return;
+
+	put_entry(m, rec, RECORD_SERIAL);
+	put_varint(rec, len);
+	for (i = 0; i < len; i++)
+		put_byte(rec, data[i]);
+}
+
+void _emu51_replay_inputs(emu51 *m)
+{
+	emu51_recorder *rec = m->recorder;
+
+	while (_emu51_replay_next(m) <= m->cycles) {
+		uint64_t len;
+		if (get_varint(rec, &len)) {
+			invalid_log(rec);
+			return;
+		}
+		for (; len; len--) {
+			int byte = get_byte(rec);
+			uint8_t value = (uint8_t)byte;
+			if (byte < 0) {
+				invalid_log(rec);
+				return;
+			}
+			_emu51_serial_push(m, &value, 1);
+		}
+		next_entry(rec);
+	}
+}
@@ -0,0 +1,90 @@
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+/* NOTE: This header file is internal to emu51. */
+
+#include <emu51.h>
+#include <stdio.h>
+
+/* Record and replay of the external inputs, see emu51_set_recorder().
+ *
+ * The inputs are the values read from the ports by instructions (after the
+ * io_read callback), the bytes sent by the host to the serial port and the
+ * changes of the INT0 and INT1 pins seen by the interrupt controller. The
+ * log starts with a header, followed by one entry per input:
+ *
+ *   varint  (cycles since the previous entry << 3) | kind
+ *   kind 0~3 (port read of P0~P3): 1 byte, the value read
+ *   kind 4 (serial input): varint length, then the bytes
+ *   kind 5~6 (INT0/INT1 pins): 1 byte, the new levels in bits 2 and 3 (as in
+ *            P3); kind 6 if they were seen as emu51_step() or emu51_run()
+ *            started, kind 5 on a write of the firmware to an event SFR
+ *
+ * where a varint holds 7 bits per byte, least significant first, with the top
+ * bit set in all bytes but the last. The cycle of a port read is the one at
+ * the start of the instruction; the bytes sent by the host between two runs
+ * are logged at the cycle the emulator stopped at, and replayed as an event
+ * at that cycle. The levels of the pins are replayed where they were seen,
+ * after the serial input of the same cycle.
+ */
+
+/* size of the file buffer */
+#define RECORD_BUFFER_SIZE 4096
+
+/* kinds of the entries */
+enum record_kind
+{
+	RECORD_PORT = 0,   /* + port number */
+	RECORD_SERIAL = 4,
+	RECORD_PINS = 5,   /* + 1 if seen as a step or run started */
+	RECORD_END = 8,    /* no more entries (replay) */
+};
+
+struct emu51_recorder
+{
+	FILE *file;
+	int mode;            /* EMU51_RECORD or EMU51_REPLAY */
+	int error;           /* first error in accessing the file, or 0 */
+	uint64_t last_cycle; /* cycle of the previous entry */
+
+	/* the next entry to replay, with its header decoded */
+	uint64_t next_cycle; /* UINT64_MAX at the end of the log */
+	int next_kind;       /* enum record_kind */
+
+	long pos, len;       /* read position and size of the data in buffer */
+	uint8_t buffer[RECORD_BUFFER_SIZE];
+};
+
+/* Read a port (0~3) for an instruction, see direct_operand_read().
+ *
+ * Returns 0 on success, or EMU51_REPLAY_DIVERGED. */
+int _emu51_port_read(emu51 *m, uint8_t portno, uint8_t *out);
+
+/* Take the levels of the INT0 and INT1 pins (P3.2 and P3.3, the other bits
+ * clear) seen by the interrupt controller as an input: a change from
+ * emu51::irq.pins is logged, or while replaying (or re-executing from a
+ * checkpoint), the logged levels are taken instead, and the levels are kept
+ * otherwise.
+ *
+ * entry: 1 if seen as emu51_step() or emu51_run() starts, 0 otherwise
+ *
+ * Returns the levels to act upon. */
+uint8_t _emu51_pins_input(emu51 *m, uint8_t pins, int entry);
+
+/* Log the bytes sent by the host to the serial port, if recording. */
+void _emu51_record_serial(emu51 *m, const uint8_t *data, long len);
+
+/* Feed the inputs due at emu51::cycles, if replaying. */
+void _emu51_replay_inputs(emu51 *m);
+
+/* Get the cycle of the next input to feed as an event, or UINT64_MAX. */
+static inline uint64_t _emu51_replay_next(const emu51 *m)
+{
+	const emu51_recorder *rec = m->recorder;
+
+	if (!rec || rec->mode != EMU51_REPLAY || rec->next_kind != RECORD_SERIAL)
+		return UINT64_MAX;
+	return rec->next_cycle;
+}
+
+#endif /* _RECORD_H_ */
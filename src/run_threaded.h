@@ -0,0 +1,137 @@
+/* Threaded-code interpreter core, included by instr.c.
+ *
+ * This file is included once for each variant of the core with the following
+ * macros defined:
+ *
+ *   THREADED_CORE  name of the function
+ *   TRUSTED        1 for the trusted mode (see emu51_set_trusted()), else 0
+ *
+ * There is no include guard on purpose.
+ */
+
+/* Threaded-code interpreter core used by emu51_run().
+ *
+ * Each implemented opcode has a block of its own that runs the handler and
+ * then jumps directly to the block of the next opcode (computed goto). This
+ * gives every opcode its own indirect branch, which the branch predictor can
+ * learn far better than the single call site shared by all instructions in
+ * the portable loop. Instruction lengths and cycle counts are constants in
+ * the blocks, and handlers are called directly.
+ *
+ * The stop conditions are checked in the same order as the portable loop, so
+ * both cores give identical results. In trusted mode (TRUSTED is 1), pc is not
+ * checked against the program memory size.
+ */
+long THREADED_CORE(emu51 *m, emu51_decode_cache *cache,
+		long max_cycles, int *reason)
+{
+	const uint8_t *breakpoints = m->breakpoints;
+	const uint8_t *pmem = m->pmem;
+	const long pmem_len = m->pmem_len;
+	emu51_decoded decoded;
+	const emu51_decoded *d;
+	uint16_t old_pc;
+	long used = 0;
+	int stop;
+
+	/* jump table indexed by opcode */
+#define INSTR(op, mne, b, c, h) [op] = &&op_##op,
+#define NOT_IMPLEMENTED(op) [op] = &&generic,
+	static const void *const dispatch[256] = {
+#include "instr_table.h"
+	};
+#undef INSTR
+#undef NOT_IMPLEMENTED
+
+	/* check the stop conditions and jump to the block of the next opcode */
+#define DISPATCH() do { \
+	if (used >= max_cycles) { \
+		stop = EMU51_STOP_BUDGET; \
+		goto out; \
+	} \
+	if (take_stop_request(m)) { \
+		stop = EMU51_STOP_HOST; \
+		goto out; \
+	} \
+	if (m->cycles >= m->next_event) \
+		goto event; \
+	if (!TRUSTED && m->pc >= pmem_len) { \
+		stop = EMU51_PMEM_OUT_OF_RANGE; \
+		goto out; \
+	} \
+	if (breakpoints && used > 0 && is_breakpoint(breakpoints, m->pc)) { \
+		stop = EMU51_STOP_BREAKPOINT; \
+		goto out; \
+	} \
+	goto *dispatch[pmem[m->pc]]; } while (0)
+
+	/* fetch the decoded instruction of length b into d */
+#define FETCH(b) do { \
+	emu51_decoded *entry = cache ? &cache->entries[m->pc] : &decoded; \
+	if (!cache || !entry->handler) { \
+		if (!TRUSTED && m->pc + (b) > pmem_len) { \
+			stop = EMU51_PMEM_OUT_OF_RANGE; \
+			goto out; \
+		} \
+		_emu51_decode(entry, &pmem[m->pc], m->pc + (b)); \
+	} \
+	d = entry; } while (0)
+
+	/* run the handler h and account c cycles */
+#define EXECUTE(b, c, h) do { \
+	old_pc = m->pc; \
+	m->pc += (b); \
+	stop = h(d, m); \
+	if (stop) { \
+		m->pc = old_pc; /* restore pc when an error occurs */ \
+		goto out; \
+	} \
+	used += (c); \
+	m->cycles += (c); } while (0)
+
+	DISPATCH();
+
+	/* one block for each implemented opcode; the test for loops that jump to
+	 * themselves is only compiled into the blocks of their opcodes */
+#define INSTR(op, mne, b, c, h) \
+	op_##op: \
+		if (_emu51_is_spin_opcode(op)) { \
+			long skipped = _emu51_fast_forward(m, \
+				event_budget(m, max_cycles - used)); \
+			if (skipped) { \
+				used += skipped; \
+				DISPATCH(); \
+			} \
+		} \
+		FETCH(b); \
+		EXECUTE(b, c, SPECIALIZED(h, op)); \
+		DISPATCH();
+#define NOT_IMPLEMENTED(op)
+#include "instr_table.h"
+#undef INSTR
+#undef NOT_IMPLEMENTED
+
+	/* opcodes without a block go through the instruction table, exactly
+	 * like emu51_step() */
+generic:
+	FETCH(_emu51_decode_instr(pmem[m->pc])->bytes);
+	EXECUTE(d->bytes, d->cycles, d->handler);
+	DISPATCH();
+
+	/* events are handled out of line, see interrupt.h */
+event:
+	stop = _emu51_handle_event(m);
+	if (stop < 0)
+		goto out;
+	used += stop; /* the cycles of a call to an interrupt vector */
+	DISPATCH();
+
+#undef DISPATCH
+#undef FETCH
+#undef EXECUTE
+
+out:
+	if (reason)
+		*reason = stop;
+	return used;
+}
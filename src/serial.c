@@ -0,0 +1,214 @@
+#include <emu51.h>
+#include <string.h>
+
+#include "history.h"
+#include "record.h"
+#include "serial.h"
+
+/* round size up to the alignment of pointers */
+#define ALIGN_UP(size) (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+size_t emu51_serial_size(long capacity)
+{
+	return ALIGN_UP(sizeof(emu51_serial)) + 2 * capacity;
+}
+
+void emu51_set_serial(emu51 *m, void *buffer, long capacity)
+{
+	emu51_serial *serial = buffer;
+
+	if (serial) {
+		serial->rx_head = serial->rx_tail = 0;
+		serial->tx_head = serial->tx_tail = 0;
+		serial->lost = 0;
+		serial->capacity = capacity;
+		serial->rx = (uint8_t*)buffer + ALIGN_UP(sizeof(emu51_serial));
+		serial->tx = serial->rx + capacity;
+	}
+	m->serial = serial;
+}
+
+/* Copy count bytes between the ring buffer and a linear buffer, in up to two
+ * pieces since the bytes may wrap around. */
+static void copy_ring(uint8_t *ring, long capacity, uint64_t start,
+		uint8_t *data, long count, int to_ring)
+{
+	long i;
+
+	for (i = 0; i < count; ) {
+		long index = (long)((start + i) & (capacity - 1));
+		long n = capacity - index;
+		if (n > count - i)
+			n = count - i;
+		if (to_ring)
+			memcpy(&ring[index], &data[i], n);
+		else
+			memcpy(&data[i], &ring[index], n);
+		i += n;
+	}
+}
+
+long _emu51_serial_push(emu51 *m, const uint8_t *data, long len)
+{
+	emu51_serial *serial = m->serial;
+	long count;
+
+	if (!serial)
+		return 0;
+
+	count = serial->capacity - (long)(serial->rx_head - serial->rx_tail);
+	if (count > len)
+		count = len;
+	copy_ring(serial->rx, serial->capacity, serial->rx_head,
+		(uint8_t*)data, count, 1);
+	serial->rx_head += count;
+
+	return count;
+}
+
+long emu51_serial_send(emu51 *m, const uint8_t *data, long len)
+{
+	long count;
+
+	/* the recorded bytes are fed instead */
+	if (m->recorder && m->recorder->mode == EMU51_REPLAY)
+		return m->serial ? len : 0;
+
+	count = _emu51_serial_push(m, data, len);
+	_emu51_record_serial(m, data, count);
+	return count;
+}
+
+long emu51_serial_receive(emu51 *m, uint8_t *data, long max_len)
+{
+	emu51_serial *serial = m->serial;
+	long count;
+
+	if (!serial)
+		return 0;
+
+	count = (long)(serial->tx_head - serial->tx_tail);
+	if (count > max_len)
+		count = max_len;
+	copy_ring(serial->tx, serial->capacity, serial->tx_tail, data, count, 0);
+	serial->tx_tail += count;
+
+	return count;
+}
+
+uint64_t emu51_serial_lost(const emu51 *m)
+{
+	return m->serial ? m->serial->lost : 0;
+}
+
+/* Compute the number of cycles taken by a frame in the current mode.
+ *
+ * transmit: non-zero for the transmitter, which may have another baud rate
+ *           than the receiver with timer 2
+ */
+static uint64_t frame_cycles(const emu51 *m, int transmit)
+{
+	uint8_t scon = m->sfr[SFR_SCON];
+	int smod = m->sfr[SFR_PCON] >> 7;
+	uint64_t bits;
+
+	switch (scon & (SCON_SM0 | SCON_SM1)) {
+		case 0: /* mode 0: 8 bits, one per cycle */
+			return 8;
+		case SCON_SM0: /* mode 2: 11 bits of 64 (SMOD: 32) clocks */
+			return (11 * (smod ? 32 : 64) + 11) / 12;
+		case SCON_SM1: /* mode 1: 10 bits */
+			bits = 10;
+			break;
+		default: /* mode 3: 11 bits */
+			bits = 11;
+			break;
+	}
+
+	/* modes 1 and 3: one bit per 16 overflows of timer 2, which counts 6
+	 * times per cycle as a baud rate generator... */
+	if (m->feature.timer2 && (m->sfr[SFR_T2CON]
+			& (transmit ? T2CON_TCLK : T2CON_RCLK))) {
+		uint32_t reload = (m->sfr[SFR_RCAP2H] << 8) | m->sfr[SFR_RCAP2L];
+		return (bits * 16 * (65536 - reload) + 5) / 6;
+	}
+
+	/* ...or per 32 (SMOD: 16) overflows of timer 1, which is expected to
+	 * run in 8-bit auto-reload mode */
+	return bits * (smod ? 16 : 32) * (256 - m->sfr[SFR_TH1]);
+}
+
+void _emu51_serial_transmit(emu51 *m)
+{
+	/* a transmission in progress is abandoned */
+	m->uart.tx_byte = m->sfr[SFR_SBUF];
+	m->uart.tx_done = m->cycles + frame_cycles(m, 1);
+}
+
+/* Test if there is a byte to receive, and log the start of the reception
+ * for the history. While re-executing from a checkpoint, the logged
+ * receptions start instead. */
+static int rx_available(emu51 *m)
+{
+	emu51_serial *serial = m->serial;
+
+	if (_emu51_history_replaying(m))
+		return _emu51_history_feed(m, HISTORY_RX_START, NULL);
+	if (!serial || serial->rx_head == serial->rx_tail)
+		return 0;
+	if (m->history)
+		_emu51_history_log(m, HISTORY_RX_START, 0);
+	return 1;
+}
+
+/* Take the received byte from the FIFO, and log it for the history. While
+ * re-executing from a checkpoint, the logged byte is taken instead.
+ *
+ * Returns 1 and sets byte if there is one, 0 otherwise. */
+static int rx_take(emu51 *m, uint8_t *byte)
+{
+	emu51_serial *serial = m->serial;
+
+	if (_emu51_history_replaying(m))
+		return _emu51_history_feed(m, HISTORY_RX, byte);
+	/* the host side may have been detached in between */
+	if (!serial || serial->rx_head == serial->rx_tail)
+		return 0;
+	*byte = serial->rx[serial->rx_tail++ & (serial->capacity - 1)];
+	if (m->history)
+		_emu51_history_log(m, HISTORY_RX, *byte);
+	return 1;
+}
+
+void _emu51_serial_check_receive(emu51 *m)
+{
+	uint8_t scon = m->sfr[SFR_SCON];
+
+	if (m->uart.rx_done != UINT64_MAX
+			|| (scon & (SCON_REN | SCON_RI)) != SCON_REN
+			|| !rx_available(m))
+		return;
+	m->uart.rx_done = m->cycles + frame_cycles(m, 0);
+}
+
+void _emu51_serial_sync(emu51 *m)
+{
+	emu51_serial *serial = m->serial;
+
+	if (m->uart.tx_done <= m->cycles) {
+		m->uart.tx_done = UINT64_MAX;
+		m->sfr[SFR_SCON] |= SCON_TI;
+		if (serial && serial->tx_head - serial->tx_tail
+				== (uint64_t)serial->capacity)
+			serial->lost++;
+		else if (serial)
+			serial->tx[serial->tx_head++ & (serial->capacity - 1)]
+				= m->uart.tx_byte;
+	}
+
+	if (m->uart.rx_done <= m->cycles) {
+		m->uart.rx_done = UINT64_MAX;
+		if (rx_take(m, &m->uart.rx_byte))
+			m->sfr[SFR_SCON] |= SCON_RI;
+	}
+}
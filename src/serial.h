@@ -0,0 +1,57 @@
+#ifndef _SERIAL_H_
+#define _SERIAL_H_
+
+/* NOTE: This header file is internal to emu51. */
+
+#include <emu51.h>
+
+/* Serial port.
+ *
+ * A byte written to SBUF is sent, and a byte from the receive FIFO of the
+ * host side is received into emu51::uart.rx_byte, where reads of SBUF find
+ * it, in the time of a frame at the baud rate of the
+ * current mode (see emu51::uart). Like the timers, transfers are not ticked
+ * for each instruction: their end is scheduled as an event (see interrupt.h),
+ * where TI or RI is set.
+ */
+
+/* Host side of the serial port, see emu51_set_serial().
+ *
+ * Two ring buffers of capacity bytes (a power of 2), stored after the header
+ * in the same buffer: rx holds the bytes sent by the host to the firmware,
+ * tx the bytes sent by the firmware to the host. The heads and tails count
+ * the bytes appended and taken since the buffer was attached.
+ */
+struct emu51_serial
+{
+	uint64_t rx_head, rx_tail;
+	uint64_t tx_head, tx_tail;
+	uint64_t lost;     /* bytes sent by the firmware while tx was full */
+	long capacity;     /* size of each ring buffer */
+	uint8_t *rx;
+	uint8_t *tx;
+};
+
+/* Append bytes to the receive FIFO of the host side, see
+ * emu51_serial_send(). */
+long _emu51_serial_push(emu51 *m, const uint8_t *data, long len);
+
+/* Start sending the byte written to SBUF. */
+void _emu51_serial_transmit(emu51 *m);
+
+/* Start receiving the next byte from the host, if the receiver is idle and
+ * enabled (REN set, RI clear) and there is a byte to receive. */
+void _emu51_serial_check_receive(emu51 *m);
+
+/* End the transfers that are done at emu51::cycles, setting TI and RI. */
+void _emu51_serial_sync(emu51 *m);
+
+/* Get the cycle at which the next transfer is done, or UINT64_MAX if the
+ * serial port is idle. */
+static inline uint64_t _emu51_serial_next(const emu51 *m)
+{
+	return m->uart.tx_done < m->uart.rx_done ? m->uart.tx_done
+		: m->uart.rx_done;
+}
+
+#endif /* _SERIAL_H_ */
@@ -0,0 +1,290 @@
+#ifdef EMU51_COW_FORK
+#define _GNU_SOURCE /* memfd_create() */
+#endif
+
+#include <emu51.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef EMU51_COW_FORK
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "helpers.h"
+#include "snapshot.h"
+
+/* round size up to the alignment of pointers */
+#define ALIGN_UP(size) (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+/* Snapshots.
+ *
+ * A snapshot holds a copy of the emulator structure, which carries the
+ * internal state (cycles, timers, interrupts, serial port, ...), and copies
+ * of its memories. The snapshot is never modified after it is taken, so any
+ * number of emulators can be restored or forked from it.
+ *
+ * With EMU51_COW_FORK, the external memory of the snapshot is kept in an
+ * anonymous file, and emu51_fork() maps the file privately instead of copying
+ * it: the pages are shared by the snapshot and its forks until a fork writes
+ * one, and the kernel gives that fork a copy of the page. Otherwise, or if
+ * the file cannot be created, the external memory is copied.
+ */
+
+struct emu51_state
+{
+	emu51 m;           /* the emulator when the snapshot was taken; the
+	                      pointers to its memories are not used */
+	uint8_t sfr[128];
+	uint8_t iram[256]; /* lower, then upper internal memory */
+	int iram_upper;    /* non-zero if the upper internal memory is saved */
+	uint8_t *xram;     /* copy of the external memory, or NULL */
+	int xram_fd;       /* file mapped at xram, or -1 if xram is allocated */
+};
+
+/* Save a copy of the external memory in the snapshot.
+ *
+ * Returns 0 on success, or EMU51_OUT_OF_MEMORY. */
+static int save_xram(emu51_state *s, const uint8_t *xram, long xram_len)
+{
+#ifdef EMU51_COW_FORK
+	int fd = memfd_create("emu51-xram", MFD_CLOEXEC);
+
+	if (fd >= 0) {
+		void *p = MAP_FAILED;
+		if (ftruncate(fd, xram_len) == 0)
+			p = mmap(NULL, xram_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fd, 0);
+		if (p != MAP_FAILED) {
+			memcpy(p, xram, xram_len);
+			mprotect(p, xram_len, PROT_READ);
+			s->xram = p;
+			s->xram_fd = fd;
+			return 0;
+		}
+		close(fd);
+	}
+	/* fall back to a copy */
+#endif
+
+	s->xram = malloc(xram_len);
+	if (!s->xram)
+		return EMU51_OUT_OF_MEMORY;
+	memcpy(s->xram, xram, xram_len);
+	return 0;
+}
+
+/* Map the external memory of the snapshot privately for a fork.
+ *
+ * Returns the mapping, or NULL if the external memory must be copied. */
+static uint8_t *map_xram(const emu51_state *s)
+{
+#ifdef EMU51_COW_FORK
+	if (s->xram_fd >= 0) {
+		void *p = mmap(NULL, s->m.xram_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE, s->xram_fd, 0);
+		if (p != MAP_FAILED)
+			return p;
+	}
+#else
+	(void)s;
+#endif
+	return NULL;
+}
+
+void _emu51_unmap_xram(uint8_t *xram, long xram_len)
+{
+#ifdef EMU51_COW_FORK
+	munmap(xram, xram_len);
+#else
+	(void)xram;
+	(void)xram_len;
+#endif
+}
+
+void _emu51_save_registers(const emu51 *m, emu51 *saved, uint8_t *sfr,
+		uint8_t *iram)
+{
+	memcpy(saved, m, sizeof(emu51));
+	memcpy(sfr, m->sfr, 128);
+	memcpy(iram, m->iram_lower, 128);
+	if (m->iram_upper)
+		memcpy(iram + 128, m->iram_upper, 128);
+}
+
+void _emu51_restore_registers(emu51 *m, const emu51 *saved,
+		const uint8_t *sfr, const uint8_t *iram)
+{
+	m->pc = saved->pc;
+	m->lazy_psw = saved->lazy_psw;
+	m->cycles = saved->cycles;
+	m->next_event = saved->next_event;
+	m->feature = saved->feature;
+	m->timers = saved->timers;
+	m->irq = saved->irq;
+	m->uart = saved->uart;
+
+	memcpy(m->sfr, sfr, 128);
+	memcpy(m->iram_lower, iram, 128);
+	if (m->iram_upper)
+		memcpy(m->iram_upper, iram + 128, 128);
+	map_memory(m);
+}
+
+emu51_state *emu51_snapshot(const emu51 *m)
+{
+	emu51_state *s = malloc(sizeof(emu51_state));
+
+	if (!s)
+		return NULL;
+
+	_emu51_save_registers(m, &s->m, s->sfr, s->iram);
+	s->iram_upper = m->iram_upper != NULL;
+
+	s->xram = NULL;
+	s->xram_fd = -1;
+	if (m->xram && save_xram(s, m->xram, m->xram_len)) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+/* Copy the state of the snapshot to the emulator, except the external memory
+ * if copy_xram is 0. The memories must have the same sizes. */
+static void restore_state(emu51 *m, const emu51_state *s, int copy_xram)
+{
+	_emu51_restore_registers(m, &s->m, s->sfr, s->iram);
+	if (m->xram && copy_xram) {
+		memcpy(m->xram, s->xram, m->xram_len);
+		emu51_mark_xram_dirty(m, 0, m->xram_len);
+	}
+}
+
+int emu51_restore(emu51 *m, const emu51_state *s)
+{
+	if ((m->iram_upper != NULL) != s->iram_upper
+			|| (m->xram != NULL) != (s->xram != NULL)
+			|| (m->xram && m->xram_len != s->m.xram_len))
+		return EMU51_STATE_MISMATCH;
+
+	restore_state(m, s, 1);
+	return 0;
+}
+
+emu51 *emu51_fork(const emu51_state *s)
+{
+	emu51_config config;
+	uint8_t *xram = NULL;
+	emu51 *m;
+
+	memset(&config, 0, sizeof(config));
+	config.pmem = s->m.pmem;
+	config.pmem_len = s->m.pmem_len;
+	config.iram_upper = s->iram_upper;
+	config.feature = s->m.feature;
+	if (s->xram) {
+		config.xram_len = s->m.xram_len;
+		xram = map_xram(s);
+	}
+
+	m = _emu51_create(&config, xram);
+	if (!m) {
+		if (xram)
+			_emu51_unmap_xram(xram, config.xram_len);
+		return NULL;
+	}
+	restore_state(m, s, !xram);
+
+	/* the settings of the host, but not the attached buffers */
+	m->callback = s->m.callback;
+	m->watch = s->m.watch;
+	m->breakpoints = s->m.breakpoints;
+	m->userdata = s->m.userdata;
+	map_memory(m);
+	return m;
+}
+
+void emu51_state_destroy(emu51_state *s)
+{
+	if (!s)
+		return;
+
+#ifdef EMU51_COW_FORK
+	if (s->xram_fd >= 0) {
+		munmap(s->xram, s->m.xram_len);
+		close(s->xram_fd);
+		free(s);
+		return;
+	}
+#endif
+	free(s->xram);
+	free(s);
+}
+
+size_t emu51_baseline_size(const emu51 *m)
+{
+	return ALIGN_UP(sizeof(emu51_baseline)) + (m->xram ? m->xram_len : 0);
+}
+
+void emu51_set_baseline(emu51 *m, void *buffer)
+{
+	emu51_baseline *baseline = buffer;
+
+	m->baseline = baseline;
+	if (!baseline)
+		return;
+
+	_emu51_save_registers(m, &baseline->m, baseline->sfr, baseline->iram);
+	memset(baseline->dirty, 0, sizeof(baseline->dirty));
+	baseline->xram = (uint8_t*)buffer + ALIGN_UP(sizeof(emu51_baseline));
+	if (m->xram)
+		memcpy(baseline->xram, m->xram, m->xram_len);
+}
+
+void emu51_mark_xram_dirty(emu51 *m, uint16_t addr, long len)
+{
+	long page, last;
+
+	if (!m->baseline || len <= 0)
+		return;
+
+	last = (addr + len - 1) / DIRTY_PAGE_SIZE;
+	for (page = addr / DIRTY_PAGE_SIZE;
+			page <= last && page < 65536 / DIRTY_PAGE_SIZE; page++)
+		m->baseline->dirty[page / 8] |= 1 << (page % 8);
+}
+
+void emu51_reset_to_baseline(emu51 *m)
+{
+	emu51_baseline *baseline = m->baseline;
+	long len = m->xram ? m->xram_len : 0;
+	long pages, i;
+
+	if (!baseline)
+		return;
+
+	/* the last page may be partial; addresses beyond 64k are not tracked */
+	pages = (len + DIRTY_PAGE_SIZE - 1) / DIRTY_PAGE_SIZE;
+	if (pages > 65536 / DIRTY_PAGE_SIZE)
+		pages = 65536 / DIRTY_PAGE_SIZE;
+
+	_emu51_restore_registers(m, &baseline->m, baseline->sfr, baseline->iram);
+
+	/* the dirty pages, skipping clean bytes of the bitmap */
+	for (i = 0; i < pages; i += 8) {
+		uint8_t bits = baseline->dirty[i / 8];
+		long page;
+
+		if (!bits)
+			continue;
+		baseline->dirty[i / 8] = 0;
+		for (page = i; bits && page < pages; page++, bits >>= 1) {
+			long offset = page * DIRTY_PAGE_SIZE;
+			if (bits & 1)
+				memcpy(&m->xram[offset], &baseline->xram[offset],
+					len - offset < DIRTY_PAGE_SIZE ? len - offset
+					: DIRTY_PAGE_SIZE);
+		}
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+/* NOTE: This header file is internal to emu51. */
+
+#include <emu51.h>
+
+/* size of the pages of external memory whose writes are tracked */
+#define DIRTY_PAGE_SIZE 256
+
+/* Baseline state, see emu51_set_baseline().
+ *
+ * The saved registers and memories are stored after the header in the same
+ * buffer. Since the internal memory and the SFRs are small, they are restored
+ * as a whole; the external memory is restored by pages, only for the pages
+ * marked in the dirty bitmap.
+ */
+struct emu51_baseline
+{
+	emu51 m;           /* the emulator when the baseline was set; the pointers
+	                      to its memories are not used */
+	uint8_t sfr[128];
+	uint8_t iram[256]; /* lower, then upper internal memory */
+	uint8_t dirty[65536 / DIRTY_PAGE_SIZE / 8]; /* bitmap of the written
+	                                               pages of xram */
+	uint8_t *xram;     /* copy of the external memory */
+};
+
+/* Mark the page of external memory at addr as written, if a baseline is
+ * set. */
+static inline void mark_xram_dirty(emu51 *m, uint16_t addr)
+{
+	if (m->baseline) {
+		unsigned int page = addr / DIRTY_PAGE_SIZE;
+		m->baseline->dirty[page / 8] |= 1 << (page % 8);
+	}
+}
+
+/* Save the emulator structure, the SFRs and the internal memory (lower, then
+ * upper). */
+void _emu51_save_registers(const emu51 *m, emu51 *saved, uint8_t *sfr,
+		uint8_t *iram);
+
+/* Restore the state saved by _emu51_save_registers(). */
+void _emu51_restore_registers(emu51 *m, const emu51 *saved,
+		const uint8_t *sfr, const uint8_t *iram);
+
+/* Allocate an emulator like emu51_create(). If xram is not NULL, it is used as
+ * the external memory instead of allocating one: it is a mapping made by
+ * emu51_fork(), which emu51_destroy() releases with _emu51_unmap_xram(). */
+emu51 *_emu51_create(const emu51_config *config, uint8_t *xram);
+
+/* Release the external memory mapped by emu51_fork(). */
+void _emu51_unmap_xram(uint8_t *xram, long xram_len);
+
+#endif
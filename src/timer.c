@@ -0,0 +1,255 @@
+#include <emu51.h>
+
+#include "timer.h"
+
+/* The counters of the timers. In mode 3, timer 0 is split into two 8-bit
+ * counters, TL0 (COUNTER_T0) and TH0 (COUNTER_TH0). */
+enum timer_counter
+{
+	COUNTER_T0,
+	COUNTER_T1,
+	COUNTER_TH0,
+	COUNTER_COUNT
+};
+
+/* State of a counter, see load_counter(). */
+typedef struct counter
+{
+	unsigned int value;  /* current count */
+	unsigned int size;   /* count at which the counter overflows */
+	unsigned int reload; /* count after an overflow */
+} counter;
+
+/* Get the mode (0~3) of the timer (0 or 1). */
+static int timer_mode(const emu51 *m, int timer)
+{
+	return (m->sfr[SFR_TMOD] >> (4 * timer)) & (TMOD_T0_M1 | TMOD_T0_M0);
+}
+
+/* Test if the timer (0 or 1) counts machine cycles. The timer is enabled by
+ * TRx, and also by the INTx pin (P3.2 or P3.3) if GATE is set. In counter
+ * mode (C/T set), the Tx pins are not emulated, so the timer never counts. */
+static int timer_enabled(const emu51 *m, int timer)
+{
+	uint8_t tmod = m->sfr[SFR_TMOD] >> (4 * timer);
+	uint8_t run = timer ? TCON_TR1 : TCON_TR0;
+
+	if (tmod & TMOD_T0_CT)
+		return 0;
+	if ((tmod & TMOD_T0_GATE) && !(m->sfr[SFR_P3] & (0x04 << timer)))
+		return 0;
+	return (m->sfr[SFR_TCON] & run) != 0;
+}
+
+/* Get the TF bit set when the counter overflows, or 0 if none (timer 1 while
+ * timer 0 is in mode 3). Returns -1 if the counter doesn't count. */
+static int counter_flag(const emu51 *m, int index)
+{
+	int split = timer_mode(m, 0) == 3;
+
+	switch (index) {
+		case COUNTER_T0:
+			return timer_enabled(m, 0) ? TCON_TF0 : -1;
+		case COUNTER_T1:
+			/* mode 3 stops timer 1; while timer 0 is split, TR1 and TF1
+			 * belong to TH0, and timer 1 runs unless it is in mode 3 */
+			if (timer_mode(m, 1) == 3)
+				return -1;
+			if (split)
+				return (m->sfr[SFR_TMOD] & TMOD_T1_CT) ? -1 : 0;
+			return timer_enabled(m, 1) ? TCON_TF1 : -1;
+		default: /* COUNTER_TH0 */
+			return split && (m->sfr[SFR_TCON] & TCON_TR1) ? TCON_TF1 : -1;
+	}
+}
+
+/* Read the counter from its SFRs. */
+static void load_counter(const emu51 *m, int index, counter *c)
+{
+	int timer = index == COUNTER_T1;
+	uint8_t tl = m->sfr[timer ? SFR_TL1 : SFR_TL0];
+	uint8_t th = m->sfr[timer ? SFR_TH1 : SFR_TH0];
+
+	c->reload = 0;
+	if (index == COUNTER_TH0) {
+		c->value = th;
+		c->size = 0x100;
+		return;
+	}
+
+	switch (timer_mode(m, timer)) {
+		case 0: /* 13 bits: THx and the lower 5 bits of TLx */
+			c->value = (th << 5) | (tl & 0x1f);
+			c->size = 0x2000;
+			break;
+		case 1: /* 16 bits */
+			c->value = (th << 8) | tl;
+			c->size = 0x10000;
+			break;
+		case 2: /* 8 bits, reloaded from THx */
+			c->value = tl;
+			c->size = 0x100;
+			c->reload = th;
+			break;
+		default: /* TL0 of the split timer 0 */
+			c->value = tl;
+			c->size = 0x100;
+	}
+}
+
+/* Write the counter back to its SFRs. */
+static void store_counter(emu51 *m, int index, const counter *c)
+{
+	int timer = index == COUNTER_T1;
+	uint8_t *tl = &m->sfr[timer ? SFR_TL1 : SFR_TL0];
+	uint8_t *th = &m->sfr[timer ? SFR_TH1 : SFR_TH0];
+
+	if (index == COUNTER_TH0) {
+		*th = c->value;
+		return;
+	}
+
+	switch (timer_mode(m, timer)) {
+		case 0:
+			*th = c->value >> 5;
+			*tl = (*tl & 0xe0) | (c->value & 0x1f);
+			break;
+		case 1:
+			*th = c->value >> 8;
+			*tl = c->value & 0xff;
+			break;
+		default:
+			*tl = c->value;
+	}
+}
+
+/* Advance the counter by n counts.
+ *
+ * Returns non-zero if it overflowed.
+ */
+static int advance_counter(counter *c, uint64_t n)
+{
+	unsigned int period = c->size - c->reload;
+
+	if (n < c->size - c->value) {
+		c->value += n;
+		return 0;
+	}
+	n -= c->size - c->value;
+	c->value = c->reload + n % period;
+	return 1;
+}
+
+/* Get the T2CON bits selecting the baud rate generator mode of timer 2. */
+#define T2CON_BAUD (T2CON_RCLK | T2CON_TCLK)
+
+/* Test if timer 2 counts machine cycles. In counter mode (C/T2 set), the T2
+ * pin is not emulated, so the timer never counts. */
+static int timer2_enabled(const emu51 *m)
+{
+	return m->feature.timer2
+		&& (m->sfr[SFR_T2CON] & (T2CON_TR2 | T2CON_C_T2)) == T2CON_TR2;
+}
+
+/* Read timer 2 from its SFRs. In the auto-reload and baud rate generator
+ * modes, it is reloaded from RCAP2H:RCAP2L on overflow. */
+static void load_timer2(const emu51 *m, counter *c)
+{
+	c->value = (m->sfr[SFR_TH2] << 8) | m->sfr[SFR_TL2];
+	c->size = 0x10000;
+	c->reload = 0;
+	if ((m->sfr[SFR_T2CON] & (T2CON_BAUD | T2CON_CP_RL2)) != T2CON_CP_RL2)
+		c->reload = (m->sfr[SFR_RCAP2H] << 8) | m->sfr[SFR_RCAP2L];
+}
+
+/* Write timer 2 back to its SFRs. */
+static void store_timer2(emu51 *m, const counter *c)
+{
+	m->sfr[SFR_TH2] = c->value >> 8;
+	m->sfr[SFR_TL2] = c->value & 0xff;
+}
+
+/* Count timer 2 by the elapsed cycles. As a baud rate generator, it counts
+ * every state (6 times per machine cycle) and its overflows don't set TF2. */
+static void sync_timer2(emu51 *m, uint64_t elapsed)
+{
+	int baud = (m->sfr[SFR_T2CON] & T2CON_BAUD) != 0;
+	counter c;
+
+	load_timer2(m, &c);
+	if (advance_counter(&c, baud ? elapsed * 6 : elapsed) && !baud)
+		m->sfr[SFR_T2CON] |= T2CON_TF2;
+	store_timer2(m, &c);
+}
+
+void _emu51_timer_check_t2ex(emu51 *m)
+{
+	uint8_t level = m->sfr[SFR_P1] & 0x02;
+	uint8_t t2con = m->sfr[SFR_T2CON];
+	int falling = m->timers.t2ex && !level;
+
+	m->timers.t2ex = level;
+	if (!m->feature.timer2 || !falling || !(t2con & T2CON_EXEN2))
+		return;
+
+	m->sfr[SFR_T2CON] |= T2CON_EXF2;
+	if (t2con & T2CON_BAUD)
+		return;
+	if (t2con & T2CON_CP_RL2) {
+		m->sfr[SFR_RCAP2H] = m->sfr[SFR_TH2];
+		m->sfr[SFR_RCAP2L] = m->sfr[SFR_TL2];
+	} else {
+		m->sfr[SFR_TH2] = m->sfr[SFR_RCAP2H];
+		m->sfr[SFR_TL2] = m->sfr[SFR_RCAP2L];
+	}
+}
+
+void _emu51_timer_sync(emu51 *m)
+{
+	uint64_t elapsed = m->cycles - m->timers.synced;
+	int i;
+
+	if (!elapsed)
+		return;
+	m->timers.synced = m->cycles;
+
+	for (i = 0; i < COUNTER_COUNT; i++) {
+		int flag = counter_flag(m, i);
+		counter c;
+
+		if (flag < 0)
+			continue;
+		load_counter(m, i, &c);
+		if (advance_counter(&c, elapsed))
+			m->sfr[SFR_TCON] |= flag;
+		store_counter(m, i, &c);
+	}
+
+	if (timer2_enabled(m))
+		sync_timer2(m, elapsed);
+}
+
+uint64_t _emu51_timer_next(const emu51 *m)
+{
+	uint64_t next = UINT64_MAX;
+	counter c;
+	int i;
+
+	for (i = 0; i < COUNTER_COUNT; i++) {
+		/* an overflow of timer 1 without a flag can't be observed */
+		if (counter_flag(m, i) <= 0)
+			continue;
+		load_counter(m, i, &c);
+		if (m->timers.synced + (c.size - c.value) < next)
+			next = m->timers.synced + (c.size - c.value);
+	}
+
+	/* neither can an overflow of the baud rate generator */
+	if (timer2_enabled(m) && !(m->sfr[SFR_T2CON] & T2CON_BAUD)) {
+		load_timer2(m, &c);
+		if (m->timers.synced + (c.size - c.value) < next)
+			next = m->timers.synced + (c.size - c.value);
+	}
+
+	return next;
+}
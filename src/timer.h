@@ -0,0 +1,30 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+/* NOTE: This header file is internal to emu51. */
+
+#include <emu51.h>
+
+/* Timers 0 and 1, and timer 2 if emu51_features::timer2 is set.
+ *
+ * The timers are not ticked for each instruction. The timer SFRs (TCON, TLx,
+ * THx, ...) hold the state as of emu51::timers.synced, and are brought up to
+ * date by _emu51_timer_sync() when they are read, before they are written,
+ * and when emu51_step() or emu51_run() returns. The next overflow that sets
+ * a flag is scheduled as an event, see interrupt.h.
+ */
+
+/* Count the timers up to emu51::cycles, setting their flags on overflow. */
+void _emu51_timer_sync(emu51 *m);
+
+/* Act upon a falling edge of T2EX (P1.1) since it was last seen: if timer 2
+ * exists and EXEN2 is set, EXF2 is set and timer 2 is captured into
+ * RCAP2H:RCAP2L (capture mode) or reloaded from it (auto-reload mode). The
+ * timers must be in sync. */
+void _emu51_timer_check_t2ex(emu51 *m);
+
+/* Get the cycle of the next timer overflow that sets a flag, or UINT64_MAX
+ * if there is none. The timers must be in sync. */
+uint64_t _emu51_timer_next(const emu51 *m);
+
+#endif /* _TIMER_H_ */
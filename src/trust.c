@@ -0,0 +1,160 @@
+#include <emu51.h>
+#include <string.h>
+
+#include "instr.h"
+#include "trust.h"
+
+/* round size up to the alignment of pointers */
+#define ALIGN_UP(size) (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+/* size of the bitmap of verified addresses */
+#define BITMAP_SIZE (65536 / 8)
+
+size_t emu51_trust_size(long pmem_len)
+{
+	return ALIGN_UP(sizeof(emu51_trust)) + BITMAP_SIZE
+		+ pmem_len * sizeof(uint16_t);
+}
+
+/* Start over with no verified address for the current program memory. */
+static void reset_trust(emu51 *m, emu51_trust *trust)
+{
+	memset(trust->verified, 0, BITMAP_SIZE);
+	trust->pmem = m->pmem;
+	trust->pmem_len = m->pmem_len;
+}
+
+int emu51_set_trusted(emu51 *m, void *buffer)
+{
+	emu51_trust *trust = buffer;
+	int err;
+
+	m->trust = NULL;
+	if (!trust)
+		return 0;
+
+	trust->verified = (uint8_t*)buffer + ALIGN_UP(sizeof(emu51_trust));
+	trust->queue = (uint16_t*)(trust->verified + BITMAP_SIZE);
+	trust->capacity = m->pmem_len;
+	reset_trust(m, trust);
+
+	/* the firmware is checked from the reset vector */
+	err = _emu51_trust_verify(trust, 0);
+	if (err)
+		return err;
+
+	m->trust = trust;
+	return 0;
+}
+
+/* Test if the execution can continue with the next instruction after the
+ * opcode, i.e. the opcode isn't an unconditional jump. */
+static int falls_through(uint8_t opcode)
+{
+	if ((opcode & 0x1f) == 0x01) /* AJMP */
+		return 0;
+
+	switch (opcode) {
+		case 0x02: /* LJMP */
+		case 0x22: /* RET */
+		case 0x32: /* RETI */
+		case 0x73: /* JMP @A+DPTR */
+		case 0x80: /* SJMP */
+			return 0;
+	}
+	return 1;
+}
+
+/* Mark the address and append it to the queue, unless it is already
+ * verified or queued. */
+static inline void enqueue(emu51_trust *trust, uint16_t addr, long *tail)
+{
+	if (_emu51_is_verified(trust, addr))
+		return;
+	trust->verified[addr / 8] |= 1 << (addr % 8);
+	trust->queue[(*tail)++] = addr;
+}
+
+int _emu51_trust_verify(emu51_trust *trust, uint16_t entry)
+{
+	/* Breadth-first search over the static successors. The addresses are
+	 * marked when they are queued and stay in the queue, so that the marks
+	 * made by this call can be undone if the code is rejected. */
+	long head = 0, tail = 0, i;
+	int err = 0;
+
+	if (entry >= trust->pmem_len)
+		return EMU51_PMEM_OUT_OF_RANGE;
+	enqueue(trust, entry, &tail);
+
+	while (head < tail) {
+		uint16_t pc = trust->queue[head++];
+		const emu51_instr *instr = _emu51_decode_instr(trust->pmem[pc]);
+		emu51_decoded d;
+		uint16_t succ[2];
+		int n = 0, j;
+
+		if (!instr->handler) {
+			err = EMU51_NOT_IMPLEMENTED;
+			break;
+		}
+		if (pc + instr->bytes > trust->pmem_len) {
+			err = EMU51_PMEM_OUT_OF_RANGE;
+			break;
+		}
+
+		uint16_t next = pc + instr->bytes;
+		_emu51_decode(&d, &trust->pmem[pc], next);
+		if (falls_through(d.code[0]))
+			succ[n++] = next;
+		switch (_emu51_branch_kind(d.code[0])) {
+			case BRANCH_RELATIVE:
+				succ[n++] = (uint16_t)(next + d.reladdr);
+				break;
+			case BRANCH_ABSOLUTE:
+				succ[n++] = d.target;
+				break;
+		}
+
+		for (j = 0; j < n; j++) {
+			if (succ[j] >= trust->pmem_len) {
+				err = EMU51_PMEM_OUT_OF_RANGE;
+				break;
+			}
+			enqueue(trust, succ[j], &tail);
+		}
+		if (err)
+			break;
+	}
+
+	if (err) {
+		for (i = 0; i < tail; i++) {
+			uint16_t addr = trust->queue[i];
+			trust->verified[addr / 8] &= ~(1 << (addr % 8));
+		}
+	}
+	return err;
+}
+
+int _emu51_enter_trusted(emu51 *m)
+{
+	emu51_trust *trust = m->trust;
+
+	if (!trust)
+		return 0;
+
+	if (trust->pmem != m->pmem || trust->pmem_len != m->pmem_len) {
+		if (m->pmem_len > trust->capacity) {
+			m->trust = NULL;
+			return 0;
+		}
+		reset_trust(m, trust);
+	}
+
+	if (!_emu51_is_verified(trust, m->pc)) {
+		int err = _emu51_trust_verify(trust, m->pc);
+		if (err)
+			return err;
+	}
+	return 1;
+}
@@ -0,0 +1,66 @@
+#ifndef _TRUST_H_
+#define _TRUST_H_
+
+/* NOTE: This header file is internal to emu51. */
+
+#include <emu51.h>
+
+/* Trusted program memory, see emu51_set_trusted().
+ *
+ * An address is verified if the instruction there is implemented and lies
+ * entirely in program memory, and all its static successors (the following
+ * instruction and direct jump targets) are verified. Execution that starts at
+ * a verified address only reaches verified addresses, except through indirect
+ * jumps, which check their target with _emu51_trust_jump().
+ *
+ * The bitmap and the work queue of the verifier are stored after the header
+ * in the same buffer.
+ */
+struct emu51_trust
+{
+	const uint8_t *pmem; /* program memory that was verified */
+	long pmem_len;       /* size of that program memory */
+	long capacity;       /* number of addresses the buffer can hold */
+
+	/* bitmap of verified addresses, covering the whole 64k address space so
+	 * that any pc can be looked up */
+	uint8_t *verified;
+	uint16_t *queue;   /* work queue of the verifier, capacity entries */
+};
+
+/* Test if the address is verified. */
+static inline int _emu51_is_verified(const emu51_trust *trust, uint16_t addr)
+{
+	return (trust->verified[addr / 8] >> (addr % 8)) & 1;
+}
+
+/* Verify the code reachable from entry.
+ *
+ * Returns 0 on success. Otherwise returns EMU51_NOT_IMPLEMENTED or
+ * EMU51_PMEM_OUT_OF_RANGE, and no address is marked by the call.
+ */
+int _emu51_trust_verify(emu51_trust *trust, uint16_t entry);
+
+/* Prepare the trusted mode for emu51_step() or emu51_run(): the trusted
+ * program memory is verified again if it was swapped (and detached if it no
+ * longer fits), and pc must be verified.
+ *
+ * Returns 1 if the instruction at pc may run in trusted mode, 0 if the
+ * emulator is not in trusted mode, or an error number if pc can't be
+ * verified.
+ */
+int _emu51_enter_trusted(emu51 *m);
+
+/* Check the target of an indirect jump in trusted mode.
+ *
+ * Returns 0 if the jump can be taken, or an error number if the code at the
+ * target can't be verified.
+ */
+static inline int _emu51_trust_jump(emu51 *m, uint16_t target)
+{
+	if (!m->trust || _emu51_is_verified(m->trust, target))
+		return 0;
+	return _emu51_trust_verify(m->trust, target);
+}
+
+#endif /* _TRUST_H_ */
@@ -2,6 +2,11 @@
 
 #include "test_instr_common.h"
 
+/* disable unused parameter warning when using gcc */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+
 struct arith_testcase {
 	uint8_t reg;      /* original value of the target register */
 	uint8_t operand;  /* value of the operand */
@@ -71,6 +76,7 @@ void test_add_addc(void **state)
 		struct arith_testcase *t = &add_testcases[i];
 		ACC(m) = t->reg;
 		PSW(m) = 0xff;
+		expect_value(callback_sfr_update, index, SFR_ACC);
 		expect_value(callback_sfr_update, index, SFR_PSW);
 		err = run_instr(INSTR2(0x24, t->operand), data);
 		assert_int_equal(err, 0);
@@ -87,6 +93,7 @@ void test_add_addc(void **state)
 			PSW(m) = 0;
 		else
 			PSW(m) = PSW_C;
+		expect_value(callback_sfr_update, index, SFR_ACC);
 		expect_value(callback_sfr_update, index, SFR_PSW);
 		err = run_instr(INSTR2(0x34, t->operand), data);
 		assert_int_equal(err, 0);
@@ -105,6 +112,7 @@ void test_add_addc(void **state)
 		ACC(m) = t->reg;
 		PSW(m) = 0xff;
 		m->iram_lower[addr] = t->operand;
+		expect_value(callback_sfr_update, index, SFR_ACC);
 		expect_value(callback_sfr_update, index, SFR_PSW);
 		err = run_instr(INSTR2(0x25, addr), data);
 		assert_int_equal(err, 0);
@@ -117,6 +125,7 @@ void test_add_addc(void **state)
 		ACC(m) = t->reg;
 		PSW(m) = 0xff;
 		m->sfr[addr - 0x80] = t->operand;
+		expect_value(callback_sfr_update, index, SFR_ACC);
 		expect_value(callback_sfr_update, index, SFR_PSW);
 		err = run_instr(INSTR2(0x25, addr), data);
 		assert_int_equal(err, 0);
@@ -135,6 +144,7 @@ void test_add_addc(void **state)
 		ACC(m) = t->reg;
 		PSW(m) = t->carry_in ? 0xff : ~PSW_C;
 		m->iram_lower[addr] = t->operand;
+		expect_value(callback_sfr_update, index, SFR_ACC);
 		expect_value(callback_sfr_update, index, SFR_PSW);
 		err = run_instr(INSTR2(0x35, addr), data);
 		assert_int_equal(err, 0);
@@ -147,6 +157,7 @@ void test_add_addc(void **state)
 		ACC(m) = t->reg;
 		PSW(m) = t->carry_in ? 0xff : ~PSW_C;
 		m->sfr[addr - 0x80] = t->operand;
+		expect_value(callback_sfr_update, index, SFR_ACC);
 		expect_value(callback_sfr_update, index, SFR_PSW);
 		err = run_instr(INSTR2(0x35, addr), data);
 		assert_int_equal(err, 0);
@@ -172,6 +183,7 @@ void test_add_addc(void **state)
 			PSW(m) = 0xff;
 			R_REG(m, reg) = addr;
 			m->iram_lower[addr] = t->operand;
+			expect_value(callback_sfr_update, index, SFR_ACC);
 			expect_value(callback_sfr_update, index, SFR_PSW);
 			err = run_instr(INSTR1(opcode), data);
 			assert_int_equal(err, 0);
@@ -185,6 +197,7 @@ void test_add_addc(void **state)
 			PSW(m) = 0xff;
 			R_REG(m, reg) = addr;
 			m->iram_upper[addr - 0x80] = t->operand;
+			expect_value(callback_sfr_update, index, SFR_ACC);
 			expect_value(callback_sfr_update, index, SFR_PSW);
 			err = run_instr(INSTR1(opcode), data);
 			assert_int_equal(err, 0);
@@ -211,6 +224,7 @@ void test_add_addc(void **state)
 			PSW(m) = t->carry_in ? PSW_C : 0;
 			R_REG(m, reg) = addr;
 			m->iram_lower[addr] = t->operand;
+			expect_value(callback_sfr_update, index, SFR_ACC);
 			expect_value(callback_sfr_update, index, SFR_PSW);
 			err = run_instr(INSTR1(opcode), data);
 			assert_int_equal(err, 0);
@@ -224,6 +238,7 @@ void test_add_addc(void **state)
 			PSW(m) = t->carry_in ? PSW_C : 0;
 			R_REG(m, reg) = addr;
 			m->iram_upper[addr - 0x80] = t->operand;
+			expect_value(callback_sfr_update, index, SFR_ACC);
 			expect_value(callback_sfr_update, index, SFR_PSW);
 			err = run_instr(INSTR1(opcode), data);
 			assert_int_equal(err, 0);
@@ -245,6 +260,7 @@ void test_add_addc(void **state)
 			ACC(m) = t->reg;
 			PSW(m) = 0xff;
 			R_REG(m, reg) = t->operand;
+			expect_value(callback_sfr_update, index, SFR_ACC);
 			expect_value(callback_sfr_update, index, SFR_PSW);
 			err = run_instr(INSTR1(opcode), data);
 			assert_int_equal(err, 0);
@@ -265,6 +281,7 @@ void test_add_addc(void **state)
 			ACC(m) = t->reg;
 			PSW(m) = t->carry_in ? PSW_C : 0;
 			R_REG(m, reg) = t->operand;
+			expect_value(callback_sfr_update, index, SFR_ACC);
 			expect_value(callback_sfr_update, index, SFR_PSW);
 			err = run_instr(INSTR1(opcode), data);
 			assert_int_equal(err, 0);
@@ -277,10 +294,48 @@ void test_add_addc(void **state)
 	free_test_data(data);
 }
 
+/* P follows the parity of ACC after ADD/ADDC */
+void test_add_parity(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = data->m;
+	int err;
+
+	ACC(m) = 0x00;
+	PSW(m) = 0;
+	expect_value(callback_sfr_update, index, SFR_ACC);
+	expect_value(callback_sfr_update, index, SFR_PSW);
+	err = run_instr(INSTR2(0x24, 0x07), data); /* 3 bits set */
+	assert_int_equal(err, 0);
+	assert_int_equal(PSW(m) & PSW_P, PSW_P);
+
+	expect_value(callback_sfr_update, index, SFR_ACC);
+	expect_value(callback_sfr_update, index, SFR_PSW);
+	err = run_instr(INSTR2(0x24, 0x0c), data); /* 0x13: 3 bits set */
+	assert_int_equal(err, 0);
+	assert_int_equal(PSW(m) & PSW_P, PSW_P);
+
+	PSW(m) = PSW_C;
+	expect_value(callback_sfr_update, index, SFR_ACC);
+	expect_value(callback_sfr_update, index, SFR_PSW);
+	err = run_instr(INSTR2(0x34, 0x11), data); /* 0x25: 3 bits set */
+	assert_int_equal(err, 0);
+	assert_int_equal(PSW(m) & PSW_P, PSW_P);
+
+	expect_value(callback_sfr_update, index, SFR_ACC);
+	expect_value(callback_sfr_update, index, SFR_PSW);
+	err = run_instr(INSTR2(0x24, 0xdb), data); /* 0x00: no bits set */
+	assert_int_equal(err, 0);
+	assert_int_equal(PSW(m) & PSW_P, 0);
+
+	free_test_data(data);
+}
+
 int main()
 {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_add_addc),
+		cmocka_unit_test(test_add_parity),
 	};
 	return cmocka_run_group_tests(tests, NULL, NULL);
 }
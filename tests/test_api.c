@@ -3,6 +3,7 @@
 #include <setjmp.h>
 #include <string.h>
 #include <cmocka.h>
+#include <stdlib.h>
 
 #include <emu51.h>
 
@@ -113,12 +114,1373 @@ void test_step(void **state)
 	free(xram);
 }
 
+/* sfr_update callback used to stop emu51_run() from inside the emulator */
+static void stop_on_sfr_update(emu51 *m, uint8_t index)
+{
+	emu51_stop(m);
+}
+
+void test_run(void **state)
+{
+	uint8_t iram_lower[128], sfr[128];
+	uint8_t *pmem = calloc(4096, 1);
+	uint8_t breakpoints[4096 / 8];
+	int reason, cycles;
+	long used;
+
+	emu51 m;
+	memset(&m, 0, sizeof(m));
+	memset(iram_lower, 0, sizeof(iram_lower));
+	memset(sfr, 0, sizeof(sfr));
+	m.pmem = pmem;
+	m.pmem_len = 4096;
+	m.sfr = sfr;
+	m.iram_lower = iram_lower;
+	emu51_reset(&m);
+
+	/* program: NOP; NOP; SJMP $-2 (loops over the second NOP forever) */
+	pmem[0] = 0x00;
+	pmem[1] = 0x00;
+	pmem[2] = 0x80; /* SJMP */
+	pmem[3] = 0xfd; /* -3 */
+
+	/* run until the budget is exhausted: 1 + (1 + 2) * n cycles */
+	used = emu51_run(&m, 10, &reason);
+	assert_int_equal(reason, EMU51_STOP_BUDGET);
+	assert_int_equal(used, 10);
+	assert_int_equal(m.pc, 1);
+
+	/* the last instruction may overrun the budget */
+	used = emu51_run(&m, 2, &reason);
+	assert_int_equal(reason, EMU51_STOP_BUDGET);
+	assert_int_equal(used, 3);
+	assert_int_equal(m.pc, 1);
+
+	/* a zero budget executes nothing */
+	used = emu51_run(&m, 0, NULL);
+	assert_int_equal(used, 0);
+	assert_int_equal(m.pc, 1);
+
+	/* the result must match calling emu51_step() in a loop */
+	m.pc = 0;
+	used = 0;
+	while (used < 100) {
+		assert_int_equal(emu51_step(&m, &cycles), 0);
+		used += cycles;
+	}
+	uint16_t step_pc = m.pc;
+	m.pc = 0;
+	assert_int_equal(emu51_run(&m, 100, &reason), used);
+	assert_int_equal(m.pc, step_pc);
+
+	/* breakpoint on the SJMP */
+	memset(breakpoints, 0, sizeof(breakpoints));
+	breakpoints[0] = 1 << 2;
+	m.breakpoints = breakpoints;
+	m.pc = 0;
+	used = emu51_run(&m, 100, &reason);
+	assert_int_equal(reason, EMU51_STOP_BREAKPOINT);
+	assert_int_equal(used, 2);
+	assert_int_equal(m.pc, 2);
+
+	/* resuming from the breakpoint executes the SJMP and stops again */
+	used = emu51_run(&m, 100, &reason);
+	assert_int_equal(reason, EMU51_STOP_BREAKPOINT);
+	assert_int_equal(used, 3);
+	assert_int_equal(m.pc, 2);
+	m.breakpoints = NULL;
+
+	/* stop requested before running */
+	emu51_stop(&m);
+	used = emu51_run(&m, 100, &reason);
+	assert_int_equal(reason, EMU51_STOP_HOST);
+	assert_int_equal(used, 0);
+	assert_int_equal(m.stop_request, 0);
+
+	/* a pending stop is taken before the events and with no budget */
+	sfr[SFR_IE] = IE_EA | IE_ET0;
+	sfr[SFR_TCON] = TCON_TF0;
+	emu51_stop(&m);
+	used = emu51_run(&m, 100, &reason);
+	assert_int_equal(reason, EMU51_STOP_HOST);
+	assert_int_equal(used, 0);
+	assert_int_equal(m.pc, 2);
+	sfr[SFR_IE] = 0;
+	sfr[SFR_TCON] = 0;
+	emu51_stop(&m);
+	used = emu51_run(&m, 0, &reason);
+	assert_int_equal(reason, EMU51_STOP_HOST);
+	assert_int_equal(m.stop_request, 0);
+
+	/* stop requested by a callback: ADD A, #1 updates PSW */
+	pmem[0] = 0x24;
+	pmem[1] = 0x01;
+	pmem[2] = 0x80; /* SJMP $ */
+	pmem[3] = 0xfe;
+	m.callback.sfr_update = stop_on_sfr_update;
+	m.pc = 0;
+	used = emu51_run(&m, 100, &reason);
+	assert_int_equal(reason, EMU51_STOP_HOST);
+	assert_int_equal(used, 1);
+	assert_int_equal(m.pc, 2);
+	m.callback.sfr_update = NULL;
+
+	/* errors stop the run and leave pc at the offending instruction */
+	pmem[4094] = 0x00; /* NOP */
+	pmem[4095] = 0x02; /* LJMP, truncated by the end of program memory */
+	m.pc = 4094;
+	used = emu51_run(&m, 100, &reason);
+	assert_int_equal(reason, EMU51_PMEM_OUT_OF_RANGE);
+	assert_int_equal(used, 1);
+	assert_int_equal(m.pc, 4095);
+
+	free(pmem);
+}
+
+void test_decode(void **state)
+{
+	emu51_decoded d;
+	uint8_t code[3];
+
+	/* ADD A, R5: register index from the lowest 3 bits */
+	code[0] = 0x2d;
+	_emu51_decode(&d, code, 0x101);
+	assert_ptr_equal(d.handler, _emu51_decode_instr(0x2d)->handler);
+	assert_int_equal(d.bytes, 1);
+	assert_int_equal(d.cycles, 1);
+	assert_int_equal(d.reg, 5);
+
+	/* ADD A, @R1: register index from the lowest bit */
+	code[0] = 0x27;
+	_emu51_decode(&d, code, 0x101);
+	assert_int_equal(d.reg, 1);
+
+	/* CJNE A, #data, reladdr: offset is the last byte */
+	code[0] = 0xb4;
+	code[1] = 0x12;
+	code[2] = 0xf0;
+	_emu51_decode(&d, code, 0x103);
+	assert_int_equal(d.code[1], 0x12);
+	assert_int_equal(d.reladdr, -16);
+
+	/* AJMP page5: target within the 2k block of the next instruction */
+	code[0] = 0xa1;
+	code[1] = 0x34;
+	_emu51_decode(&d, code, 0xf7ff);
+	assert_int_equal(d.target, 0xf534);
+	_emu51_decode(&d, code, 0xf800);
+	assert_int_equal(d.target, 0xfd34);
+
+	/* LCALL addr16 */
+	code[0] = 0x12;
+	code[1] = 0xab;
+	code[2] = 0xcd;
+	_emu51_decode(&d, code, 0x0003);
+	assert_int_equal(d.target, 0xabcd);
+
+	/* bytes beyond the instruction are not read */
+	code[0] = 0x00;
+	code[1] = 0xff;
+	code[2] = 0xff;
+	_emu51_decode(&d, code, 0x0001);
+	assert_int_equal(d.code[1], 0);
+	assert_int_equal(d.code[2], 0);
+}
+
+void test_decode_cache(void **state)
+{
+	uint8_t iram_lower[128], sfr[128];
+	uint8_t *pmem = calloc(4096, 1);
+	uint8_t *pmem2 = calloc(8192, 1);
+	void *cache = malloc(emu51_decode_cache_size(4096));
+	int reason;
+
+	emu51 m;
+	memset(&m, 0, sizeof(m));
+	memset(iram_lower, 0, sizeof(iram_lower));
+	memset(sfr, 0, sizeof(sfr));
+	m.pmem = pmem;
+	m.pmem_len = 4096;
+	m.sfr = sfr;
+	m.iram_lower = iram_lower;
+	emu51_reset(&m);
+
+	/* program: counting loop
+	 *   0: ADD A, #3
+	 *   2: DJNZ R2, 0
+	 *   4: SJMP $
+	 */
+	pmem[0] = 0x24;
+	pmem[1] = 0x03;
+	pmem[2] = 0xda;
+	pmem[3] = 0xfc;
+	pmem[4] = 0x80;
+	pmem[5] = 0xfe;
+
+	/* run without cache as reference */
+	iram_lower[2] = 10;
+	long used = emu51_run(&m, 1000, &reason);
+	uint8_t acc = sfr[SFR_ACC];
+	assert_int_equal(acc, 30);
+
+	/* run again with the cache */
+	emu51_set_decode_cache(&m, cache);
+	assert_ptr_equal(m.decode_cache, cache);
+	m.pc = 0;
+	sfr[SFR_ACC] = 0;
+	iram_lower[2] = 10;
+	assert_int_equal(emu51_run(&m, 1000, &reason), used);
+	assert_int_equal(sfr[SFR_ACC], acc);
+	assert_int_equal(m.pc, 4);
+
+	/* only executed addresses are decoded */
+	assert_non_null(m.decode_cache->entries[0].handler);
+	assert_non_null(m.decode_cache->entries[2].handler);
+	assert_null(m.decode_cache->entries[1].handler);
+	assert_null(m.decode_cache->entries[6].handler);
+
+	/* errors are reported from the cache as well */
+	pmem[4095] = 0x02; /* LJMP, truncated */
+	m.pc = 4095;
+	assert_int_equal(emu51_step(&m, NULL), EMU51_PMEM_OUT_OF_RANGE);
+	assert_int_equal(emu51_step(&m, NULL), EMU51_PMEM_OUT_OF_RANGE);
+	assert_int_equal(m.pc, 4095);
+
+	/* swapping the program memory discards the decoded entries */
+	memcpy(pmem2, pmem, 4096);
+	pmem2[0] = 0x34; /* ADDC A, #3 */
+	pmem2[1] = 0x03;
+	m.pmem = pmem2;
+	m.pc = 0;
+	sfr[SFR_ACC] = 0;
+	sfr[SFR_PSW] = PSW_C;
+	assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_int_equal(sfr[SFR_ACC], 4);
+	assert_ptr_equal(m.decode_cache, cache);
+	assert_null(m.decode_cache->entries[2].handler);
+
+	/* a program memory larger than the cache detaches it */
+	m.pmem_len = 8192;
+	m.pc = 0;
+	assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_null(m.decode_cache);
+
+	free(cache);
+	free(pmem);
+	free(pmem2);
+}
+
+/* emulator with its own buffers, for comparing two runs of the same program */
+typedef struct run_instance
+{
+	emu51 m;
+	uint8_t iram_lower[128];
+	uint8_t iram_upper[128];
+	uint8_t sfr[128];
+} run_instance;
+
+static void init_run_instance(run_instance *r, const uint8_t *pmem, long len)
+{
+	memset(r, 0, sizeof(*r));
+	r->m.pmem = pmem;
+	r->m.pmem_len = len;
+	r->m.iram_lower = r->iram_lower;
+	r->m.iram_upper = r->iram_upper;
+	r->m.sfr = r->sfr;
+	emu51_reset(&r->m);
+}
+
+/* Run random programs with emu51_run() and with an emu51_step() loop, and
+ * check that both end in the same state. Every byte of the program memory is
+ * an implemented opcode, so jumping anywhere executes a valid instruction. */
+void test_run_matches_step(void **state)
+{
+	uint8_t implemented[256];
+	int implemented_count = 0;
+	uint8_t *pmem = malloc(65536);
+	void *cache = malloc(emu51_decode_cache_size(65536));
+	void *block_cache = malloc(emu51_block_cache_size(65536));
+	run_instance *a = malloc(sizeof(run_instance));
+	run_instance *b = malloc(sizeof(run_instance));
+	int opcode, seed, i;
+
+	for (opcode = 0; opcode <= 255; opcode++)
+		if (_emu51_decode_instr(opcode)->handler)
+			implemented[implemented_count++] = opcode;
+
+	for (seed = 0; seed < 200; seed++) {
+		srand(seed);
+		for (i = 0; i < 65536; i++)
+			pmem[i] = implemented[rand() % implemented_count];
+
+		init_run_instance(a, pmem, 65536);
+		for (i = 0; i < 128; i++) {
+			a->iram_lower[i] = rand();
+			a->iram_upper[i] = rand();
+		}
+		a->sfr[SFR_SP] = rand() & 0x7f;
+		a->sfr[SFR_PSW] = rand();
+		a->sfr[SFR_ACC] = rand();
+		a->m.pc = rand() % 65536;
+		*b = *a;
+		b->m.iram_lower = b->iram_lower;
+		b->m.iram_upper = b->iram_upper;
+		b->m.sfr = b->sfr;
+
+		/* reference: step until the budget is used up or an error occurs */
+		long budget = 1 + rand() % 5000;
+		long used_b = 0;
+		int reason_b = EMU51_STOP_BUDGET;
+		while (used_b < budget) {
+			int cycles;
+			int err = emu51_step(&b->m, &cycles);
+			if (err) {
+				reason_b = err;
+				break;
+			}
+			used_b += cycles;
+		}
+
+		/* alternate between no cache, the decode cache and the block cache */
+		int reason_a;
+		if (seed % 3 == 1)
+			emu51_set_decode_cache(&a->m, cache);
+		else if (seed % 3 == 2)
+			emu51_set_block_cache(&a->m, block_cache);
+		long used_a = emu51_run(&a->m, budget, &reason_a);
+
+		assert_int_equal(used_a, used_b);
+		assert_int_equal(reason_a, reason_b);
+		assert_int_equal(a->m.pc, b->m.pc);
+		assert_memory_equal(a->sfr, b->sfr, 128);
+		assert_memory_equal(a->iram_lower, b->iram_lower, 128);
+		assert_memory_equal(a->iram_upper, b->iram_upper, 128);
+	}
+
+	free(a);
+	free(b);
+	free(cache);
+	free(block_cache);
+	free(pmem);
+}
+
+void test_block_cache(void **state)
+{
+	uint8_t iram_lower[128], sfr[128];
+	uint8_t *pmem = calloc(4096, 1);
+	uint8_t *pmem2 = calloc(4096, 1);
+	void *cache = malloc(emu51_block_cache_size(4096));
+	emu51_block_stats stats;
+	int reason;
+	long used;
+
+	emu51 m;
+	memset(&m, 0, sizeof(m));
+	memset(iram_lower, 0, sizeof(iram_lower));
+	memset(sfr, 0, sizeof(sfr));
+	m.pmem = pmem;
+	m.pmem_len = 4096;
+	m.sfr = sfr;
+	m.iram_lower = iram_lower;
+	emu51_reset(&m);
+
+	/* program:
+	 *   0: NOP
+	 *   1: ADD A, #1       <- block B (loop body)
+	 *   3: DJNZ R2, 1
+	 *   5: SJMP $          <- block C
+	 */
+	pmem[0] = 0x00;
+	pmem[1] = 0x24;
+	pmem[2] = 0x01;
+	pmem[3] = 0xda;
+	pmem[4] = 0xfc;
+	pmem[5] = 0x80;
+	pmem[6] = 0xfe;
+
+	emu51_get_block_stats(&m, &stats);
+	assert_int_equal(stats.hits, 0);
+
+	emu51_set_block_cache(&m, cache);
+	iram_lower[2] = 10;
+
+	/* NOP + 10 * (ADD + DJNZ) = 31 cycles */
+	used = emu51_run(&m, 31, &reason);
+	assert_int_equal(reason, EMU51_STOP_BUDGET);
+	assert_int_equal(used, 31);
+	assert_int_equal(m.pc, 5);
+	assert_int_equal(sfr[SFR_ACC], 10);
+	assert_int_equal(iram_lower[2], 0);
+
+	/* Blocks: [0,1,3] runs once, [1,3] runs 9 times. The edges to [1,3] are
+	 * linked when first taken, so the last 7 runs follow a link. */
+	emu51_get_block_stats(&m, &stats);
+	assert_int_equal(stats.misses, 2);
+	assert_int_equal(stats.hits, 10);
+	assert_int_equal(stats.chained, 7);
+	assert_int_equal(stats.invalidations, 0);
+
+	/* the budget runs out inside a block: stop at the same instruction as
+	 * emu51_step() would */
+	m.pc = 0;
+	sfr[SFR_ACC] = 0;
+	iram_lower[2] = 10;
+	used = emu51_run(&m, 2, &reason);
+	assert_int_equal(reason, EMU51_STOP_BUDGET);
+	assert_int_equal(used, 2);
+	assert_int_equal(m.pc, 3);
+	used = emu51_run(&m, 1, &reason);
+	assert_int_equal(used, 2);
+	assert_int_equal(m.pc, 1);
+
+	/* errors inside a block leave pc at the offending instruction */
+	pmem2[0] = 0x00;
+	pmem2[1] = 0x00;
+	pmem2[2] = 0x26; /* ADD A, @R0 */
+	pmem2[3] = 0x80; /* SJMP $ */
+	pmem2[4] = 0xfe;
+	m.pmem = pmem2;
+	m.pc = 0;
+	sfr[SFR_PSW] = 0;
+	iram_lower[0] = 0x90; /* upper iram is not present */
+	used = emu51_run(&m, 100, &reason);
+	assert_int_equal(reason, EMU51_IRAM_OUT_OF_RANGE);
+	assert_int_equal(used, 2);
+	assert_int_equal(m.pc, 2);
+
+	/* swapping the program memory invalidated the blocks; the blocks at 3
+	 * (resumed in the middle of [0,1,3]) and at 0 of pmem2 were built */
+	emu51_get_block_stats(&m, &stats);
+	assert_int_equal(stats.invalidations, 1);
+	assert_int_equal(stats.misses, 4);
+
+	free(cache);
+	free(pmem);
+	free(pmem2);
+}
+
+void test_jit(void **state)
+{
+	uint8_t iram_lower[128], sfr[128];
+	uint8_t *pmem = calloc(4096, 1);
+	void *cache = malloc(emu51_block_cache_size(4096));
+	emu51_block_stats stats;
+	emu51_config config;
+	emu51 *created;
+	int reason;
+	long used;
+
+	emu51 m;
+	memset(&m, 0, sizeof(m));
+	memset(iram_lower, 0, sizeof(iram_lower));
+	memset(sfr, 0, sizeof(sfr));
+	m.pmem = pmem;
+	m.pmem_len = 4096;
+	m.sfr = sfr;
+	m.iram_lower = iram_lower;
+	emu51_reset(&m);
+
+	if (emu51_jit_enable(&m) == EMU51_NOT_SUPPORTED) {
+		assert_null(m.jit);
+		emu51_jit_disable(&m);
+		free(cache);
+		free(pmem);
+		return;
+	}
+	assert_non_null(m.jit);
+	assert_int_equal(emu51_jit_enable(&m), 0); /* already enabled */
+
+	/* program:
+	 *   0: ADDC A, R3      <- loop body
+	 *   1: ADD A, @R0
+	 *   2: DJNZ R2, 0
+	 *   4: SJMP $
+	 */
+	pmem[0] = 0x3b;
+	pmem[1] = 0x26;
+	pmem[2] = 0xda;
+	pmem[3] = 0xfc;
+	pmem[4] = 0x80;
+	pmem[5] = 0xfe;
+
+	/* the loop runs natively after it gets hot */
+	emu51_set_block_cache(&m, cache);
+	iram_lower[0] = 0x40;
+	iram_lower[2] = 100;
+	iram_lower[3] = 0x75;
+	iram_lower[0x40] = 0x21;
+	used = emu51_run(&m, 400, &reason);
+	assert_int_equal(reason, EMU51_STOP_BUDGET);
+	assert_int_equal(used, 400);
+	assert_int_equal(m.pc, 4);
+	assert_int_equal(iram_lower[2], 0);
+	emu51_get_block_stats(&m, &stats);
+	assert_int_equal(stats.compiled, 1);
+	assert_int_equal(stats.native, 100 - 16 + 1);
+
+	/* blocks that fire a callback which is set are interpreted */
+	m.callback.sfr_update = stop_on_sfr_update;
+	m.pc = 0;
+	used = emu51_run(&m, 400, &reason);
+	assert_int_equal(reason, EMU51_STOP_HOST);
+	assert_int_equal(used, 1);
+	assert_int_equal(m.pc, 1);
+	m.callback.sfr_update = NULL;
+
+	/* side exit: @R0 points to the missing upper iram */
+	iram_lower[0] = 0x90;
+	m.pc = 0;
+	used = emu51_run(&m, 400, &reason);
+	assert_int_equal(reason, EMU51_IRAM_OUT_OF_RANGE);
+	assert_int_equal(used, 1);
+	assert_int_equal(m.pc, 1);
+	emu51_get_block_stats(&m, &stats);
+	assert_int_equal(stats.native, 100 - 16 + 2);
+
+	emu51_jit_disable(&m);
+	assert_null(m.jit);
+	emu51_jit_disable(&m); /* already disabled */
+
+	/* an emulator can be destroyed after its block cache is freed */
+	memset(&config, 0, sizeof(config));
+	config.pmem = pmem;
+	config.pmem_len = 4096;
+	created = emu51_create(&config);
+	assert_non_null(created);
+	emu51_set_block_cache(created, cache);
+	assert_int_equal(emu51_jit_enable(created), 0);
+	created->iram_lower[2] = 100;
+	emu51_run(created, 400, &reason);
+	emu51_get_block_stats(created, &stats);
+	assert_int_equal(stats.compiled, 1);
+	free(cache);
+	emu51_destroy(created);
+
+	free(pmem);
+}
+
+/* counts sfr_update callbacks in the userdata */
+static void count_sfr_update(emu51 *m, uint8_t index)
+{
+	(*(long*)m->userdata)++;
+}
+
+/* counts iram_update callbacks in the userdata */
+static void count_iram_update(emu51 *m, uint8_t addr)
+{
+	(*(long*)m->userdata)++;
+}
+
+/* Append a loop at pc to the program: a straight run of ADD, ADDC, NOP and
+ * MOVC instructions, ended by a conditional jump back to its start. Returns the
+ * address following the loop. */
+static long append_random_loop(uint8_t *pmem, long pc)
+{
+	long start = pc;
+	int n = rand() % 8;
+
+	while (n-- > 0) {
+		uint8_t addc = (rand() % 2) ? 0x10 : 0x00;
+		switch (rand() % 6) {
+			case 0: /* NOP */
+				pmem[pc++] = 0x00;
+				break;
+			case 1: /* ADD(C) A, #data */
+				pmem[pc++] = 0x24 | addc;
+				pmem[pc++] = rand();
+				break;
+			case 2: /* ADD(C) A, direct (SFRs included) */
+				pmem[pc++] = 0x25 | addc;
+				pmem[pc++] = (rand() % 4) ? rand() % 0x80 : 0x80 + rand() % 0x80;
+				break;
+			case 3: /* ADD(C) A, @Ri */
+				pmem[pc++] = 0x26 | addc | (rand() % 2);
+				break;
+			case 4: /* ADD(C) A, Rn */
+				pmem[pc++] = 0x28 | addc | (rand() % 8);
+				break;
+			default: /* MOVC A, @A+PC, not compiled */
+				pmem[pc++] = 0x83;
+		}
+	}
+
+	switch (rand() % 6) {
+		case 0: /* DJNZ Rn */
+			pmem[pc++] = 0xd8 | (rand() % 8);
+			break;
+		case 1: /* DJNZ direct */
+			pmem[pc++] = 0xd5;
+			pmem[pc++] = rand() % 0x80;
+			break;
+		case 2: /* CJNE A, #data / A, direct / Rn, #data */
+			pmem[pc] = (rand() % 2) ? 0xb4 + rand() % 2 : 0xb8 + rand() % 8;
+			pmem[pc + 1] = (pmem[pc] == 0xb5) ? rand() % 0x80 : rand();
+			pc += 2;
+			break;
+		case 3: /* JBC, JB, JNB */
+			pmem[pc++] = 0x10 + 0x10 * (rand() % 3);
+			pmem[pc++] = rand() % 0x80;
+			break;
+		default: /* JC, JNC, JZ, JNZ */
+			pmem[pc++] = 0x40 + 0x10 * (rand() % 4);
+	}
+	pmem[pc] = (uint8_t)(start - (pc + 1));
+	return pc + 1;
+}
+
+/* Run random loops with the JIT enabled and with an emu51_step() loop, and
+ * check that both end in the same state and fire the same callbacks. */
+void test_jit_matches_step(void **state)
+{
+	uint8_t *pmem = malloc(4096);
+	void *block_cache = malloc(emu51_block_cache_size(4096));
+	run_instance *a = malloc(sizeof(run_instance));
+	run_instance *b = malloc(sizeof(run_instance));
+	emu51_block_stats stats;
+	uint64_t compiled = 0, native = 0;
+	int seed, i;
+
+	for (seed = 0; seed < 200; seed++) {
+		long pc = 0;
+
+		srand(seed);
+		memset(pmem, 0, 4096);
+		for (i = 0; i < 32; i++)
+			pc = append_random_loop(pmem, pc);
+		pmem[pc++] = 0x80; /* SJMP $ */
+		pmem[pc++] = 0xfe;
+
+		init_run_instance(a, pmem, 4096);
+		for (i = 0; i < 128; i++) {
+			a->iram_lower[i] = rand();
+			a->iram_upper[i] = rand();
+		}
+		a->sfr[SFR_PSW] = rand();
+		a->sfr[SFR_ACC] = rand();
+		*b = *a;
+		b->m.iram_lower = b->iram_lower;
+		b->m.iram_upper = b->iram_upper;
+		b->m.sfr = b->sfr;
+
+		/* some runs exercise the side exit of @Ri, others the callbacks */
+		long callbacks_a = 0, callbacks_b = 0;
+		if (seed % 3 == 1) {
+			a->m.iram_upper = b->m.iram_upper = NULL;
+		} else if (seed % 3 == 2) {
+			a->m.userdata = &callbacks_a;
+			b->m.userdata = &callbacks_b;
+			a->m.callback.sfr_update = b->m.callback.sfr_update = count_sfr_update;
+		}
+
+		long budget = 1 + rand() % 20000;
+		long used_b = 0;
+		int reason_b = EMU51_STOP_BUDGET;
+		while (used_b < budget) {
+			int cycles;
+			int err = emu51_step(&b->m, &cycles);
+			if (err) {
+				reason_b = err;
+				break;
+			}
+			used_b += cycles;
+		}
+
+		int reason_a;
+		emu51_set_block_cache(&a->m, block_cache);
+		if (emu51_jit_enable(&a->m) == EMU51_NOT_SUPPORTED)
+			break;
+		long used_a = emu51_run(&a->m, budget, &reason_a);
+		emu51_get_block_stats(&a->m, &stats);
+		compiled += stats.compiled;
+		native += stats.native;
+		emu51_jit_disable(&a->m);
+
+		assert_int_equal(used_a, used_b);
+		assert_int_equal(reason_a, reason_b);
+		assert_int_equal(a->m.pc, b->m.pc);
+		assert_int_equal(callbacks_a, callbacks_b);
+		assert_memory_equal(a->sfr, b->sfr, 128);
+		assert_memory_equal(a->iram_lower, b->iram_lower, 128);
+		assert_memory_equal(a->iram_upper, b->iram_upper, 128);
+	}
+
+	/* make sure the comparison involved native code */
+	if (seed == 200) {
+		assert_true(compiled > 0);
+		assert_true(native > compiled);
+	}
+
+	free(a);
+	free(b);
+	free(block_cache);
+	free(pmem);
+}
+
+/* Delay loops and idle spins are skipped in one go, with the same result as
+ * executing them. Checked with each of the engines of emu51_run(). */
+void test_fast_forward(void **state)
+{
+	uint8_t iram_lower[128], sfr[128], breakpoints[512];
+	uint8_t *pmem = calloc(4096, 1);
+	void *cache = malloc(emu51_decode_cache_size(4096));
+	void *block_cache = malloc(emu51_block_cache_size(4096));
+	long callbacks, used;
+	int engine, reason;
+
+	/* program:
+	 *   0: DJNZ R7, $
+	 *   2: DJNZ 0x30, $
+	 *   5: SJMP $
+	 */
+	pmem[0] = 0xdf;
+	pmem[1] = 0xfe;
+	pmem[2] = 0xd5;
+	pmem[3] = 0x30;
+	pmem[4] = 0xfd;
+	pmem[5] = 0x80;
+	pmem[6] = 0xfe;
+
+	for (engine = 0; engine < 4; engine++) {
+		emu51 m;
+		memset(&m, 0, sizeof(m));
+		memset(iram_lower, 0, sizeof(iram_lower));
+		memset(sfr, 0, sizeof(sfr));
+		m.pmem = pmem;
+		m.pmem_len = 4096;
+		m.sfr = sfr;
+		m.iram_lower = iram_lower;
+		m.userdata = &callbacks;
+		emu51_reset(&m);
+
+		if (engine == 1)
+			emu51_set_decode_cache(&m, cache);
+		else if (engine >= 2)
+			emu51_set_block_cache(&m, block_cache);
+		if (engine == 3)
+			emu51_jit_enable(&m);
+
+		/* the budget runs out in the first loop: 51 iterations */
+		sfr[SFR_PSW] = PSW_RS0; /* R7 of bank 1 */
+		iram_lower[0x0f] = 200;
+		iram_lower[0x30] = 0; /* 256 iterations */
+		used = emu51_run(&m, 101, &reason);
+		assert_int_equal(reason, EMU51_STOP_BUDGET);
+		assert_int_equal(used, 102);
+		assert_int_equal(m.pc, 0);
+		assert_int_equal(iram_lower[0x0f], 149);
+
+		/* both loops end, then spin until the budget runs out */
+		used = emu51_run(&m, 2000000000L, &reason);
+		assert_int_equal(reason, EMU51_STOP_BUDGET);
+		assert_int_equal(used, 2000000000L);
+		assert_int_equal(m.pc, 5);
+		assert_int_equal(iram_lower[0x0f], 0);
+		assert_int_equal(iram_lower[0x30], 0);
+
+		/* each iteration fires a callback: the loops are executed */
+		m.callback.iram_update = count_iram_update;
+		callbacks = 0;
+		m.pc = 0;
+		iram_lower[0x0f] = 5;
+		iram_lower[0x30] = 10;
+		used = emu51_run(&m, 30, &reason);
+		assert_int_equal(used, 30);
+		assert_int_equal(m.pc, 5);
+		assert_int_equal(callbacks, 15);
+		m.callback.iram_update = NULL;
+
+		/* a breakpoint in the loop is hit after one iteration */
+		if (engine < 2) {
+			memset(breakpoints, 0, sizeof(breakpoints));
+			breakpoints[0] = 0x01;
+			m.breakpoints = breakpoints;
+			m.pc = 0;
+			iram_lower[0x0f] = 5;
+			used = emu51_run(&m, 100, &reason);
+			assert_int_equal(reason, EMU51_STOP_BREAKPOINT);
+			assert_int_equal(used, 2);
+			assert_int_equal(iram_lower[0x0f], 4);
+		}
+
+		emu51_jit_disable(&m);
+	}
+
+	free(block_cache);
+	free(cache);
+	free(pmem);
+}
+
+/* checks that the PSW seen by the callback holds the flags of ADD A, #0x80
+ * with ACC = 0x80 */
+static void check_psw_in_callback(emu51 *m, uint8_t index)
+{
+	if (index == SFR_PSW && m->sfr[SFR_ACC] == 0)
+		assert_int_equal(m->sfr[SFR_PSW] & (PSW_C | PSW_AC | PSW_OV | PSW_P),
+				PSW_C | PSW_OV);
+	(*(long*)m->userdata)++;
+}
+
+/* The PSW flags are up to date whenever they can be observed: by instructions
+ * reading PSW, by callbacks and after emu51_step()/emu51_run(). */
+void test_psw_flags(void **state)
+{
+	uint8_t iram_lower[128], sfr[128];
+	uint8_t *pmem = calloc(4096, 1);
+	long callbacks = 0;
+	int reason;
+
+	emu51 m;
+	memset(&m, 0, sizeof(m));
+	memset(iram_lower, 0, sizeof(iram_lower));
+	memset(sfr, 0, sizeof(sfr));
+	m.pmem = pmem;
+	m.pmem_len = 4096;
+	m.sfr = sfr;
+	m.iram_lower = iram_lower;
+	m.userdata = &callbacks;
+	emu51_reset(&m);
+
+	/* program:
+	 *   0: ADD A, #0x80      C = OV = 1, ACC = 0
+	 *   2: ADDC A, 0xd0      ACC = 0 + PSW + C
+	 *   4: JC 0x10           not taken
+	 *   6: ADD A, #0x7a      ACC = 0xff, C = 0, P = 0
+	 *   8: JNC 0x10          taken
+	 */
+	pmem[0] = 0x24;
+	pmem[1] = 0x80;
+	pmem[2] = 0x35;
+	pmem[3] = 0xd0;
+	pmem[4] = 0x40;
+	pmem[5] = 0x0a;
+	pmem[6] = 0x24;
+	pmem[7] = 0x7a;
+	pmem[8] = 0x50;
+	pmem[9] = 0x06;
+
+	sfr[SFR_ACC] = 0x80;
+	sfr[SFR_PSW] = PSW_RS0 | PSW_AC; /* AC is cleared by the ADD */
+	assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_int_equal(sfr[SFR_ACC], 0);
+	assert_int_equal(sfr[SFR_PSW], PSW_RS0 | PSW_C | PSW_OV);
+
+	/* PSW read as an operand */
+	assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_int_equal(sfr[SFR_ACC], (PSW_RS0 | PSW_C | PSW_OV) + 1);
+	assert_int_equal(sfr[SFR_PSW] & (PSW_C | PSW_OV | PSW_P), 0);
+
+	/* flags seen by the callback and by jumps within one run */
+	m.pc = 0;
+	sfr[SFR_ACC] = 0x80;
+	sfr[SFR_PSW] = 0;
+	m.callback.sfr_update = check_psw_in_callback;
+	assert_int_equal(emu51_run(&m, 1, &reason), 1);
+	assert_int_equal(callbacks, 2); /* ACC and PSW */
+	m.callback.sfr_update = NULL;
+	emu51_run(&m, 6, &reason);
+	assert_int_equal(m.pc, 0x10);
+	assert_int_equal(sfr[SFR_ACC], 0xff);
+	assert_int_equal(sfr[SFR_PSW] & (PSW_C | PSW_OV | PSW_P), 0);
+
+	free(pmem);
+}
+
+/* The register bank follows PSW whether it is written by an instruction or by
+ * the user, and the upper iram can be attached between steps. */
+void test_register_bank(void **state)
+{
+	uint8_t iram_lower[128], iram_upper[128], sfr[128];
+	uint8_t *pmem = calloc(4096, 1);
+
+	emu51 m;
+	memset(&m, 0, sizeof(m));
+	memset(iram_lower, 0, sizeof(iram_lower));
+	memset(iram_upper, 0, sizeof(iram_upper));
+	memset(sfr, 0, sizeof(sfr));
+	m.pmem = pmem;
+	m.pmem_len = 4096;
+	m.sfr = sfr;
+	m.iram_lower = iram_lower;
+	emu51_reset(&m);
+
+	/* program:
+	 *   0: DJNZ PSW, 0       PSW = 0x10 - 1 selects bank 1
+	 *   3: DJNZ R0, 0
+	 *   5: ADD A, @R1
+	 */
+	pmem[0] = 0xd5;
+	pmem[1] = 0xd0;
+	pmem[2] = 0x00;
+	pmem[3] = 0xd8;
+	pmem[4] = 0x00;
+	pmem[5] = 0x27;
+
+	sfr[SFR_PSW] = PSW_RS1;
+	iram_lower[0x08] = 5; /* bank 1 R0 */
+	iram_lower[0x09] = 0x85; /* bank 1 R1 */
+	iram_lower[0x10] = 7; /* bank 2 R0 */
+	assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_int_equal(sfr[SFR_PSW] & (PSW_RS1 | PSW_RS0), PSW_RS0);
+	assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_int_equal(iram_lower[0x08], 4);
+	assert_int_equal(iram_lower[0x10], 7);
+
+	/* @R1 points to the upper iram, which is missing */
+	assert_int_equal(emu51_step(&m, NULL), EMU51_IRAM_OUT_OF_RANGE);
+	assert_int_equal(m.pc, 5);
+
+	/* bank selected by the user */
+	sfr[SFR_PSW] = PSW_RS1;
+	m.pc = 3;
+	assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_int_equal(iram_lower[0x08], 4);
+	assert_int_equal(iram_lower[0x10], 6);
+
+	/* upper iram attached by the user */
+	m.iram_upper = iram_upper;
+	iram_upper[0x05] = 0x21;
+	sfr[SFR_PSW] = PSW_RS0;
+	sfr[SFR_ACC] = 0x10;
+	m.pc = 5;
+	assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_int_equal(sfr[SFR_ACC], 0x31);
+
+	free(pmem);
+}
+
+void test_create(void **state)
+{
+	uint8_t *pmem = calloc(4096, 1);
+	emu51_config config;
+	emu51 *m;
+
+	memset(&config, 0, sizeof(config));
+	config.pmem = pmem;
+	config.pmem_len = 4096;
+	config.xram_len = 1024;
+	config.iram_upper = 1;
+	config.feature.timer2 = 1;
+
+	m = emu51_create(&config);
+	assert_non_null(m);
+	assert_int_equal((uintptr_t)m % 64, 0);
+	assert_ptr_equal(m->pmem, pmem);
+	assert_int_equal(m->pmem_len, 4096);
+	assert_int_equal(m->xram_len, 1024);
+	assert_int_equal(m->feature.timer2, 1);
+	assert_int_equal(m->pc, 0);
+	assert_int_equal(m->sfr[SFR_SP], 0x07);
+
+	/* the memories follow the structure and don't overlap */
+	assert_true(m->sfr >= (uint8_t*)(m + 1));
+	assert_ptr_equal(m->iram_lower, m->sfr + 128);
+	assert_ptr_equal(m->iram_upper, m->iram_lower + 128);
+	assert_ptr_equal(m->xram, m->iram_upper + 128);
+	assert_int_equal((uintptr_t)m->sfr % 64, 0);
+	m->xram[1023] = 0x12;
+
+	/* ADD A, @R0 with R0 pointing to the upper iram */
+	pmem[0] = 0x26;
+	m->iram_lower[0] = 0x90;
+	m->iram_upper[0x10] = 0x21;
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->sfr[SFR_ACC], 0x21);
+	emu51_destroy(m);
+
+	/* 8051 without external memory */
+	config.xram_len = 0;
+	config.iram_upper = 0;
+	m = emu51_create(&config);
+	assert_non_null(m);
+	assert_null(m->iram_upper);
+	assert_null(m->xram);
+	assert_int_equal(m->xram_len, 0);
+	m->iram_lower[0] = 0x90;
+	assert_int_equal(emu51_step(m, NULL), EMU51_IRAM_OUT_OF_RANGE);
+	emu51_destroy(m);
+
+	emu51_destroy(NULL);
+	free(pmem);
+}
+
+/* number of reports of each address by the watch callbacks */
+typedef struct watch_counts
+{
+	int sfr[128];
+	int iram[256];
+} watch_counts;
+
+static void count_watched_sfr(emu51 *m, uint8_t index)
+{
+	((watch_counts*)m->userdata)->sfr[index]++;
+}
+
+static void count_watched_iram(emu51 *m, uint8_t addr)
+{
+	((watch_counts*)m->userdata)->iram[addr]++;
+}
+
+void test_watch(void **state)
+{
+	uint8_t iram_lower[128], sfr[128];
+	uint8_t *pmem = calloc(4096, 1);
+	void *cache = malloc(emu51_block_cache_size(4096));
+	uint8_t watch_sfr[16], watch_iram[32];
+	emu51_block_stats stats;
+	watch_counts counts;
+	int i;
+
+	emu51 m;
+	memset(&m, 0, sizeof(m));
+	memset(iram_lower, 0, sizeof(iram_lower));
+	memset(sfr, 0, sizeof(sfr));
+	m.pmem = pmem;
+	m.pmem_len = 4096;
+	m.sfr = sfr;
+	m.iram_lower = iram_lower;
+	m.userdata = &counts;
+	m.callback.sfr_update = count_watched_sfr;
+	m.callback.iram_update = count_watched_iram;
+	emu51_reset(&m);
+
+	/* program:
+	 *   0x00: ACALL 0x10     writes SP and iram 0x08, 0x09
+	 *   0x10: ADD A, #1      writes PSW
+	 *   0x12: SJMP 0x10
+	 */
+	pmem[0x00] = 0x11;
+	pmem[0x01] = 0x10;
+	pmem[0x10] = 0x24;
+	pmem[0x11] = 0x01;
+	pmem[0x12] = 0x80;
+	pmem[0x13] = 0xfc;
+
+	/* without bitmaps, every write is reported */
+	memset(&counts, 0, sizeof(counts));
+	for (i = 0; i < 2; i++)
+		assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_int_equal(counts.sfr[SFR_SP], 1);
+	assert_int_equal(counts.sfr[SFR_PSW], 1);
+	assert_int_equal(counts.iram[0x08], 1);
+	assert_int_equal(counts.iram[0x09], 1);
+
+	/* only the watched addresses are reported */
+	memset(watch_sfr, 0, sizeof(watch_sfr));
+	memset(watch_iram, 0, sizeof(watch_iram));
+	watch_sfr[SFR_PSW / 8] |= 1 << (SFR_PSW % 8);
+	watch_iram[0x09 / 8] |= 1 << (0x09 % 8);
+	m.watch.sfr = watch_sfr;
+	m.watch.iram = watch_iram;
+	memset(&counts, 0, sizeof(counts));
+	m.pc = 0;
+	sfr[SFR_SP] = 0x07;
+	for (i = 0; i < 2; i++)
+		assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_int_equal(counts.sfr[SFR_SP], 0);
+	assert_int_equal(counts.sfr[SFR_PSW], 1);
+	assert_int_equal(counts.iram[0x08], 0);
+	assert_int_equal(counts.iram[0x09], 1);
+
+	/* the JIT runs the blocks whose writes are not watched */
+	emu51_set_block_cache(&m, cache);
+	if (emu51_jit_enable(&m) == 0) {
+		memset(watch_sfr, 0, sizeof(watch_sfr));
+		memset(&counts, 0, sizeof(counts));
+		emu51_run(&m, 1000, NULL);
+		emu51_get_block_stats(&m, &stats);
+		assert_true(stats.native > 0);
+		assert_int_equal(counts.sfr[SFR_PSW], 0);
+
+		watch_sfr[SFR_PSW / 8] |= 1 << (SFR_PSW % 8);
+		emu51_set_block_cache(&m, cache); /* resets the statistics */
+		emu51_run(&m, 1000, NULL);
+		emu51_get_block_stats(&m, &stats);
+		assert_int_equal(stats.native, 0);
+		assert_true(counts.sfr[SFR_PSW] > 0);
+		emu51_jit_disable(&m);
+	}
+
+	free(cache);
+	free(pmem);
+}
+
+void test_event_log(void **state)
+{
+	uint8_t iram_lower[128], sfr[128];
+	uint8_t *pmem = calloc(4096, 1);
+	void *log = malloc(emu51_event_log_size(8));
+	emu51_event events[8];
+	uint8_t watch_sfr[16];
+	long used;
+
+	emu51 m;
+	memset(&m, 0, sizeof(m));
+	memset(iram_lower, 0, sizeof(iram_lower));
+	memset(sfr, 0, sizeof(sfr));
+	m.pmem = pmem;
+	m.pmem_len = 4096;
+	m.sfr = sfr;
+	m.iram_lower = iram_lower;
+	emu51_reset(&m);
+
+	/* program:
+	 *   0x00: ACALL 0x10     writes SP and iram 0x08, 0x09
+	 *   0x10: ADD A, #1      writes ACC and PSW
+	 *   0x12: SJMP 0x10
+	 */
+	pmem[0x00] = 0x11;
+	pmem[0x01] = 0x10;
+	pmem[0x10] = 0x24;
+	pmem[0x11] = 0x01;
+	pmem[0x12] = 0x80;
+	pmem[0x13] = 0xfc;
+
+	/* nothing to drain without a log */
+	assert_int_equal(emu51_drain_events(&m, events, 8), 0);
+
+	emu51_set_event_log(&m, log, 8);
+	assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_int_equal(m.cycles, 3);
+
+	/* the events are drained in order, in pieces */
+	assert_int_equal(emu51_drain_events(&m, events, 3), 3);
+	assert_int_equal(events[0].kind, EMU51_EVENT_SFR);
+	assert_int_equal(events[0].addr, SFR_SP);
+	assert_int_equal(events[0].value, 0x09);
+	assert_int_equal(events[0].cycle, 0);
+	assert_int_equal(events[1].kind, EMU51_EVENT_IRAM);
+	assert_int_equal(events[1].addr, 0x08);
+	assert_int_equal(events[1].value, 0x02); /* return address, low byte */
+	assert_int_equal(events[2].kind, EMU51_EVENT_IRAM);
+	assert_int_equal(events[2].addr, 0x09);
+	assert_int_equal(events[2].value, 0x00);
+	assert_int_equal(emu51_drain_events(&m, events, 8), 2);
+	assert_int_equal(events[0].kind, EMU51_EVENT_SFR);
+	assert_int_equal(events[0].addr, SFR_ACC);
+	assert_int_equal(events[0].value, 1);
+	assert_int_equal(events[0].cycle, 2);
+	assert_int_equal(events[1].addr, SFR_PSW);
+	assert_int_equal(events[1].value, PSW_P); /* ACC is 1 */
+	assert_int_equal(events[1].cycle, 2);
+	assert_int_equal(emu51_drain_events(&m, events, 8), 0);
+	assert_int_equal(emu51_events_lost(&m), 0);
+
+	/* the events that don't fit are dropped: 3 cycles per iteration */
+	used = emu51_run(&m, 30, NULL);
+	assert_int_equal(used, 30);
+	assert_int_equal(m.cycles, 33);
+	assert_int_equal(emu51_drain_events(&m, events, 8), 8);
+	assert_int_equal(emu51_events_lost(&m), 12);
+	assert_int_equal(events[0].cycle, 5); /* after the SJMP */
+	assert_int_equal(events[0].value, 2);     /* ACC */
+	assert_int_equal(events[1].value, PSW_P); /* PSW */
+	assert_int_equal(events[2].value, 3);
+	assert_int_equal(events[3].value, 0);
+	assert_int_equal(events[3].cycle, 8);
+	assert_int_equal(events[7].cycle, 14);
+
+	/* the block engine counts the cycles the same way */
+	void *cache = malloc(emu51_block_cache_size(4096));
+	emu51_set_block_cache(&m, cache);
+	assert_int_equal(emu51_run(&m, 300, NULL), 300);
+	assert_int_equal(m.cycles, 333);
+	emu51_set_block_cache(&m, NULL);
+	free(cache);
+
+	/* the log is empty after being attached again */
+	emu51_set_event_log(&m, log, 8);
+	assert_int_equal(emu51_drain_events(&m, events, 8), 0);
+	assert_int_equal(emu51_events_lost(&m), 0);
+
+	/* the changes made by the timers are logged when they are seen */
+	memset(watch_sfr, 0, sizeof(watch_sfr));
+	watch_sfr[SFR_TCON / 8] |= 1 << (SFR_TCON % 8);
+	watch_sfr[SFR_TL0 / 8] |= 1 << (SFR_TL0 % 8);
+	m.watch.sfr = watch_sfr;
+	sfr[SFR_TMOD] = 0x02; /* timer 0 in mode 2: 8 bits auto-reload */
+	sfr[SFR_TH0] = sfr[SFR_TL0] = 0xf0;
+	sfr[SFR_TCON] = TCON_TR0;
+	emu51_set_event_log(&m, log, 8);
+	emu51_run(&m, 20, NULL);
+	assert_int_equal(emu51_drain_events(&m, events, 8), 3);
+	/* the overflow, seen at the next instruction boundary */
+	assert_int_equal(events[0].kind, EMU51_EVENT_SFR);
+	assert_int_equal(events[0].addr, SFR_TCON);
+	assert_int_equal(events[0].value, TCON_TR0 | TCON_TF0);
+	assert_int_equal(events[1].addr, SFR_TL0);
+	assert_int_equal(events[1].value, 0xf1);
+	assert_int_equal(events[1].cycle, events[0].cycle);
+	/* the count when the run returns */
+	assert_int_equal(events[2].addr, SFR_TL0);
+	assert_int_equal(events[2].value, 0xf4);
+	assert_int_equal(events[2].cycle, (uint32_t)m.cycles);
+	m.watch.sfr = NULL;
+
+	emu51_set_event_log(&m, NULL, 0);
+	free(log);
+	free(pmem);
+}
+
+void test_build_options(void **state)
+{
+	unsigned int options = emu51_build_options();
+	emu51 m;
+
+	/* the test is linked with the library variant it is built for */
+#ifdef EMU51_NO_CALLBACKS
+	assert_false(options & EMU51_BUILD_CALLBACKS);
+#else
+	assert_true(options & EMU51_BUILD_CALLBACKS);
+#endif
+
+	/* the JIT can only be enabled if it is built */
+	memset(&m, 0, sizeof(m));
+	if (options & EMU51_BUILD_JIT) {
+		assert_int_equal(emu51_jit_enable(&m), 0);
+		emu51_jit_disable(&m);
+	} else {
+		assert_int_equal(emu51_jit_enable(&m), EMU51_NOT_SUPPORTED);
+	}
+}
+
+void test_trusted(void **state)
+{
+	uint8_t iram_lower[128], sfr[128];
+	uint8_t *pmem = calloc(4096, 1);
+	void *trust = malloc(emu51_trust_size(4096));
+	void *block_cache = malloc(emu51_block_cache_size(4096));
+	int reason, pass;
+
+	emu51 m;
+	memset(&m, 0, sizeof(m));
+	memset(iram_lower, 0, sizeof(iram_lower));
+	memset(sfr, 0, sizeof(sfr));
+	m.pmem = pmem;
+	m.pmem_len = 4096;
+	m.sfr = sfr;
+	m.iram_lower = iram_lower;
+	emu51_reset(&m);
+
+	/* an unimplemented instruction at the reset vector is rejected */
+	pmem[0] = 0xa5;
+	assert_int_equal(emu51_set_trusted(&m, trust), EMU51_NOT_IMPLEMENTED);
+	assert_null(m.trust);
+
+	/* so is code that runs off the end of program memory */
+	pmem[0] = 0x02; /* LJMP 0x0fff */
+	pmem[1] = 0x0f;
+	pmem[2] = 0xff;
+	assert_int_equal(emu51_set_trusted(&m, trust), EMU51_PMEM_OUT_OF_RANGE);
+	assert_null(m.trust);
+
+	/* program:
+	 *   0x00: LJMP 0x10
+	 *   0x03: (unimplemented, unreachable)
+	 *   0x10: ADD A, #1
+	 *   0x12: CJNE A, #5, 0x10
+	 *   0x15: JMP @A+DPTR
+	 *   0x20: SJMP $
+	 *   0x30: MOVC A, @A+DPTR
+	 *   0x31: SJMP $
+	 */
+	pmem[1] = 0x00;
+	pmem[2] = 0x10;
+	pmem[3] = 0xa5;
+	pmem[0x10] = 0x24;
+	pmem[0x11] = 0x01;
+	pmem[0x12] = 0xb4;
+	pmem[0x13] = 0x05;
+	pmem[0x14] = 0xfb;
+	pmem[0x15] = 0x73;
+	pmem[0x20] = 0x80;
+	pmem[0x21] = 0xfe;
+	pmem[0x30] = 0x93;
+	pmem[0x31] = 0x80;
+	pmem[0x32] = 0xfe;
+	assert_int_equal(emu51_set_trusted(&m, trust), 0);
+	assert_ptr_equal(m.trust, trust);
+
+	/* the same results in each engine */
+	for (pass = 0; pass < 2; pass++) {
+		emu51_set_block_cache(&m, pass ? block_cache : NULL);
+
+		m.pc = 0;
+		sfr[SFR_ACC] = 0;
+		sfr[SFR_DPL] = 0x1b; /* jump to 0x1b + 5 */
+		sfr[SFR_DPH] = 0;
+		assert_int_equal(emu51_run(&m, 101, &reason), 101);
+		assert_int_equal(reason, EMU51_STOP_BUDGET);
+		assert_int_equal(m.pc, 0x20);
+		assert_int_equal(sfr[SFR_ACC], 5);
+
+		/* the indirect jump checks its target */
+		m.pc = 0x15;
+		sfr[SFR_DPL] = 0xfe; /* jump to 0xfe + 5 = 0x03 */
+		sfr[SFR_DPH] = 0xff;
+		assert_int_equal(emu51_run(&m, 100, &reason), 0);
+		assert_int_equal(reason, EMU51_NOT_IMPLEMENTED);
+		assert_int_equal(m.pc, 0x15);
+		sfr[SFR_DPH] = 0x0f; /* beyond program memory */
+		assert_int_equal(emu51_run(&m, 100, &reason), 0);
+		assert_int_equal(reason, EMU51_PMEM_OUT_OF_RANGE);
+		assert_int_equal(m.pc, 0x15);
+	}
+	emu51_set_block_cache(&m, NULL);
+
+	/* code entered by setting pc is checked before it runs */
+	m.pc = 0x03;
+	assert_int_equal(emu51_step(&m, NULL), EMU51_NOT_IMPLEMENTED);
+	assert_int_equal(emu51_run(&m, 100, &reason), 0);
+	assert_int_equal(reason, EMU51_NOT_IMPLEMENTED);
+	assert_int_equal(m.pc, 0x03);
+	m.pc = 0x1000;
+	assert_int_equal(emu51_step(&m, NULL), EMU51_PMEM_OUT_OF_RANGE);
+
+	/* MOVC wraps around at the end of program memory */
+	m.pc = 0x30;
+	sfr[SFR_ACC] = 0x01;
+	sfr[SFR_DPL] = 0x0f;
+	sfr[SFR_DPH] = 0x10;
+	assert_int_equal(emu51_step(&m, NULL), 0);
+	assert_int_equal(sfr[SFR_ACC], 0x24);
+
+	/* leaving trusted mode */
+	assert_int_equal(emu51_set_trusted(&m, NULL), 0);
+	assert_null(m.trust);
+	m.pc = 0x30;
+	sfr[SFR_ACC] = 0x01;
+	assert_int_equal(emu51_step(&m, NULL), EMU51_PMEM_OUT_OF_RANGE);
+
+	free(block_cache);
+	free(trust);
+	free(pmem);
+}
+
 int main()
 {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_reset),
 		cmocka_unit_test(test_instr_table),
 		cmocka_unit_test(test_step),
+		cmocka_unit_test(test_decode),
+		cmocka_unit_test(test_decode_cache),
+		cmocka_unit_test(test_run_matches_step),
+		cmocka_unit_test(test_block_cache),
+		cmocka_unit_test(test_register_bank),
+		cmocka_unit_test(test_create),
+		cmocka_unit_test(test_event_log),
+		cmocka_unit_test(test_build_options),
+		cmocka_unit_test(test_trusted),
+		/* the tests below set callbacks, which emu51_nocallback ignores */
+#ifndef EMU51_NO_CALLBACKS
+		cmocka_unit_test(test_run),
+		cmocka_unit_test(test_jit),
+		cmocka_unit_test(test_jit_matches_step),
+		cmocka_unit_test(test_fast_forward),
+		cmocka_unit_test(test_psw_flags),
+		cmocka_unit_test(test_watch),
+#endif
 	};
 
 	return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,127 @@
+/* tests for the fleet runner */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <string.h>
+#include <cmocka.h>
+#include <stdlib.h>
+
+#include <emu51.h>
+
+/* use cmocka's version of memory allocation functions with checks */
+#define malloc test_malloc
+#define calloc test_calloc
+#define free test_free
+
+/* disable unused parameter warning when using gcc */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+
+#define PMEM_SIZE 4096
+#define COUNT 100
+
+/* program: two nested loops on the counters at 0x30 and 0x31, then an
+ * endless loop; each instruction takes 2 cycles
+ *   0x00: DJNZ 0x30, 0x00
+ *   0x03: DJNZ 0x31, 0x00
+ *   0x06: SJMP $
+ */
+static const uint8_t program[] = {
+	0xd5, 0x30, 0xfd, 0xd5, 0x31, 0xfa, 0x80, 0xfe,
+};
+
+/* Create an emulator whose outer loop runs n times. */
+static emu51 *create(const uint8_t *pmem, int n)
+{
+	emu51_config config;
+	emu51 *m;
+
+	memset(&config, 0, sizeof(config));
+	config.pmem = pmem;
+	config.pmem_len = PMEM_SIZE;
+	m = emu51_create(&config);
+	assert_non_null(m);
+	emu51_reset(m);
+	m->iram_lower[0x31] = n;
+	return m;
+}
+
+void test_fleet(void **state)
+{
+	uint8_t *pmem = calloc(PMEM_SIZE, 1);
+	uint8_t *breakpoints = calloc(65536 / 8, 1);
+	emu51 *machines[COUNT];
+	emu51_fleet_status status[COUNT];
+	emu51_fleet *fleet;
+	int i, reason;
+
+	memcpy(pmem, program, sizeof(program));
+
+	if (!(emu51_build_options() & EMU51_BUILD_FLEET)) {
+		assert_null(emu51_fleet_create(2));
+		assert_int_equal(emu51_fleet_run(NULL, machines, 0, 100, 10, status),
+			EMU51_NOT_SUPPORTED);
+		free(breakpoints);
+		free(pmem);
+		return;
+	}
+
+	fleet = emu51_fleet_create(4);
+	assert_non_null(fleet);
+	assert_int_equal(emu51_fleet_threads(fleet), 4);
+
+	for (i = 0; i < COUNT; i++)
+		machines[i] = create(pmem, i % 7 + 1);
+	machines[1]->pc = PMEM_SIZE; /* fails at once */
+	machines[2]->breakpoints = breakpoints;
+	breakpoints[0] = 0x40; /* 0x06 */
+
+	/* fewer emulators than threads, then more */
+	assert_int_equal(emu51_fleet_run(fleet, machines, 3, 100, 10, status), 0);
+	assert_int_equal(status[0].cycles, 100);
+	assert_int_equal(status[0].reason, EMU51_STOP_BUDGET);
+	assert_int_equal(emu51_fleet_run(fleet, machines, COUNT, 200000, 1000,
+		status), 0);
+
+	for (i = 0; i < COUNT; i++) {
+		/* the same state as a single run */
+		emu51 *ref = create(pmem, i % 7 + 1);
+		long cycles;
+
+		if (i == 1) {
+			assert_int_equal(status[i].cycles, 0);
+			assert_int_equal(status[i].reason, EMU51_PMEM_OUT_OF_RANGE);
+		} else if (i == 2) {
+			assert_int_equal(status[i].reason, EMU51_STOP_BREAKPOINT);
+			assert_int_equal(machines[i]->pc, 0x06);
+		} else {
+			assert_int_equal(status[i].reason, EMU51_STOP_BUDGET);
+			cycles = (i == 0 ? 100 : 0) + status[i].cycles;
+			assert_int_equal(cycles, i == 0 ? 200100 : 200000);
+			assert_int_equal(emu51_run(ref, cycles, &reason), cycles);
+			assert_int_equal(machines[i]->pc, ref->pc);
+			assert_int_equal(machines[i]->iram_lower[0x30],
+				ref->iram_lower[0x30]);
+			assert_int_equal(machines[i]->iram_lower[0x31],
+				ref->iram_lower[0x31]);
+		}
+		emu51_destroy(ref);
+	}
+
+	for (i = 0; i < COUNT; i++)
+		emu51_destroy(machines[i]);
+	emu51_fleet_destroy(fleet);
+	free(breakpoints);
+	free(pmem);
+}
+
+int main()
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_fleet),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -24,6 +24,7 @@ int setup(void **state)
 	m->sfr = calloc(128, 1);
 	m->xram = calloc(65536, 1);
 	m->xram_len = 65536;
+	map_memory(m);
 
 	*state = m;
 	return 0;
@@ -124,6 +125,7 @@ void test_indirect_addr_read(void **state)
 	/* delete iram_upper to test for error conditions */
 	free(m->iram_upper);
 	m->iram_upper = NULL;
+	map_memory(m);
 
 	/* *address < 0x80 */
 	m->sfr[SFR_B] = 0x7f;
@@ -170,6 +172,7 @@ void test_indirect_addr_write(void **state)
 	/* delete iram_upper to test for error conditions */
 	free(m->iram_upper);
 	m->iram_upper = NULL;
+	map_memory(m);
 
 	/* *address < 0x80 */
 	m->sfr[SFR_B] = 0x7f;
@@ -274,6 +277,7 @@ void test_stack_push(void **state)
 	/* delete iram_upper to test for error conditions */
 	free(m->iram_upper);
 	m->iram_upper = NULL;
+	map_memory(m);
 
 	/* SP < 0x7f: ok */
 	m->sfr[SFR_SP] = 0x7e;
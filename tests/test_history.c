@@ -0,0 +1,341 @@
+/* tests for the reverse execution */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <string.h>
+#include <cmocka.h>
+#include <stdlib.h>
+
+#include <emu51.h>
+
+/* use cmocka's version of memory allocation functions with checks */
+#define malloc test_malloc
+#define calloc test_calloc
+#define free test_free
+
+/* disable unused parameter warning when using gcc */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+
+#define PMEM_SIZE 4096
+#define XRAM_SIZE 1024
+
+/* main loop of the program */
+#define MAIN 0x40
+/* counters decremented by the interrupt service routines */
+#define TIMER_COUNTER 0x30
+#define SERIAL_COUNTER 0x31
+/* counter decremented by the main loop */
+#define LOOP_COUNTER 0x32
+/* counter decremented by the external interrupt 0 service routine */
+#define PINS_COUNTER 0x33
+
+/* steps run forward */
+#define STEPS 300
+
+/* program:
+ *   0x00: LJMP MAIN
+ *   0x03: DJNZ PINS_COUNTER, +0   (external 0)
+ *   0x06: RETI
+ *   0x0b: DJNZ TIMER_COUNTER, +0  (timer 0)
+ *   0x0e: RETI
+ *   0x23: DJNZ SCON, +0           (serial, clears RI)
+ *   0x26: DJNZ SERIAL_COUNTER, +0
+ *   0x29: ADD A, SBUF
+ *   0x2b: RETI
+ *   MAIN: ADD A, P1
+ *   0x42: CJNE A, P3, 0x45
+ *   0x45: DJNZ LOOP_COUNTER, +0
+ *   0x48: ADDC A, R2
+ *   0x49: SJMP MAIN
+ */
+static const uint8_t program[] = {
+	0x02, 0x00, MAIN, 0xd5, PINS_COUNTER, 0x00, 0x32, 0x00,
+	0x00, 0x00, 0x00, 0xd5, TIMER_COUNTER, 0x00, 0x32, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0xd5, SFR_BASE_ADDR + SFR_SCON, 0x00, 0xd5,
+	SERIAL_COUNTER,
+	0x00, 0x25, SFR_BASE_ADDR + SFR_SBUF, 0x32, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x25, 0x90, 0xb5, 0xb0, 0x00, 0xd5, LOOP_COUNTER, 0x00,
+	0x3a, 0x80, 0xf5,
+};
+
+static uint8_t pmem[PMEM_SIZE];
+
+/* state of the emulator before a step */
+typedef struct trace_entry
+{
+	uint16_t pc;
+	uint64_t cycles;
+	uint8_t sfr[128];
+	uint8_t iram[128];
+} trace_entry;
+
+typedef struct testdata
+{
+	emu51 *m;
+	void *serial;
+	void *history;
+	long reads; /* calls to io_read */
+	trace_entry trace[STEPS + 1];
+} testdata;
+
+/* Port values that change at every read. */
+static void callback_io_read(emu51 *m, uint8_t portno, uint8_t bitmask, uint8_t *data)
+{
+	testdata *td = m->userdata;
+	*data ^= (uint8_t)(td->reads++ * 37 + portno);
+}
+
+/* Create an emulator running the program with timer 0 and serial interrupts,
+ * keeping a history. */
+static testdata *alloc_test_data(long checkpoints, long inputs, long interval)
+{
+	testdata *data = calloc(1, sizeof(testdata));
+	emu51_config config;
+	emu51 *m;
+
+	memcpy(pmem, program, sizeof(program));
+	memset(&config, 0, sizeof(config));
+	config.pmem = pmem;
+	config.pmem_len = PMEM_SIZE;
+	config.xram_len = XRAM_SIZE;
+	m = emu51_create(&config);
+	assert_non_null(m);
+	data->m = m;
+
+	m->userdata = data;
+	m->callback.io_read = callback_io_read;
+	m->sfr[SFR_TMOD] = 0x02; /* 8-bit auto-reload */
+	m->sfr[SFR_TH0] = 0xc0;
+	m->sfr[SFR_TCON] = TCON_TR0;
+	m->sfr[SFR_SCON] = SCON_REN; /* mode 0 */
+	m->sfr[SFR_IE] = IE_EA | IE_ET0 | IE_ES;
+	data->serial = malloc(emu51_serial_size(16));
+	emu51_set_serial(m, data->serial, 16);
+
+	data->history = malloc(emu51_history_size(m, checkpoints, inputs));
+	emu51_set_history(m, data->history, checkpoints, inputs, interval);
+	return data;
+}
+
+static void free_test_data(testdata *data)
+{
+	emu51_destroy(data->m);
+	free(data->history);
+	free(data->serial);
+	free(data);
+}
+
+static void save_state(const emu51 *m, trace_entry *entry)
+{
+	entry->pc = m->pc;
+	entry->cycles = m->cycles;
+	memcpy(entry->sfr, m->sfr, 128);
+	memcpy(entry->iram, m->iram_lower, 128);
+}
+
+static void check_state(const emu51 *m, const trace_entry *entry)
+{
+	assert_int_equal(m->pc, entry->pc);
+	assert_int_equal(m->cycles, entry->cycles);
+	assert_memory_equal(m->sfr, entry->sfr, 128);
+	assert_memory_equal(m->iram_lower, entry->iram, 128);
+}
+
+/* Step forward from the trace entry to the end of the trace, with the host
+ * sending a byte to the serial port once in a while. */
+static void run_forward(testdata *data, int from)
+{
+	int i;
+
+	for (i = from; i < STEPS; i++) {
+		uint8_t byte = (uint8_t)(i * 7);
+		if (i % 23 == 0)
+			emu51_serial_send(data->m, &byte, 1);
+		save_state(data->m, &data->trace[i]);
+		assert_int_equal(emu51_step(data->m, NULL), 0);
+	}
+	save_state(data->m, &data->trace[STEPS]);
+}
+
+/* Find the last step of the trace before the entry that wrote to the
+ * internal memory address, which is a counter decremented by DJNZ. */
+static int last_write(const testdata *data, int before, uint8_t addr)
+{
+	int i;
+
+	for (i = before - 1; i >= 0; i--)
+		if (data->trace[i].iram[addr] != data->trace[i + 1].iram[addr])
+			return i;
+	return -1;
+}
+
+void test_reverse_step(void **state)
+{
+	testdata *data = alloc_test_data(64, 1024, 50);
+	emu51 *m = data->m;
+	long reads;
+	int i;
+
+	run_forward(data, 0);
+	assert_true(m->iram_lower[SERIAL_COUNTER] != 0);
+	assert_true(m->iram_lower[TIMER_COUNTER] != 0);
+
+	/* back to the start, without the host */
+	reads = data->reads;
+	for (i = STEPS - 1; i >= 0; i--) {
+		assert_int_equal(emu51_reverse_step(m), 0);
+		check_state(m, &data->trace[i]);
+	}
+	assert_int_equal(data->reads, reads);
+
+	/* the start of the history */
+	assert_int_equal(emu51_reverse_step(m), EMU51_NO_HISTORY);
+	check_state(m, &data->trace[0]);
+
+	/* forward again, with the host, and back in the new history */
+	data->reads = 0;
+	run_forward(data, 0);
+	assert_true(data->reads > 0);
+	for (i = STEPS - 1; i >= STEPS - 20; i--) {
+		assert_int_equal(emu51_reverse_step(m), 0);
+		check_state(m, &data->trace[i]);
+	}
+	run_forward(data, STEPS - 20);
+	for (i = STEPS - 1; i >= STEPS - 40; i--) {
+		assert_int_equal(emu51_reverse_step(m), 0);
+		check_state(m, &data->trace[i]);
+	}
+
+	free_test_data(data);
+}
+
+void test_reverse_continue(void **state)
+{
+	testdata *data = alloc_test_data(64, 1024, 50);
+	emu51 *m = data->m;
+	int step;
+
+	run_forward(data, 0);
+
+	/* the last timer interrupt, then the ones before */
+	step = last_write(data, STEPS, TIMER_COUNTER);
+	assert_true(step > 0);
+	assert_int_equal(emu51_reverse_continue(m, EMU51_EVENT_IRAM,
+		TIMER_COUNTER), 0);
+	check_state(m, &data->trace[step]);
+	assert_int_equal(m->pc, 0x0b);
+
+	step = last_write(data, step, TIMER_COUNTER);
+	assert_true(step > 0);
+	assert_int_equal(emu51_reverse_continue(m, EMU51_EVENT_IRAM,
+		TIMER_COUNTER), 0);
+	check_state(m, &data->trace[step]);
+
+	/* the serial interrupt */
+	step = last_write(data, step, SERIAL_COUNTER);
+	assert_true(step > 0);
+	assert_int_equal(emu51_reverse_continue(m, EMU51_EVENT_IRAM,
+		SERIAL_COUNTER), 0);
+	check_state(m, &data->trace[step]);
+
+	/* a SFR */
+	assert_int_equal(emu51_reverse_continue(m, EMU51_EVENT_SFR, SFR_SCON), 0);
+	assert_int_equal(m->pc, 0x23);
+
+	/* never written: the start of the history */
+	assert_int_equal(emu51_reverse_continue(m, EMU51_EVENT_IRAM, 0x70),
+		EMU51_NO_HISTORY);
+	check_state(m, &data->trace[0]);
+	assert_int_equal(emu51_reverse_continue(m, EMU51_EVENT_IRAM,
+		TIMER_COUNTER), EMU51_NO_HISTORY);
+	assert_int_equal(emu51_reverse_continue(m, 3, 0), EMU51_NOT_SUPPORTED);
+	assert_int_equal(emu51_reverse_continue(m, EMU51_EVENT_IRAM, 0x80),
+		EMU51_NOT_SUPPORTED);
+
+	free_test_data(data);
+}
+
+void test_reverse_pins(void **state)
+{
+	testdata *data = alloc_test_data(64, 1024, 50);
+	emu51 *m = data->m;
+	int i;
+
+	/* the host toggles INT0, falling edges raise the interrupt */
+	m->sfr[SFR_TCON] |= TCON_IT0;
+	m->sfr[SFR_IE] |= IE_EX0;
+	emu51_set_history(m, data->history, 64, 1024, 50);
+	for (i = 0; i < STEPS; i++) {
+		save_state(m, &data->trace[i]);
+		if (i % 17 == 0)
+			m->sfr[SFR_P3] ^= 0x04;
+		assert_int_equal(emu51_step(m, NULL), 0);
+	}
+	save_state(m, &data->trace[STEPS]);
+	assert_true(m->iram_lower[PINS_COUNTER] != 0);
+
+	/* the levels are fed again, not taken from the latch */
+	m->sfr[SFR_P3] ^= 0x04;
+	for (i = STEPS - 1; i >= 0; i--) {
+		assert_int_equal(emu51_reverse_step(m), 0);
+		check_state(m, &data->trace[i]);
+	}
+
+	free_test_data(data);
+}
+
+void test_history_limits(void **state)
+{
+	testdata *data = alloc_test_data(3, 1024, 50);
+	emu51 *m = data->m;
+	int i;
+
+	/* the oldest checkpoints are dropped */
+	run_forward(data, 0);
+	for (i = STEPS - 1; emu51_reverse_step(m) == 0; i--)
+		check_state(m, &data->trace[i]);
+	assert_true(i > 0);
+	assert_true(data->trace[STEPS].cycles - m->cycles >= 2 * 50);
+	assert_true(data->trace[STEPS].cycles - m->cycles < 3 * 50 + 12);
+	check_state(m, &data->trace[i + 1]);
+	free_test_data(data);
+
+	/* the inputs fill their log, which drops all but the latest checkpoint */
+	data = alloc_test_data(16, 8, 50);
+	m = data->m;
+	run_forward(data, 0);
+	for (i = STEPS - 1; emu51_reverse_step(m) == 0; i--)
+		check_state(m, &data->trace[i]);
+	assert_true(i > 0);
+	assert_true(data->trace[STEPS].cycles - m->cycles <= 50);
+	free_test_data(data);
+
+	/* no history */
+	data = alloc_test_data(3, 8, 50);
+	m = data->m;
+	emu51_set_history(m, NULL, 0, 0, 0);
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(emu51_reverse_step(m), EMU51_NO_HISTORY);
+	assert_int_equal(emu51_reverse_continue(m, EMU51_EVENT_IRAM, 0),
+		EMU51_NO_HISTORY);
+	free_test_data(data);
+}
+
+int main()
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_reverse_step),
+		cmocka_unit_test(test_reverse_continue),
+		cmocka_unit_test(test_reverse_pins),
+		cmocka_unit_test(test_history_limits),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -295,13 +295,21 @@ static int run_instr(uint32_t instr, testdata *data)
 		fail_msg("instruction not implemented: 0x%02x", opcode);
 	assert_int_equal(instr_info->bytes, instr_length);
 
+	/* decode the instruction as if pc had been advanced past it */
+	emu51_decoded decoded;
+	_emu51_decode(&decoded, buffer, data->m->pc);
+
 	/* Run the instruction on an emulator without callback functions. */
 	testdata *data_no_callback = dup_test_data(data); /* clone emulator */
 	memset(&data_no_callback->m->callback, 0, sizeof(emu51_callbacks)); /* clear callbacks */
-	instr_info->handler(instr_info, buffer, data_no_callback->m); /* run instruction */
+	_emu51_map_memory(data_no_callback->m); /* like emu51_step() does */
+	decoded.handler(&decoded, data_no_callback->m); /* run instruction */
 	free_test_data(data_no_callback); /* free the cloned emulator */
 
-	return instr_info->handler(instr_info, buffer, data->m);
+	_emu51_map_memory(data->m);
+	int err = decoded.handler(&decoded, data->m);
+	_emu51_sync_psw(data->m); /* compute the flags like emu51_step() does */
+	return err;
 }
 
 #endif /* _TEST_INSTR_COMMON_H_ */
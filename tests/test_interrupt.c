@@ -0,0 +1,282 @@
+/* tests for the interrupt controller */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <string.h>
+#include <cmocka.h>
+#include <stdlib.h>
+
+#include <emu51.h>
+
+/* use cmocka's version of memory allocation functions with checks */
+#define malloc test_malloc
+#define calloc test_calloc
+#define free test_free
+
+/* disable unused parameter warning when using gcc */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+
+#define PMEM_SIZE 4096
+
+/* main loop of the program */
+#define MAIN 0x40
+/* counter decremented by the timer 0 interrupt service routine */
+#define COUNTER 0x30
+
+typedef struct testdata
+{
+	emu51 m;
+	uint8_t pmem[PMEM_SIZE];
+	uint8_t iram_lower[128];
+	uint8_t sfr[128];
+} testdata;
+
+/* Set up an emulator with the program:
+ *   0x00: LJMP MAIN
+ *   0x03: NOP                    (INT0)
+ *   0x04: RETI
+ *   0x0b: DJNZ COUNTER, +0       (timer 0)
+ *   0x0e: RETI
+ *   0x13: RETI                   (INT1)
+ *   0x1b: RETI                   (timer 1)
+ *   MAIN: SJMP $
+ */
+static testdata *alloc_test_data(void)
+{
+	testdata *data = calloc(1, sizeof(testdata));
+	uint8_t *pmem = data->pmem;
+
+	data->m.pmem = pmem;
+	data->m.pmem_len = PMEM_SIZE;
+	data->m.iram_lower = data->iram_lower;
+	data->m.sfr = data->sfr;
+	data->sfr[SFR_P3] = 0xff;
+	emu51_reset(&data->m);
+
+	pmem[0x00] = 0x02;
+	pmem[0x01] = 0x00;
+	pmem[0x02] = MAIN;
+	pmem[0x03] = 0x00;
+	pmem[0x04] = 0x32;
+	pmem[0x0b] = 0xd5;
+	pmem[0x0c] = COUNTER;
+	pmem[0x0d] = 0x00;
+	pmem[0x0e] = 0x32;
+	pmem[0x13] = 0x32;
+	pmem[0x1b] = 0x32;
+	pmem[MAIN] = 0x80;
+	pmem[MAIN + 1] = 0xfe;
+	return data;
+}
+
+void test_timer0(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = &data->m;
+	int cycles;
+
+	m->pc = MAIN;
+	m->sfr[SFR_TMOD] = 0x02; /* 8-bit auto reload */
+	m->sfr[SFR_TCON] = TCON_TR0;
+	m->sfr[SFR_TL0] = 0xfe;
+	m->sfr[SFR_IE] = IE_EA | IE_ET0;
+
+	/* the overflow is reached by the SJMP... */
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->pc, MAIN);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TR0 | TCON_TF0);
+
+	/* ...and the vector is called by the next step, clearing the flag */
+	assert_int_equal(emu51_step(m, &cycles), 0);
+	assert_int_equal(cycles, 2);
+	assert_int_equal(m->pc, 0x0b);
+	assert_int_equal(m->sfr[SFR_SP], 0x09);
+	assert_int_equal(data->iram_lower[0x08], MAIN);
+	assert_int_equal(data->iram_lower[0x09], 0x00);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TR0);
+	assert_int_equal(m->irq.in_service, 1);
+
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(data->iram_lower[COUNTER], 0xff);
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->pc, MAIN);
+	assert_int_equal(m->sfr[SFR_SP], 0x07);
+	assert_int_equal(m->irq.in_service, 0);
+
+	free(data);
+}
+
+/* Run the main loop for 1000 cycles with an overflow of timer 0 every 256
+ * cycles, and check that the interrupt is taken for each overflow. */
+static void run_timer0(testdata *data)
+{
+	emu51 *m = &data->m;
+	int reason;
+
+	m->pc = MAIN;
+	m->sfr[SFR_TMOD] = 0x02;
+	m->sfr[SFR_TCON] = TCON_TR0;
+	m->sfr[SFR_TL0] = 0;
+	m->sfr[SFR_TH0] = 0;
+	m->sfr[SFR_IE] = IE_EA | IE_ET0;
+	data->iram_lower[COUNTER] = 0;
+	assert_int_equal(emu51_run(m, 1000, &reason), 1000);
+	assert_int_equal(reason, EMU51_STOP_BUDGET);
+	assert_int_equal(data->iram_lower[COUNTER], 0x100 - 3);
+	assert_int_equal(m->pc, MAIN);
+	assert_int_equal(m->sfr[SFR_SP], 0x07);
+	assert_int_equal(m->irq.in_service, 0);
+}
+
+void test_engines(void **state)
+{
+	testdata *data = alloc_test_data();
+	void *cache = malloc(emu51_block_cache_size(PMEM_SIZE));
+
+	/* interpreter */
+	run_timer0(data);
+
+	/* block engine and JIT */
+	emu51_set_block_cache(&data->m, cache);
+	emu51_jit_enable(&data->m);
+	run_timer0(data);
+	run_timer0(data);
+	emu51_jit_disable(&data->m);
+
+	free(cache);
+	free(data);
+}
+
+void test_priority(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = &data->m;
+
+	/* edge triggered external interrupts, INT1 with high priority */
+	m->pc = MAIN;
+	m->sfr[SFR_TCON] = TCON_IT0 | TCON_IT1;
+	m->sfr[SFR_IE] = IE_EA | IE_EX0 | IE_EX1;
+	m->sfr[SFR_IP] = IE_EX1;
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->pc, MAIN);
+
+	/* falling edge of INT0 */
+	m->sfr[SFR_P3] = 0xfb;
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->pc, 0x03);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_IT0 | TCON_IT1);
+	assert_int_equal(m->irq.in_service, 1);
+
+	/* INT1 interrupts the service routine of INT0 */
+	m->sfr[SFR_P3] = 0xf3;
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->pc, 0x13);
+	assert_int_equal(m->sfr[SFR_SP], 0x0b);
+	assert_int_equal(m->irq.in_service, 3);
+
+	/* RETI ends the high priority level only */
+	m->sfr[SFR_P3] = 0xff;
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->pc, 0x03);
+	assert_int_equal(m->irq.in_service, 1);
+
+	/* INT0 can't interrupt its own level */
+	m->sfr[SFR_P3] = 0xfb;
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->pc, 0x04);
+	assert_int_equal(m->sfr[SFR_TCON] & TCON_IE0, TCON_IE0);
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->pc, MAIN);
+	assert_int_equal(m->irq.in_service, 0);
+
+	/* one instruction runs after RETI before the pending interrupt */
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->pc, MAIN);
+	assert_int_equal(m->sfr[SFR_TCON] & TCON_IE0, TCON_IE0);
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->pc, 0x03);
+	assert_int_equal(m->sfr[SFR_TCON] & TCON_IE0, 0);
+
+	free(data);
+}
+
+void test_enable(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = &data->m;
+
+	/* nothing is taken without EA */
+	m->pc = MAIN;
+	m->sfr[SFR_TCON] = TCON_TF0;
+	m->sfr[SFR_IE] = IE_ET0;
+	assert_int_equal(emu51_run(m, 10, NULL), 10);
+	assert_int_equal(m->pc, MAIN);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TF0);
+	m->sfr[SFR_IE] |= IE_EA;
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->pc, 0x0b);
+	assert_int_equal(m->sfr[SFR_TCON], 0);
+
+	/* a level triggered external interrupt follows the pin */
+	m->pc = MAIN;
+	m->sfr[SFR_SP] = 0x07;
+	m->irq.in_service = 0;
+	m->sfr[SFR_IE] = IE_EX1;
+	m->sfr[SFR_P3] = 0xf7;
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_IE1);
+	m->sfr[SFR_P3] = 0xff;
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->sfr[SFR_TCON], 0);
+	assert_int_equal(m->pc, MAIN);
+
+	free(data);
+}
+
+void test_trusted(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = &data->m;
+	void *trust = malloc(emu51_trust_size(PMEM_SIZE));
+	int reason;
+
+	/* the vectors are not reached from the reset vector */
+	data->pmem[0x0b] = 0xa5; /* unimplemented */
+	assert_int_equal(emu51_set_trusted(m, trust), 0);
+
+	/* the vector is checked when the interrupt is taken */
+	m->pc = MAIN;
+	m->sfr[SFR_TCON] = TCON_TF0;
+	m->sfr[SFR_IE] = IE_EA | IE_ET0;
+	assert_int_equal(emu51_run(m, 10, &reason), 0);
+	assert_int_equal(reason, EMU51_NOT_IMPLEMENTED);
+	assert_int_equal(m->pc, MAIN);
+	assert_int_equal(m->sfr[SFR_SP], 0x07);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TF0);
+
+	data->pmem[0x0b] = 0xd5;
+	assert_int_equal(emu51_run(m, 6, &reason), 6);
+	assert_int_equal(reason, EMU51_STOP_BUDGET);
+	assert_int_equal(m->pc, MAIN);
+	assert_int_equal(data->iram_lower[COUNTER], 0xff);
+
+	emu51_set_trusted(m, NULL);
+	free(trust);
+	free(data);
+}
+
+int main()
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_timer0),
+		cmocka_unit_test(test_engines),
+		cmocka_unit_test(test_priority),
+		cmocka_unit_test(test_enable),
+		cmocka_unit_test(test_trusted),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -465,6 +465,54 @@ void test_lcall(void **state)
 	free_test_data(data);
 }
 
+void test_ret(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = data->m;
+	int err;
+
+	/* RET pops the address pushed by LCALL */
+	PC(m) = 0x5783;
+	SP(m) = 0x32;
+	iram_write(m, 0x31, 0x34);
+	iram_write(m, 0x32, 0x12);
+	expect_value(callback_sfr_update, index, SFR_SP);
+	err = run_instr(INSTR1(0x22), data);
+	assert_int_equal(err, 0);
+	assert_int_equal(PC(m), 0x1234);
+	assert_int_equal(SP(m), 0x30);
+	assert_int_equal(iram_read(m, 0x31), 0x34);
+	assert_int_equal(iram_read(m, 0x32), 0x12);
+	assert_emu51_callbacks(data, CB_SFR_UPDATE);
+
+	/* RETI also ends the interrupt in service */
+	PC(m) = 0x000b;
+	SP(m) = 0x32;
+	m->irq.in_service = 0x01;
+	expect_value(callback_sfr_update, index, SFR_SP);
+	err = run_instr(INSTR1(0x32), data);
+	assert_int_equal(err, 0);
+	assert_int_equal(PC(m), 0x1234);
+	assert_int_equal(SP(m), 0x30);
+	assert_int_equal(m->irq.in_service, 0);
+	assert_emu51_callbacks(data, CB_SFR_UPDATE);
+
+	/* the stack is unchanged if it is out of range */
+	testdata *data_no_upper_iram = dup_test_data(data);
+	m = data_no_upper_iram->m;
+	m->iram_upper = NULL;
+	PC(m) = 0x5783;
+	SP(m) = 0x81;
+	err = run_instr(INSTR1(0x22), data_no_upper_iram);
+	assert_int_equal(err, EMU51_IRAM_OUT_OF_RANGE);
+	assert_int_equal(PC(m), 0x5783);
+	assert_int_equal(SP(m), 0x81);
+	assert_emu51_callbacks(data_no_upper_iram, 0);
+	free_test_data(data_no_upper_iram);
+
+	free_test_data(data);
+}
+
 void test_sjmp(void **state)
 {
 	testdata *data = alloc_test_data();
@@ -792,6 +840,16 @@ void test_djnz(void **state)
 	assert_int_equal(m->sfr[SFR_ACC], 255);
 	assert_emu51_callbacks(data, CB_SFR_UPDATE);
 
+	/* djnz 0x30, 63 (before: 0x30 = 2; after: 0x30 = 1; jump: true) */
+	m->iram_lower[0x30] = 2;
+	m->pc = orig_pc;
+	expect_value(callback_iram_update, addr, 0x30);
+	err = run_instr(INSTR3(0xd5, 0x30, reladdr), data);
+	assert_int_equal(err, 0);
+	assert_int_equal(m->pc, orig_pc + reladdr); /* jumps */
+	assert_int_equal(m->iram_lower[0x30], 1);
+	assert_emu51_callbacks(data, CB_IRAM_UPDATE);
+
 	/* DJNZ Rn, reladdr (opcode = 0xd8~0xdf) */
 	for (regno = 0; regno < 8; regno++) {
 		int opcode = 0xd8 + regno;
@@ -800,24 +858,30 @@ void test_djnz(void **state)
 
 		/* djnz Rn, -32 (before: Rn = 2; after: Rn = 1; jump: true) */
 		m->pc = 64;
+		expect_value(callback_iram_update, addr, R_REG_BASE(m) + regno);
 		err = run_instr(INSTR2(opcode, -32), data);
 		assert_int_equal(err, 0);
 		assert_int_equal(m->pc, 64 - 32);
 		assert_int_equal(R_REG(m, regno), 1);
+		assert_emu51_callbacks(data, CB_IRAM_UPDATE);
 
 		/* djnz Rn, -32 (before: Rn = 1: after: Rn = 0: jump: false) */
 		m->pc = 64;
+		expect_value(callback_iram_update, addr, R_REG_BASE(m) + regno);
 		err = run_instr(INSTR2(opcode, -32), data);
 		assert_int_equal(err, 0);
 		assert_int_equal(m->pc, 64);
 		assert_int_equal(R_REG(m, regno), 0);
+		assert_emu51_callbacks(data, CB_IRAM_UPDATE);
 
 		/* djnz Rn, -32 (before: Rn = 0: after: Rn = 255: jump: true) */
 		m->pc = 64;
+		expect_value(callback_iram_update, addr, R_REG_BASE(m) + regno);
 		err = run_instr(INSTR2(opcode, -32), data);
 		assert_int_equal(err, 0);
 		assert_int_equal(m->pc, 64 - 32);
 		assert_int_equal(R_REG(m, regno), 255);
+		assert_emu51_callbacks(data, CB_IRAM_UPDATE);
 	}
 
 	free_test_data(data);
@@ -860,10 +924,12 @@ void test_jbc(void **state)
 
 	m->pc = 128;
 	m->iram_lower[0x20] = 0x08; /* bit[3] */
+	expect_value(callback_iram_update, addr, 0x20);
 	err = run_instr(INSTR3(opcode, 3, -8), data);
 	assert_int_equal(err, 0);
 	assert_int_equal(m->pc, 120); /* jumps */
 	assert_int_equal(m->iram_lower[0x20], 0x00); /* jbc clears the bit after jump */
+	assert_emu51_callbacks(data, CB_IRAM_UPDATE);
 
 	m->pc = 128;
 	m->iram_lower[0x20] = 0x00;
@@ -920,6 +986,7 @@ int main()
 		cmocka_unit_test(test_jz_jnz),
 		cmocka_unit_test(test_ljmp),
 		cmocka_unit_test(test_lcall),
+		cmocka_unit_test(test_ret),
 		cmocka_unit_test(test_sjmp),
 		cmocka_unit_test(test_cjne),
 		cmocka_unit_test(test_djnz),
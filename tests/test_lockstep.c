@@ -0,0 +1,239 @@
+/* tests for the lockstep engine */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <string.h>
+#include <cmocka.h>
+#include <stdlib.h>
+
+#include <emu51.h>
+
+/* library internal headers */
+#include <instr.h>
+
+/* use cmocka's version of memory allocation functions with checks */
+#define malloc test_malloc
+#define calloc test_calloc
+#define free test_free
+
+/* disable unused parameter warning when using gcc */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+
+#define PMEM_SIZE 4096
+#define LANES 37
+
+/* program: loops whose branches depend on the inputs (A, R0, 0x21, 0x33
+ * and 0x40~0x4f), mixing vectorized instructions and instructions run lane by lane
+ *   0x00: ADD A, @R0
+ *   0x01: ADDC A, R2
+ *   0x02: ACALL 0x20
+ *   0x04: JNC 0x08
+ *   0x06: ADDC A, #3
+ *   0x08: CJNE A, #0x40, 0x0b
+ *   0x0b: JZ 0x10
+ *   0x0d: CJNE R7, #7, 0x10
+ *   0x10: JBC 0x21.1, 0x15
+ *   0x13: ADDC A, 0x33
+ *   0x15: DJNZ R2, 0x00
+ *   0x17: DJNZ 0x33, 0x00
+ *   0x1a: SJMP $
+ *   0x20: MOVC A, @A+DPTR
+ *   0x21: JNZ 0x24
+ *   0x23: NOP
+ *   0x24: RET
+ */
+static const uint8_t program[] = {
+	0x26, 0x3a, 0x11, 0x20, 0x50, 0x02, 0x34, 0x03,
+	0xb4, 0x40, 0x00, 0x60, 0x03, 0xbf, 0x07, 0x00,
+	0x10, 0x09, 0x02, 0x35, 0x33, 0xda, 0xe9, 0xd5,
+	0x33, 0xe6, 0x80, 0xfe, 0x00, 0x00, 0x00, 0x00,
+	0x93, 0x70, 0x01, 0x00, 0x22,
+};
+
+/* Create an emulator with the inputs of a lane. */
+static emu51 *create(const uint8_t *pmem, int lane)
+{
+	emu51_config config;
+	emu51 *m;
+	int i;
+
+	memset(&config, 0, sizeof(config));
+	config.pmem = pmem;
+	config.pmem_len = PMEM_SIZE;
+	m = emu51_create(&config);
+	assert_non_null(m);
+	emu51_reset(m);
+	m->sfr[SFR_ACC] = lane * 7;
+	m->iram_lower[0x00] = 0x40 + lane % 16; /* R0 */
+	m->iram_lower[0x02] = 5; /* R2 */
+	m->iram_lower[0x21] = lane;
+	m->iram_lower[0x33] = lane % 5 + 1;
+	for (i = 0; i < 16; i++)
+		m->iram_lower[0x40 + i] = i * 37 + lane;
+	return m;
+}
+
+/* Check that a lane has the same state as an emulator. */
+static void check_lane(const emu51_lockstep *ls, long lane, const emu51 *ref)
+{
+	emu51 *m = create(ref->pmem, 0);
+
+	emu51_lockstep_store(ls, lane, m);
+	assert_int_equal(m->pc, ref->pc);
+	assert_int_equal(m->cycles, ref->cycles);
+	assert_memory_equal(m->iram_lower, ref->iram_lower, 128);
+	assert_memory_equal(m->sfr, ref->sfr, 128);
+	emu51_destroy(m);
+}
+
+void test_lockstep(void **state)
+{
+	uint8_t *pmem = calloc(PMEM_SIZE, 1);
+	void *buffer = malloc(emu51_lockstep_size(LANES));
+	emu51 *refs[LANES];
+	int reasons[LANES];
+	emu51_lockstep *ls;
+	emu51 *m;
+	int i, reason;
+
+	memcpy(pmem, program, sizeof(program));
+	ls = emu51_lockstep_init(buffer, pmem, PMEM_SIZE, LANES);
+
+	/* the lanes start in the reset state */
+	m = create(pmem, 0);
+	emu51_lockstep_store(ls, LANES - 1, m);
+	assert_int_equal(m->pc, 0);
+	assert_int_equal(m->cycles, 0);
+	assert_int_equal(m->sfr[SFR_SP], 0x07);
+	assert_int_equal(m->sfr[SFR_ACC], 0);
+	emu51_destroy(m);
+
+	for (i = 0; i < LANES; i++) {
+		refs[i] = create(pmem, i);
+		emu51_lockstep_load(ls, i, refs[i]);
+	}
+
+	/* lane 5 points R0 to the upper iram, which lanes don't have */
+	refs[5]->iram_lower[0x00] = 0x90;
+	emu51_lockstep_load(ls, 5, refs[5]);
+
+	/* in two runs, the lanes diverging in the first one */
+	assert_int_equal(emu51_lockstep_run(ls, 301, reasons), 1);
+	assert_int_equal(reasons[5], EMU51_IRAM_OUT_OF_RANGE);
+	for (i = 0; i < LANES; i++) {
+		if (i == 5)
+			continue;
+		assert_int_equal(reasons[i], EMU51_STOP_BUDGET);
+		emu51_run(refs[i], 301, &reason);
+		check_lane(ls, i, refs[i]);
+	}
+
+	assert_int_equal(emu51_lockstep_run(ls, 40000, NULL), 1);
+	for (i = 0; i < LANES; i++) {
+		if (i == 5)
+			continue;
+		emu51_run(refs[i], 40000, &reason);
+		check_lane(ls, i, refs[i]);
+		/* all lanes ended in SJMP $ */
+		assert_int_equal(refs[i]->pc, 0x1a);
+	}
+
+	/* the failed lane stays at the faulting instruction */
+	m = create(pmem, 0);
+	emu51_lockstep_store(ls, 5, m);
+	assert_int_equal(m->pc, 0x00);
+	emu51_destroy(m);
+
+	for (i = 0; i < LANES; i++)
+		emu51_destroy(refs[i]);
+	free(buffer);
+	free(pmem);
+}
+
+/* Run random programs on lanes with random states, and check that each lane
+ * ends like an emu51_step() loop on an emulator in the same state. Every
+ * byte of the program memory is an implemented opcode, except DJNZ direct,
+ * which could start the timers or enable the interrupts that lanes do not
+ * have. */
+void test_lockstep_matches_step(void **state)
+{
+	uint8_t *pmem = malloc(PMEM_SIZE);
+	void *buffer = malloc(emu51_lockstep_size(LANES));
+	uint8_t opcodes[256];
+	int reasons[LANES];
+	int opcode_count = 0;
+	int opcode, seed, i, j;
+
+	for (opcode = 0; opcode <= 255; opcode++)
+		if (_emu51_decode_instr(opcode)->handler && opcode != 0xd5)
+			opcodes[opcode_count++] = opcode;
+
+	for (seed = 0; seed < 50; seed++) {
+		emu51_lockstep *ls;
+		emu51 *refs[LANES];
+		long budget;
+
+		srand(seed);
+		for (i = 0; i < PMEM_SIZE; i++)
+			pmem[i] = opcodes[rand() % opcode_count];
+		ls = emu51_lockstep_init(buffer, pmem, PMEM_SIZE, LANES);
+
+		for (i = 0; i < LANES; i++) {
+			refs[i] = create(pmem, 0);
+			for (j = 0; j < 128; j++)
+				refs[i]->iram_lower[j] = rand();
+			refs[i]->sfr[SFR_SP] = rand() & 0x7f;
+			refs[i]->sfr[SFR_PSW] = rand();
+			refs[i]->sfr[SFR_ACC] = rand();
+			refs[i]->pc = rand() % PMEM_SIZE;
+			emu51_lockstep_load(ls, i, refs[i]);
+		}
+
+		budget = 1 + rand() % 2000;
+		emu51_lockstep_run(ls, budget, reasons);
+
+		for (i = 0; i < LANES; i++) {
+			emu51 *m = refs[i];
+			int reason = EMU51_STOP_BUDGET;
+			long used = 0;
+
+			while (used < budget) {
+				int cycles;
+				int err = emu51_step(m, &cycles);
+				if (err) {
+					reason = err;
+					break;
+				}
+				used += cycles;
+			}
+
+			/* the state after an error is not specified */
+			assert_int_equal(reasons[i], reason);
+			if (reason == EMU51_STOP_BUDGET) {
+				check_lane(ls, i, m);
+			} else {
+				emu51 *lane = create(pmem, 0);
+				emu51_lockstep_store(ls, i, lane);
+				assert_int_equal(lane->pc, m->pc);
+				emu51_destroy(lane);
+			}
+			emu51_destroy(m);
+		}
+	}
+
+	free(buffer);
+	free(pmem);
+}
+
+int main()
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_lockstep),
+		cmocka_unit_test(test_lockstep_matches_step),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
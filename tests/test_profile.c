@@ -0,0 +1,329 @@
+/* tests for the execution profiler */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <string.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <emu51.h>
+
+/* use cmocka's version of memory allocation functions with checks */
+#define malloc test_malloc
+#define calloc test_calloc
+#define free test_free
+
+/* disable unused parameter warning when using gcc */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+
+#define PMEM_SIZE 4096
+
+/* the SJMP $ at the end of the program */
+#define END 0x08
+/* start of the delay function */
+#define DELAY 0x10
+
+/* program: two nested loops, the outer one calling a delay loop
+ *   0x00: ADD A, #1
+ *   0x02: DJNZ R2, 0x00
+ *   0x04: ACALL DELAY
+ *   0x06: DJNZ R3, 0x00
+ *   END:  SJMP $
+ *   DELAY: DJNZ R4, $
+ *   0x12: RET
+ */
+static const uint8_t program[] = {
+	0x24, 0x01, 0xda, 0xfc, 0x11, DELAY, 0xdb, 0xf8,
+	0x80, 0xfe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xdc, 0xfe, 0x22,
+};
+
+/* executions of each address before reaching END, with R3 = 3 and R4 = 10 */
+static const struct
+{
+	uint16_t addr;
+	uint64_t count;
+	uint64_t cycles;
+} expected[] = {
+	{ 0x00, 3 * 256, 3 * 256 },
+	{ 0x02, 3 * 256, 3 * 256 * 2 },
+	{ 0x04, 3, 3 * 2 },
+	{ 0x06, 3, 3 * 2 },
+	{ DELAY, 10 + 2 * 256, (10 + 2 * 256) * 2 },
+	{ 0x12, 3, 3 * 2 },
+};
+
+enum engine
+{
+	ENGINE_STEP,   /* emu51_step() */
+	ENGINE_PLAIN,  /* emu51_run() without caches */
+	ENGINE_DECODE, /* emu51_run() with a decode cache */
+	ENGINE_BLOCKS, /* emu51_run() with a block cache */
+};
+
+typedef struct testdata
+{
+	emu51 *m;
+	uint8_t *pmem;
+	void *profile;
+	void *cache;
+} testdata;
+
+static testdata *alloc_test_data(int engine, uint8_t outer, long period)
+{
+	testdata *data = calloc(1, sizeof(testdata));
+	emu51_config config;
+
+	data->pmem = calloc(PMEM_SIZE, 1);
+	memcpy(data->pmem, program, sizeof(program));
+	memset(&config, 0, sizeof(config));
+	config.pmem = data->pmem;
+	config.pmem_len = PMEM_SIZE;
+	data->m = emu51_create(&config);
+	assert_non_null(data->m);
+	data->m->iram_lower[0x03] = outer; /* R3 */
+	data->m->iram_lower[0x04] = 10; /* R4 */
+
+	if (engine == ENGINE_DECODE) {
+		data->cache = malloc(emu51_decode_cache_size(PMEM_SIZE));
+		emu51_set_decode_cache(data->m, data->cache);
+	} else if (engine == ENGINE_BLOCKS) {
+		data->cache = malloc(emu51_block_cache_size(PMEM_SIZE));
+		emu51_set_block_cache(data->m, data->cache);
+	}
+
+	data->profile = malloc(emu51_profile_size(PMEM_SIZE));
+	emu51_set_profile(data->m, data->profile, period);
+	return data;
+}
+
+static void free_test_data(testdata *data)
+{
+	emu51_destroy(data->m);
+	free(data->profile);
+	free(data->cache);
+	free(data->pmem);
+	free(data);
+}
+
+/* Run the program to END with the engine. */
+static void run_to_end(testdata *data, int engine)
+{
+	int reason;
+
+	if (engine == ENGINE_STEP) {
+		while (data->m->pc != END)
+			assert_int_equal(emu51_step(data->m, NULL), 0);
+	} else {
+		emu51_run(data->m, 4000, &reason);
+		assert_int_equal(reason, EMU51_STOP_BUDGET);
+		assert_int_equal(data->m->pc, END);
+	}
+}
+
+/* Sum the counters of all the addresses. */
+static void total(const emu51 *m, uint64_t *count, uint64_t *cycles)
+{
+	uint64_t c, n;
+	long addr;
+
+	*count = *cycles = 0;
+	for (addr = 0; addr < PMEM_SIZE; addr++) {
+		emu51_profile_get(m, (uint16_t)addr, &n, &c);
+		*count += n;
+		*cycles += c;
+	}
+}
+
+void test_profile_exact(void **state)
+{
+	int engine;
+
+	for (engine = ENGINE_STEP; engine <= ENGINE_BLOCKS; engine++) {
+		/* a period below 1 counts every execution */
+		testdata *data = alloc_test_data(engine, 3,
+			engine == ENGINE_STEP ? -1 : engine == ENGINE_PLAIN ? 0 : 1);
+		uint64_t count, cycles, spins;
+		size_t i;
+
+		run_to_end(data, engine);
+		for (i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+			emu51_profile_get(data->m, expected[i].addr, &count, &cycles);
+			assert_int_equal(count, expected[i].count);
+			assert_int_equal(cycles, expected[i].cycles);
+		}
+
+		/* every cycle is accounted, including the final spin */
+		emu51_profile_get(data->m, END, &spins, &cycles);
+		assert_int_equal(cycles, spins * 2);
+		total(data->m, &count, &cycles);
+		assert_int_equal(cycles, data->m->cycles);
+
+		/* out of the program memory */
+		emu51_profile_get(data->m, 0xffff, &count, &cycles);
+		assert_int_equal(count, 0);
+		assert_int_equal(cycles, 0);
+		free_test_data(data);
+	}
+}
+
+void test_profile_sampling(void **state)
+{
+	int engine;
+
+	for (engine = ENGINE_PLAIN; engine <= ENGINE_BLOCKS; engine++) {
+		testdata *data = alloc_test_data(engine, 0, 61);
+		uint64_t count, cycles;
+		int reason;
+
+		/* 256 outer iterations: 328724 cycles */
+		emu51_run(data->m, 330000, &reason);
+		assert_int_equal(data->m->pc, END);
+
+		/* the estimates are within 2% */
+		emu51_profile_get(data->m, 0x00, &count, &cycles);
+		assert_true(count > 256 * 256 * 98 / 100);
+		assert_true(count < 256 * 256 * 102 / 100);
+		total(data->m, &count, &cycles);
+		assert_true(cycles > data->m->cycles * 98 / 100);
+		assert_true(cycles < data->m->cycles * 102 / 100);
+
+		/* the counters are multiples of the period, except the skipped
+		 * delay loops */
+		emu51_profile_get(data->m, 0x02, &count, &cycles);
+		assert_int_equal(count % 61, 0);
+		emu51_profile_get(data->m, DELAY, &count, &cycles);
+		assert_int_equal(count, 10 + 255 * 256);
+		free_test_data(data);
+	}
+}
+
+void test_profile_write(void **state)
+{
+	testdata *data = alloc_test_data(ENGINE_BLOCKS, 3, 1);
+	unsigned long long count, cycles;
+	unsigned int addr;
+	uint8_t record[18];
+	FILE *file;
+	char line[80];
+	int lines = 0;
+
+	run_to_end(data, ENGINE_BLOCKS);
+
+	/* text */
+	file = tmpfile();
+	assert_non_null(file);
+	assert_int_equal(emu51_profile_write(data->m, file, EMU51_PROFILE_TEXT), 0);
+	rewind(file);
+	assert_non_null(fgets(line, sizeof(line), file));
+	assert_string_equal(line, "# emu51 profile, period 1\n");
+	assert_non_null(fgets(line, sizeof(line), file));
+	assert_int_equal(line[0], '#');
+	while (fgets(line, sizeof(line), file)) {
+		uint64_t c, n;
+		assert_int_equal(sscanf(line, "%x %llu %llu", &addr, &count,
+			&cycles), 3);
+		emu51_profile_get(data->m, (uint16_t)addr, &n, &c);
+		assert_true(n > 0);
+		assert_int_equal(count, n);
+		assert_int_equal(cycles, c);
+		lines++;
+	}
+	assert_int_equal(lines, 7);
+	fclose(file);
+
+	/* binary */
+	file = tmpfile();
+	assert_non_null(file);
+	assert_int_equal(emu51_profile_write(data->m, file, EMU51_PROFILE_BINARY),
+		0);
+	rewind(file);
+	assert_int_equal(fread(record, 13, 1, file), 1);
+	assert_memory_equal(record, "E51P\x01\x01\x00\x00\x00\x07\x00\x00\x00", 13);
+	assert_int_equal(fread(record, 18, 1, file), 1);
+	assert_int_equal(record[0] | record[1] << 8, 0x00);
+	assert_int_equal(record[2] | record[3] << 8, 3 * 256);
+	assert_memory_equal(record + 4, "\0\0\0\0\0\0", 6);
+	assert_int_equal(record[10] | record[11] << 8, 3 * 256);
+	for (lines = 1; fread(record, 18, 1, file) == 1; lines++)
+		;
+	assert_int_equal(lines, 7);
+	assert_int_equal(record[0] | record[1] << 8, 0x12);
+	fclose(file);
+
+	/* errors */
+	assert_int_equal(emu51_profile_write(data->m, stdout, 2),
+		EMU51_NOT_SUPPORTED);
+	emu51_set_profile(data->m, NULL, 0);
+	assert_int_equal(emu51_profile_write(data->m, stdout, EMU51_PROFILE_TEXT),
+		EMU51_NOT_SUPPORTED);
+	free_test_data(data);
+}
+
+void test_profile_aggregate(void **state)
+{
+	testdata *data = alloc_test_data(ENGINE_DECODE, 3, 1);
+	emu51_symbol symbols[] = {
+		{ "loop", 0x02, 1, 1 },
+		{ "delay", DELAY, 1, 1 },
+	};
+	uint64_t spins, cycles;
+
+	run_to_end(data, ENGINE_DECODE);
+	emu51_profile_get(data->m, END, &spins, &cycles);
+
+	/* 0x00 is before the first symbol */
+	emu51_profile_aggregate(data->m, symbols, 2);
+	assert_int_equal(symbols[0].count, 3 * 256 + 3 + 3 + spins);
+	assert_int_equal(symbols[0].cycles, 3 * 256 * 2 + 6 + 6 + spins * 2);
+	assert_int_equal(symbols[1].count, 10 + 2 * 256 + 3);
+	assert_int_equal(symbols[1].cycles, (10 + 2 * 256) * 2 + 6);
+
+	emu51_set_profile(data->m, NULL, 0);
+	emu51_profile_aggregate(data->m, symbols, 2);
+	assert_int_equal(symbols[0].count, 0);
+	assert_int_equal(symbols[1].cycles, 0);
+	free_test_data(data);
+}
+
+void test_profile_reverse(void **state)
+{
+	testdata *data = alloc_test_data(ENGINE_STEP, 3, 1);
+	void *history = malloc(emu51_history_size(data->m, 4, 16));
+	uint64_t count, cycles;
+	int i;
+
+	/* the re-execution of the steps is not counted */
+	emu51_set_history(data->m, history, 4, 16, 20);
+	for (i = 0; i < 50; i++)
+		assert_int_equal(emu51_step(data->m, NULL), 0);
+	emu51_profile_get(data->m, 0x00, &count, &cycles);
+	assert_int_equal(count, 25);
+	for (i = 0; i < 10; i++)
+		assert_int_equal(emu51_reverse_step(data->m), 0);
+	emu51_profile_get(data->m, 0x00, &count, &cycles);
+	assert_int_equal(count, 25);
+	total(data->m, &count, &cycles);
+	assert_int_equal(count, 50);
+
+	emu51_set_history(data->m, NULL, 0, 0, 0);
+	free(history);
+	free_test_data(data);
+}
+
+int main()
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_profile_exact),
+		cmocka_unit_test(test_profile_sampling),
+		cmocka_unit_test(test_profile_write),
+		cmocka_unit_test(test_profile_aggregate),
+		cmocka_unit_test(test_profile_reverse),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
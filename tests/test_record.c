@@ -0,0 +1,298 @@
+/* tests for the record and replay of the external inputs */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <string.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <emu51.h>
+
+/* use cmocka's version of memory allocation functions with checks */
+#define malloc test_malloc
+#define calloc test_calloc
+#define free test_free
+
+/* disable unused parameter warning when using gcc */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+
+#define PMEM_SIZE 4096
+
+/* main loop of the program */
+#define MAIN 0x40
+/* counter decremented by the serial interrupt service routine */
+#define COUNTER 0x30
+/* counter decremented by the external interrupt 0 service routine */
+#define PINS_COUNTER 0x31
+
+/* runs of the recorded session, and cycles per run */
+#define RUNS 40
+#define RUN_CYCLES 97
+
+typedef struct testdata
+{
+	emu51 m;
+	uint8_t pmem[PMEM_SIZE];
+	uint8_t iram_lower[128];
+	uint8_t sfr[128];
+	void *serial;
+	void *recorder;
+	long reads; /* calls to io_read */
+} testdata;
+
+/* Port values that change at every read. */
+static void callback_io_read(emu51 *m, uint8_t portno, uint8_t bitmask, uint8_t *data)
+{
+	testdata *td = m->userdata;
+	*data ^= (uint8_t)(td->reads++ * 37 + portno);
+}
+
+/* Set up an emulator receiving in serial mode 0, and the program:
+ *   0x00: LJMP MAIN
+ *   0x03: DJNZ PINS_COUNTER, +0  (external 0)
+ *   0x06: RETI
+ *   0x23: DJNZ SCON, +0          (serial, clears RI)
+ *   0x26: DJNZ COUNTER, +0
+ *   0x29: ADD A, SBUF
+ *   0x2b: RETI
+ *   MAIN: NOP
+ *   0x41: ADD A, P1
+ *   0x43: CJNE A, P3, 0x46
+ *   0x46: ADDC A, R2
+ *   0x47: SJMP 0x41
+ */
+static testdata *alloc_test_data(void)
+{
+	static const uint8_t main_loop[] = {
+		0x00, 0x25, 0x90, 0xb5, 0xb0, 0x00, 0x3a, 0x80, 0xf8,
+	};
+	testdata *data = calloc(1, sizeof(testdata));
+	uint8_t *pmem = data->pmem;
+
+	data->m.pmem = pmem;
+	data->m.pmem_len = PMEM_SIZE;
+	data->m.iram_lower = data->iram_lower;
+	data->m.sfr = data->sfr;
+	data->m.userdata = data;
+	emu51_reset(&data->m);
+	data->m.sfr[SFR_SCON] = SCON_REN;
+	data->m.sfr[SFR_IE] = 0x90; /* EA, ES */
+	data->serial = malloc(emu51_serial_size(16));
+	emu51_set_serial(&data->m, data->serial, 16);
+	data->recorder = malloc(emu51_recorder_size());
+
+	pmem[0x00] = 0x02;
+	pmem[0x01] = 0x00;
+	pmem[0x02] = MAIN;
+	pmem[0x03] = 0xd5;
+	pmem[0x04] = PINS_COUNTER;
+	pmem[0x05] = 0x00;
+	pmem[0x06] = 0x32;
+	pmem[0x23] = 0xd5;
+	pmem[0x24] = SFR_BASE_ADDR + SFR_SCON;
+	pmem[0x25] = 0x00;
+	pmem[0x26] = 0xd5;
+	pmem[0x27] = COUNTER;
+	pmem[0x28] = 0x00;
+	pmem[0x29] = 0x25;
+	pmem[0x2a] = SFR_BASE_ADDR + SFR_SBUF;
+	pmem[0x2b] = 0x32;
+	memcpy(&pmem[MAIN], main_loop, sizeof(main_loop));
+	return data;
+}
+
+static void free_test_data(testdata *data)
+{
+	free(data->recorder);
+	free(data->serial);
+	free(data);
+}
+
+/* Run the session: the host sends 0~2 bytes to the serial port before each
+ * run, and toggles INT0 every few runs if pins is set. Returns the number of
+ * bytes sent. */
+static long run_session(testdata *data, int pins)
+{
+	emu51 *m = &data->m;
+	long sent = 0;
+	int i, reason;
+
+	for (i = 0; i < RUNS; i++) {
+		uint8_t bytes[2] = { (uint8_t)(i * 11), (uint8_t)(i * 13) };
+		sent += emu51_serial_send(m, bytes, i % 3);
+		if (pins && i % 5 == 0)
+			m->sfr[SFR_P3] ^= 0x04;
+		emu51_run(m, RUN_CYCLES, &reason);
+		assert_int_equal(reason, EMU51_STOP_BUDGET);
+	}
+	return sent;
+}
+
+void test_record_replay(void **state)
+{
+	testdata *rec = alloc_test_data();
+	testdata *play = alloc_test_data();
+	FILE *file = tmpfile();
+	long sent, size;
+	int reason;
+
+	assert_non_null(file);
+
+	/* record */
+	rec->m.callback.io_read = callback_io_read;
+	assert_int_equal(emu51_set_recorder(&rec->m, rec->recorder, file,
+		EMU51_RECORD), 0);
+	sent = run_session(rec, 0);
+	assert_int_equal(emu51_replay_done(&rec->m), 0);
+	assert_int_equal(emu51_set_recorder(&rec->m, NULL, NULL, 0), 0);
+	assert_null(rec->m.recorder);
+	assert_true(rec->reads > RUNS);
+	assert_true(sent > 0);
+	assert_true(rec->iram_lower[COUNTER] != 0);
+
+	/* mostly two bytes per port read */
+	size = ftell(file);
+	assert_true(size <= 5 + 2 * rec->reads + 3 * RUNS + sent);
+
+	/* replay, with neither callbacks nor serial input from the host */
+	rewind(file);
+	assert_int_equal(emu51_set_recorder(&play->m, play->recorder, file,
+		EMU51_REPLAY), 0);
+	run_session(play, 0);
+	assert_int_equal(play->reads, 0);
+	assert_int_equal(play->m.pc, rec->m.pc);
+	assert_int_equal(play->m.cycles, rec->m.cycles);
+	assert_memory_equal(play->iram_lower, rec->iram_lower, 128);
+	assert_memory_equal(play->sfr, rec->sfr, 128);
+
+	/* the port reads hit the end of the log and read the latches */
+	emu51_run(&play->m, RUN_CYCLES, &reason);
+	assert_int_equal(reason, EMU51_STOP_BUDGET);
+	assert_int_equal(emu51_replay_done(&play->m), 1);
+	assert_int_equal(emu51_set_recorder(&play->m, NULL, NULL, 0), 0);
+
+	fclose(file);
+	free_test_data(play);
+	free_test_data(rec);
+}
+
+void test_record_pins(void **state)
+{
+	testdata *rec = alloc_test_data();
+	testdata *play = alloc_test_data();
+	FILE *file = tmpfile();
+
+	assert_non_null(file);
+	rec->m.sfr[SFR_TCON] = TCON_IT0;
+	rec->m.sfr[SFR_IE] |= IE_EX0;
+	play->m.sfr[SFR_TCON] = TCON_IT0;
+	play->m.sfr[SFR_IE] |= IE_EX0;
+
+	/* record, the host toggling INT0 */
+	rec->m.callback.io_read = callback_io_read;
+	assert_int_equal(emu51_set_recorder(&rec->m, rec->recorder, file,
+		EMU51_RECORD), 0);
+	run_session(rec, 1);
+	assert_int_equal(emu51_set_recorder(&rec->m, NULL, NULL, 0), 0);
+	assert_true(rec->iram_lower[PINS_COUNTER] != 0);
+
+	/* replay, the levels come from the log */
+	rewind(file);
+	assert_int_equal(emu51_set_recorder(&play->m, play->recorder, file,
+		EMU51_REPLAY), 0);
+	run_session(play, 0);
+	assert_int_equal(play->m.pc, rec->m.pc);
+	assert_int_equal(play->m.cycles, rec->m.cycles);
+	assert_memory_equal(play->iram_lower, rec->iram_lower, 128);
+	assert_memory_equal(play->sfr, rec->sfr, 128);
+
+	/* the host's levels are ignored */
+	play->m.sfr[SFR_P3] ^= 0x04;
+	emu51_step(&play->m, NULL);
+	assert_int_equal(play->sfr[SFR_P3] & 0x04, rec->sfr[SFR_P3] & 0x04);
+	assert_int_equal(emu51_set_recorder(&play->m, NULL, NULL, 0), 0);
+
+	fclose(file);
+	free_test_data(play);
+	free_test_data(rec);
+}
+
+void test_replay_diverged(void **state)
+{
+	testdata *rec = alloc_test_data();
+	testdata *play = alloc_test_data();
+	FILE *file = tmpfile();
+	int reason;
+
+	assert_non_null(file);
+	rec->m.callback.io_read = callback_io_read;
+	assert_int_equal(emu51_set_recorder(&rec->m, rec->recorder, file,
+		EMU51_RECORD), 0);
+	run_session(rec, 0);
+	assert_int_equal(emu51_set_recorder(&rec->m, NULL, NULL, 0), 0);
+
+	/* skipping the NOP reads P1 one cycle early */
+	rewind(file);
+	assert_int_equal(emu51_set_recorder(&play->m, play->recorder, file,
+		EMU51_REPLAY), 0);
+	play->m.pc = MAIN + 1;
+	emu51_run(&play->m, RUN_CYCLES, &reason);
+	assert_int_equal(reason, EMU51_REPLAY_DIVERGED);
+	assert_int_equal(play->m.pc, MAIN + 1);
+	assert_int_equal(emu51_set_recorder(&play->m, NULL, NULL, 0), 0);
+
+	fclose(file);
+	free_test_data(play);
+	free_test_data(rec);
+}
+
+void test_invalid_log(void **state)
+{
+	testdata *data = alloc_test_data();
+	FILE *file = tmpfile();
+	/* valid header, then a P1 read at cycle 3 without its value */
+	static const uint8_t truncated[] = { 'E', '5', '1', 'L', 1, 3 << 3 | 1 };
+	int reason;
+
+	assert_non_null(file);
+	fputs("E51X", file);
+	rewind(file);
+	assert_int_equal(emu51_set_recorder(&data->m, data->recorder, file,
+		EMU51_REPLAY), EMU51_LOG_ERROR);
+	assert_null(data->m.recorder);
+
+	/* an empty log has no header either */
+	fclose(file);
+	file = tmpfile();
+	assert_non_null(file);
+	assert_int_equal(emu51_set_recorder(&data->m, data->recorder, file,
+		EMU51_REPLAY), EMU51_LOG_ERROR);
+
+	fwrite(truncated, 1, sizeof(truncated), file);
+	rewind(file);
+	assert_int_equal(emu51_set_recorder(&data->m, data->recorder, file,
+		EMU51_REPLAY), 0);
+	emu51_run(&data->m, RUN_CYCLES, &reason);
+	assert_int_equal(reason, EMU51_REPLAY_DIVERGED);
+	assert_int_equal(emu51_set_recorder(&data->m, NULL, NULL, 0),
+		EMU51_LOG_ERROR);
+
+	fclose(file);
+	free_test_data(data);
+}
+
+int main()
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_record_replay),
+		cmocka_unit_test(test_record_pins),
+		cmocka_unit_test(test_replay_diverged),
+		cmocka_unit_test(test_invalid_log),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
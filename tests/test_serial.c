@@ -0,0 +1,307 @@
+/* tests for the serial port */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <string.h>
+#include <cmocka.h>
+#include <stdlib.h>
+
+#include <emu51.h>
+
+/* use cmocka's version of memory allocation functions with checks */
+#define malloc test_malloc
+#define calloc test_calloc
+#define free test_free
+
+/* disable unused parameter warning when using gcc */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+
+#define PMEM_SIZE 4096
+
+/* main loop of the program */
+#define MAIN 0x40
+/* counter decremented by the serial interrupt service routine */
+#define COUNTER 0x30
+
+typedef struct testdata
+{
+	emu51 m;
+	uint8_t pmem[PMEM_SIZE];
+	uint8_t iram_lower[128];
+	uint8_t sfr[128];
+	void *serial;
+} testdata;
+
+/* Set up an emulator with FIFOs of the given capacity, and the program:
+ *   0x00: LJMP MAIN
+ *   0x23: DJNZ SCON, +0          (serial, clears RI if it is the only flag)
+ *   0x26: DJNZ COUNTER, +0
+ *   0x29: RETI
+ *   MAIN: SJMP $
+ */
+static testdata *alloc_test_data(long capacity)
+{
+	testdata *data = calloc(1, sizeof(testdata));
+	uint8_t *pmem = data->pmem;
+
+	data->m.pmem = pmem;
+	data->m.pmem_len = PMEM_SIZE;
+	data->m.iram_lower = data->iram_lower;
+	data->m.sfr = data->sfr;
+	emu51_reset(&data->m);
+	data->serial = malloc(emu51_serial_size(capacity));
+	emu51_set_serial(&data->m, data->serial, capacity);
+
+	pmem[0x00] = 0x02;
+	pmem[0x01] = 0x00;
+	pmem[0x02] = MAIN;
+	pmem[0x23] = 0xd5;
+	pmem[0x24] = SFR_BASE_ADDR + SFR_SCON;
+	pmem[0x25] = 0x00;
+	pmem[0x26] = 0xd5;
+	pmem[0x27] = COUNTER;
+	pmem[0x28] = 0x00;
+	pmem[0x29] = 0x32;
+	pmem[MAIN] = 0x80;
+	pmem[MAIN + 1] = 0xfe;
+	return data;
+}
+
+static void free_test_data(testdata *data)
+{
+	free(data->serial);
+	free(data);
+}
+
+/* Send sbuf - 1 with DJNZ SBUF, +0, which reads sbuf from the receive buffer
+ * and writes the transmitter, and run the main loop until the frame of the
+ * given (even) number of cycles is done. */
+static void transmit(testdata *data, uint8_t sbuf, long frame)
+{
+	emu51 *m = &data->m;
+	uint64_t start = m->cycles;
+
+	data->pmem[0x10] = 0xd5;
+	data->pmem[0x11] = SFR_BASE_ADDR + SFR_SBUF;
+	data->pmem[0x12] = 0x00;
+	data->pmem[0x13] = 0x02; /* LJMP MAIN */
+	data->pmem[0x14] = 0x00;
+	data->pmem[0x15] = MAIN;
+
+	m->pc = 0x10;
+	m->uart.rx_byte = sbuf;
+	m->sfr[SFR_SCON] &= ~SCON_TI;
+	assert_int_equal(emu51_step(m, NULL), 0);
+
+	/* TI is set at the cycle the frame is done */
+	assert_int_equal(emu51_run(m, frame - 4, NULL), frame - 4);
+	assert_int_equal(m->cycles, start + frame - 2);
+	assert_int_equal(m->sfr[SFR_SCON] & SCON_TI, 0);
+	assert_int_equal(emu51_run(m, 2, NULL), 2);
+	assert_int_equal(m->sfr[SFR_SCON] & SCON_TI, SCON_TI);
+}
+
+void test_transmit(void **state)
+{
+	testdata *data = alloc_test_data(16);
+	emu51 *m = &data->m;
+	uint8_t out[16];
+
+	/* mode 0: 8 cycles */
+	transmit(data, 0x42, 8);
+	assert_int_equal(emu51_serial_receive(m, out, sizeof(out)), 1);
+	assert_int_equal(out[0], 0x41);
+
+	/* mode 2: 11 * 32 clocks with SMOD */
+	emu51_reset(m);
+	m->sfr[SFR_SCON] = SCON_SM0;
+	m->sfr[SFR_PCON] = 0x80;
+	transmit(data, 0x80, 30);
+
+	/* mode 1: 10 bits of 32 overflows of timer 1 every 3 cycles */
+	emu51_reset(m);
+	m->sfr[SFR_SCON] = SCON_SM1;
+	m->sfr[SFR_PCON] = 0;
+	m->sfr[SFR_TMOD] = 0x20;
+	m->sfr[SFR_TH1] = 0xfd;
+	m->sfr[SFR_TCON] = TCON_TR1;
+	transmit(data, 0x00, 960);
+
+	/* mode 3 with timer 2: 11 bits of 16 overflows every 0x10 / 6 cycles */
+	emu51_reset(m);
+	m->feature.timer2 = 1;
+	m->sfr[SFR_SCON] = SCON_SM0 | SCON_SM1;
+	m->sfr[SFR_T2CON] = T2CON_TR2 | T2CON_TCLK | T2CON_RCLK;
+	m->sfr[SFR_RCAP2H] = 0xff;
+	m->sfr[SFR_RCAP2L] = 0xf0;
+	transmit(data, 0x7f, (11 * 16 * 0x10 + 5) / 6);
+
+	assert_int_equal(emu51_serial_receive(m, out, sizeof(out)), 3);
+	assert_memory_equal(out, "\x7f\xff\x7e", 3);
+	assert_int_equal(emu51_serial_receive(m, out, sizeof(out)), 0);
+	assert_int_equal(emu51_serial_lost(m), 0);
+
+	free_test_data(data);
+}
+
+void test_transmit_full(void **state)
+{
+	testdata *data = alloc_test_data(2);
+	emu51 *m = &data->m;
+	uint8_t out[4];
+	int i;
+
+	/* mode 0: three bytes 8 cycles apart */
+	for (i = 0; i < 3; i++) {
+		uint8_t *code = &data->pmem[0x10 + 9 * i];
+		code[0] = 0xd5; /* DJNZ SBUF, +0 */
+		code[1] = SFR_BASE_ADDR + SFR_SBUF;
+		code[2] = 0x00;
+		memset(&code[3], 0x00, 6); /* NOP */
+	}
+	data->pmem[0x10 + 27] = 0x80; /* SJMP $ */
+	data->pmem[0x10 + 28] = 0xfe;
+
+	m->pc = 0x10;
+	m->uart.rx_byte = 0x10;
+	assert_int_equal(emu51_run(m, 30, NULL), 30);
+	assert_int_equal(emu51_serial_lost(m), 1);
+	assert_int_equal(emu51_serial_receive(m, out, sizeof(out)), 2);
+	assert_memory_equal(out, "\x0f\x0f", 2);
+
+	/* without FIFOs, TI is still set */
+	emu51_set_serial(m, NULL, 0);
+	transmit(data, 0x42, 8);
+	assert_int_equal(emu51_serial_receive(m, out, sizeof(out)), 0);
+
+	free_test_data(data);
+}
+
+/* Send three bytes to the firmware in mode 1 at 960 cycles per frame, and
+ * check that the interrupt is taken for each byte. */
+static void run_receive(testdata *data)
+{
+	emu51 *m = &data->m;
+	int reason;
+
+	emu51_reset(m);
+	m->pc = MAIN;
+	m->sfr[SFR_SCON] = SCON_SM1 | SCON_REN;
+	m->sfr[SFR_TH1] = 0xfd;
+	m->sfr[SFR_IE] = IE_EA | IE_ES;
+	data->iram_lower[COUNTER] = 0;
+
+	assert_int_equal(emu51_serial_send(m, (const uint8_t*)"abc", 3), 3);
+	assert_int_equal(emu51_run(m, 2000, &reason), 2000);
+	assert_int_equal(reason, EMU51_STOP_BUDGET);
+	assert_int_equal(data->iram_lower[COUNTER], 0x100 - 2);
+	assert_int_equal(m->uart.rx_byte, 'b');
+
+	assert_int_equal(emu51_run(m, 2000, &reason), 2000);
+	assert_int_equal(data->iram_lower[COUNTER], 0x100 - 3);
+	assert_int_equal(m->uart.rx_byte, 'c');
+	assert_int_equal(m->sfr[SFR_SBUF], 0); /* nothing was sent */
+	assert_int_equal(m->sfr[SFR_SCON], SCON_SM1 | SCON_REN);
+	assert_int_equal(m->pc, MAIN);
+}
+
+void test_receive(void **state)
+{
+	testdata *data = alloc_test_data(2);
+	emu51 *m = &data->m;
+	void *cache = malloc(emu51_block_cache_size(PMEM_SIZE));
+	uint8_t in[3] = { 1, 2, 3 };
+
+	/* the receive FIFO holds capacity bytes */
+	assert_int_equal(emu51_serial_send(m, in, 3), 2);
+	assert_int_equal(emu51_serial_send(m, in, 3), 0);
+
+	/* nothing is received while REN is clear */
+	emu51_set_serial(m, data->serial, 4);
+	assert_int_equal(emu51_serial_send(m, in, 1), 1);
+	assert_int_equal(emu51_run(m, 100, NULL), 100);
+	assert_int_equal(m->sfr[SFR_SCON], 0);
+	emu51_set_serial(m, data->serial, 4);
+
+	/* interpreter */
+	run_receive(data);
+
+	/* block engine and JIT */
+	emu51_set_block_cache(m, cache);
+	emu51_jit_enable(m);
+	run_receive(data);
+	emu51_jit_disable(m);
+
+	free(cache);
+	free_test_data(data);
+}
+
+/* SBUF reads the receive buffer, and writes don't overwrite it. */
+void test_sbuf_buffers(void **state)
+{
+	testdata *data = alloc_test_data(4);
+	emu51 *m = &data->m;
+	void *log = malloc(emu51_event_log_size(4));
+	emu51_event events[4];
+	uint8_t out[4];
+
+	/* program:
+	 *   0x10: ADD A, SBUF
+	 *   0x12: DJNZ SBUF, +0
+	 *   0x15: ADD A, SBUF
+	 */
+	data->pmem[0x10] = 0x25;
+	data->pmem[0x11] = SFR_BASE_ADDR + SFR_SBUF;
+	data->pmem[0x12] = 0xd5;
+	data->pmem[0x13] = SFR_BASE_ADDR + SFR_SBUF;
+	data->pmem[0x14] = 0x00;
+	data->pmem[0x15] = 0x25;
+	data->pmem[0x16] = SFR_BASE_ADDR + SFR_SBUF;
+
+	/* receive a byte, logged as a change of SBUF */
+	m->sfr[SFR_SCON] = SCON_REN;
+	m->sfr[SFR_SBUF] = 0x11;
+	emu51_set_event_log(m, log, 4);
+	assert_int_equal(emu51_serial_send(m, (const uint8_t*)"\x22", 1), 1);
+	assert_int_equal(emu51_run(m, 8, NULL), 8);
+	assert_int_equal(m->sfr[SFR_SCON], SCON_REN | SCON_RI);
+	assert_int_equal(m->uart.rx_byte, 0x22);
+	assert_int_equal(m->sfr[SFR_SBUF], 0x11);
+	assert_int_equal(emu51_drain_events(m, events, 4), 2);
+	assert_int_equal(events[0].addr, SFR_SCON);
+	assert_int_equal(events[1].addr, SFR_SBUF);
+	assert_int_equal(events[1].value, 0x22);
+	emu51_set_event_log(m, NULL, 0);
+
+	m->pc = 0x10;
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->sfr[SFR_ACC], 0x22);
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->sfr[SFR_SBUF], 0x21);
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->sfr[SFR_ACC], 0x44);
+
+	/* the byte written is sent */
+	assert_int_equal(emu51_run(m, 8, NULL), 8);
+	assert_int_equal(emu51_serial_receive(m, out, sizeof(out)), 1);
+	assert_int_equal(out[0], 0x21);
+	assert_int_equal(m->uart.rx_byte, 0x22);
+
+	free(log);
+	free_test_data(data);
+}
+
+int main()
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_transmit),
+		cmocka_unit_test(test_transmit_full),
+		cmocka_unit_test(test_receive),
+		cmocka_unit_test(test_sbuf_buffers),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,298 @@
+/* tests for snapshots, restore and fork */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <string.h>
+#include <cmocka.h>
+#include <stdlib.h>
+
+#include <emu51.h>
+
+/* use cmocka's version of memory allocation functions with checks */
+#define malloc test_malloc
+#define calloc test_calloc
+#define free test_free
+
+/* disable unused parameter warning when using gcc */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+
+#define PMEM_SIZE 4096
+#define XRAM_SIZE 65536
+
+/* main loop of the program */
+#define MAIN 0x40
+/* counter decremented by the timer 0 interrupt service routine */
+#define COUNTER 0x30
+
+/* program:
+ *   0x00: LJMP MAIN
+ *   0x0b: DJNZ COUNTER, +0       (timer 0)
+ *   0x0e: RETI
+ *   MAIN: ADD A, #3
+ *         SJMP MAIN
+ */
+static const uint8_t program[] = {
+	0x02, 0x00, MAIN, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0xd5, COUNTER, 0x00, 0x32,
+};
+
+static uint8_t pmem[PMEM_SIZE];
+
+/* Create an emulator running the program, with timer 0 interrupts. */
+static emu51 *create(long xram_len)
+{
+	emu51_config config;
+	emu51 *m;
+
+	memcpy(pmem, program, sizeof(program));
+	pmem[MAIN] = 0x24;
+	pmem[MAIN + 1] = 0x03;
+	pmem[MAIN + 2] = 0x80;
+	pmem[MAIN + 3] = 0xfc;
+
+	memset(&config, 0, sizeof(config));
+	config.pmem = pmem;
+	config.pmem_len = PMEM_SIZE;
+	config.xram_len = xram_len;
+	config.iram_upper = 1;
+	m = emu51_create(&config);
+	assert_non_null(m);
+
+	m->sfr[SFR_TMOD] = 0x01; /* 16-bit */
+	m->sfr[SFR_TCON] = TCON_TR0;
+	m->sfr[SFR_TH0] = 0xfe;
+	m->sfr[SFR_IE] = IE_EA | IE_ET0;
+	return m;
+}
+
+/* Check that two emulators are in the same state. */
+static void check_same(const emu51 *a, const emu51 *b)
+{
+	assert_int_equal(a->pc, b->pc);
+	assert_int_equal(a->cycles, b->cycles);
+	assert_memory_equal(a->sfr, b->sfr, 128);
+	assert_memory_equal(a->iram_lower, b->iram_lower, 128);
+	assert_memory_equal(a->iram_upper, b->iram_upper, 128);
+	assert_int_equal(a->irq.in_service, b->irq.in_service);
+	assert_int_equal(a->xram_len, b->xram_len);
+	if (a->xram)
+		assert_memory_equal(a->xram, b->xram, a->xram_len);
+}
+
+/* Run an emulator, which must not fail. */
+static void run(emu51 *m, long cycles)
+{
+	int reason;
+
+	emu51_run(m, cycles, &reason);
+	assert_int_equal(reason, EMU51_STOP_BUDGET);
+}
+
+void test_restore(void **state)
+{
+	emu51 *m = create(XRAM_SIZE), *ref = create(XRAM_SIZE);
+	emu51 *other = create(XRAM_SIZE);
+	emu51_state *s;
+	uint64_t cycles;
+
+	/* stop in the middle of the interrupt service routine */
+	m->xram[0x1234] = 0x56;
+	ref->xram[0x1234] = 0x56;
+	run(m, 515);
+	run(ref, 515);
+	assert_int_equal(m->irq.in_service, 1);
+	cycles = m->cycles;
+	s = emu51_snapshot(m);
+	assert_non_null(s);
+
+	/* the same run after restoring */
+	run(ref, 3000);
+	run(m, 3000);
+	m->xram[0x1234] = 0;
+	m->iram_upper[0x10] = 0xaa;
+	assert_int_equal(emu51_restore(m, s), 0);
+	assert_int_equal(m->xram[0x1234], 0x56);
+	assert_int_equal(m->iram_upper[0x10], 0);
+	assert_int_equal(m->cycles, cycles);
+	assert_int_equal(m->irq.in_service, 1);
+	run(m, 3000);
+	check_same(m, ref);
+
+	/* and on another emulator with the same memories */
+	assert_int_equal(emu51_restore(other, s), 0);
+	run(other, 3000);
+	check_same(other, ref);
+
+	emu51_state_destroy(s);
+	emu51_destroy(other);
+	emu51_destroy(ref);
+	emu51_destroy(m);
+}
+
+void test_mismatch(void **state)
+{
+	emu51 *m = create(XRAM_SIZE), *small = create(1024), *none = create(0);
+	emu51_state *s = emu51_snapshot(m);
+
+	assert_int_equal(emu51_restore(small, s), EMU51_STATE_MISMATCH);
+	assert_int_equal(emu51_restore(none, s), EMU51_STATE_MISMATCH);
+	assert_int_equal(small->pc, 0);
+
+	emu51_state_destroy(s);
+	s = emu51_snapshot(none);
+	assert_int_equal(emu51_restore(m, s), EMU51_STATE_MISMATCH);
+	emu51_state_destroy(s);
+
+	emu51_destroy(none);
+	emu51_destroy(small);
+	emu51_destroy(m);
+}
+
+#define FORKS 4
+
+void test_fork(void **state)
+{
+	emu51 *m = create(XRAM_SIZE), *ref = create(XRAM_SIZE);
+	emu51 *forks[FORKS];
+	uint8_t breakpoints[PMEM_SIZE / 8];
+	emu51_state *s;
+	int i;
+
+	memset(breakpoints, 0, sizeof(breakpoints));
+	m->breakpoints = breakpoints;
+	m->userdata = &ref;
+	m->xram[0] = 1;
+	m->xram[XRAM_SIZE - 1] = 2;
+	run(m, 700);
+	s = emu51_snapshot(m);
+	assert_non_null(s);
+
+	for (i = 0; i < FORKS; i++) {
+		forks[i] = emu51_fork(s);
+		assert_non_null(forks[i]);
+		check_same(forks[i], m);
+		assert_ptr_equal(forks[i]->breakpoints, breakpoints);
+		assert_ptr_equal(forks[i]->userdata, &ref);
+		assert_ptr_not_equal(forks[i]->xram, m->xram);
+	}
+
+	/* the writes of a fork (or of the original) are its own */
+	forks[0]->xram[0] = 10;
+	forks[1]->xram[XRAM_SIZE - 1] = 20;
+	m->xram[0] = 30;
+	assert_int_equal(forks[0]->xram[0], 10);
+	assert_int_equal(forks[0]->xram[XRAM_SIZE - 1], 2);
+	assert_int_equal(forks[1]->xram[0], 1);
+	assert_int_equal(forks[1]->xram[XRAM_SIZE - 1], 20);
+	assert_int_equal(forks[2]->xram[0], 1);
+
+	/* a fork made after the writes, from a freed snapshot */
+	emu51 *late = emu51_fork(s);
+	emu51_state_destroy(s);
+	assert_int_equal(late->xram[0], 1);
+	assert_int_equal(forks[0]->xram[0], 10);
+
+	/* the forks run like the original */
+	m->xram[0] = 1;
+	run(m, 2000);
+	run(late, 2000);
+	check_same(late, m);
+	for (i = 2; i < FORKS; i++) {
+		run(forks[i], 2000);
+		check_same(forks[i], m);
+	}
+
+	emu51_destroy(late);
+	for (i = 0; i < FORKS; i++)
+		emu51_destroy(forks[i]);
+	emu51_destroy(ref);
+	emu51_destroy(m);
+}
+
+void test_baseline(void **state)
+{
+	emu51 *m = create(XRAM_SIZE), *ref = create(XRAM_SIZE);
+	emu51 *start = create(XRAM_SIZE);
+	void *buffer = malloc(emu51_baseline_size(m));
+	emu51_state *s;
+	int i;
+
+	m->xram[0x100] = 7;
+	start->xram[0x100] = 7;
+	ref->xram[0x100] = 7;
+	emu51_set_baseline(m, buffer);
+	assert_ptr_equal(m->baseline, buffer);
+	run(ref, 3000);
+
+	for (i = 0; i < 3; i++) {
+		run(m, 3000);
+		check_same(m, ref);
+
+		/* the writes reported by the host are undone */
+		m->xram[0x100] = 0;
+		m->xram[0x4321] = 9;
+		emu51_mark_xram_dirty(m, 0x100, 1);
+		emu51_mark_xram_dirty(m, 0x4321, 1);
+		emu51_reset_to_baseline(m);
+		check_same(m, start);
+	}
+
+	/* the pages that are not marked are not restored */
+	m->xram[0x8000] = 1;
+	emu51_reset_to_baseline(m);
+	assert_int_equal(m->xram[0x8000], 1);
+	m->xram[0x8000] = 0;
+
+	/* a restore marks the whole external memory */
+	run(m, 1000);
+	m->xram[0xffff] = 5;
+	s = emu51_snapshot(m);
+	emu51_reset_to_baseline(m);
+	assert_int_equal(emu51_restore(m, s), 0);
+	assert_int_equal(m->xram[0xffff], 5);
+	emu51_reset_to_baseline(m);
+	check_same(m, start);
+
+	/* without a baseline, nothing is reset */
+	emu51_set_baseline(m, NULL);
+	run(m, 1000);
+	emu51_reset_to_baseline(m);
+	assert_true(m->cycles >= 1000);
+
+	emu51_state_destroy(s);
+	emu51_destroy(start);
+	emu51_destroy(ref);
+	emu51_destroy(m);
+	free(buffer);
+
+	/* external memories that end with a partial page, or have none */
+	for (i = 0; i < 2; i++) {
+		long len = i ? 100 : 1000;
+		m = create(len);
+		memset(m->xram, 3, len);
+		buffer = malloc(emu51_baseline_size(m));
+		emu51_set_baseline(m, buffer);
+		memset(m->xram, 4, len);
+		emu51_mark_xram_dirty(m, 0, len);
+		emu51_reset_to_baseline(m);
+		assert_int_equal(m->xram[0], 3);
+		assert_int_equal(m->xram[len - 1], 3);
+		emu51_destroy(m);
+		free(buffer);
+	}
+}
+
+int main()
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_restore),
+		cmocka_unit_test(test_mismatch),
+		cmocka_unit_test(test_fork),
+		cmocka_unit_test(test_baseline),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
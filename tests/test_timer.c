@@ -0,0 +1,326 @@
+/* tests for timers 0 and 1 */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <string.h>
+#include <cmocka.h>
+#include <stdlib.h>
+
+#include <emu51.h>
+
+/* use cmocka's version of memory allocation functions with checks */
+#define malloc test_malloc
+#define calloc test_calloc
+#define free test_free
+
+/* disable unused parameter warning when using gcc */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+
+#define PMEM_SIZE 4096
+
+typedef struct testdata
+{
+	emu51 m;
+	uint8_t pmem[PMEM_SIZE];
+	uint8_t iram_lower[128];
+	uint8_t sfr[128];
+} testdata;
+
+/* Set up an emulator whose program is "SJMP $" at address 0. */
+static testdata *alloc_test_data(void)
+{
+	testdata *data = calloc(1, sizeof(testdata));
+
+	data->m.pmem = data->pmem;
+	data->m.pmem_len = PMEM_SIZE;
+	data->m.iram_lower = data->iram_lower;
+	data->m.sfr = data->sfr;
+	emu51_reset(&data->m);
+
+	data->pmem[0] = 0x80; /* SJMP $ */
+	data->pmem[1] = 0xfe;
+	return data;
+}
+
+void test_mode1(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = &data->m;
+	int i;
+
+	/* 16-bit timer 0 */
+	m->sfr[SFR_TMOD] = 0x01;
+	m->sfr[SFR_TCON] = TCON_TR0;
+	m->sfr[SFR_TH0] = 0xff;
+	m->sfr[SFR_TL0] = 0xf0;
+	assert_int_equal(emu51_run(m, 100, NULL), 100);
+	assert_int_equal(m->sfr[SFR_TH0], 0x00);
+	assert_int_equal(m->sfr[SFR_TL0], 0x54);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TR0 | TCON_TF0);
+
+	/* the flag is set by the instruction that reaches the overflow */
+	data->pmem[0x10] = 0x00; /* NOP */
+	data->pmem[0x11] = 0x00;
+	m->pc = 0x10;
+	m->sfr[SFR_TCON] = TCON_TR0;
+	m->sfr[SFR_TH0] = 0xff;
+	m->sfr[SFR_TL0] = 0xfe;
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->sfr[SFR_TL0], 0xff);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TR0);
+	assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->sfr[SFR_TL0], 0x00);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TR0 | TCON_TF0);
+
+	/* a stopped timer holds its value */
+	m->pc = 0;
+	m->sfr[SFR_TCON] = 0;
+	for (i = 0; i < 3; i++)
+		assert_int_equal(emu51_step(m, NULL), 0);
+	assert_int_equal(m->sfr[SFR_TL0], 0x00);
+	assert_int_equal(m->sfr[SFR_TH0], 0x00);
+
+	free(data);
+}
+
+void test_mode0(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = &data->m;
+
+	/* 13-bit timer 1: TH1 and the lower 5 bits of TL1 */
+	m->sfr[SFR_TMOD] = 0x00;
+	m->sfr[SFR_TCON] = TCON_TR1;
+	m->sfr[SFR_TH1] = 0xff;
+	m->sfr[SFR_TL1] = 0xf0; /* the upper 3 bits are not counted */
+	assert_int_equal(emu51_run(m, 0x20, NULL), 0x20);
+	assert_int_equal(m->sfr[SFR_TH1], 0x00);
+	assert_int_equal(m->sfr[SFR_TL1], 0xf0);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TR1 | TCON_TF1);
+
+	free(data);
+}
+
+void test_mode2(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = &data->m;
+
+	/* 8-bit timer 0 reloaded from TH0: overflows after 16 cycles, then
+	 * every 16 cycles */
+	m->sfr[SFR_TMOD] = 0x02;
+	m->sfr[SFR_TCON] = TCON_TR0;
+	m->sfr[SFR_TH0] = 0xf0;
+	m->sfr[SFR_TL0] = 0xf0;
+	assert_int_equal(emu51_run(m, 40, NULL), 40);
+	assert_int_equal(m->sfr[SFR_TL0], 0xf8);
+	assert_int_equal(m->sfr[SFR_TH0], 0xf0);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TR0 | TCON_TF0);
+
+	/* long runs are counted at once */
+	m->sfr[SFR_TCON] = TCON_TR0;
+	assert_int_equal(emu51_run(m, 1000000, NULL), 1000000);
+	assert_int_equal(m->sfr[SFR_TL0], 0xf0 + (8 + 1000000) % 16);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TR0 | TCON_TF0);
+
+	free(data);
+}
+
+void test_mode3(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = &data->m;
+
+	/* timer 0 split into TL0 (TR0, TF0) and TH0 (TR1, TF1); timer 1 keeps
+	 * running without a flag */
+	m->sfr[SFR_TMOD] = 0x13;
+	m->sfr[SFR_TCON] = TCON_TR0 | TCON_TR1;
+	m->sfr[SFR_TL0] = 0xfe;
+	m->sfr[SFR_TH0] = 0x00;
+	m->sfr[SFR_TH1] = 0xff;
+	m->sfr[SFR_TL1] = 0xff;
+	assert_int_equal(emu51_run(m, 10, NULL), 10);
+	assert_int_equal(m->sfr[SFR_TL0], 8);
+	assert_int_equal(m->sfr[SFR_TH0], 10);
+	assert_int_equal(m->sfr[SFR_TH1], 0x00);
+	assert_int_equal(m->sfr[SFR_TL1], 9);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TR0 | TCON_TR1 | TCON_TF0);
+
+	/* TH0 sets TF1 */
+	m->sfr[SFR_TH0] = 0xff;
+	assert_int_equal(emu51_run(m, 2, NULL), 2);
+	assert_int_equal(m->sfr[SFR_TH0], 1);
+	assert_int_equal(m->sfr[SFR_TCON] & TCON_TF1, TCON_TF1);
+
+	/* timer 1 in mode 3 is stopped */
+	m->sfr[SFR_TMOD] = 0x30;
+	m->sfr[SFR_TL1] = 0;
+	assert_int_equal(emu51_run(m, 10, NULL), 10);
+	assert_int_equal(m->sfr[SFR_TL1], 0);
+
+	free(data);
+}
+
+void test_gate(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = &data->m;
+
+	/* GATE: timer 0 only counts while INT0 (P3.2) is high */
+	m->sfr[SFR_TMOD] = TMOD_T0_GATE | 0x01;
+	m->sfr[SFR_TCON] = TCON_TR0;
+	m->sfr[SFR_P3] = 0xff & ~0x04;
+	assert_int_equal(emu51_run(m, 10, NULL), 10);
+	assert_int_equal(m->sfr[SFR_TL0], 0);
+	m->sfr[SFR_P3] = 0xff;
+	assert_int_equal(emu51_run(m, 10, NULL), 10);
+	assert_int_equal(m->sfr[SFR_TL0], 10);
+
+	/* the Tx pins are not emulated, so counters never count */
+	m->sfr[SFR_TMOD] = TMOD_T0_CT | 0x01;
+	assert_int_equal(emu51_run(m, 10, NULL), 10);
+	assert_int_equal(m->sfr[SFR_TL0], 10);
+
+	free(data);
+}
+
+/* Run the program that waits for TL0 to reach 0x40 with CJNE A, TL0, $ and
+ * check that the firmware sees the counting timer. */
+static void run_wait_loop(testdata *data)
+{
+	emu51 *m = &data->m;
+	int reason;
+
+	data->pmem[0] = 0xb5; /* CJNE A, TL0, $ */
+	data->pmem[1] = SFR_BASE_ADDR + SFR_TL0;
+	data->pmem[2] = 0xfd;
+	data->pmem[3] = 0x80; /* SJMP $ */
+	data->pmem[4] = 0xfe;
+
+	m->pc = 0;
+	m->sfr[SFR_ACC] = 0x40;
+	m->sfr[SFR_TMOD] = 0x02; /* 8-bit auto reload */
+	m->sfr[SFR_TCON] = TCON_TR0;
+	m->sfr[SFR_TH0] = 0;
+	m->sfr[SFR_TL0] = 0;
+	assert_int_equal(emu51_run(m, 1000, &reason), 1000);
+	assert_int_equal(reason, EMU51_STOP_BUDGET);
+	assert_int_equal(m->pc, 3);
+}
+
+void test_firmware_read(void **state)
+{
+	testdata *data = alloc_test_data();
+	void *cache = malloc(emu51_block_cache_size(PMEM_SIZE));
+
+	/* interpreter */
+	run_wait_loop(data);
+
+	/* block engine and JIT */
+	emu51_set_block_cache(&data->m, cache);
+	emu51_jit_enable(&data->m);
+	run_wait_loop(data);
+	run_wait_loop(data);
+	emu51_jit_disable(&data->m);
+
+	free(cache);
+	free(data);
+}
+
+void test_firmware_write(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = &data->m;
+
+	/* DJNZ TL0, rel writes the timer: the timer is counted up to the write,
+	 * and counts on from the written value */
+	data->pmem[0x10] = 0xd5; /* DJNZ TL0, +0 */
+	data->pmem[0x11] = SFR_BASE_ADDR + SFR_TL0;
+	data->pmem[0x12] = 0x00;
+
+	m->pc = 0x10;
+	m->sfr[SFR_TMOD] = 0x01;
+	m->sfr[SFR_TCON] = TCON_TR0;
+	m->sfr[SFR_TL0] = 0xfe;
+	m->sfr[SFR_TH0] = 0xff;
+	assert_int_equal(emu51_run(m, 2, NULL), 2);
+	assert_int_equal(m->pc, 0x13);
+	/* read 0xfe at cycle 0, wrote 0xfd; 2 cycles later */
+	assert_int_equal(m->sfr[SFR_TL0], 0xff);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TR0);
+
+	/* the overflow is scheduled from the written value */
+	m->pc = 0;
+	assert_int_equal(emu51_run(m, 2, NULL), 2);
+	assert_int_equal(m->sfr[SFR_TL0], 0x01);
+	assert_int_equal(m->sfr[SFR_TCON], TCON_TR0 | TCON_TF0);
+
+	free(data);
+}
+
+void test_timer2(void **state)
+{
+	testdata *data = alloc_test_data();
+	emu51 *m = &data->m;
+
+	/* without the feature, timer 2 doesn't exist */
+	m->sfr[SFR_T2CON] = T2CON_TR2;
+	m->sfr[SFR_TL2] = 0xf0;
+	assert_int_equal(emu51_run(m, 10, NULL), 10);
+	assert_int_equal(m->sfr[SFR_TL2], 0xf0);
+
+	/* auto-reload from RCAP2H:RCAP2L */
+	m->feature.timer2 = 1;
+	m->sfr[SFR_TH2] = 0xff;
+	m->sfr[SFR_RCAP2H] = 0xff;
+	m->sfr[SFR_RCAP2L] = 0x00;
+	assert_int_equal(emu51_run(m, 20, NULL), 20);
+	assert_int_equal(m->sfr[SFR_TH2], 0xff);
+	assert_int_equal(m->sfr[SFR_TL2], 0x04);
+	assert_int_equal(m->sfr[SFR_T2CON], T2CON_TR2 | T2CON_TF2);
+
+	/* capture: 16-bit timer, T2EX captures it into RCAP2H:RCAP2L */
+	m->sfr[SFR_T2CON] = T2CON_TR2 | T2CON_CP_RL2 | T2CON_EXEN2;
+	m->sfr[SFR_TH2] = 0x12;
+	m->sfr[SFR_TL2] = 0x00;
+	m->sfr[SFR_P1] = 0xff;
+	assert_int_equal(emu51_run(m, 10, NULL), 10);
+	assert_int_equal(m->sfr[SFR_T2CON] & T2CON_EXF2, 0);
+	m->sfr[SFR_P1] = 0xfd; /* falling edge */
+	assert_int_equal(emu51_run(m, 10, NULL), 10);
+	assert_int_equal(m->sfr[SFR_RCAP2H], 0x12);
+	assert_int_equal(m->sfr[SFR_RCAP2L], 10);
+	assert_int_equal(m->sfr[SFR_TL2], 20);
+	assert_int_equal(m->sfr[SFR_T2CON] & T2CON_EXF2, T2CON_EXF2);
+
+	/* baud rate generator: 6 counts per cycle, reloaded without TF2 */
+	m->sfr[SFR_T2CON] = T2CON_TR2 | T2CON_TCLK;
+	m->sfr[SFR_TH2] = 0xff;
+	m->sfr[SFR_TL2] = 0xf0;
+	m->sfr[SFR_RCAP2H] = 0xff;
+	m->sfr[SFR_RCAP2L] = 0xe0;
+	assert_int_equal(emu51_run(m, 4, NULL), 4);
+	assert_int_equal(m->sfr[SFR_TL2], 0xe0 + 8);
+	assert_int_equal(m->sfr[SFR_T2CON], T2CON_TR2 | T2CON_TCLK);
+
+	free(data);
+}
+
+int main()
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_mode1),
+		cmocka_unit_test(test_mode0),
+		cmocka_unit_test(test_mode2),
+		cmocka_unit_test(test_mode3),
+		cmocka_unit_test(test_gate),
+		cmocka_unit_test(test_firmware_read),
+		cmocka_unit_test(test_firmware_write),
+		cmocka_unit_test(test_timer2),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}